@@ -28,6 +28,11 @@ endif
 
 ifeq ($(PROJECT_PATH_AGREES),true)
 
+# Checked by both the recovery module and the exFAT makefiles below
+ifeq ($(BUILD_ID), GINGERBREAD)
+    TW_NO_EXFAT := true
+endif
+
 ifneq (,$(filter $(PLATFORM_SDK_VERSION), 21 22))
 # Make recovery domain permissive for TWRP
     BOARD_SEPOLICY_UNION += twrp.te
@@ -45,6 +50,10 @@ LOCAL_SRC_FILES := \
     fixPermissions.cpp \
     twrpTar.cpp \
     twrpDU.cpp \
+    twrpFSProbe.cpp \
+    twrpStats.cpp \
+    twrpGzip.cpp \
+    twrpAES.cpp \
     twrpDigest.cpp \
     digest/md5.c \
     find_file.cpp \
@@ -62,7 +71,8 @@ LOCAL_SRC_FILES += \
 LOCAL_SRC_FILES += \
     multirom.cpp \
     mrominstaller.cpp \
-    multiromedify.cpp
+    multiromedify.cpp \
+    multiromramdisk.cpp
 
 ifneq ($(TARGET_RECOVERY_REBOOT_SRC),)
   LOCAL_SRC_FILES += $(TARGET_RECOVERY_REBOOT_SRC)
@@ -105,7 +115,7 @@ LOCAL_C_INCLUDES += \
     system/extras/ext4_utils \
     system/core/adb \
 
-LOCAL_C_INCLUDES += bionic external/openssl/include $(LOCAL_PATH)/libmincrypt/includes
+LOCAL_C_INCLUDES += bionic external/openssl/include external/zlib $(LOCAL_PATH)/libmincrypt/includes
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
     LOCAL_C_INCLUDES += external/stlport/stlport
 endif
@@ -289,6 +299,13 @@ endif
 ifeq ($(TW_NO_EXFAT_FUSE), true)
     LOCAL_CFLAGS += -DTW_NO_EXFAT_FUSE
 endif
+LOCAL_STATIC_LIBRARIES += libmkfs_fat
+ifeq ($(TW_NO_EXFAT), true)
+    LOCAL_CFLAGS += -DTW_NO_EXFAT
+else
+    LOCAL_STATIC_LIBRARIES += libmkexfatfs
+    LOCAL_SHARED_LIBRARIES += libexfat_twrp
+endif
 ifeq ($(TW_INCLUDE_JB_CRYPTO), true)
     TW_INCLUDE_CRYPTO := true
 endif
@@ -366,6 +383,16 @@ endif
 ifeq ($(MR_USE_MROM_FSTAB),true)
     LOCAL_CFLAGS += -DMR_USE_MROM_FSTAB
 endif
+ifneq ($(wildcard external/lz4/Android.mk),)
+    LOCAL_CFLAGS += -DMR_HAVE_LZ4
+    LOCAL_C_INCLUDES += external/lz4/lib
+    LOCAL_STATIC_LIBRARIES += liblz4-static
+endif
+ifneq ($(wildcard external/lzma/C/Android.mk),)
+    LOCAL_CFLAGS += -DMR_HAVE_LZMA
+    LOCAL_C_INCLUDES += external/lzma/C
+    LOCAL_STATIC_LIBRARIES += liblzma
+endif
 ifneq ($(MR_DEVICE_RECOVERY_HOOKS),)
 ifeq ($(MR_DEVICE_RECOVERY_HOOKS_VER),)
     $(info MR_DEVICE_RECOVERY_HOOKS is set but MR_DEVICE_RECOVERY_HOOKS_VER is not specified!)
@@ -618,14 +645,12 @@ ifeq ($(TW_INCLUDE_CRYPTO), true)
     include $(commands_recovery_local_path)/crypto/lollipop/Android.mk
     include $(commands_recovery_local_path)/crypto/scrypt/Android.mk
 endif
-ifeq ($(BUILD_ID), GINGERBREAD)
-    TW_NO_EXFAT := true
-endif
 ifneq ($(TW_NO_EXFAT), true)
     include $(commands_recovery_local_path)/exfat/mkfs/Android.mk \
             $(commands_recovery_local_path)/exfat/fsck/Android.mk \
             $(commands_recovery_local_path)/fuse/Android.mk \
-            $(commands_recovery_local_path)/exfat/libexfat/Android.mk
+            $(commands_recovery_local_path)/exfat/libexfat/Android.mk \
+            $(commands_recovery_local_path)/exfat/bench/Android.mk
 endif
 ifneq ($(TW_NO_EXFAT_FUSE), true)
     include $(commands_recovery_local_path)/exfat/fuse/Android.mk
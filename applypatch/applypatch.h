@@ -80,6 +80,9 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
                     SinkFn sink, void* token, SHA_CTX* ctx,
                     const Value* bonus_data);
+// Number of worker threads used for deflate chunks; 0 picks a default
+// based on the number of online CPUs, 1 patches every chunk inline.
+void SetImagePatchThreads(int threads);
 
 // freecache.c
 int MakeFreeSpaceOnCache(size_t bytes_needed);
@@ -24,6 +24,7 @@
 #include <malloc.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "zlib.h"
 #include "mincrypt/sha.h"
@@ -31,6 +32,232 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+// Deflate chunks are independent of each other until their output is
+// concatenated, so they are inflated, patched and re-deflated on a
+// small pool of worker threads.  The main thread walks the chunk list
+// in order, writing normal and raw chunks itself and streaming each
+// deflate chunk's output to the sink as soon as it is ready.
+
+// Maximum number of deflate chunks that may be finished but not yet
+// written out, per worker.  Bounds the memory held by completed output.
+#define IMGPATCH_WINDOW_PER_THREAD 2
+
+typedef struct {
+    int type;
+
+    // CHUNK_NORMAL, CHUNK_DEFLATE
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;
+
+    // CHUNK_RAW
+    ssize_t raw_pos;
+    ssize_t raw_len;
+
+    // CHUNK_DEFLATE
+    size_t expanded_len;
+    size_t target_len;
+    int level;
+    int method;
+    int windowBits;
+    int memLevel;
+    int strategy;
+    size_t bonus_size;
+
+    // Result of a deflate chunk, filled in by a worker.
+    unsigned char* out_data;
+    ssize_t out_size;
+    int status;      // 0 pending, 1 done, -1 failed
+} ImageChunk;
+
+typedef struct {
+    const unsigned char* old_data;
+    const Value* patch;
+    const Value* bonus_data;
+
+    ImageChunk* chunks;
+    int num_chunks;
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    int next_chunk;     // next chunk index a worker may claim
+    int emit_chunk;     // chunk the main thread is currently writing
+    int window;         // how far ahead of emit_chunk workers may run
+    int abort;
+} ImagePatchState;
+
+static int imgpatch_threads = 0;
+
+void SetImagePatchThreads(int threads) {
+    imgpatch_threads = threads;
+}
+
+static int ImagePatchThreadCount() {
+    if (imgpatch_threads > 0) {
+        return imgpatch_threads;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > 8 ? 8 : (int)cpus;
+}
+
+/*
+ * Inflate the source of a deflate chunk, apply its bsdiff patch and
+ * deflate the result with the recorded zlib parameters.  The complete
+ * compressed output is left in chunk->out_data.  Return 0 on success.
+ */
+static int PatchDeflateChunk(const unsigned char* old_data, const Value* patch,
+                             const Value* bonus_data, int i, ImageChunk* chunk) {
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if
+    // the patch was constructed with bonus data.  The
+    // deflation will come up 'bonus_size' bytes short; these
+    // must be appended from the bonus_data value.
+    size_t expanded_len = chunk->expanded_len;
+    size_t bonus_size = chunk->bonus_size;
+
+    unsigned char* expanded_source = malloc(expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %zu bytes for expanded_source\n",
+               expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = chunk->src_len;
+    strm.next_in = (unsigned char*)(old_data + chunk->src_start);
+    strm.avail_out = expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        inflateEnd(&strm);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != bonus_size) {
+        printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
+        inflateEnd(&strm);
+        free(expanded_source);
+        return -1;
+    }
+    inflateEnd(&strm);
+
+    if (bonus_size) {
+        memcpy(expanded_source + (expanded_len - bonus_size),
+               bonus_data->data, bonus_size);
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                            patch, chunk->patch_offset,
+                            &uncompressed_target_data,
+                            &uncompressed_target_size) != 0) {
+        free(expanded_source);
+        return -1;
+    }
+    free(expanded_source);
+
+    // Now compress the target data into a buffer large enough to
+    // hold all of it, so a single deflate() call finishes the stream.
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit2(&strm, chunk->level, chunk->method, chunk->windowBits,
+                       chunk->memLevel, chunk->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init chunk %d deflation: %d\n", i, ret);
+        free(uncompressed_target_data);
+        return -1;
+    }
+
+    uLong out_size = deflateBound(&strm, uncompressed_target_size);
+    if (out_size < chunk->target_len) {
+        out_size = chunk->target_len;
+    }
+    unsigned char* out_data = malloc(out_size);
+    if (out_data == NULL) {
+        printf("failed to allocate %lu bytes for chunk %d output\n",
+               (unsigned long)out_size, i);
+        deflateEnd(&strm);
+        free(uncompressed_target_data);
+        return -1;
+    }
+
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    strm.avail_out = out_size;
+    strm.next_out = out_data;
+    ret = deflate(&strm, Z_FINISH);
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
+    if (ret != Z_STREAM_END) {
+        printf("chunk %d deflation returned %d\n", i, ret);
+        free(out_data);
+        return -1;
+    }
+
+    chunk->out_data = out_data;
+    chunk->out_size = out_size - strm.avail_out;
+    return 0;
+}
+
+static void* ImagePatchWorker(void* cookie) {
+    ImagePatchState* state = (ImagePatchState*) cookie;
+
+    pthread_mutex_lock(&state->mu);
+    while (!state->abort) {
+        // Find the next deflate chunk nobody has claimed yet.
+        while (state->next_chunk < state->num_chunks &&
+               state->chunks[state->next_chunk].type != CHUNK_DEFLATE) {
+            ++state->next_chunk;
+        }
+        if (state->next_chunk >= state->num_chunks) {
+            break;
+        }
+        // Don't run too far ahead of the writer.
+        if (state->next_chunk >= state->emit_chunk + state->window) {
+            pthread_cond_wait(&state->cv, &state->mu);
+            continue;
+        }
+
+        int i = state->next_chunk++;
+        pthread_mutex_unlock(&state->mu);
+
+        int result = PatchDeflateChunk(state->old_data, state->patch,
+                                       state->bonus_data, i, &state->chunks[i]);
+
+        pthread_mutex_lock(&state->mu);
+        state->chunks[i].status = (result == 0) ? 1 : -1;
+        pthread_cond_broadcast(&state->cv);
+    }
+    pthread_mutex_unlock(&state->mu);
+    return NULL;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
@@ -57,178 +284,206 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
     }
 
     int num_chunks = Read4(header+8);
+    if (num_chunks < 0) {
+        printf("corrupt patch file header (chunk count)\n");
+        return -1;
+    }
 
+    ImageChunk* chunks = calloc(num_chunks > 0 ? num_chunks : 1, sizeof(ImageChunk));
+    if (chunks == NULL) {
+        printf("failed to allocate %d chunk records\n", num_chunks);
+        return -1;
+    }
+
+    // Parse every chunk header up front so the deflate chunks can be
+    // handed to the workers before any output is written.
+    int num_deflate = 0;
     int i;
     for (i = 0; i < num_chunks; ++i) {
+        ImageChunk* chunk = &chunks[i];
+
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
+            free(chunks);
             return -1;
         }
-        int type = Read4(patch->data + pos);
+        chunk->type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (chunk->type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
+                free(chunks);
                 return -1;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            chunk->src_start = Read8(normal_header);
+            chunk->src_len = Read8(normal_header+8);
+            chunk->patch_offset = Read8(normal_header+16);
+        } else if (chunk->type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
+                free(chunks);
                 return -1;
             }
 
-            ssize_t data_len = Read4(raw_header);
+            chunk->raw_len = Read4(raw_header);
+            chunk->raw_pos = pos;
 
-            if (pos + data_len > patch->size) {
+            if (pos + chunk->raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
+                free(chunks);
                 return -1;
             }
-            if (ctx) SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
-            }
-            pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+            pos += chunk->raw_len;
+        } else if (chunk->type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
+                free(chunks);
                 return -1;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            // Note: expanded_len will include the bonus data size if
-            // the patch was constructed with bonus data.  The
-            // deflation will come up 'bonus_size' bytes short; these
-            // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %zu bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+            chunk->src_start = Read8(deflate_header);
+            chunk->src_len = Read8(deflate_header+8);
+            chunk->patch_offset = Read8(deflate_header+16);
+            chunk->expanded_len = Read8(deflate_header+24);
+            chunk->target_len = Read8(deflate_header+32);
+            chunk->level = Read4(deflate_header+40);
+            chunk->method = Read4(deflate_header+44);
+            chunk->windowBits = Read4(deflate_header+48);
+            chunk->memLevel = Read4(deflate_header+52);
+            chunk->strategy = Read4(deflate_header+56);
+            chunk->bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+            ++num_deflate;
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, chunk->type);
+            free(chunks);
+            return -1;
+        }
+    }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+    ImagePatchState state;
+    state.old_data = old_data;
+    state.patch = patch;
+    state.bonus_data = bonus_data;
+    state.chunks = chunks;
+    state.num_chunks = num_chunks;
+    state.next_chunk = 0;
+    state.emit_chunk = 0;
+    state.abort = 0;
+    pthread_mutex_init(&state.mu, NULL);
+    pthread_cond_init(&state.cv, NULL);
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
-                return -1;
-            }
-            inflateEnd(&strm);
+    // A single deflate chunk gains nothing from a worker; do it inline.
+    int num_threads = ImagePatchThreadCount();
+    if (num_threads > num_deflate) {
+        num_threads = num_deflate;
+    }
+    if (num_threads < 2) {
+        num_threads = 0;
+    }
+    state.window = num_threads * IMGPATCH_WINDOW_PER_THREAD;
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
+    pthread_t* threads = NULL;
+    int started = 0;
+    if (num_threads > 0) {
+        threads = malloc(num_threads * sizeof(pthread_t));
+        if (threads != NULL) {
+            for (; started < num_threads; ++started) {
+                int err = pthread_create(&threads[started], NULL,
+                                         ImagePatchWorker, &state);
+                if (err != 0) {
+                    printf("failed to start imgpatch worker %d: %s\n",
+                           started, strerror(err));
+                    break;
+                }
             }
+        }
+    }
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
+    int result = 0;
+    for (i = 0; i < num_chunks && result == 0; ++i) {
+        ImageChunk* chunk = &chunks[i];
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+        if (chunk->type == CHUNK_NORMAL) {
+            if (ApplyBSDiffPatch(old_data + chunk->src_start, chunk->src_len,
+                                 patch, chunk->patch_offset,
+                                 sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d bsdiff patch\n", i);
+                result = -1;
+            }
+        } else if (chunk->type == CHUNK_RAW) {
+            unsigned char* raw_data = (unsigned char*)patch->data + chunk->raw_pos;
+            if (ctx) SHA_update(ctx, raw_data, chunk->raw_len);
+            if (sink(raw_data, chunk->raw_len, token) != chunk->raw_len) {
+                printf("failed to write chunk %d raw data\n", i);
+                result = -1;
+            }
+        } else {
+            if (started > 0) {
+                // Chunk i is always inside the workers' window, so one
+                // of them will claim it and signal when it is done.
+                pthread_mutex_lock(&state.mu);
+                while (chunk->status == 0) {
+                    pthread_cond_wait(&state.cv, &state.mu);
+                }
+                pthread_mutex_unlock(&state.mu);
+            } else if (PatchDeflateChunk(old_data, patch, bonus_data,
+                                         i, chunk) == 0) {
+                chunk->status = 1;
+            } else {
+                chunk->status = -1;
             }
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
+            if (chunk->status != 1) {
+                result = -1;
+            } else {
+                if (sink(chunk->out_data, chunk->out_size, token) != chunk->out_size) {
                     printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
+                           (long)chunk->out_size);
+                    result = -1;
                 }
-                if (ctx) SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
+                if (ctx) SHA_update(ctx, chunk->out_data, chunk->out_size);
+            }
+            free(chunk->out_data);
+            chunk->out_data = NULL;
+        }
 
-            free(temp_data);
-            free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+        if (started > 0) {
+            pthread_mutex_lock(&state.mu);
+            state.emit_chunk = i + 1;
+            if (result != 0) state.abort = 1;
+            pthread_cond_broadcast(&state.cv);
+            pthread_mutex_unlock(&state.mu);
         }
     }
 
-    return 0;
+    if (started > 0) {
+        pthread_mutex_lock(&state.mu);
+        state.abort = 1;
+        pthread_cond_broadcast(&state.cv);
+        pthread_mutex_unlock(&state.mu);
+        int t;
+        for (t = 0; t < started; ++t) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    free(threads);
+
+    for (i = 0; i < num_chunks; ++i) {
+        free(chunks[i].out_data);
+    }
+    free(chunks);
+    pthread_cond_destroy(&state.cv);
+    pthread_mutex_destroy(&state.mu);
+
+    return result;
 }
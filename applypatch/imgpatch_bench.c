@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times ApplyImagePatch() on a source file and an imgdiff patch,
+// once with all chunks patched inline and once with the worker pool,
+// and checks that both runs produce the same output.
+//
+// usage: imgpatch_bench <src-file> <patch-file> [iterations] [threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "applypatch.h"
+#include "mincrypt/sha.h"
+
+static ssize_t NullSink(const unsigned char* data __unused, ssize_t len,
+                        void* token) {
+    *(size_t*)token += len;
+    return len;
+}
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int RunPatch(const FileContents* source, const Value* patch,
+                    int threads, int iterations, uint8_t* digest) {
+    SetImagePatchThreads(threads);
+
+    size_t total = 0;
+    double start = Now();
+    int i;
+    for (i = 0; i < iterations; ++i) {
+        SHA_CTX ctx;
+        SHA_init(&ctx);
+        size_t written = 0;
+        if (ApplyImagePatch(source->data, source->size, patch,
+                            NullSink, &written, &ctx, NULL) != 0) {
+            printf("ApplyImagePatch failed with %d thread(s)\n", threads);
+            return -1;
+        }
+        memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+        total += written;
+    }
+    double elapsed = Now() - start;
+
+    printf("threads=%-2d %d iteration(s) in %.3f s: %.3f s/patch, %.2f MB/s output\n",
+           threads, iterations, elapsed, elapsed / iterations,
+           elapsed > 0 ? total / elapsed / (1024.0 * 1024.0) : 0.0);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("usage: %s <src-file> <patch-file> [iterations] [threads]\n", argv[0]);
+        return 2;
+    }
+    int iterations = argc > 3 ? atoi(argv[3]) : 5;
+    int threads = argc > 4 ? atoi(argv[4]) : 0;
+    if (iterations < 1) iterations = 1;
+
+    FileContents source, patch_file;
+    if (LoadFileContents(argv[1], &source) != 0) {
+        printf("failed to load source %s\n", argv[1]);
+        return 1;
+    }
+    if (LoadFileContents(argv[2], &patch_file) != 0) {
+        printf("failed to load patch %s\n", argv[2]);
+        return 1;
+    }
+
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = patch_file.size;
+    patch.data = (char*)patch_file.data;
+
+    uint8_t serial_digest[SHA_DIGEST_SIZE];
+    uint8_t parallel_digest[SHA_DIGEST_SIZE];
+    if (RunPatch(&source, &patch, 1, iterations, serial_digest) != 0 ||
+        RunPatch(&source, &patch, threads, iterations, parallel_digest) != 0) {
+        return 1;
+    }
+
+    if (memcmp(serial_digest, parallel_digest, SHA_DIGEST_SIZE) != 0) {
+        printf("output of serial and parallel runs differs!\n");
+        return 1;
+    }
+    printf("outputs match\n");
+
+    free(source.data);
+    free(patch_file.data);
+    return 0;
+}
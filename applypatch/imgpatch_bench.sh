@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# A benchmark for imgpatch.  Run in a client where you have done
+# envsetup, choosecombo, etc., and built imgdiff, minigzip and
+# imgpatch_bench.  It builds a boot-image-like file out of the files
+# in testdata (several gzipped copies separated by raw padding),
+# generates an imgdiff patch for it on the host, then times
+# ApplyImagePatch on the device with and without the worker pool.
+
+DATA_DIR=$ANDROID_BUILD_TOP/bootable/recovery/applypatch/testdata
+
+# where on the device to do all the patching.
+WORK_DIR=/data/local/tmp
+
+# number of gzipped chunks in the generated image.
+NUM_CHUNKS=${NUM_CHUNKS:-8}
+
+# number of times to apply the patch in each configuration.
+ITERATIONS=${ITERATIONS:-5}
+
+# worker threads for the parallel run; 0 means one per CPU.
+THREADS=${THREADS:-0}
+
+ADB="adb -d "
+
+# ------------------------
+
+tmpdir=$(mktemp -d)
+
+fail() {
+  echo
+  echo FAIL: $1
+  echo
+  rm -rf $tmpdir
+  exit 1
+}
+
+make_image() {
+  local src=$1
+  local out=$2
+  rm -f $out
+  for i in $(seq 1 $NUM_CHUNKS); do
+    cat $tmpdir/pad.$i >> $out
+    # imgdiff can only reconstruct zlib's own gzip output.
+    minigzip -c < $src >> $out || fail "minigzip failed"
+  done
+}
+
+for i in $(seq 1 $NUM_CHUNKS); do
+  head -c 4096 /dev/urandom > $tmpdir/pad.$i
+done
+
+make_image $DATA_DIR/old.file $tmpdir/old.img
+make_image $DATA_DIR/new.file $tmpdir/new.img
+imgdiff $tmpdir/old.img $tmpdir/new.img $tmpdir/patch.img || fail "imgdiff failed"
+echo "patch is $(stat -c %s $tmpdir/patch.img) bytes for $(stat -c %s $tmpdir/new.img) byte target"
+
+echo "waiting to connect to device"
+$ADB wait-for-device
+
+$ADB push $ANDROID_PRODUCT_OUT/system/bin/imgpatch_bench $WORK_DIR/imgpatch_bench || fail "push failed"
+$ADB push $tmpdir/old.img $WORK_DIR/old.img || fail "push failed"
+$ADB push $tmpdir/patch.img $WORK_DIR/patch.img || fail "push failed"
+
+$ADB shell $WORK_DIR/imgpatch_bench $WORK_DIR/old.img $WORK_DIR/patch.img \
+  $ITERATIONS $THREADS
+
+$ADB shell rm $WORK_DIR/imgpatch_bench $WORK_DIR/old.img $WORK_DIR/patch.img
+rm -rf $tmpdir
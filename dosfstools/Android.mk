@@ -41,6 +41,14 @@ LOCAL_MODULE_CLASS := RECOVERY_EXECUTABLES
 LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/sbin
 include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := src/mkfs.fat.c
+LOCAL_CFLAGS += -D_USING_BIONIC_
+LOCAL_CFLAGS += -DMKFS_FAT_LIBRARY
+LOCAL_MODULE = libmkfs_fat
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_STATIC_LIBRARY)
+
 include $(CLEAR_VARS)
 LOCAL_SRC_FILES := src/mkfs.fat.c
 
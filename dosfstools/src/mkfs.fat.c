@@ -70,6 +70,25 @@
 
 #include "msdos_fs.h"
 
+#ifdef MKFS_FAT_LIBRARY
+/* Built into recovery as a library: exit() unwinds back to
+   mkfs_fat_main() instead of ending the calling process */
+#include <setjmp.h>
+#include "mkfs.fat.h"
+
+static jmp_buf library_exit_jmp;
+static mkfs_fat_progress_fn progress_fn = NULL;
+static void *progress_cookie = NULL;
+
+static void library_exit(int code) __attribute__ ((noreturn));
+static void library_exit(int code)
+{
+    longjmp(library_exit_jmp, code + 1);
+}
+
+#define exit(code) library_exit(code)
+#endif
+
 /* In earlier versions, an own llseek() was used, but glibc lseek() is
  * sufficient (or even better :) for 64 bit offsets in the meantime */
 #define llseek lseek64
@@ -85,6 +104,8 @@
 
 #define NO_NAME "NO NAME    "
 
+#define BLANK_RUN_SECTORS 256	/* Blank FAT sectors are written this many at a time */
+
 /* Macro definitions */
 
 /* Report a failure message and return a failure error code */
@@ -252,7 +273,7 @@ static struct msdos_dir_entry *root_dir;	/* Root directory */
 static int size_root_dir;	/* Size of the root directory in bytes */
 static int sectors_per_cluster = 0;	/* Number of sectors per disk cluster */
 static int root_dir_entries = 0;	/* Number of root directory entries */
-static char *blank_sector;	/* Blank sector - all zeros */
+static char *blank_sector;	/* Blank sectors - all zeros */
 static int hidden_sectors = 0;	/* Number of hidden sectors */
 static int hidden_sectors_by_user = 0;	/* -h option invoked */
 static int drive_number_option = 0;	/* drive number */
@@ -1263,9 +1284,8 @@ static void setup_tables(void)
 	*(uint16_t *) (info_sector + 0x1fe) = htole16(BOOT_SIGN);
     }
 
-    if (!(blank_sector = malloc(sector_size)))
+    if (!(blank_sector = calloc(BLANK_RUN_SECTORS, sector_size)))
 	die("Out of memory");
-    memset(blank_sector, 0, sector_size);
 }
 
 /* Write the new filesystem's data tables to wherever they're going to end up! */
@@ -1273,8 +1293,11 @@ static void setup_tables(void)
 #define error(str)				\
   do {						\
     free (fat);					\
+    fat = NULL;					\
     if (info_sector) free (info_sector);	\
+    info_sector = NULL;				\
     free (root_dir);				\
+    root_dir = NULL;				\
     die (str);					\
   } while(0)
 
@@ -1292,13 +1315,24 @@ static void setup_tables(void)
 	error ("failed whilst writing " errstr);	\
   } while(0)
 
+static void report_progress(uint64_t done, uint64_t total)
+{
+#ifdef MKFS_FAT_LIBRARY
+    if (progress_fn)
+	progress_fn(done, total, progress_cookie);
+#endif
+}
+
 static void write_tables(void)
 {
     int x;
     int fat_length;
+    uint64_t done = 0, total;
 
     fat_length = (size_fat == 32) ?
 	le32toh(bs.fat32.fat32_length) : le16toh(bs.fat_length);
+    total = reserved_sectors + (uint64_t) nr_fats * fat_length +
+	size_root_dir / sector_size;
 
     seekto(0, "start of device");
     /* clear all reserved sectors */
@@ -1317,25 +1351,39 @@ static void write_tables(void)
 		     "backup boot sector");
 	}
     }
+    done += reserved_sectors;
+    report_progress(done, total);
     /* seek to start of FATS and write them all */
     seekto(reserved_sectors * sector_size, "first FAT");
     for (x = 1; x <= nr_fats; x++) {
-	int y;
+	int y, run;
 	int blank_fat_length = fat_length - alloced_fat_length;
 	writebuf(fat, alloced_fat_length * sector_size, "FAT");
-	for (y = 0; y < blank_fat_length; y++)
-	    writebuf(blank_sector, sector_size, "FAT");
+	done += alloced_fat_length;
+	for (y = 0; y < blank_fat_length; y += run) {
+	    run = blank_fat_length - y;
+	    if (run > BLANK_RUN_SECTORS)
+		run = BLANK_RUN_SECTORS;
+	    writebuf(blank_sector, run * sector_size, "FAT");
+	    done += run;
+	    report_progress(done, total);
+	}
     }
     /* Write the root directory directly after the last FAT. This is the root
      * dir area on FAT12/16, and the first cluster on FAT32. */
     writebuf((char *)root_dir, size_root_dir, "root directory");
+    report_progress(total, total);
 
     if (blank_sector)
 	free(blank_sector);
+    blank_sector = NULL;
     if (info_sector)
 	free(info_sector);
+    info_sector = NULL;
     free(root_dir);		/* Free up the root directory space from setup_tables */
+    root_dir = NULL;
     free(fat);			/* Free up the fat table space reserved during setup_tables */
+    fat = NULL;
 }
 
 /* Report the command usage and exit with the given error code */
@@ -1382,10 +1430,108 @@ static void check_atari(void)
 #endif
 }
 
+#ifdef MKFS_FAT_LIBRARY
+static int mkfs_fat(int argc, char **argv);
+
+/* Put every global back to its initial value so that the filesystem
+   can be created more than once from the same process */
+static void reset_globals(void)
+{
+    static char saved_boot_code[BOOTCODE_SIZE];
+    static int saved = 0;
+
+    if (!saved) {
+	memcpy(saved_boot_code, dummy_boot_code, BOOTCODE_SIZE);
+	saved = 1;
+    } else
+	memcpy(dummy_boot_code, saved_boot_code, BOOTCODE_SIZE);
+
+    program_name = "mkfs.fat";
+    device_name = NULL;
+    atari_format = 0;
+    check = FALSE;
+    verbose = 0;
+    volume_id = 0;
+    create_time = 0;
+    memcpy(volume_name, NO_NAME, sizeof(volume_name));
+    blocks = 0;
+    sector_size = 512;
+    sector_size_set = 0;
+    backup_boot = 0;
+    reserved_sectors = 0;
+    badblocks = 0;
+    nr_fats = 2;
+    size_fat = 0;
+    size_fat_by_user = 0;
+    dev = -1;
+    ignore_full_disk = 0;
+    currently_testing = 0;
+    memset(&bs, 0, sizeof(bs));
+    start_data_sector = 0;
+    start_data_block = 0;
+    fat = NULL;
+    alloced_fat_length = 0;
+    info_sector = NULL;
+    root_dir = NULL;
+    size_root_dir = 0;
+    sectors_per_cluster = 0;
+    root_dir_entries = 0;
+    blank_sector = NULL;
+    hidden_sectors = 0;
+    hidden_sectors_by_user = 0;
+    drive_number_option = 0;
+    drive_number_by_user = 0;
+    fat_media_byte = 0;
+    malloc_entire_fat = FALSE;
+    align_structures = TRUE;
+    orphaned_sectors = 0;
+    invariant = 0;
+    optind = 0;			/* Restart getopt from scratch */
+}
+
+void mkfs_fat_set_progress(mkfs_fat_progress_fn fn, void *cookie)
+{
+    progress_fn = fn;
+    progress_cookie = cookie;
+}
+
+int mkfs_fat_main(int argc, char **argv)
+{
+    int ret;
+
+    reset_globals();
+    ret = setjmp(library_exit_jmp);
+    if (ret == 0)
+	ret = mkfs_fat(argc, argv) + 1;
+
+    free(fat);
+    free(info_sector);
+    free(root_dir);
+    free(blank_sector);
+    fat = NULL;
+    info_sector = NULL;
+    root_dir = NULL;
+    blank_sector = NULL;
+    if (dev >= 0) {
+	if (ret == 1 && fsync(dev) != 0) {
+	    perror(device_name);
+	    ret = 2;
+	}
+	close(dev);
+	dev = -1;
+    }
+    return ret - 1;
+}
+#endif
+
 /* The "main" entry point into the utility - we pick up the options and attempt to process them in some sort of sensible
    way.  In the event that some/all of the options are invalid we need to tell the user so that something can be done! */
 
+#ifdef MKFS_FAT_LIBRARY
+static int mkfs_fat(int argc, char **argv)
+#else
 int main(int argc, char **argv)
+#endif
 {
     int c;
     char *tmp;
@@ -0,0 +1,43 @@
+/* mkfs.fat.h - mkfs.fat built as a library
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+   The complete text of the GNU General Public License
+   can be found in /usr/share/common-licenses/GPL-3 file.
+*/
+
+#ifndef _MKFS_FAT_H
+#define _MKFS_FAT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called as the filesystem tables are written, with the number of
+   sectors written so far and the total that will be written */
+typedef void (*mkfs_fat_progress_fn) (uint64_t done, uint64_t total,
+				      void *cookie);
+
+/* Runs mkfs.fat with the given command line and returns its exit code.
+   Errors return instead of exiting the calling process. */
+int mkfs_fat_main(int argc, char **argv);
+void mkfs_fat_set_progress(mkfs_fat_progress_fn fn, void *cookie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,6 +19,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "expr.h"
@@ -32,8 +35,12 @@ int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
+static char operator_name[] = "(operator)";
+
+static Value* EvaluateNode(State* state, Expr* expr);
+
 char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    Value* v = EvaluateNode(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -46,7 +53,7 @@ char* Evaluate(State* state, Expr* expr) {
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    return EvaluateNode(state, expr);
 }
 
 Value* StringValue(char* str) {
@@ -327,7 +334,9 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_start(v, count);
     Expr* e = malloc(sizeof(Expr));
     e->fn = fn;
-    e->name = "(operator)";
+    e->name = operator_name;
+    e->name_len = -1;
+    e->profile_index = -1;
     e->argc = count;
     e->argv = malloc(count * sizeof(Expr*));
     int i;
@@ -340,6 +349,311 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     return e;
 }
 
+// -----------------------------------------------------------------
+//   the packed form
+// -----------------------------------------------------------------
+
+// A packed tree is one malloc'd block holding, in order, every Expr
+// node (pre-order, so the root is first), every argv array, and a
+// table of the distinct literal and function name strings.  Literals
+// carry their length, so evaluating one is a single copy out of the
+// table instead of a call through Literal().  Each distinct function
+// name also gets a profile slot, so profiling a call is an array index.
+
+typedef struct {
+    const char* str;     // string in the parse tree
+    char* interned;      // copy in the packed block
+    int profile_index;   // -1 until the name is seen as a function
+} InternEntry;
+
+typedef struct {
+    InternEntry* table;
+    int table_size;
+    int nodes;
+    int args;
+    size_t string_bytes;
+
+    Expr* next_node;
+    Expr** next_arg;
+    char* next_string;
+} PackState;
+
+// Profile slots handed out so far, over every packed tree.
+static int profile_slots = 0;
+
+static unsigned int HashName(const char* str) {
+    unsigned int h = 5381;
+    while (*str) {
+        h = h * 33 + (unsigned char)*str++;
+    }
+    return h;
+}
+
+static InternEntry* FindIntern(PackState* ps, const char* str) {
+    unsigned int i = HashName(str) & (ps->table_size - 1);
+    while (ps->table[i].str != NULL && strcmp(ps->table[i].str, str) != 0) {
+        i = (i + 1) & (ps->table_size - 1);
+    }
+    return &ps->table[i];
+}
+
+static void CountExpr(Expr* e, int* nodes, int* args) {
+    ++*nodes;
+    *args += e->argc;
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        CountExpr(e->argv[i], nodes, args);
+    }
+}
+
+static void InternNames(PackState* ps, Expr* e) {
+    if (e->name != operator_name) {
+        InternEntry* entry = FindIntern(ps, e->name);
+        if (entry->str == NULL) {
+            entry->str = e->name;
+            entry->profile_index = -1;
+            ps->string_bytes += strlen(e->name) + 1;
+        }
+    }
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        InternNames(ps, e->argv[i]);
+    }
+}
+
+static Expr* CopyExpr(PackState* ps, Expr* e) {
+    Expr* n = ps->next_node++;
+    n->fn = e->fn;
+    n->start = e->start;
+    n->end = e->end;
+    n->argc = e->argc;
+    n->name_len = -1;
+    n->profile_index = -1;
+    if (e->name == operator_name) {
+        n->name = operator_name;
+    } else {
+        InternEntry* entry = FindIntern(ps, e->name);
+        if (entry->interned == NULL) {
+            size_t len = strlen(e->name);
+            entry->interned = ps->next_string;
+            memcpy(entry->interned, e->name, len + 1);
+            ps->next_string += len + 1;
+        }
+        n->name = entry->interned;
+        if (n->fn == Literal) {
+            n->name_len = strlen(n->name);
+        } else {
+            if (entry->profile_index < 0) {
+                entry->profile_index = profile_slots++;
+            }
+            n->profile_index = entry->profile_index;
+        }
+    }
+
+    n->argv = NULL;
+    if (e->argc > 0) {
+        n->argv = ps->next_arg;
+        ps->next_arg += e->argc;
+    }
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        n->argv[i] = CopyExpr(ps, e->argv[i]);
+    }
+    return n;
+}
+
+static void FreeParsedExpr(Expr* e) {
+    int i;
+    for (i = 0; i < e->argc; ++i) {
+        FreeParsedExpr(e->argv[i]);
+    }
+    free(e->argv);
+    if (e->name != operator_name) {
+        free(e->name);
+    }
+    free(e);
+}
+
+Expr* PackExpr(Expr* root) {
+    PackState ps;
+    memset(&ps, 0, sizeof(ps));
+    CountExpr(root, &ps.nodes, &ps.args);
+
+    // Keep the intern table at most half full.
+    ps.table_size = 16;
+    while (ps.table_size < ps.nodes * 2) {
+        ps.table_size *= 2;
+    }
+    ps.table = calloc(ps.table_size, sizeof(InternEntry));
+    if (ps.table == NULL) {
+        return NULL;
+    }
+    InternNames(&ps, root);
+
+    size_t size = ps.nodes * sizeof(Expr) + ps.args * sizeof(Expr*) +
+                  ps.string_bytes;
+    char* block = malloc(size);
+    if (block == NULL) {
+        free(ps.table);
+        return NULL;
+    }
+    ps.next_node = (Expr*) block;
+    ps.next_arg = (Expr**) (block + ps.nodes * sizeof(Expr));
+    ps.next_string = (char*) (ps.next_arg + ps.args);
+
+    Expr* packed = CopyExpr(&ps, root);
+    free(ps.table);
+    FreeParsedExpr(root);
+    return packed;
+}
+
+void FreePackedExpr(Expr* root) {
+    free(root);
+}
+
+// -----------------------------------------------------------------
+//   profiling
+// -----------------------------------------------------------------
+
+typedef struct {
+    char* name;
+    int calls;
+    double seconds;
+    long long read_bytes;
+    long long write_bytes;
+} ProfileEntry;
+
+static int profiling = 0;
+static int profile_io_fd = -1;
+static ProfileEntry* profile = NULL;
+static int profile_size = 0;
+
+void SetProfiling(int enabled) {
+    profiling = enabled;
+    if (enabled && profile_io_fd < 0) {
+        profile_io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+    } else if (!enabled && profile_io_fd >= 0) {
+        close(profile_io_fd);
+        profile_io_fd = -1;
+    }
+}
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read the bytes this process has read and written so far (including
+// page cache hits, which the block layer counters would miss).  The
+// file is kept open so each sample is a single pread().
+static void ReadIoCounters(long long* rchar, long long* wchar) {
+    *rchar = 0;
+    *wchar = 0;
+    if (profile_io_fd < 0) {
+        return;
+    }
+    char buf[512];
+    ssize_t len = pread(profile_io_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0) {
+        return;
+    }
+    buf[len] = '\0';
+    char* p = strstr(buf, "rchar:");
+    if (p) *rchar = strtoll(p + 6, NULL, 10);
+    p = strstr(buf, "wchar:");
+    if (p) *wchar = strtoll(p + 6, NULL, 10);
+}
+
+static ProfileEntry* GetProfileEntry(Expr* expr) {
+    if (expr->profile_index >= profile_size) {
+        int size = profile_slots;
+        ProfileEntry* grown = realloc(profile, size * sizeof(ProfileEntry));
+        if (grown == NULL) {
+            return NULL;
+        }
+        memset(grown + profile_size, 0,
+               (size - profile_size) * sizeof(ProfileEntry));
+        profile = grown;
+        profile_size = size;
+    }
+    ProfileEntry* entry = &profile[expr->profile_index];
+    if (entry->name == NULL) {
+        entry->name = strdup(expr->name);
+    }
+    return entry;
+}
+
+static Value* ProfiledCall(State* state, Expr* expr) {
+    long long rchar, wchar;
+    ReadIoCounters(&rchar, &wchar);
+    double start = Now();
+
+    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+
+    double elapsed = Now() - start;
+    long long rchar_after, wchar_after;
+    ReadIoCounters(&rchar_after, &wchar_after);
+
+    ProfileEntry* entry = GetProfileEntry(expr);
+    if (entry != NULL) {
+        ++entry->calls;
+        entry->seconds += elapsed;
+        entry->read_bytes += rchar_after - rchar;
+        entry->write_bytes += wchar_after - wchar;
+    }
+    return v;
+}
+
+static int profile_compare(const void* a, const void* b) {
+    double sa = (*(ProfileEntry* const*)a)->seconds;
+    double sb = (*(ProfileEntry* const*)b)->seconds;
+    return (sa < sb) - (sa > sb);
+}
+
+void DumpProfile(FILE* out) {
+    int i, count = 0;
+    ProfileEntry** sorted = malloc(profile_size * sizeof(ProfileEntry*));
+    if (sorted == NULL) {
+        return;
+    }
+    for (i = 0; i < profile_size; ++i) {
+        if (profile[i].calls > 0) {
+            sorted[count++] = &profile[i];
+        }
+    }
+    if (count > 0) {
+        qsort(sorted, count, sizeof(ProfileEntry*), profile_compare);
+        fprintf(out, "edify profile (inclusive of nested calls):\n");
+        fprintf(out, "  %-32s %6s %10s %12s %12s\n",
+                "function", "calls", "seconds", "read KB", "written KB");
+        for (i = 0; i < count; ++i) {
+            fprintf(out, "  %-32s %6d %10.3f %12lld %12lld\n",
+                    sorted[i]->name, sorted[i]->calls, sorted[i]->seconds,
+                    sorted[i]->read_bytes / 1024,
+                    sorted[i]->write_bytes / 1024);
+        }
+    }
+    free(sorted);
+}
+
+static Value* EvaluateNode(State* state, Expr* expr) {
+    if (expr->name_len >= 0) {
+        // Literal in a packed tree.
+        char* str = malloc(expr->name_len + 1);
+        memcpy(str, expr->name, expr->name_len + 1);
+        Value* v = malloc(sizeof(Value));
+        v->type = VAL_STRING;
+        v->size = expr->name_len;
+        v->data = str;
+        return v;
+    }
+    if (profiling && expr->profile_index >= 0) {
+        return ProfiledCall(state, expr);
+    }
+    return expr->fn(expr->name, state, expr->argc, expr->argv);
+}
+
 // -----------------------------------------------------------------
 //   the function table
 // -----------------------------------------------------------------
@@ -17,6 +17,7 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdio.h>
 #include <unistd.h>
 
 #include "yydefs.h"
@@ -63,6 +64,11 @@ struct Expr {
     int argc;
     Expr** argv;
     int start, end;
+    // Length of name for literals in a packed tree (see PackExpr());
+    // -1 otherwise.
+    int name_len;
+    // Profile slot of a function call in a packed tree; -1 otherwise.
+    int profile_index;
 };
 
 // Take one of the Expr*s passed to the function as an argument,
@@ -166,6 +172,24 @@ void FreeValue(Value* v);
 
 int parse_string(const char* str, Expr** root, int* error_count);
 
+// Copy the tree returned by parse_string() into a single block holding
+// every node, every argv array and one interned table of the literal
+// and function names, and free the original.  The packed tree is
+// evaluated exactly like the parsed one, but without a malloc'd node
+// per expression to chase.  Returns NULL (leaving the tree untouched)
+// if allocation fails.
+Expr* PackExpr(Expr* root);
+
+// Free a tree returned by PackExpr().
+void FreePackedExpr(Expr* root);
+
+// Off by default.  When enabled, every call of a registered function in
+// a packed tree records its wall time and the bytes the process read
+// and wrote while it ran (inclusive of nested calls).  DumpProfile()
+// prints the totals per function, slowest first.
+void SetProfiling(int enabled);
+void DumpProfile(FILE* out);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
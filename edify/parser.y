@@ -75,6 +75,8 @@ expr:  STRING {
     $$->name = $1;
     $$->argc = 0;
     $$->argv = NULL;
+    $$->name_len = -1;
+    $$->profile_index = -1;
     $$->start = @$.start;
     $$->end = @$.end;
 }
@@ -102,6 +104,8 @@ expr:  STRING {
     $$->name = $1;
     $$->argc = $3.argc;
     $$->argv = $3.argv;
+    $$->name_len = -1;
+    $$->profile_index = -1;
     $$->start = @$.start;
     $$->end = @$.end;
 }
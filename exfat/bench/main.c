@@ -0,0 +1,396 @@
+/*
+	main.c
+	exFAT throughput benchmark.
+
+	Free exFAT implementation.
+	Copyright (C) 2011-2015  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+	Creates an image file with mkexfatfs, mounts it with libexfat and
+	measures sequential and random reads and writes through
+	exfat_generic_pread() and exfat_generic_pwrite(), first on a
+	contiguous file and then on two files written in turns so their
+	clusters interleave. Every read is checked against the written data.
+	It also times allocating and freeing the clusters of a large file
+	with exfat_truncate() and the free space count used by statfs.
+	Finally several threads read and write files of their own at once,
+	as the FUSE daemon serves requests, first one request at a time and
+	then concurrently.
+	The image normally sits in the page cache, so the numbers show the
+	cost of the file system code and of the requests it makes rather
+	than of the storage.
+
+	usage: exfatbench <image-file> [size-MB]
+*/
+
+#include <exfat.h>
+#include "mkexfatfs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SEQ_REQUEST (1024 * 1024)
+#define RANDOM_REQUEST (64 * 1024)
+#define FRAGMENT_SIZE (256 * 1024)
+#define THREAD_REQUEST (128 * 1024)	/* as FUSE sends */
+#define THREADS 4
+
+struct thread_job
+{
+	struct exfat* ef;
+	struct exfat_node* node;
+	uint64_t size;
+	int seed;
+	bool write;
+	bool ok;
+};
+
+/* held around each request to serve them one at a time */
+static pthread_mutex_t serial_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool serialize;
+
+static uint8_t* buffer;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, uint64_t bytes, double seconds, bool ok)
+{
+	printf("%-28s %9.1f MB/s  %s\n", name,
+			seconds > 0 ? bytes / 1048576.0 / seconds : 0,
+			ok ? "ok" : "FAILED");
+}
+
+/* the data at each offset depends on the offset, so any read can be
+   checked and rewriting a range keeps the file valid */
+static void fill(uint8_t* p, size_t size, uint64_t offset, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		p[i] = (uint8_t) ((offset + i) * 13 + ((offset + i) >> 16) + seed);
+}
+
+static bool check(const uint8_t* p, size_t size, uint64_t offset, int seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		if (p[i] != (uint8_t) ((offset + i) * 13 + ((offset + i) >> 16) + seed))
+			return false;
+	return true;
+}
+
+static struct exfat_node* create(struct exfat* ef, const char* path)
+{
+	struct exfat_node* node;
+
+	if (exfat_mknod(ef, path) != 0 || exfat_lookup(ef, &node, path) != 0)
+	{
+		exfat_error("failed to create '%s'", path);
+		return NULL;
+	}
+	return node;
+}
+
+static bool write_at(struct exfat* ef, struct exfat_node* node,
+		size_t size, uint64_t offset, int seed)
+{
+	fill(buffer, size, offset, seed);
+	return exfat_generic_pwrite(ef, node, buffer, size, offset) ==
+			(ssize_t) size;
+}
+
+static bool read_at(struct exfat* ef, struct exfat_node* node,
+		size_t size, uint64_t offset, int seed)
+{
+	return exfat_generic_pread(ef, node, buffer, size, offset) ==
+			(ssize_t) size && check(buffer, size, offset, seed);
+}
+
+static bool sequential(struct exfat* ef, struct exfat_node* node,
+		uint64_t size, bool write, int seed, const char* name)
+{
+	uint64_t offset;
+	bool ok = true;
+	double start = now();
+
+	for (offset = 0; ok && offset < size; offset += SEQ_REQUEST)
+		ok = write ? write_at(ef, node, SEQ_REQUEST, offset, seed) :
+				read_at(ef, node, SEQ_REQUEST, offset, seed);
+	if (write)
+		ok = exfat_flush_node(ef, node) == 0 && exfat_fsync(ef->dev) == 0
+				&& ok;
+	report(name, size, now() - start, ok);
+	return ok;
+}
+
+static bool random_io(struct exfat* ef, struct exfat_node* node,
+		uint64_t size, bool write, int seed, const char* name)
+{
+	const uint64_t count = size / RANDOM_REQUEST;
+	uint64_t i;
+	bool ok = true;
+	double start = now();
+
+	srand(count);
+	for (i = 0; ok && i < count; i++)
+	{
+		uint64_t offset = (uint64_t) (rand() % count) * RANDOM_REQUEST;
+		ok = write ? write_at(ef, node, RANDOM_REQUEST, offset, seed) :
+				read_at(ef, node, RANDOM_REQUEST, offset, seed);
+	}
+	if (write)
+		ok = exfat_flush_node(ef, node) == 0 && exfat_fsync(ef->dev) == 0
+				&& ok;
+	report(name, count * RANDOM_REQUEST, now() - start, ok);
+	return ok;
+}
+
+static void report_time(const char* name, uint32_t clusters, double seconds,
+		bool ok)
+{
+	printf("%-28s %9.3f ms    %s, %u clusters\n", name, seconds * 1e3,
+			ok ? "ok" : "FAILED", clusters);
+}
+
+static bool allocation(struct exfat* ef, uint64_t size)
+{
+	struct exfat_node* node;
+	const uint32_t clusters = size / CLUSTER_SIZE(*ef->sb);
+	const int calls = 1000;
+	uint32_t free_clusters = 0;
+	double start;
+	bool ok;
+	int i;
+
+	node = create(ef, "/allocation");
+	if (node == NULL)
+		return false;
+	start = now();
+	ok = exfat_truncate(ef, node, size, false) == 0;
+	report_time("allocate clusters", clusters, now() - start, ok);
+	printf("%-28s %s\n", "allocated file",
+			IS_CONTIGUOUS(*node) ? "contiguous" : "fragmented");
+	start = now();
+	ok = exfat_truncate(ef, node, 0, false) == 0 && ok;
+	report_time("free clusters", clusters, now() - start, ok);
+	ok = exfat_flush_node(ef, node) == 0 && ok;
+	exfat_put_node(ef, node);
+
+	start = now();
+	for (i = 0; i < calls; i++)
+		free_clusters += exfat_count_free_clusters(ef);
+	printf("%-28s %9.3f us/call\n", "statfs free clusters",
+			(now() - start) * 1e6 / calls);
+	return ok && free_clusters != 0;
+}
+
+static bool fragmented(struct exfat* ef, uint64_t size)
+{
+	struct exfat_node* a;
+	struct exfat_node* b;
+	uint64_t offset;
+	bool ok = true;
+	double start;
+
+	a = create(ef, "/fragmented-a");
+	b = create(ef, "/fragmented-b");
+	if (a == NULL || b == NULL)
+		return false;
+
+	/* write in turns so the clusters of the files interleave */
+	start = now();
+	for (offset = 0; ok && offset < size; offset += FRAGMENT_SIZE)
+		ok = write_at(ef, a, FRAGMENT_SIZE, offset, 1) &&
+				write_at(ef, b, FRAGMENT_SIZE, offset, 2);
+	ok = exfat_flush_node(ef, a) == 0 && exfat_flush_node(ef, b) == 0 &&
+			exfat_fsync(ef->dev) == 0 && ok;
+	report("fragmented interleaved write", 2 * size, now() - start, ok);
+
+	ok = ok && sequential(ef, a, size, false, 1, "fragmented seq read");
+	ok = ok && random_io(ef, a, size, false, 1, "fragmented random read");
+
+	exfat_put_node(ef, a);
+	exfat_put_node(ef, b);
+	return ok;
+}
+
+static void* thread_io(void* cookie)
+{
+	struct thread_job* job = cookie;
+	uint8_t* p = malloc(THREAD_REQUEST);
+	uint64_t offset;
+	ssize_t rc;
+
+	job->ok = p != NULL;
+	for (offset = 0; job->ok && offset < job->size; offset += THREAD_REQUEST)
+	{
+		if (serialize)
+			pthread_mutex_lock(&serial_lock);
+		if (job->write)
+		{
+			fill(p, THREAD_REQUEST, offset, job->seed);
+			rc = exfat_generic_pwrite(job->ef, job->node, p, THREAD_REQUEST,
+					offset);
+		}
+		else
+			rc = exfat_generic_pread(job->ef, job->node, p, THREAD_REQUEST,
+					offset);
+		if (serialize)
+			pthread_mutex_unlock(&serial_lock);
+		job->ok = rc == THREAD_REQUEST &&
+				(job->write || check(p, THREAD_REQUEST, offset, job->seed));
+	}
+	free(p);
+	return NULL;
+}
+
+static bool run_threads(struct thread_job* jobs, bool write, bool serial,
+		const char* name)
+{
+	pthread_t threads[THREADS];
+	bool ok = true;
+	double start;
+	int i, started;
+
+	serialize = serial;
+	start = now();
+	for (started = 0; started < THREADS; started++)
+	{
+		jobs[started].write = write;
+		if (pthread_create(&threads[started], NULL, thread_io,
+				&jobs[started]) != 0)
+			break;
+	}
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(threads[i], NULL);
+		ok = ok && jobs[i].ok;
+	}
+	ok = ok && started == THREADS;
+	if (write)
+	{
+		for (i = 0; i < THREADS; i++)
+			ok = exfat_flush_node(jobs[i].ef, jobs[i].node) == 0 && ok;
+		ok = exfat_fsync(jobs[0].ef->dev) == 0 && ok;
+	}
+	report(name, jobs[0].size * THREADS, now() - start, ok);
+	return ok;
+}
+
+static bool concurrency(struct exfat* ef, uint64_t size)
+{
+	struct thread_job jobs[THREADS];
+	char path[32];
+	bool ok = true;
+	int i;
+
+	for (i = 0; i < THREADS; i++)
+	{
+		snprintf(path, sizeof(path), "/thread-%d", i);
+		jobs[i].ef = ef;
+		jobs[i].node = create(ef, path);
+		jobs[i].size = size / THREADS / THREAD_REQUEST * THREAD_REQUEST;
+		jobs[i].seed = 3 + i;
+		ok = ok && jobs[i].node != NULL && jobs[i].size != 0;
+	}
+
+	printf("%d threads, %d KB requests\n", THREADS, THREAD_REQUEST / 1024);
+	ok = ok && run_threads(jobs, true, false, "threads new file write");
+	ok = ok && run_threads(jobs, false, true, "threads serialized read");
+	ok = ok && run_threads(jobs, false, false, "threads concurrent read");
+	ok = ok && run_threads(jobs, true, true, "threads serialized write");
+	ok = ok && run_threads(jobs, true, false, "threads concurrent write");
+
+	for (i = 0; i < THREADS; i++)
+		if (jobs[i].node != NULL)
+			exfat_put_node(ef, jobs[i].node);
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	struct exfat ef;
+	struct exfat_node* node;
+	uint64_t size;
+	int fd;
+	bool ok;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <image-file> [size-MB]\n", argv[0]);
+		return 1;
+	}
+	size = (argc > 2 ? strtoull(argv[2], NULL, 10) : 256) * 1024 * 1024;
+	if (size < SEQ_REQUEST)
+	{
+		exfat_error("size must be at least 1 MB");
+		return 1;
+	}
+	buffer = malloc(SEQ_REQUEST);
+	if (buffer == NULL)
+	{
+		exfat_error("failed to allocate buffer");
+		return 1;
+	}
+
+	/* room for the contiguous file, the two fragmented ones, the files
+	   of the threads and metadata */
+	fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, 4 * size + size / 8 + 64 * 1024 * 1024) != 0)
+	{
+		exfat_error("failed to create '%s': %s", argv[1], strerror(errno));
+		return 1;
+	}
+	close(fd);
+	if (mkexfatfs(argv[1], "bench", NULL, NULL) != 0)
+		return 1;
+	if (exfat_mount(&ef, argv[1], "noatime") != 0)
+		return 1;
+	printf("%"PRIu64" MB, %d KB clusters\n", size / 1024 / 1024,
+			CLUSTER_SIZE(*ef.sb) / 1024);
+
+	node = create(&ef, "/contiguous");
+	ok = node != NULL;
+	ok = ok && sequential(&ef, node, size, true, 0, "sequential write");
+	ok = ok && sequential(&ef, node, size, false, 0, "sequential read");
+	ok = ok && random_io(&ef, node, size, true, 0, "random write");
+	ok = ok && random_io(&ef, node, size, false, 0, "random read");
+	if (node != NULL)
+		exfat_put_node(&ef, node);
+	ok = ok && allocation(&ef, size);
+	ok = ok && fragmented(&ef, size);
+	ok = ok && concurrency(&ef, size);
+
+	exfat_unmount(&ef);
+	unlink(argv[1]);
+	free(buffer);
+	return ok ? 0 : 1;
+}
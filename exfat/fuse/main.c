@@ -42,10 +42,16 @@
 	#error FUSE 2.6 or later is required
 #endif
 
+/* the largest request kernels without FUSE_MAX_PAGES send, which is also
+   what the libfuse channel buffer holds */
+#define FUSE_EXFAT_MAX_IO (128 * 1024)
+
 const char* default_options = "ro_fallback,allow_other,blkdev,big_writes,"
 		"default_permissions";
 
 struct exfat ef;
+static unsigned max_read = FUSE_EXFAT_MAX_IO;
+static unsigned max_write = FUSE_EXFAT_MAX_IO;
 
 static struct exfat_node* get_node(const struct fuse_file_info* fi)
 {
@@ -69,7 +75,9 @@ static int fuse_exfat_getattr(const char* path, struct stat* stbuf)
 	if (rc != 0)
 		return rc;
 
+	exfat_lock(&ef);
 	exfat_stat(&ef, node, stbuf);
+	exfat_unlock(&ef);
 	exfat_put_node(&ef, node);
 	return 0;
 }
@@ -121,9 +129,12 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 	filler(buffer, ".", NULL, 0);
 	filler(buffer, "..", NULL, 0);
 
+	/* keep other threads from changing the directory while it is listed */
+	exfat_lock(&ef);
 	rc = exfat_opendir(&ef, parent, &it);
 	if (rc != 0)
 	{
+		exfat_unlock(&ef);
 		exfat_put_node(&ef, parent);
 		exfat_error("failed to open directory '%s'", path);
 		return rc;
@@ -138,6 +149,7 @@ static int fuse_exfat_readdir(const char* path, void* buffer,
 		exfat_put_node(&ef, node);
 	}
 	exfat_closedir(&ef, &it);
+	exfat_unlock(&ef);
 	exfat_put_node(&ef, parent);
 	return 0;
 }
@@ -304,7 +316,9 @@ static int fuse_exfat_utimens(const char* path, const struct timespec tv[2])
 	if (rc != 0)
 		return rc;
 
+	exfat_lock(&ef);
 	exfat_utimes(node, tv);
+	exfat_unlock(&ef);
 	rc = exfat_flush_node(&ef, node);
 	exfat_put_node(&ef, node);
 	return rc;
@@ -359,6 +373,10 @@ static void* fuse_exfat_init(struct fuse_conn_info* fci)
 #ifdef FUSE_CAP_BIG_WRITES
 	fci->want |= FUSE_CAP_BIG_WRITES;
 #endif
+	/* libfuse lowers these further if the kernel or the channel buffer
+	   cannot do as much */
+	fci->max_write = max_write;
+	fci->max_readahead = max_read;
 	return NULL;
 }
 
@@ -370,7 +388,8 @@ static void fuse_exfat_destroy(void* unused)
 
 static void usage(const char* prog)
 {
-	fprintf(stderr, "Usage: %s [-d] [-o options] [-V] <device> <dir>\n", prog);
+	fprintf(stderr, "Usage: %s [-d] [-s] [-o options] [-V] <device> <dir>\n",
+			prog);
 	exit(1);
 }
 
@@ -456,6 +475,33 @@ static char* add_blksize_option(char* options, long cluster_size)
 	return add_option(options, "blksize", blksize);
 }
 
+static unsigned get_size_option(const char* options, const char* name,
+		unsigned default_value)
+{
+	const char* p;
+	size_t length = strlen(name);
+
+	for (p = strstr(options, name); p; p = strstr(p + 1, name))
+		if ((p == options || p[-1] == ',') && p[length] == '=')
+			return strtoul(p + length + 1, NULL, 10);
+	return default_value;
+}
+
+static char* add_max_read_option(char* options)
+{
+	char value[20];
+
+	max_write = get_size_option(options, "max_write", max_write);
+	max_read = get_size_option(options, "max_read", 0);
+	if (max_read != 0)
+		return options;
+
+	/* the kernel splits reads into requests of at most this size */
+	max_read = FUSE_EXFAT_MAX_IO;
+	snprintf(value, sizeof(value), "%u", max_read);
+	return add_option(options, "max_read", value);
+}
+
 static char* add_fuse_options(char* options, const char* spec)
 {
 	options = add_option(options, "fsname", spec);
@@ -465,6 +511,9 @@ static char* add_fuse_options(char* options, const char* spec)
 	if (options == NULL)
 		return NULL;
 	options = add_blksize_option(options, CLUSTER_SIZE(*ef.sb));
+	if (options == NULL)
+		return NULL;
+	options = add_max_read_option(options);
 	if (options == NULL)
 		return NULL;
 
@@ -479,6 +528,7 @@ int main(int argc, char* argv[])
 	const char* mount_point = NULL;
 	char* mount_options;
 	int debug = 0;
+	int single_thread = 0;
 	struct fuse_chan* fc = NULL;
 	struct fuse* fh = NULL;
 	int opt;
@@ -492,7 +542,7 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	while ((opt = getopt(argc, argv, "dno:Vv")) != -1)
+	while ((opt = getopt(argc, argv, "dno:sVv")) != -1)
 	{
 		switch (opt)
 		{
@@ -506,6 +556,9 @@ int main(int argc, char* argv[])
 			if (mount_options == NULL)
 				return 1;
 			break;
+		case 's':
+			single_thread = 1;
+			break;
 		case 'V':
 			free(mount_options);
 			puts("Copyright (C) 2010-2015  Andrew Nayenko");
@@ -601,10 +654,11 @@ int main(int argc, char* argv[])
 	}
 
 	/* go to background (unless "-d" option is passed) and run FUSE
-	   main loop */
+	   main loop; requests are served by a pool of threads unless "-s"
+	   option is passed */
 	if (fuse_daemonize(debug) == 0)
 	{
-		if (fuse_loop(fh) != 0)
+		if ((single_thread ? fuse_loop(fh) : fuse_loop_mt(fh)) != 0)
 			exfat_error("FUSE loop failure");
 	}
 	else
@@ -70,17 +70,109 @@ static uint32_t bytes2clusters(const struct exfat* ef, uint64_t bytes)
 	return (bytes + cluster_size - 1) / cluster_size;
 }
 
+void exfat_init_fat_cache(struct exfat* ef)
+{
+	struct exfat_fat_cache* fat;
+	const loff_t page_size = EXFAT_FAT_PAGE_ENTRIES * sizeof(cluster_t);
+
+	ef->fat = NULL;
+	fat = malloc(sizeof(struct exfat_fat_cache));
+	if (fat == NULL)
+	{
+		exfat_warn("failed to allocate FAT cache, FAT will not be cached");
+		return;
+	}
+	fat->offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start));
+	fat->size = s2o(ef, le32_to_cpu(ef->sb->fat_sector_count));
+	fat->page_count = DIV_ROUND_UP(fat->size, page_size);
+	fat->pages = calloc(fat->page_count, sizeof(le32_t*));
+	if (fat->pages == NULL)
+	{
+		free(fat);
+		exfat_warn("failed to allocate FAT cache, FAT will not be cached");
+		return;
+	}
+	fat->loaded = 0;
+	fat->max_loaded = MAX(EXFAT_FAT_CACHE_MAX / page_size, 1);
+	fat->clock = 0;
+	ef->fat = fat;
+}
+
+void exfat_free_fat_cache(struct exfat* ef)
+{
+	uint32_t i;
+
+	if (ef->fat == NULL)
+		return;
+	for (i = 0; i < ef->fat->page_count; i++)
+		free(ef->fat->pages[i]);
+	free(ef->fat->pages);
+	free(ef->fat);
+	ef->fat = NULL;
+}
+
+static void evict_fat_page(struct exfat_fat_cache* fat)
+{
+	while (fat->pages[fat->clock] == NULL)
+		fat->clock = (fat->clock + 1) % fat->page_count;
+	free(fat->pages[fat->clock]);
+	fat->pages[fat->clock] = NULL;
+	fat->loaded--;
+	fat->clock = (fat->clock + 1) % fat->page_count;
+}
+
+/*
+ * Returns the cached page of FAT with the specified cluster, reading it from
+ * the device if needed, or NULL if the cluster cannot be cached.
+ */
+static le32_t* get_fat_page(const struct exfat* ef, cluster_t cluster)
+{
+	struct exfat_fat_cache* fat = ef->fat;
+	const uint32_t index = cluster / EXFAT_FAT_PAGE_ENTRIES;
+	const loff_t page_size = EXFAT_FAT_PAGE_ENTRIES * sizeof(cluster_t);
+	loff_t offset;
+	le32_t* page;
+
+	if (fat == NULL || index >= fat->page_count)
+		return NULL;
+	if (fat->pages[index] != NULL)
+		return fat->pages[index];
+
+	if (fat->loaded >= fat->max_loaded)
+		evict_fat_page(fat);
+	page = malloc(page_size);
+	if (page == NULL)
+		return NULL;
+	offset = (loff_t) index * page_size;
+	/* the tail of the last page lies beyond the FAT */
+	if (offset + page_size > fat->size)
+		memset(page, 0, page_size);
+	if (exfat_pread(ef->dev, page, MIN(page_size, fat->size - offset),
+			fat->offset + offset) < 0)
+	{
+		free(page);
+		return NULL;
+	}
+	fat->pages[index] = page;
+	fat->loaded++;
+	return page;
+}
+
 cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster)
 {
 	le32_t next;
 	loff_t fat_offset;
+	const le32_t* page;
 
 	if (cluster < EXFAT_FIRST_DATA_CLUSTER)
 		exfat_bug("bad cluster 0x%x", cluster);
 
 	if (IS_CONTIGUOUS(*node))
 		return cluster + 1;
+	page = get_fat_page(ef, cluster);
+	if (page != NULL)
+		return le32_to_cpu(page[cluster % EXFAT_FAT_PAGE_ENTRIES]);
 	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
 		+ cluster * sizeof(cluster_t);
 	if (exfat_pread(ef->dev, &next, sizeof(next), fat_offset) < 0)
@@ -89,11 +181,121 @@ cluster_t exfat_next_cluster(const struct exfat* ef,
 	return le32_to_cpu(next);
 }
 
+void exfat_reset_extents(struct exfat_node* node)
+{
+	free(node->extents);
+	node->extents = NULL;
+	node->extent_count = 0;
+	node->extent_clusters = 0;
+	node->extent_tail = EXFAT_CLUSTER_FREE;
+}
+
+/*
+ * Walks the clusters chain of a fragmented node once, up to its size, and
+ * records it as runs of contiguous clusters. Clusters past the size are not
+ * mapped: they may be in the middle of being linked by grow_file().
+ */
+static bool build_extents(const struct exfat* ef, struct exfat_node* node)
+{
+	const uint32_t clusters = MIN(bytes2clusters(ef, node->size),
+			le32_to_cpu(ef->sb->cluster_count));
+	struct exfat_extent* extents = NULL;
+	struct exfat_extent* p;
+	uint32_t allocated = 0;
+	uint32_t count = 0;
+	uint32_t index;
+	cluster_t cluster = node->start_cluster;
+
+	for (index = 0; index < clusters && !CLUSTER_INVALID(cluster); index++)
+	{
+		if (count == 0 || extents[count - 1].cluster +
+				extents[count - 1].count != cluster)
+		{
+			if (count == allocated)
+			{
+				allocated = allocated ? allocated * 2 : 16;
+				p = realloc(extents, allocated * sizeof(struct exfat_extent));
+				if (p == NULL)
+				{
+					free(extents);
+					return false;
+				}
+				extents = p;
+			}
+			extents[count].index = index;
+			extents[count].cluster = cluster;
+			extents[count].count = 0;
+			count++;
+		}
+		extents[count - 1].count++;
+		cluster = exfat_next_cluster(ef, node, cluster);
+	}
+	if (count == 0)
+	{
+		free(extents);
+		return false;
+	}
+
+	exfat_reset_extents(node);
+	node->extents = extents;
+	node->extent_count = count;
+	node->extent_clusters = index;
+	node->extent_tail = cluster;
+	return true;
+}
+
+static cluster_t lookup_extent(const struct exfat* ef,
+		const struct exfat_node* node, uint32_t index)
+{
+	uint32_t lo = 0;
+	uint32_t hi = node->extent_count;
+	uint32_t i;
+	cluster_t cluster;
+
+	if (index >= node->extent_clusters)
+	{
+		/* past the mapped part of the chain, follow the FAT */
+		cluster = node->extent_tail;
+		for (i = node->extent_clusters; i < index; i++)
+		{
+			if (CLUSTER_INVALID(cluster))
+				break;
+			cluster = exfat_next_cluster(ef, node, cluster);
+		}
+		return cluster;
+	}
+	/* find the last extent starting at or before the index */
+	while (hi - lo > 1)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (node->extents[mid].index <= index)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return node->extents[lo].cluster + (index - node->extents[lo].index);
+}
+
 cluster_t exfat_advance_cluster(const struct exfat* ef,
 		struct exfat_node* node, uint32_t count)
 {
 	uint32_t i;
 
+	if (IS_CONTIGUOUS(*node))
+	{
+		node->fptr_index = count;
+		node->fptr_cluster = node->start_cluster + count;
+		return node->fptr_cluster;
+	}
+	if (node->extents != NULL || (!CLUSTER_INVALID(node->start_cluster) &&
+			build_extents(ef, node)))
+	{
+		node->fptr_index = count;
+		node->fptr_cluster = lookup_extent(ef, node, count);
+		return node->fptr_cluster;
+	}
+
+	/* no memory for the extent map, walk the chain */
 	if (node->fptr_index > count)
 	{
 		node->fptr_index = 0;
@@ -111,29 +313,114 @@ cluster_t exfat_advance_cluster(const struct exfat* ef,
 	return node->fptr_cluster;
 }
 
-static cluster_t find_bit_and_set(bitmap_t* bitmap, size_t start, size_t end)
+#define BMAP_BITS (sizeof(bitmap_t) * 8)
+
+/*
+ * Bits [from, to) of a bitmap word, 0 <= from < to <= BMAP_BITS.
+ */
+static bitmap_t bmap_bits(size_t from, size_t to)
+{
+	const bitmap_t all = ~((bitmap_t) 0);
+
+	return (all << from) & (to == BMAP_BITS ? all : ~(all << to));
+}
+
+static int bmap_popcount(bitmap_t word)
+{
+	return __builtin_popcountll((unsigned long long) word);
+}
+
+/* index of the lowest set bit, the word must not be zero */
+static int bmap_ctz(bitmap_t word)
 {
-	const size_t start_index = start / sizeof(bitmap_t) / 8;
-	const size_t end_index = DIV_ROUND_UP(end, sizeof(bitmap_t) * 8);
+	return __builtin_ctzll((unsigned long long) word);
+}
+
+uint32_t exfat_count_free_bits(const bitmap_t* bitmap, uint32_t count)
+{
+	const size_t full = count / BMAP_BITS;
+	uint32_t used = 0;
 	size_t i;
-	size_t start_bitindex;
-	size_t end_bitindex;
-	size_t c;
 
-	for (i = start_index; i < end_index; i++)
+	for (i = 0; i < full; i++)
+		used += bmap_popcount(bitmap[i]);
+	/* bits past the end of the last word do not count */
+	if (count % BMAP_BITS != 0)
+		used += bmap_popcount(bitmap[full] & bmap_bits(0, count % BMAP_BITS));
+	return count - used;
+}
+
+/*
+ * Finds the first clear bit in [start, end) a word at a time, or returns end.
+ */
+static size_t find_clear_bit(const bitmap_t* bitmap, size_t start, size_t end)
+{
+	size_t i = start / BMAP_BITS;
+	bitmap_t free;
+
+	if (start >= end)
+		return end;
+	/* treat the bits before start as used */
+	free = ~bitmap[i] & bmap_bits(start % BMAP_BITS, BMAP_BITS);
+	while (free == 0)
 	{
-		if (bitmap[i] == ~((bitmap_t) 0))
-			continue;
-		start_bitindex = MAX(i * sizeof(bitmap_t) * 8, start);
-		end_bitindex = MIN((i + 1) * sizeof(bitmap_t) * 8, end);
-		for (c = start_bitindex; c < end_bitindex; c++)
-			if (BMAP_GET(bitmap, c) == 0)
-			{
-				BMAP_SET(bitmap, c);
-				return c + EXFAT_FIRST_DATA_CLUSTER;
-			}
+		if (++i * BMAP_BITS >= end)
+			return end;
+		free = ~bitmap[i];
 	}
-	return EXFAT_CLUSTER_END;
+	return MIN(i * BMAP_BITS + bmap_ctz(free), end);
+}
+
+/*
+ * Returns the number of clear bits starting at start, up to max and not
+ * crossing end.
+ */
+static size_t clear_run_length(const bitmap_t* bitmap, size_t start,
+		size_t end, size_t max)
+{
+	size_t c = start;
+	size_t limit = MIN(end, start + max);
+	bitmap_t used;
+
+	while (c < limit)
+	{
+		used = bitmap[c / BMAP_BITS] & bmap_bits(c % BMAP_BITS, BMAP_BITS);
+		if (used != 0)
+			return MIN(c / BMAP_BITS * BMAP_BITS + bmap_ctz(used), limit)
+					- start;
+		c = (c / BMAP_BITS + 1) * BMAP_BITS;
+	}
+	return limit - start;
+}
+
+static void set_bits(bitmap_t* bitmap, size_t start, size_t count)
+{
+	size_t c = start;
+	const size_t end = start + count;
+
+	while (c < end)
+	{
+		size_t to = MIN(end - c / BMAP_BITS * BMAP_BITS, BMAP_BITS);
+		bitmap[c / BMAP_BITS] |= bmap_bits(c % BMAP_BITS, to);
+		c = (c / BMAP_BITS + 1) * BMAP_BITS;
+	}
+}
+
+/*
+ * Finds the first free cluster in [start, end) and marks the free run that
+ * begins there as used, up to max clusters. Returns its first cluster
+ * and its length in count, or EXFAT_CLUSTER_END if all are used.
+ */
+static cluster_t find_run_and_set(bitmap_t* bitmap, size_t start, size_t end,
+		uint32_t max, uint32_t* count)
+{
+	size_t c = find_clear_bit(bitmap, start, end);
+
+	if (c == end)
+		return EXFAT_CLUSTER_END;
+	*count = clear_run_length(bitmap, c, end, max);
+	set_bits(bitmap, c, *count);
+	return c + EXFAT_FIRST_DATA_CLUSTER;
 }
 
 static int flush_nodes(struct exfat* ef, struct exfat_node* node)
@@ -151,11 +438,19 @@ static int flush_nodes(struct exfat* ef, struct exfat_node* node)
 
 int exfat_flush_nodes(struct exfat* ef)
 {
-	return flush_nodes(ef, ef->root);
+	int rc;
+
+	exfat_lock(ef);
+	rc = flush_nodes(ef, ef->root);
+	exfat_unlock(ef);
+	return rc;
 }
 
 int exfat_flush(struct exfat* ef)
 {
+	int rc = 0;
+
+	exfat_lock(ef);
 	if (ef->cmap.dirty)
 	{
 		if (exfat_pwrite(ef->dev, ef->cmap.chunk,
@@ -163,26 +458,51 @@ int exfat_flush(struct exfat* ef)
 				exfat_c2o(ef, ef->cmap.start_cluster)) < 0)
 		{
 			exfat_error("failed to write clusters bitmap");
-			return -EIO;
+			rc = -EIO;
 		}
-		ef->cmap.dirty = false;
+		else
+			ef->cmap.dirty = false;
 	}
+	exfat_unlock(ef);
+	return rc;
+}
 
-	return 0;
+/*
+ * Writes count consecutive FAT entries starting with the one of first.
+ */
+static bool write_fat(const struct exfat* ef, cluster_t first,
+		const le32_t* entries, uint32_t count)
+{
+	loff_t fat_offset;
+	uint32_t i;
+
+	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
+		+ (loff_t) first * sizeof(cluster_t);
+	if (exfat_pwrite(ef->dev, entries, count * sizeof(le32_t), fat_offset) < 0)
+		return false;
+	/* keep the cached copy in sync, the device is always written first */
+	if (ef->fat == NULL)
+		return true;
+	for (i = 0; i < count; i++)
+	{
+		cluster_t c = first + i;
+		if (c / EXFAT_FAT_PAGE_ENTRIES < ef->fat->page_count &&
+				ef->fat->pages[c / EXFAT_FAT_PAGE_ENTRIES] != NULL)
+			ef->fat->pages[c / EXFAT_FAT_PAGE_ENTRIES]
+					[c % EXFAT_FAT_PAGE_ENTRIES] = entries[i];
+	}
+	return true;
 }
 
 static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 		cluster_t current, cluster_t next)
 {
-	loff_t fat_offset;
 	le32_t next_le32;
 
 	if (contiguous)
 		return true;
-	fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
-		+ current * sizeof(cluster_t);
 	next_le32 = cpu_to_le32(next);
-	if (exfat_pwrite(ef->dev, &next_le32, sizeof(next_le32), fat_offset) < 0)
+	if (!write_fat(ef, current, &next_le32, 1))
 	{
 		exfat_error("failed to write the next cluster %#x after %#x", next,
 				current);
@@ -191,7 +511,38 @@ static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 	return true;
 }
 
-static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
+/*
+ * Chains clusters [first, last] one after another, writing the FAT in
+ * batches instead of an entry at a time.
+ */
+static bool link_clusters(const struct exfat* ef, cluster_t first,
+		cluster_t last)
+{
+	le32_t entries[1024];
+	cluster_t c;
+	uint32_t i;
+
+	for (c = first; c < last; c += i)
+	{
+		for (i = 0; i < sizeof(entries) / sizeof(entries[0]) &&
+				c + i < last; i++)
+			entries[i] = cpu_to_le32(c + i + 1);
+		if (!write_fat(ef, c, entries, i))
+		{
+			exfat_error("failed to chain clusters %#x-%#x", c, c + i);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Allocates up to max clusters that follow each other on the disk, starting
+ * with the first free one at or after hint. Returns the first cluster and
+ * the number allocated in count.
+ */
+static cluster_t allocate_clusters(struct exfat* ef, cluster_t hint,
+		uint32_t max, uint32_t* count)
 {
 	cluster_t cluster;
 
@@ -199,15 +550,17 @@ static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
 	if (hint >= ef->cmap.chunk_size)
 		hint = 0;
 
-	cluster = find_bit_and_set(ef->cmap.chunk, hint, ef->cmap.chunk_size);
+	cluster = find_run_and_set(ef->cmap.chunk, hint, ef->cmap.chunk_size,
+			max, count);
 	if (cluster == EXFAT_CLUSTER_END)
-		cluster = find_bit_and_set(ef->cmap.chunk, 0, hint);
+		cluster = find_run_and_set(ef->cmap.chunk, 0, hint, max, count);
 	if (cluster == EXFAT_CLUSTER_END)
 	{
 		exfat_error("no free space left");
 		return EXFAT_CLUSTER_END;
 	}
 
+	ef->cmap.free_count -= *count;
 	ef->cmap.dirty = true;
 	return cluster;
 }
@@ -220,21 +573,12 @@ static void free_cluster(struct exfat* ef, cluster_t cluster)
 		exfat_bug("freeing non-existing cluster 0x%x (0x%x)", cluster,
 				ef->cmap.size);
 
+	if (BMAP_GET(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER))
+		ef->cmap.free_count++;
 	BMAP_CLR(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER);
 	ef->cmap.dirty = true;
 }
 
-static bool make_noncontiguous(const struct exfat* ef, cluster_t first,
-		cluster_t last)
-{
-	cluster_t c;
-
-	for (c = first; c < last; c++)
-		if (!set_next_cluster(ef, false, c, c + 1))
-			return false;
-	return true;
-}
-
 static int shrink_file(struct exfat* ef, struct exfat_node* node,
 		uint32_t current, uint32_t difference);
 
@@ -244,6 +588,7 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 	cluster_t previous;
 	cluster_t next;
 	uint32_t allocated = 0;
+	uint32_t count;
 
 	if (difference == 0)
 		exfat_bug("zero clusters count passed");
@@ -263,38 +608,43 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 		if (node->fptr_index != 0)
 			exfat_bug("non-zero pointer index (%u)", node->fptr_index);
 		/* file does not have clusters (i.e. is empty), allocate
-		   the first one for it */
-		previous = allocate_cluster(ef, 0);
+		   the first run for it */
+		previous = allocate_clusters(ef, 0, difference, &count);
 		if (CLUSTER_INVALID(previous))
 			return -ENOSPC;
 		node->fptr_cluster = node->start_cluster = previous;
-		allocated = 1;
-		/* file consists of only one cluster, so it's contiguous */
+		/* file consists of only one run, so it's contiguous */
 		node->flags |= EXFAT_ATTRIB_CONTIGUOUS;
+		previous += count - 1;
+		allocated = count;
 	}
 
 	while (allocated < difference)
 	{
-		next = allocate_cluster(ef, previous + 1);
+		next = allocate_clusters(ef, previous + 1, difference - allocated,
+				&count);
 		if (CLUSTER_INVALID(next))
 		{
 			if (allocated != 0)
 				shrink_file(ef, node, current + allocated, allocated);
 			return -ENOSPC;
 		}
-		if (next != previous - 1 && IS_CONTIGUOUS(*node))
+		if (next != previous + 1 && IS_CONTIGUOUS(*node))
 		{
 			/* it's a pity, but we are not able to keep the file contiguous
 			   anymore */
-			if (!make_noncontiguous(ef, node->start_cluster, previous))
+			if (!link_clusters(ef, node->start_cluster, previous))
 				return -EIO;
 			node->flags &= ~EXFAT_ATTRIB_CONTIGUOUS;
 			node->flags |= EXFAT_ATTRIB_DIRTY;
 		}
 		if (!set_next_cluster(ef, IS_CONTIGUOUS(*node), previous, next))
 			return -EIO;
-		previous = next;
-		allocated++;
+		if (!IS_CONTIGUOUS(*node) &&
+				!link_clusters(ef, next, next + count - 1))
+			return -EIO;
+		previous = next + count - 1;
+		allocated += count;
 	}
 
 	if (!set_next_cluster(ef, IS_CONTIGUOUS(*node), previous,
@@ -404,8 +754,13 @@ static int erase_range(struct exfat* ef, struct exfat_node* node,
 	return 0;
 }
 
-int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
-		bool erase)
+/*
+ * Same as exfat_truncate() for callers that already hold ef->lock. Nothing
+ * may transfer data of the node meanwhile: either the caller holds its
+ * data_lock exclusively or the node is a directory or is not referenced.
+ */
+int exfat_truncate_locked(struct exfat* ef, struct exfat_node* node,
+		uint64_t size, bool erase)
 {
 	uint32_t c1 = bytes2clusters(ef, node->size);
 	uint32_t c2 = bytes2clusters(ef, size);
@@ -421,6 +776,9 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		rc = grow_file(ef, node, c1, c2 - c1);
 	else if (c1 > c2)
 		rc = shrink_file(ef, node, c1, c1 - c2);
+	/* the clusters chain has changed, even if only partially */
+	if (c1 != c2)
+		exfat_reset_extents(node);
 
 	if (rc != 0)
 		return rc;
@@ -438,15 +796,27 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 	return 0;
 }
 
-uint32_t exfat_count_free_clusters(const struct exfat* ef)
+/*
+ * Must not be called with ef->lock held: reads and writes of the node in
+ * other threads are waited for before the clusters chain is changed.
+ */
+int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
+		bool erase)
 {
-	uint32_t free_clusters = 0;
-	uint32_t i;
+	int rc;
+
+	pthread_rwlock_wrlock(&node->data_lock);
+	exfat_lock(ef);
+	rc = exfat_truncate_locked(ef, node, size, erase);
+	exfat_unlock(ef);
+	pthread_rwlock_unlock(&node->data_lock);
+	return rc;
+}
 
-	for (i = 0; i < ef->cmap.size; i++)
-		if (BMAP_GET(ef->cmap.chunk, i) == 0)
-			free_clusters++;
-	return free_clusters;
+uint32_t exfat_count_free_clusters(const struct exfat* ef)
+{
+	/* counted when the bitmap is read and kept up to date since */
+	return ef->cmap.free_count;
 }
 
 static int find_used_clusters(const struct exfat* ef,
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -43,6 +44,7 @@
 #define EXFAT_ATTRIB_CACHED     0x20000
 #define EXFAT_ATTRIB_DIRTY      0x40000
 #define EXFAT_ATTRIB_UNLINKED   0x80000
+#define EXFAT_ATTRIB_CLEANUP    0x100000
 #define IS_CONTIGUOUS(node) (((node).flags & EXFAT_ATTRIB_CONTIGUOUS) != 0)
 #define SECTOR_SIZE(sb) (1 << (sb).sector_bits)
 #define CLUSTER_SIZE(sb) (SECTOR_SIZE(sb) << (sb).spc_bits)
@@ -65,10 +67,23 @@
 #define BMAP_CLR(bitmap, index) \
 	((bitmap)[BMAP_BLOCK(index)] &= ~BMAP_MASK(index))
 
+/* FAT cache: the FAT is read in pages of this many entries on first use
+   and at most EXFAT_FAT_CACHE_MAX bytes of it are kept in memory */
+#define EXFAT_FAT_PAGE_ENTRIES 16384
+#define EXFAT_FAT_CACHE_MAX (16 * 1024 * 1024)
+
 /* The size of off_t type must be 64 bits. File systems larger than 2 GB will
    be corrupted with 32-bit off_t. So, we use loff_t here.*/
 STATIC_ASSERT(sizeof(loff_t) == 8);
 
+/* run of physically contiguous clusters of a fragmented node */
+struct exfat_extent
+{
+	uint32_t index;			/* index of the first cluster in the node */
+	cluster_t cluster;
+	uint32_t count;
+};
+
 struct exfat_node
 {
 	struct exfat_node* parent;
@@ -86,6 +101,22 @@ struct exfat_node
 	uint64_t size;
 	time_t mtime, atime;
 	le16_t name[EXFAT_NAME_MAX + 1];
+	/* extent map of the clusters chain, built on the first seek into
+	   a fragmented node and dropped when the chain changes */
+	struct exfat_extent* extents;
+	uint32_t extent_count;
+	uint32_t extent_clusters;	/* clusters covered by the map */
+	cluster_t extent_tail;		/* what follows the last mapped cluster */
+	/* name hash index of the children of a cached directory, built on
+	   the first lookup in it */
+	struct exfat_node** buckets;
+	uint32_t bucket_count;		/* a power of 2 */
+	uint32_t hashed;			/* children in the index */
+	struct exfat_node* hash_next;	/* in the bucket of the parent */
+	uint16_t hash;				/* of the name when added to the index */
+	/* taken shared around data transfers and exclusively while the
+	   clusters chain may shrink or grow under them */
+	pthread_rwlock_t data_lock;
 };
 
 enum exfat_mode
@@ -97,6 +128,17 @@ enum exfat_mode
 
 struct exfat_dev;
 
+struct exfat_fat_cache
+{
+	le32_t** pages;				/* NULL until read */
+	uint32_t page_count;
+	uint32_t loaded;			/* pages in memory */
+	uint32_t max_loaded;
+	uint32_t clock;				/* where to look for a page to evict */
+	loff_t offset;				/* of the FAT on the device */
+	loff_t size;				/* of the FAT in bytes */
+};
+
 struct exfat
 {
 	struct exfat_dev* dev;
@@ -110,10 +152,23 @@ struct exfat
 		uint32_t size;				/* in bits */
 		bitmap_t* chunk;
 		uint32_t chunk_size;		/* in bits */
+		uint32_t free_count;		/* clear bits */
 		bool dirty;
 	}
 	cmap;
+	struct exfat_fat_cache* fat;	/* NULL if it could not be allocated */
+	struct
+	{
+		uint64_t lookups;
+		uint64_t found;				/* through the name index */
+		uint64_t not_found;			/* through the name index */
+		uint64_t compared;			/* names compared, in all lookups */
+	}
+	lookup_stats;
 	char label[UTF8_BYTES(EXFAT_ENAME_MAX) + 1];
+	/* protects the nodes tree, the FAT, the clusters bitmap and the node
+	   fields; recursive so that locked functions can call each other */
+	pthread_mutex_t lock;
 	void* zero_cluster;
 	int dmask, fmask;
 	uid_t uid;
@@ -154,7 +209,7 @@ ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		loff_t offset);
 ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 		loff_t offset);
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
+ssize_t exfat_generic_pread(struct exfat* ef, struct exfat_node* node,
 		void* buffer, size_t size, loff_t offset);
 ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		const void* buffer, size_t size, loff_t offset);
@@ -167,17 +222,28 @@ int exfat_lookup(struct exfat* ef, struct exfat_node** node,
 		const char* path);
 int exfat_split(struct exfat* ef, struct exfat_node** parent,
 		struct exfat_node** node, le16_t* name, const char* path);
+void exfat_index_add(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* node);
+void exfat_index_remove(struct exfat_node* dir, struct exfat_node* node);
+void exfat_index_free(struct exfat_node* dir);
+void exfat_print_lookup_stats(const struct exfat* ef);
 
 loff_t exfat_c2o(const struct exfat* ef, cluster_t cluster);
 cluster_t exfat_next_cluster(const struct exfat* ef,
 		const struct exfat_node* node, cluster_t cluster);
 cluster_t exfat_advance_cluster(const struct exfat* ef,
 		struct exfat_node* node, uint32_t count);
+void exfat_reset_extents(struct exfat_node* node);
+void exfat_init_fat_cache(struct exfat* ef);
+void exfat_free_fat_cache(struct exfat* ef);
 int exfat_flush_nodes(struct exfat* ef);
 int exfat_flush(struct exfat* ef);
 int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		bool erase);
+int exfat_truncate_locked(struct exfat* ef, struct exfat_node* node,
+		uint64_t size, bool erase);
 uint32_t exfat_count_free_clusters(const struct exfat* ef);
+uint32_t exfat_count_free_bits(const bitmap_t* bitmap, uint32_t count);
 int exfat_find_used_sectors(const struct exfat* ef, loff_t* a, loff_t* b);
 
 void exfat_stat(const struct exfat* ef, const struct exfat_node* node,
@@ -219,6 +285,8 @@ int exfat_set_label(struct exfat* ef, const char* label);
 
 int exfat_mount(struct exfat* ef, const char* spec, const char* options);
 void exfat_unmount(struct exfat* ef);
+void exfat_lock(struct exfat* ef);
+void exfat_unlock(struct exfat* ef);
 
 time_t exfat_exfat2unix(le16_t date, le16_t time, uint8_t centisec);
 void exfat_unix2exfat(time_t unix_time, le16_t* date, le16_t* time,
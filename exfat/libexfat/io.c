@@ -346,95 +346,174 @@ ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 #endif
 }
 
-ssize_t exfat_generic_pread(const struct exfat* ef, struct exfat_node* node,
-		void* buffer, size_t size, loff_t offset)
+/* at most this many runs of clusters are mapped under ef->lock at a time,
+   their transfers are done without it */
+#define IO_RUNS 16
+
+struct io_run
 {
-	cluster_t cluster;
-	char* bufp = buffer;
-	loff_t lsize, loffset, remainder;
+	cluster_t cluster;			/* the first one */
+	loff_t offset;				/* on the device */
+	loff_t size;
+};
 
-	if (offset >= node->size)
-		return 0;
-	if (size == 0)
-		return 0;
+/*
+ * Returns how many of the remaining bytes, starting at offset within the
+ * cluster, lie in clusters that follow it physically, so they can be
+ * transferred with one request. The cluster after the run goes to next.
+ */
+static loff_t contiguous_run(const struct exfat* ef,
+		const struct exfat_node* node, cluster_t cluster, loff_t offset,
+		loff_t remainder, cluster_t* next)
+{
+	loff_t size = MIN(CLUSTER_SIZE(*ef->sb) - offset, remainder);
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
-	if (CLUSTER_INVALID(cluster))
+	*next = exfat_next_cluster(ef, node, cluster);
+	while (size < remainder && *next == cluster + 1)
 	{
-		exfat_error("invalid cluster 0x%x while reading", cluster);
-		return -1;
+		cluster = *next;
+		size += MIN(CLUSTER_SIZE(*ef->sb), remainder - size);
+		*next = exfat_next_cluster(ef, node, cluster);
+	}
+	return size;
+}
+
+/*
+ * Maps up to IO_RUNS runs of the remaining bytes, starting at offset within
+ * cluster, and advances cluster, offset and remainder past them. Returns the
+ * number of runs or -1 if cluster is invalid.
+ */
+static int map_runs(const struct exfat* ef, const struct exfat_node* node,
+		cluster_t* cluster, loff_t* offset, loff_t* remainder,
+		struct io_run* runs)
+{
+	cluster_t next;
+	int count = 0;
+
+	while (*remainder > 0 && count < IO_RUNS)
+	{
+		if (CLUSTER_INVALID(*cluster))
+			return -1;
+		runs[count].cluster = *cluster;
+		runs[count].offset = exfat_c2o(ef, *cluster) + *offset;
+		runs[count].size = contiguous_run(ef, node, *cluster, *offset,
+				*remainder, &next);
+		*remainder -= runs[count].size;
+		*offset = 0;
+		*cluster = next;
+		count++;
 	}
+	return count;
+}
+
+/*
+ * Transfers size bytes of the node starting at offset, which must lie
+ * within it. Called and returns with ef->lock held but drops it around the
+ * device requests, while the caller's hold on the node data_lock keeps the
+ * clusters in place.
+ */
+static ssize_t transfer(struct exfat* ef, struct exfat_node* node,
+		char* buffer, size_t size, loff_t offset, bool write)
+{
+	struct io_run runs[IO_RUNS];
+	cluster_t cluster;
+	loff_t loffset = offset % CLUSTER_SIZE(*ef->sb);
+	loff_t remainder = size;
+	int count, i;
 
-	loffset = offset % CLUSTER_SIZE(*ef->sb);
-	remainder = MIN(size, node->size - offset);
+	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
 	while (remainder > 0)
 	{
-		if (CLUSTER_INVALID(cluster))
+		count = map_runs(ef, node, &cluster, &loffset, &remainder, runs);
+		if (count < 0)
 		{
-			exfat_error("invalid cluster 0x%x while reading", cluster);
+			exfat_error("invalid cluster 0x%x while %s", cluster,
+					write ? "writing" : "reading");
 			return -1;
 		}
-		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pread(ef->dev, bufp, lsize,
-					exfat_c2o(ef, cluster) + loffset) < 0)
+#ifndef USE_UBLIO	/* ublio buffers are not thread-safe */
+		exfat_unlock(ef);
+#endif
+		for (i = 0; i < count; i++)
 		{
-			exfat_error("failed to read cluster %#x", cluster);
+			if ((write ?
+					exfat_pwrite(ef->dev, buffer, runs[i].size,
+						runs[i].offset) :
+					exfat_pread(ef->dev, buffer, runs[i].size,
+						runs[i].offset)) < 0)
+				break;
+			buffer += runs[i].size;
+		}
+#ifndef USE_UBLIO
+		exfat_lock(ef);
+#endif
+		if (i < count)
+		{
+			exfat_error("failed to %s cluster %#x", write ? "write" : "read",
+					runs[i].cluster);
 			return -1;
 		}
-		bufp += lsize;
-		loffset = 0;
-		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
 	}
-	if (!ef->ro && !ef->noatime)
-		exfat_update_atime(node);
-	return MIN(size, node->size - offset) - remainder;
+	return size;
+}
+
+ssize_t exfat_generic_pread(struct exfat* ef, struct exfat_node* node,
+		void* buffer, size_t size, loff_t offset)
+{
+	ssize_t rc = 0;
+
+	pthread_rwlock_rdlock(&node->data_lock);
+	exfat_lock(ef);
+	if (offset < node->size && size != 0)
+	{
+		rc = transfer(ef, node, buffer, MIN(size, node->size - offset),
+				offset, false);
+		if (rc > 0 && !ef->ro && !ef->noatime)
+			exfat_update_atime(node);
+	}
+	exfat_unlock(ef);
+	pthread_rwlock_unlock(&node->data_lock);
+	return rc;
 }
 
 ssize_t exfat_generic_pwrite(struct exfat* ef, struct exfat_node* node,
 		const void* buffer, size_t size, loff_t offset)
 {
-	cluster_t cluster;
-	const char* bufp = buffer;
-	loff_t lsize, loffset, remainder;
-
- 	if (offset > node->size)
- 		if (exfat_truncate(ef, node, offset, true) != 0)
- 			return -1;
-  	if (offset + size > node->size)
- 		if (exfat_truncate(ef, node, offset + size, false) != 0)
- 			return -1;
-	if (size == 0)
-		return 0;
+	bool exclusive = false;
+	ssize_t rc;
 
-	cluster = exfat_advance_cluster(ef, node, offset / CLUSTER_SIZE(*ef->sb));
-	if (CLUSTER_INVALID(cluster))
+	/* writes within the node share its data_lock with reads; a write that
+	   grows it takes the lock exclusively, so the new clusters are not read
+	   before they are written */
+	for (;;)
 	{
-		exfat_error("invalid cluster 0x%x while writing", cluster);
-		return -1;
+		if (exclusive)
+			pthread_rwlock_wrlock(&node->data_lock);
+		else
+			pthread_rwlock_rdlock(&node->data_lock);
+		exfat_lock(ef);
+		if (exclusive || offset + size <= node->size)
+			break;
+		exfat_unlock(ef);
+		pthread_rwlock_unlock(&node->data_lock);
+		exclusive = true;
 	}
 
-	loffset = offset % CLUSTER_SIZE(*ef->sb);
-	remainder = size;
-	while (remainder > 0)
+	if (offset > node->size &&
+			exfat_truncate_locked(ef, node, offset, true) != 0)
+		rc = -1;
+	else if (offset + size > node->size &&
+			exfat_truncate_locked(ef, node, offset + size, false) != 0)
+		rc = -1;
+	else if (size == 0)
+		rc = 0;
+	else
 	{
-		if (CLUSTER_INVALID(cluster))
-		{
-			exfat_error("invalid cluster 0x%x while writing", cluster);
-			return -1;
-		}
-		lsize = MIN(CLUSTER_SIZE(*ef->sb) - loffset, remainder);
-		if (exfat_pwrite(ef->dev, bufp, lsize,
-				exfat_c2o(ef, cluster) + loffset) < 0)
-		{
-			exfat_error("failed to write cluster %#x", cluster);
-			return -1;
-		}
-		bufp += lsize;
-		loffset = 0;
-		remainder -= lsize;
-		cluster = exfat_next_cluster(ef, node, cluster);
+		rc = transfer(ef, node, (char*) buffer, size, offset, true);
+		if (rc > 0)
+			exfat_update_mtime(node);
 	}
-	exfat_update_mtime(node);
-	return size - remainder;
+	exfat_unlock(ef);
+	pthread_rwlock_unlock(&node->data_lock);
+	return rc;
 }
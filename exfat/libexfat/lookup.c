@@ -30,12 +30,14 @@ int exfat_opendir(struct exfat* ef, struct exfat_node* dir,
 {
 	int rc;
 
+	exfat_lock(ef);
 	exfat_get_node(dir);
 	it->parent = dir;
 	it->current = NULL;
 	rc = exfat_cache_directory(ef, dir);
 	if (rc != 0)
 		exfat_put_node(ef, dir);
+	exfat_unlock(ef);
 	return rc;
 }
 
@@ -46,17 +48,24 @@ void exfat_closedir(struct exfat* ef, struct exfat_iterator* it)
 	it->current = NULL;
 }
 
+/*
+ * Another thread may unlink the current node between calls and end the
+ * iteration early; hold exfat_lock() around the whole loop to prevent this.
+ */
 struct exfat_node* exfat_readdir(struct exfat* ef, struct exfat_iterator* it)
 {
+	struct exfat_node* node = NULL;
+
+	exfat_lock(ef);
 	if (it->current == NULL)
 		it->current = it->parent->child;
 	else
 		it->current = it->current->next;
 
 	if (it->current != NULL)
-		return exfat_get_node(it->current);
-	else
-		return NULL;
+		node = exfat_get_node(it->current);
+	exfat_unlock(ef);
+	return node;
 }
 
 static int compare_char(struct exfat* ef, uint16_t a, uint16_t b)
@@ -80,11 +89,140 @@ static int compare_name(struct exfat* ef, const le16_t* a, const le16_t* b)
 	return compare_char(ef, le16_to_cpu(*a), le16_to_cpu(*b));
 }
 
+#define INDEX_MIN_BUCKETS 16
+
+static uint16_t name_hash(struct exfat* ef, const le16_t* name)
+{
+	return le16_to_cpu(exfat_calc_name_hash(ef, name));
+}
+
+static void index_insert(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** bucket =
+			&dir->buckets[node->hash & (dir->bucket_count - 1)];
+
+	node->hash_next = *bucket;
+	*bucket = node;
+	dir->hashed++;
+}
+
+/*
+ * Rehashes the index of a directory into count buckets. The old index is
+ * kept if there is no memory for the new one.
+ */
+static bool index_resize(struct exfat_node* dir, uint32_t count)
+{
+	struct exfat_node** old = dir->buckets;
+	const uint32_t old_count = dir->bucket_count;
+	struct exfat_node* p;
+	struct exfat_node* next;
+	uint32_t i;
+
+	dir->buckets = calloc(count, sizeof(struct exfat_node*));
+	if (dir->buckets == NULL)
+	{
+		dir->buckets = old;
+		return false;
+	}
+	dir->bucket_count = count;
+	dir->hashed = 0;
+	for (i = 0; i < old_count; i++)
+		for (p = old[i]; p != NULL; p = next)
+		{
+			next = p->hash_next;
+			index_insert(dir, p);
+		}
+	free(old);
+	return true;
+}
+
+/*
+ * Builds the name index of a cached directory. Returns false if there is
+ * no memory for it, then the directory is searched linearly.
+ */
+static bool index_build(struct exfat* ef, struct exfat_node* dir)
+{
+	struct exfat_node* p;
+	uint32_t children = 0;
+	uint32_t count = INDEX_MIN_BUCKETS;
+
+	for (p = dir->child; p != NULL; p = p->next)
+		children++;
+	while (count < children)
+		count *= 2;
+	dir->buckets = calloc(count, sizeof(struct exfat_node*));
+	if (dir->buckets == NULL)
+		return false;
+	dir->bucket_count = count;
+	dir->hashed = 0;
+	for (p = dir->child; p != NULL; p = p->next)
+	{
+		p->hash = name_hash(ef, p->name);
+		index_insert(dir, p);
+	}
+	return true;
+}
+
+void exfat_index_add(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* node)
+{
+	if (dir->buckets == NULL)
+		return;
+	node->hash = name_hash(ef, node->name);
+	index_insert(dir, node);
+	/* keep chains short, a failed resize only makes them longer */
+	if (dir->hashed > dir->bucket_count * 2)
+		index_resize(dir, dir->bucket_count * 2);
+}
+
+void exfat_index_remove(struct exfat_node* dir, struct exfat_node* node)
+{
+	struct exfat_node** p;
+
+	if (dir->buckets == NULL)
+		return;
+	for (p = &dir->buckets[node->hash & (dir->bucket_count - 1)]; *p != NULL;
+			p = &(*p)->hash_next)
+		if (*p == node)
+		{
+			*p = node->hash_next;
+			node->hash_next = NULL;
+			dir->hashed--;
+			return;
+		}
+	exfat_bug("node is missing from the name index");
+}
+
+void exfat_index_free(struct exfat_node* dir)
+{
+	free(dir->buckets);
+	dir->buckets = NULL;
+	dir->bucket_count = 0;
+	dir->hashed = 0;
+}
+
+void exfat_print_lookup_stats(const struct exfat* ef)
+{
+	const uint64_t indexed = ef->lookup_stats.found +
+			ef->lookup_stats.not_found;
+
+	if (ef->lookup_stats.lookups == 0)
+		return;
+	exfat_debug("%"PRIu64" name lookups, %"PRIu64" found and %"PRIu64
+			" not found through the index (%.1f%%), %.2f names compared"
+			" per lookup", ef->lookup_stats.lookups, ef->lookup_stats.found,
+			ef->lookup_stats.not_found,
+			100.0 * indexed / ef->lookup_stats.lookups,
+			(double) ef->lookup_stats.compared / ef->lookup_stats.lookups);
+}
+
 static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 		struct exfat_node** node, const char* name, size_t n)
 {
 	struct exfat_iterator it;
 	le16_t buffer[EXFAT_NAME_MAX + 1];
+	struct exfat_node* p;
+	uint16_t hash;
 	int rc;
 
 	*node = NULL;
@@ -96,8 +234,33 @@ static int lookup_name(struct exfat* ef, struct exfat_node* parent,
 	rc = exfat_opendir(ef, parent, &it);
 	if (rc != 0)
 		return rc;
+	ef->lookup_stats.lookups++;
+	if (parent->buckets != NULL || index_build(ef, parent))
+	{
+		hash = name_hash(ef, buffer);
+		for (p = parent->buckets[hash & (parent->bucket_count - 1)];
+				p != NULL; p = p->hash_next)
+		{
+			if (p->hash != hash)
+				continue;
+			ef->lookup_stats.compared++;
+			if (compare_name(ef, buffer, p->name) == 0)
+			{
+				*node = exfat_get_node(p);
+				ef->lookup_stats.found++;
+				exfat_closedir(ef, &it);
+				return 0;
+			}
+		}
+		ef->lookup_stats.not_found++;
+		exfat_closedir(ef, &it);
+		return -ENOENT;
+	}
+
+	/* no memory for the index */
 	while ((*node = exfat_readdir(ef, &it)))
 	{
+		ef->lookup_stats.compared++;
 		if (compare_name(ef, buffer, (*node)->name) == 0)
 		{
 			exfat_closedir(ef, &it);
@@ -121,7 +284,7 @@ static size_t get_comp(const char* path, const char** comp)
 		return end - *comp;
 }
 
-int exfat_lookup(struct exfat* ef, struct exfat_node** node,
+static int lookup_path(struct exfat* ef, struct exfat_node** node,
 		const char* path)
 {
 	struct exfat_node* parent;
@@ -147,6 +310,17 @@ int exfat_lookup(struct exfat* ef, struct exfat_node** node,
 	return 0;
 }
 
+int exfat_lookup(struct exfat* ef, struct exfat_node** node,
+		const char* path)
+{
+	int rc;
+
+	exfat_lock(ef);
+	rc = lookup_path(ef, node, path);
+	exfat_unlock(ef);
+	return rc;
+}
+
 static bool is_last_comp(const char* comp, size_t length)
 {
 	const char* p = comp + length;
@@ -176,7 +350,7 @@ static bool is_allowed(const char* comp, size_t length)
 	return true;
 }
 
-int exfat_split(struct exfat* ef, struct exfat_node** parent,
+static int split_path(struct exfat* ef, struct exfat_node** parent,
 		struct exfat_node** node, le16_t* name, const char* path)
 {
 	const char* p;
@@ -223,3 +397,14 @@ int exfat_split(struct exfat* ef, struct exfat_node** parent,
 	}
 	exfat_bug("impossible");
 }
+
+int exfat_split(struct exfat* ef, struct exfat_node** parent,
+		struct exfat_node** node, le16_t* name, const char* path)
+{
+	int rc;
+
+	exfat_lock(ef);
+	rc = split_path(ef, parent, node, name, path);
+	exfat_unlock(ef);
+	return rc;
+}
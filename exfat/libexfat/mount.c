@@ -165,6 +165,24 @@ static int prepare_super_block(const struct exfat* ef)
 	return commit_super_block(ef);
 }
 
+static void init_lock(struct exfat* ef)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&ef->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void free_root(struct exfat* ef)
+{
+	exfat_reset_extents(ef->root);
+	pthread_rwlock_destroy(&ef->root->data_lock);
+	free(ef->root);
+	ef->root = NULL;
+}
+
 int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 {
 	int rc;
@@ -277,9 +295,14 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 				exfat_get_size(ef->dev));
 	}
 
+	init_lock(ef);
+	exfat_init_fat_cache(ef);
+
 	ef->root = malloc(sizeof(struct exfat_node));
 	if (ef->root == NULL)
 	{
+		pthread_mutex_destroy(&ef->lock);
+		exfat_free_fat_cache(ef);
 		free(ef->zero_cluster);
 		exfat_close(ef->dev);
 		free(ef->sb);
@@ -287,6 +310,7 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 		return -ENOMEM;
 	}
 	memset(ef->root, 0, sizeof(struct exfat_node));
+	pthread_rwlock_init(&ef->root->data_lock, NULL);
 	ef->root->flags = EXFAT_ATTRIB_DIR;
 	ef->root->start_cluster = le32_to_cpu(ef->sb->rootdir_cluster);
 	ef->root->fptr_cluster = ef->root->start_cluster;
@@ -294,7 +318,9 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 	ef->root->size = rootdir_size(ef);
 	if (ef->root->size == 0)
 	{
-		free(ef->root);
+		free_root(ef);
+		pthread_mutex_destroy(&ef->lock);
+		exfat_free_fat_cache(ef);
 		free(ef->zero_cluster);
 		exfat_close(ef->dev);
 		free(ef->sb);
@@ -328,7 +354,9 @@ int exfat_mount(struct exfat* ef, const char* spec, const char* options)
 error:
 	exfat_put_node(ef, ef->root);
 	exfat_reset_cache(ef);
-	free(ef->root);
+	free_root(ef);
+	pthread_mutex_destroy(&ef->lock);
+	exfat_free_fat_cache(ef);
 	free(ef->zero_cluster);
 	exfat_close(ef->dev);
 	free(ef->sb);
@@ -359,17 +387,18 @@ static void finalize_super_block(struct exfat* ef)
 
 void exfat_unmount(struct exfat* ef)
 {
+	exfat_print_lookup_stats(ef);
 	exfat_flush_nodes(ef);	/* ignore return code */
 	exfat_flush(ef);		/* ignore return code */
 	exfat_put_node(ef, ef->root);
 	exfat_reset_cache(ef);
-	free(ef->root);
-	ef->root = NULL;
+	free_root(ef);
 	finalize_super_block(ef);
 	exfat_close(ef->dev);	/* close descriptor immediately after fsync */
 	ef->dev = NULL;
 	free(ef->zero_cluster);
 	ef->zero_cluster = NULL;
+	exfat_free_fat_cache(ef);
 	free(ef->cmap.chunk);
 	ef->cmap.chunk = NULL;
 	free(ef->sb);
@@ -377,4 +406,15 @@ void exfat_unmount(struct exfat* ef)
 	free(ef->upcase);
 	ef->upcase = NULL;
 	ef->upcase_chars = 0;
+	pthread_mutex_destroy(&ef->lock);
+}
+
+void exfat_lock(struct exfat* ef)
+{
+	pthread_mutex_lock(&ef->lock);
+}
+
+void exfat_unlock(struct exfat* ef)
+{
+	pthread_mutex_unlock(&ef->lock);
 }
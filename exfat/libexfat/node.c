@@ -34,53 +34,74 @@ struct iterator
 	char* chunk;
 };
 
+static void free_node(struct exfat_node* node)
+{
+	exfat_reset_extents(node);
+	exfat_index_free(node);
+	pthread_rwlock_destroy(&node->data_lock);
+	free(node);
+}
+
+static int free_unlinked_node(struct exfat* ef, struct exfat_node* node)
+{
+	/* free all clusters and node structure itself */
+	int rc = exfat_truncate_locked(ef, node, 0, true);
+	/* free the node even in case of error or its memory will be lost */
+	free_node(node);
+	return rc;
+}
+
 struct exfat_node* exfat_get_node(struct exfat_node* node)
 {
-	/* if we switch to multi-threaded mode we will need atomic
-	   increment here and atomic decrement in exfat_put_node() */
-	node->references++;
+	/* atomic because the caller may hold a reference to the node rather
+	   than ef->lock */
+	__sync_add_and_fetch(&node->references, 1);
 	return node;
 }
 
 void exfat_put_node(struct exfat* ef, struct exfat_node* node)
 {
 	char buffer[UTF8_BYTES(EXFAT_NAME_MAX) + 1];
+	int references;
 
-	--node->references;
-	if (node->references < 0)
+	exfat_lock(ef);
+	references = __sync_sub_and_fetch(&node->references, 1);
+	if (references < 0)
 	{
 		exfat_get_name(node, buffer, sizeof(buffer) - 1);
 		exfat_bug("reference counter of '%s' is below zero", buffer);
 	}
-	else if (node->references == 0 && node != ef->root)
+	else if (references == 0 && node != ef->root)
 	{
-		if (node->flags & EXFAT_ATTRIB_DIRTY)
+		if (node->flags & EXFAT_ATTRIB_CLEANUP)
+			free_unlinked_node(ef, node);	/* postponed by cleanup */
+		else if (node->flags & EXFAT_ATTRIB_DIRTY)
 		{
 			exfat_get_name(node, buffer, sizeof(buffer) - 1);
 			exfat_warn("dirty node '%s' with zero references", buffer);
 		}
 	}
+	exfat_unlock(ef);
 }
 
 /**
  * This function must be called on rmdir and unlink (after the last
- * exfat_put_node()) to free clusters.
+ * exfat_put_node()) to free clusters. If another thread still holds
+ * a reference to the node, it is freed when that reference is put.
  */
 int exfat_cleanup_node(struct exfat* ef, struct exfat_node* node)
 {
 	int rc = 0;
 
-	if (node->references != 0)
-		exfat_bug("unable to cleanup a node with %d references",
-				node->references);
-
+	exfat_lock(ef);
 	if (node->flags & EXFAT_ATTRIB_UNLINKED)
 	{
-		/* free all clusters and node structure itself */
-		rc = exfat_truncate(ef, node, 0, true);
-		/* free the node even in case of error or its memory will be lost */
-		free(node);
+		if (node->references != 0)
+			node->flags |= EXFAT_ATTRIB_CLEANUP;
+		else
+			rc = free_unlinked_node(ef, node);
 	}
+	exfat_unlock(ef);
 	return rc;
 }
 
@@ -163,6 +184,7 @@ static struct exfat_node* allocate_node(void)
 		return NULL;
 	}
 	memset(node, 0, sizeof(struct exfat_node));
+	pthread_rwlock_init(&node->data_lock, NULL);
 	return node;
 }
 
@@ -439,6 +461,8 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 						le64_to_cpu(bitmap->size), ef->cmap.start_cluster);
 				goto error;
 			}
+			ef->cmap.free_count = exfat_count_free_bits(ef->cmap.chunk,
+					ef->cmap.size);
 			break;
 
 		case EXFAT_ENTRY_LABEL:
@@ -478,12 +502,13 @@ static int readdir(struct exfat* ef, const struct exfat_node* parent,
 	/* we never reach here */
 
 error:
-	free(*node);
+	if (*node != NULL)
+		free_node(*node);
 	*node = NULL;
 	return rc;
 }
 
-int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
+static int cache_directory(struct exfat* ef, struct exfat_node* dir)
 {
 	struct iterator it;
 	int rc;
@@ -517,7 +542,7 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 		for (current = dir->child; current; current = node)
 		{
 			node = current->next;
-			free(current);
+			free_node(current);
 		}
 		dir->child = NULL;
 		return rc;
@@ -527,7 +552,18 @@ int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
 	return 0;
 }
 
-static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
+int exfat_cache_directory(struct exfat* ef, struct exfat_node* dir)
+{
+	int rc;
+
+	exfat_lock(ef);
+	rc = cache_directory(ef, dir);
+	exfat_unlock(ef);
+	return rc;
+}
+
+static void tree_attach(struct exfat* ef, struct exfat_node* dir,
+		struct exfat_node* node)
 {
 	node->parent = dir;
 	if (dir->child)
@@ -536,10 +572,12 @@ static void tree_attach(struct exfat_node* dir, struct exfat_node* node)
 		node->next = dir->child;
 	}
 	dir->child = node;
+	exfat_index_add(ef, dir, node);
 }
 
 static void tree_detach(struct exfat_node* node)
 {
+	exfat_index_remove(node->parent, node);
 	if (node->prev)
 		node->prev->next = node->next;
 	else /* this is the first node in the list */
@@ -560,8 +598,9 @@ static void reset_cache(struct exfat* ef, struct exfat_node* node)
 		struct exfat_node* p = node->child;
 		reset_cache(ef, p);
 		tree_detach(p);
-		free(p);
+		free_node(p);
 	}
+	exfat_index_free(node);
 	node->flags &= ~EXFAT_ATTRIB_CACHED;
 	if (node->references != 0)
 	{
@@ -600,7 +639,7 @@ static bool next_entry(struct exfat* ef, const struct exfat_node* parent,
 	return true;
 }
 
-int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
+static int flush_node(struct exfat* ef, struct exfat_node* node)
 {
 	cluster_t cluster;
 	loff_t offset;
@@ -667,6 +706,16 @@ int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
 	return exfat_flush(ef);
 }
 
+int exfat_flush_node(struct exfat* ef, struct exfat_node* node)
+{
+	int rc;
+
+	exfat_lock(ef);
+	rc = flush_node(ef, node);
+	exfat_unlock(ef);
+	return rc;
+}
+
 static bool erase_entry(struct exfat* ef, struct exfat_node* node)
 {
 	cluster_t cluster = node->entry_cluster;
@@ -747,7 +796,7 @@ static int shrink_directory(struct exfat* ef, struct exfat_node* dir,
 		new_size = CLUSTER_SIZE(*ef->sb);
 	if (new_size == dir->size)
 		return 0;
-	return exfat_truncate(ef, dir, new_size, true);
+	return exfat_truncate_locked(ef, dir, new_size, true);
 }
 
 static int delete(struct exfat* ef, struct exfat_node* node)
@@ -779,19 +828,24 @@ static int delete(struct exfat* ef, struct exfat_node* node)
 
 int exfat_unlink(struct exfat* ef, struct exfat_node* node)
 {
+	int rc;
+
 	if (node->flags & EXFAT_ATTRIB_DIR)
 		return -EISDIR;
-	return delete(ef, node);
+	exfat_lock(ef);
+	rc = delete(ef, node);
+	exfat_unlock(ef);
+	return rc;
 }
 
-int exfat_rmdir(struct exfat* ef, struct exfat_node* node)
+static int remove_directory(struct exfat* ef, struct exfat_node* node)
 {
 	int rc;
 
 	if (!(node->flags & EXFAT_ATTRIB_DIR))
 		return -ENOTDIR;
 	/* check that directory is empty */
-	rc = exfat_cache_directory(ef, node);
+	rc = cache_directory(ef, node);
 	if (rc != 0)
 		return rc;
 	if (node->child)
@@ -799,10 +853,20 @@ int exfat_rmdir(struct exfat* ef, struct exfat_node* node)
 	return delete(ef, node);
 }
 
+int exfat_rmdir(struct exfat* ef, struct exfat_node* node)
+{
+	int rc;
+
+	exfat_lock(ef);
+	rc = remove_directory(ef, node);
+	exfat_unlock(ef);
+	return rc;
+}
+
 static int grow_directory(struct exfat* ef, struct exfat_node* dir,
 		uint64_t asize, uint32_t difference)
 {
-	return exfat_truncate(ef, dir,
+	return exfat_truncate_locked(ef, dir,
 			DIV_ROUND_UP(asize + difference, CLUSTER_SIZE(*ef->sb))
 				* CLUSTER_SIZE(*ef->sb), true);
 }
@@ -921,7 +985,7 @@ static int write_entry(struct exfat* ef, struct exfat_node* dir,
 	init_node_meta1(node, &meta1);
 	init_node_meta2(node, &meta2);
 
-	tree_attach(dir, node);
+	tree_attach(ef, dir, node);
 	exfat_update_mtime(dir);
 	return 0;
 }
@@ -965,10 +1029,15 @@ static int create(struct exfat* ef, const char* path, uint16_t attrib)
 
 int exfat_mknod(struct exfat* ef, const char* path)
 {
-	return create(ef, path, EXFAT_ATTRIB_ARCH);
+	int rc;
+
+	exfat_lock(ef);
+	rc = create(ef, path, EXFAT_ATTRIB_ARCH);
+	exfat_unlock(ef);
+	return rc;
 }
 
-int exfat_mkdir(struct exfat* ef, const char* path)
+static int make_directory(struct exfat* ef, const char* path)
 {
 	int rc;
 	struct exfat_node* node;
@@ -980,7 +1049,7 @@ int exfat_mkdir(struct exfat* ef, const char* path)
 	if (rc != 0)
 		return 0;
 	/* directories always have at least one cluster */
-	rc = exfat_truncate(ef, node, CLUSTER_SIZE(*ef->sb), true);
+	rc = exfat_truncate_locked(ef, node, CLUSTER_SIZE(*ef->sb), true);
 	if (rc != 0)
 	{
 		delete(ef, node);
@@ -998,6 +1067,16 @@ int exfat_mkdir(struct exfat* ef, const char* path)
 	return 0;
 }
 
+int exfat_mkdir(struct exfat* ef, const char* path)
+{
+	int rc;
+
+	exfat_lock(ef);
+	rc = make_directory(ef, path);
+	exfat_unlock(ef);
+	return rc;
+}
+
 static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 		struct exfat_node* node, const le16_t* name, cluster_t new_cluster,
 		loff_t new_offset)
@@ -1067,11 +1146,12 @@ static int rename_entry(struct exfat* ef, struct exfat_node* dir,
 
 	memcpy(node->name, name, (EXFAT_NAME_MAX + 1) * sizeof(le16_t));
 	tree_detach(node);
-	tree_attach(dir, node);
+	tree_attach(ef, dir, node);
 	return 0;
 }
 
-int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
+static int rename_node(struct exfat* ef, const char* old_path,
+		const char* new_path)
 {
 	struct exfat_node* node;
 	struct exfat_node* existing;
@@ -1153,6 +1233,16 @@ int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
 	return rc;
 }
 
+int exfat_rename(struct exfat* ef, const char* old_path, const char* new_path)
+{
+	int rc;
+
+	exfat_lock(ef);
+	rc = rename_node(ef, old_path, new_path);
+	exfat_unlock(ef);
+	return rc;
+}
+
 void exfat_utimes(struct exfat_node* node, const struct timespec tv[2])
 {
 	node->atime = tv[0].tv_sec;
@@ -1210,7 +1300,7 @@ static int find_label(struct exfat* ef, cluster_t* cluster, loff_t* offset)
 	}
 }
 
-int exfat_set_label(struct exfat* ef, const char* label)
+static int set_label(struct exfat* ef, const char* label)
 {
 	le16_t label_utf16[EXFAT_ENAME_MAX + 1];
 	int rc;
@@ -1244,3 +1334,13 @@ int exfat_set_label(struct exfat* ef, const char* label)
 	strcpy(ef->label, label);
 	return 0;
 }
+
+int exfat_set_label(struct exfat* ef, const char* label)
+{
+	int rc;
+
+	exfat_lock(ef);
+	rc = set_label(ef, label);
+	exfat_unlock(ef);
+	return rc;
+}
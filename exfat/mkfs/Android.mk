@@ -14,3 +14,15 @@ LOCAL_SHARED_LIBRARIES := libexfat_twrp
 LOCAL_STATIC_LIBRARIES := libfusetwrp
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libmkexfatfs
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS = -D_FILE_OFFSET_BITS=64 -Dmain=mkexfatfs_main
+LOCAL_SRC_FILES = cbm.c fat.c main.c mkexfat.c rootdir.c uct.c uctc.c vbr.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH) \
+					$(commands_recovery_local_path)/exfat/libexfat \
+					$(commands_recovery_local_path)/fuse/include
+
+include $(BUILD_STATIC_LIBRARY)
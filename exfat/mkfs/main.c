@@ -21,6 +21,7 @@
 */
 
 #include "mkexfat.h"
+#include "mkexfatfs.h"
 #include "vbr.h"
 #include "fat.h"
 #include "cbm.h"
@@ -186,6 +187,28 @@ static int logarithm2(int n)
 	return -1;
 }
 
+int mkexfatfs(const char* spec, const char* volume_label,
+		mkexfatfs_progress_fn progress, void* cookie)
+{
+	struct exfat_dev* dev;
+	int ret;
+
+	dev = exfat_open(spec, EXFAT_MODE_RW);
+	if (dev == NULL)
+		return 1;
+	mkfs_set_progress(progress, cookie);
+	ret = setup(dev, 9, -1, volume_label, 0, 0);
+	mkfs_set_progress(NULL, NULL);
+	if (ret != 0)
+	{
+		exfat_close(dev);
+		return 1;
+	}
+	if (exfat_close(dev) != 0)
+		return 1;
+	return 0;
+}
+
 static void usage(const char* prog)
 {
 	fprintf(stderr, "Usage: %s [-i volume-id] [-n label] "
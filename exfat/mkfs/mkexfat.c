@@ -27,6 +27,15 @@
 #include <stdio.h>
 #include <string.h>
 
+static mkfs_progress_fn progress_fn;
+static void* progress_cookie;
+
+void mkfs_set_progress(mkfs_progress_fn fn, void* cookie)
+{
+	progress_fn = fn;
+	progress_cookie = cookie;
+}
+
 static int check_size(loff_t volume_size)
 {
 	const struct fs_object** pp;
@@ -52,7 +61,8 @@ static int check_size(loff_t volume_size)
 }
 
 static int erase_object(struct exfat_dev* dev, const void* block,
-		size_t block_size, loff_t start, loff_t size)
+		size_t block_size, loff_t start, loff_t size,
+		loff_t* erased, loff_t total)
 {
 	const loff_t block_count = DIV_ROUND_UP(size, block_size);
 	loff_t i;
@@ -70,6 +80,9 @@ static int erase_object(struct exfat_dev* dev, const void* block,
 					" at 0x%"PRIx64, i + 1, block_count, start);
 			return 1;
 		}
+		*erased += MIN(size - i, block_size);
+		if (progress_fn)
+			progress_fn(*erased, total, progress_cookie);
 	}
 	return 0;
 }
@@ -78,6 +91,7 @@ static int erase(struct exfat_dev* dev)
 {
 	const struct fs_object** pp;
 	loff_t position = 0;
+	loff_t erased = 0, total = 0;
 	const size_t block_size = 1024 * 1024;
 	void* block = malloc(block_size);
 
@@ -88,11 +102,14 @@ static int erase(struct exfat_dev* dev)
 	}
 	memset(block, 0, block_size);
 
+	for (pp = objects; *pp; pp++)
+		total += (*pp)->get_size();
+
 	for (pp = objects; *pp; pp++)
 	{
 		position = ROUND_UP(position, (*pp)->get_alignment());
 		if (erase_object(dev, block, block_size, position,
-				(*pp)->get_size()) != 0)
+				(*pp)->get_size(), &erased, total) != 0)
 		{
 			free(block);
 			return 1;
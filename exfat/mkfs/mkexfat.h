@@ -43,7 +43,10 @@ uint64_t get_first_sector(void);
 int get_sector_size(void);
 int get_cluster_size(void);
 
+typedef void (*mkfs_progress_fn)(uint64_t done, uint64_t total, void* cookie);
+
 int mkfs(struct exfat_dev* dev, loff_t volume_size);
+void mkfs_set_progress(mkfs_progress_fn fn, void* cookie);
 loff_t get_position(const struct fs_object* object);
 
 #endif /* ifndef MKFS_MKEXFAT_H_INCLUDED */
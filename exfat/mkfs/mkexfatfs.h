@@ -0,0 +1,46 @@
+/*
+	mkexfatfs.h
+	Creating an exFAT file system from another program.
+
+	Free exFAT implementation.
+	Copyright (C) 2011-2015  Andrew Nayenko
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MKFS_MKEXFATFS_H_INCLUDED
+#define MKFS_MKEXFATFS_H_INCLUDED
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*mkexfatfs_progress_fn)(uint64_t done, uint64_t total,
+		void* cookie);
+
+/* Creates a file system on spec with the default cluster size, the same
+   as running mkexfatfs with only a device.  progress, when not NULL, is
+   called with the number of bytes cleared so far.  Returns 0 on
+   success. */
+int mkexfatfs(const char* spec, const char* volume_label,
+		mkexfatfs_progress_fn progress, void* cookie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ifndef MKFS_MKEXFATFS_H_INCLUDED */
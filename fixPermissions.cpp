@@ -27,6 +27,8 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include "gui/rapidxml.hpp"
 #include "fixPermissions.hpp"
 #include "twrp-functions.hpp"
@@ -48,28 +50,115 @@ static const mode_t kMode_0660 = 0660; // S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP
 static const mode_t kMode_0755 = 0755; // S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH
 static const mode_t kMode_0771 = 0771; // S_IRWXU | S_IRWXG | S_IXOTH
 
-fixPermissions::fixPermissions() : head(NULL) {
+fixPermissions::fixPermissions() {
+	debug = false;
+	remove_data = false;
+	memset(handles, 0, sizeof(handles));
+	pthread_mutex_init(&lock, NULL);
+	phaseFunc = NULL;
+	unitCount = 0;
+	nextUnit = 0;
+	nextWorker = 0;
+	threadCount = 1;
+	failed = false;
+	changed = 0;
+	untouched = 0;
 }
 
 fixPermissions::~fixPermissions() {
-	deletePackages();
+	pthread_mutex_destroy(&lock);
+}
+
+void* fixPermissions::workerThread(void* cookie) {
+	fixPermissions* fp = (fixPermissions*) cookie;
+
+	pthread_mutex_lock(&fp->lock);
+	int worker = fp->nextWorker++;
+	pthread_mutex_unlock(&fp->lock);
+	for (;;) {
+		pthread_mutex_lock(&fp->lock);
+		if (fp->failed || fp->nextUnit >= fp->unitCount) {
+			pthread_mutex_unlock(&fp->lock);
+			break;
+		}
+		size_t index = fp->nextUnit++;
+		pthread_mutex_unlock(&fp->lock);
+		if ((fp->*(fp->phaseFunc))(index, worker) != 0) {
+			pthread_mutex_lock(&fp->lock);
+			fp->failed = true;
+			pthread_mutex_unlock(&fp->lock);
+		}
+	}
+	return NULL;
+}
+
+// Runs func on every unit from 0 to count on a pool of threads, one
+// package or tree per unit, and logs how long it took and how much of
+// what it looked at had to be changed
+int fixPermissions::runPhase(const string& phase, size_t count, unitFunc func) {
+	pthread_t threads[FIXPERMS_MAX_THREADS];
+	timespec start, end;
+	int started = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	phaseFunc = func;
+	unitCount = count;
+	nextUnit = 0;
+	nextWorker = 0;
+	failed = false;
+	changed = 0;
+	untouched = 0;
+	for (int i = 1; i < threadCount && (size_t) i < count; i++) {
+		if (pthread_create(&threads[started], NULL, workerThread, this) != 0)
+			break;
+		started++;
+	}
+	workerThread(this);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	int32_t ms = TWFunc::timespec_diff_ms(start, end);
+	LOGINFO("%s: %i units in %i.%03is on %i threads, %llu entries changed, %llu already correct\n",
+		phase.c_str(), (int) count, ms / 1000, ms % 1000, started + 1, changed, untouched);
+	return failed ? -1 : 0;
 }
 
 #ifdef HAVE_SELINUX
-struct selabel_handle *sehandle;
 struct selinux_opt selinux_options[] = {
 	{ SELABEL_OPT_PATH, "/file_contexts" }
 };
 
-int fixPermissions::restorecon(string entry, struct stat *sb) {
+int fixPermissions::openContextHandles(void) {
+	for (int i = 0; i < threadCount; i++) {
+		handles[i] = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
+		if (!handles[i]) {
+			LOGINFO("Unable to open /file_contexts\n");
+			closeContextHandles();
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void fixPermissions::closeContextHandles(void) {
+	for (int i = 0; i < FIXPERMS_MAX_THREADS; i++) {
+		if (handles[i])
+			selabel_close(handles[i]);
+		handles[i] = NULL;
+	}
+}
+
+int fixPermissions::restorecon(struct selabel_handle* handle, const string& entry, struct stat *sb) {
 	char *oldcontext, *newcontext;
 
 	if (lgetfilecon(entry.c_str(), &oldcontext) < 0) {
 		LOGINFO("Couldn't get selinux context for %s\n", entry.c_str());
 		return -1;
 	}
-	if (selabel_lookup(sehandle, &newcontext, entry.c_str(), sb->st_mode) < 0) {
+	if (selabel_lookup(handle, &newcontext, entry.c_str(), sb->st_mode) < 0) {
 		LOGINFO("Couldn't lookup selinux context for %s\n", entry.c_str());
+		freecon(oldcontext);
 		return -1;
 	}
 	if (strcmp(oldcontext, newcontext) != 0) {
@@ -77,27 +166,54 @@ int fixPermissions::restorecon(string entry, struct stat *sb) {
 		if (lsetfilecon(entry.c_str(), newcontext) < 0) {
 			LOGINFO("Couldn't label %s with %s: %s\n", entry.c_str(), newcontext, strerror(errno));
 		}
+		__sync_fetch_and_add(&changed, 1);
+	} else {
+		__sync_fetch_and_add(&untouched, 1);
 	}
 	freecon(oldcontext);
 	freecon(newcontext);
 	return 0;
 }
 
-int fixPermissions::fixDataDataContexts(void) {
-	string dir = "/data/data/";
-	sehandle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
-	if (!sehandle) {
-		LOGINFO("Unable to open /file_contexts\n");
+int fixPermissions::fixContextUnit(size_t index, int worker) {
+	const string& path = contextUnits[index];
+	struct stat sb;
+
+	if (lstat(path.c_str(), &sb) != 0)
 		return 0;
+	restorecon(handles[worker], path, &sb);
+	if (S_ISDIR(sb.st_mode))
+		fixContextsRecursively(handles[worker], path);
+	return 0;
+}
+
+// Every entry of dir becomes a unit of the contexts phase
+static void addContextUnits(const string& dir, vector<string>& units) {
+	DIR *d = opendir(dir.c_str());
+	struct dirent *de;
+
+	if (!d)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		units.push_back(dir + "/" + de->d_name);
 	}
-	if (TWFunc::Path_Exists(dir)) {
-		fixContextsRecursively(dir, 0);
-	}
-	selabel_close(sehandle);
+	closedir(d);
+}
+
+int fixPermissions::fixDataDataContexts(void) {
+	string dir = "/data/data";
+
+	if (!TWFunc::Path_Exists(dir))
+		return 0;
+	contextUnits.clear();
+	addContextUnits(dir, contextUnits);
+	runPhase("Relabel " + dir, contextUnits.size(), &fixPermissions::fixContextUnit);
 	return 0;
 }
 
-int fixPermissions::fixContextsRecursively(string name, int level) {
+int fixPermissions::fixContextsRecursively(struct selabel_handle* handle, const string& name) {
 	DIR *d;
 	struct dirent *de;
 	struct stat sb;
@@ -105,22 +221,16 @@ int fixPermissions::fixContextsRecursively(string name, int level) {
 
 	if (!(d = opendir(name.c_str())))
 		return -1;
-	if (!(de = readdir(d)))
-		return -1;
-
-	do {
-		if (de->d_type ==  DT_DIR) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-				continue;
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
-			fixContextsRecursively(path, level + 1);
-		}
-		else {
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
-		}
-	} while ((de = readdir(d)));
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (fstatat(dirfd(d), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+			continue;
+		path = name + "/" + de->d_name;
+		restorecon(handle, path, &sb);
+		if (S_ISDIR(sb.st_mode))
+			fixContextsRecursively(handle, path);
+	}
 	closedir(d);
 	return 0;
 }
@@ -130,10 +240,12 @@ int fixPermissions::fixDataInternalContexts(void) {
 	struct dirent *de;
 	struct stat sb;
 	string dir, androiddir;
-	sehandle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
-	if (!sehandle) {
-		LOGINFO("Unable to open /file_contexts\n");
-		return 0;
+	bool opened = false;
+
+	if (!handles[0]) {
+		if (openContextHandles() != 0)
+			return 0;
+		opened = true;
 	}
 	// TODO: what about /data/media/1 etc.?
 	if (TWFunc::Path_Exists("/data/media/0"))
@@ -142,34 +254,61 @@ int fixPermissions::fixDataInternalContexts(void) {
 		dir = "/data/media";
 	if (!TWFunc::Path_Exists(dir)) {
 		LOGINFO("fixDataInternalContexts: '%s' does not exist!\n", dir.c_str());
+		if (opened)
+			closeContextHandles();
 		return 0;
 	}
 	LOGINFO("Fixing %s contexts\n", dir.c_str());
-	restorecon(dir, &sb);
+	if (lstat(dir.c_str(), &sb) == 0)
+		restorecon(handles[0], dir, &sb);
 	d = opendir(dir.c_str());
-
-	while (( de = readdir(d)) != NULL) {
-		stat(de->d_name, &sb);
-		string f;
-		f = dir + "/" + de->d_name;
-		restorecon(f, &sb);
+	if (d) {
+		while ((de = readdir(d)) != NULL) {
+			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+				continue;
+			if (fstatat(dirfd(d), de->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+			restorecon(handles[0], dir + "/" + de->d_name, &sb);
+		}
+		closedir(d);
 	}
-	closedir(d);
 
-	androiddir = dir + "/Android/";
+	// Android/data, Android/obb and so on hold a folder per package
+	androiddir = dir + "/Android";
 	if (TWFunc::Path_Exists(androiddir)) {
-		fixContextsRecursively(androiddir, 0);
+		vector<string> subdirs;
+		contextUnits.clear();
+		addContextUnits(androiddir, subdirs);
+		for (size_t i = 0; i < subdirs.size(); i++) {
+			if (lstat(subdirs[i].c_str(), &sb) != 0)
+				continue;
+			restorecon(handles[0], subdirs[i], &sb);
+			if (S_ISDIR(sb.st_mode))
+				addContextUnits(subdirs[i], contextUnits);
+		}
+		runPhase("Relabel " + androiddir, contextUnits.size(), &fixPermissions::fixContextUnit);
 	}
-	selabel_close(sehandle);
+	if (opened)
+		closeContextHandles();
 	return 0;
 }
 #endif
 
+static int workerCount(void) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = (cpus < 1) ? 2 : (int) cpus;
+
+	if (count > FIXPERMS_MAX_THREADS)
+		count = FIXPERMS_MAX_THREADS;
+	return count;
+}
+
 int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_apps) {
 	string packageFile = "/data/system/packages.xml";
 	debug = enable_debug;
 	remove_data = remove_data_for_missing_apps;
 	bool multi_user = TWFunc::Path_Exists("/data/user");
+	timespec start, end;
 
 	if (!(TWFunc::Path_Exists(packageFile))) {
 		gui_print("Can't check permissions\n");
@@ -181,12 +320,16 @@ int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_app
 	}
 
 	gui_print("Fixing permissions...\nLoading packages...\n");
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	if ((getPackages(packageFile)) != 0) {
 		return -1;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("Loaded %i packages in %ims\n", (int) packages.size(), TWFunc::timespec_diff_ms(start, end));
+	threadCount = workerCount();
 
 	gui_print("Fixing app permissions...\n");
-	if (fixApps() != 0) {
+	if (runPhase("Fix apps", packages.size(), &fixPermissions::fixApp) != 0) {
 		return -1;
 	}
 
@@ -229,7 +372,8 @@ int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_app
 					continue;
 				}
 				gui_print("Fixing %s permissions...\n", new_path.c_str());
-				if ((fixDataData(new_path)) != 0) {
+				dataDir = new_path;
+				if (runPhase("Fix " + new_path, packages.size(), &fixPermissions::fixDataData) != 0) {
 					closedir(d);
 					return -1;
 				}
@@ -238,7 +382,8 @@ int fixPermissions::fixPerms(bool enable_debug, bool remove_data_for_missing_app
 		}
 	} else {
 		gui_print("Fixing /data/data permissions...\n");
-		if ((fixDataData("/data/data/")) != 0) {
+		dataDir = "/data/data/";
+		if (runPhase("Fix /data/data", packages.size(), &fixPermissions::fixDataData) != 0) {
 			return -1;
 		}
 	}
@@ -250,8 +395,12 @@ int fixPermissions::fixContexts()
 {
 #ifdef HAVE_SELINUX
 	gui_print("Fixing /data/data/ contexts.\n");
-	fixDataDataContexts();
-	fixDataInternalContexts();
+	threadCount = workerCount();
+	if (openContextHandles() == 0) {
+		fixDataDataContexts();
+		fixDataInternalContexts();
+		closeContextHandles();
+	}
 	gui_print("Done fixing contexts.\n");
 	return 0;
 #endif
@@ -259,213 +408,168 @@ int fixPermissions::fixContexts()
 	return -1;
 }
 
-int fixPermissions::pchown(string fn, int puid, int pgid) {
-	LOGINFO("Fixing %s, uid: %d, gid: %d\n", fn.c_str(), puid, pgid);
-	if (chown(fn.c_str(), puid, pgid) != 0) {
-		LOGERR("Unable to chown '%s' %i %i\n", fn.c_str(), puid, pgid);
-		return -1;
-	}
-	return 0;
-}
+// Sets the owner and mode of name, relative to dirfd, leaving entries
+// that are already right alone.  Symlinks are never followed.
+int fixPermissions::fixEntry(int dirfd, const char* name, const string& path, int uid, int gid, mode_t mode) {
+	struct stat st;
+	bool fixed = false;
 
-int fixPermissions::pchmod(string fn, mode_t mode) {
-	LOGINFO("Fixing %s, mode: %o\n", fn.c_str(), mode);
-
-	if (chmod(fn.c_str(), mode) != 0) {
-		LOGERR("Unable to chmod '%s' %o\n", fn.c_str(), mode);
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		LOGERR("Unable to stat '%s'\n", path.c_str());
 		return -1;
 	}
-
-	return 0;
-}
-
-int fixPermissions::fixApps() {
-	package* temp = head;
-	while (temp != NULL) {
-		struct stat st;
-		if (stat(temp->codePath.c_str(), &st) == 0) {
-			int new_uid = 0;
-			int new_gid = 0;
-			mode_t perms = 0;
-			bool fix = false;
-			if (temp->appDir.compare("/system/app") == 0 || temp->appDir.compare("/system/priv-app") == 0) {
-				fix = true;
-				new_uid = 0;
-				new_gid = 0;
-				perms = kMode_0644;
-			} else if (temp->appDir.compare("/data/app") == 0 || temp->appDir.compare("/sd-ext/app") == 0) {
-				fix = true;
-				new_uid = 1000;
-				new_gid = 1000;
-				perms = kMode_0644;
-			} else if (temp->appDir.compare("/data/app-private") == 0 || temp->appDir.compare("/sd-ext/app-private") == 0) {
-				fix = true;
-				new_uid = 1000;
-				new_gid = temp->gid;
-				perms = kMode_0640;
-			} else
-				fix = false;
-			if (fix) {
-				if (debug) {
-					LOGINFO("Looking at '%s'\n", temp->codePath.c_str());
-					LOGINFO("Fixing permissions on '%s'\n", temp->pkgName.c_str());
-					LOGINFO("Directory: '%s'\n", temp->appDir.c_str());
-					LOGINFO("Original package owner: %d, group: %d\n", temp->uid, temp->gid);
-				}
-				if (S_ISDIR(st.st_mode)) {
-					// Android 5.0 introduced codePath pointing to a directory instead of the apk itself
-					// TODO: check what this should do
-					if (fixDir(temp->codePath, new_uid, new_gid, kMode_0755, new_uid, new_gid, perms) != 0)
-						return -1;
-				} else {
-					if (pchown(temp->codePath, new_uid, new_gid) != 0)
-						return -1;
-					if (pchmod(temp->codePath, perms) != 0)
-						return -1;
-				}
-			}
-		} else if (remove_data) {
-			//Remove data directory since app isn't installed
-			string datapath = "/data/data/" + temp->dDir;
-			if (TWFunc::Path_Exists(datapath) && temp->appDir.size() >= 9 && temp->appDir.substr(0, 9) != "/mnt/asec") {
-				if (debug)
-					LOGINFO("Looking at '%s', removing data dir: '%s', appDir: '%s'", temp->codePath.c_str(), datapath.c_str(), temp->appDir.c_str());
-				if (TWFunc::removeDir(datapath, false) != 0) {
-					LOGINFO("Unable to removeDir '%s'\n", datapath.c_str());
-					return -1;
-				}
-			}
+	if (S_ISLNK(st.st_mode))
+		return 0;
+	if ((int) st.st_uid != uid || (int) st.st_gid != gid) {
+		LOGINFO("Fixing %s, uid: %d, gid: %d\n", path.c_str(), uid, gid);
+		if (fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0) {
+			LOGERR("Unable to chown '%s' %i %i\n", path.c_str(), uid, gid);
+			return -1;
 		}
-		temp = temp->next;
+		fixed = true;
 	}
-	return 0;
-}
-
-int fixPermissions::fixAllFiles(string directory, int uid, int gid, mode_t file_perms) {
-	vector <string> files;
-	string file;
-
-	files = listAllFiles(directory);
-	for (unsigned i = 0; i < files.size(); ++i) {
-		file = directory + "/";
-		file.append(files.at(i));
-		if (debug)
-			LOGINFO("Looking at file '%s'\n", file.c_str());
-		if (pchmod(file, file_perms) != 0)
-			return -1;
-		if (pchown(file, uid, gid) != 0)
+	if ((st.st_mode & 07777) != mode) {
+		LOGINFO("Fixing %s, mode: %o\n", path.c_str(), mode);
+		if (fchmodat(dirfd, name, mode, 0) != 0) {
+			LOGERR("Unable to chmod '%s' %o\n", path.c_str(), mode);
 			return -1;
+		}
+		fixed = true;
 	}
+	__sync_fetch_and_add(fixed ? &changed : &untouched, 1);
 	return 0;
 }
 
-int fixPermissions::fixDir(const string& dir, int diruid, int dirgid, mode_t dirmode, int fileuid, int filegid, mode_t filemode)
+// Fixes a directory and the regular files directly inside it
+int fixPermissions::fixDir(int dirfd, const char* name, const string& path, int diruid, int dirgid, mode_t dirmode, int fileuid, int filegid, mode_t filemode)
 {
-	if (pchmod(dir.c_str(), dirmode) != 0)
+	if (fixEntry(dirfd, name, path, diruid, dirgid, dirmode) != 0)
 		return -1;
-	if (pchown(dir.c_str(), diruid, dirgid) != 0)
+
+	int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		LOGERR("Error opening '%s'\n", path.c_str());
 		return -1;
-	if (fixAllFiles(dir, fileuid, filegid, filemode) != 0)
+	}
+	DIR *d = fdopendir(fd);
+	if (d == NULL) {
+		LOGERR("Error opening '%s'\n", path.c_str());
+		close(fd);
 		return -1;
-	return 0;
+	}
+	struct dirent *de;
+	int ret = 0;
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		if (de->d_type != DT_REG)
+			continue;
+		ret = fixEntry(fd, de->d_name, path + "/" + de->d_name, fileuid, filegid, filemode);
+	}
+	closedir(d);
+	return ret;
 }
 
-int fixPermissions::fixDataData(string dataDir) {
-	package* temp = head;
-	while (temp != NULL) {
-		string dir = dataDir + temp->dDir;
-		if (TWFunc::Path_Exists(dir)) {
-			vector <string> dataDataDirs = listAllDirectories(dir);
-			for (unsigned n = 0; n < dataDataDirs.size(); ++n) {
-				string directory = dir + "/";
-				directory.append(dataDataDirs.at(n));
-				if (debug)
-					LOGINFO("Looking at data directory: '%s'\n", directory.c_str());
-				if (dataDataDirs.at(n) == ".") {
-					if (fixDir(directory, temp->uid, temp->gid, kMode_0755, temp->uid, temp->gid, kMode_0755) != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "..") {
-					if (debug)
-						LOGINFO("Skipping ..\n");
-					continue;
-				}
-				// TODO: when any of these fails, do we really want to stop everything? 
-				else if (dataDataDirs.at(n) == "lib") {
-					if (fixDir(directory, 1000, 1000, kMode_0755, 1000, 1000, kMode_0755) != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "shared_prefs") {
-					if (fixDir(directory, temp->uid, temp->gid,kMode_0771, temp->uid, temp->gid, kMode_0660) != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "databases") {
-					if (fixDir(directory, temp->uid, temp->gid,kMode_0771, temp->uid, temp->gid, kMode_0660) != 0)
-						return -1;
-				}
-				else if (dataDataDirs.at(n) == "cache") {
-					if (fixDir(directory, temp->uid, temp->gid,kMode_0771, temp->uid, temp->gid, kMode_0600) != 0)
-						return -1;
-				}
-				else {
-					if (fixDir(directory, temp->uid, temp->gid,kMode_0771, temp->uid, temp->gid, kMode_0755) != 0)
-						return -1;
-				}
+int fixPermissions::fixApp(size_t index, int worker __unused) {
+	package* temp = &packages[index];
+	struct stat st;
+
+	if (stat(temp->codePath.c_str(), &st) == 0) {
+		int new_uid = 0;
+		int new_gid = 0;
+		mode_t perms = 0;
+		bool fix = false;
+		if (temp->appDir.compare("/system/app") == 0 || temp->appDir.compare("/system/priv-app") == 0) {
+			fix = true;
+			new_uid = 0;
+			new_gid = 0;
+			perms = kMode_0644;
+		} else if (temp->appDir.compare("/data/app") == 0 || temp->appDir.compare("/sd-ext/app") == 0) {
+			fix = true;
+			new_uid = 1000;
+			new_gid = 1000;
+			perms = kMode_0644;
+		} else if (temp->appDir.compare("/data/app-private") == 0 || temp->appDir.compare("/sd-ext/app-private") == 0) {
+			fix = true;
+			new_uid = 1000;
+			new_gid = temp->gid;
+			perms = kMode_0640;
+		} else
+			fix = false;
+		if (fix) {
+			if (debug) {
+				LOGINFO("Looking at '%s'\n", temp->codePath.c_str());
+				LOGINFO("Fixing permissions on '%s'\n", temp->pkgName.c_str());
+				LOGINFO("Directory: '%s'\n", temp->appDir.c_str());
+				LOGINFO("Original package owner: %d, group: %d\n", temp->uid, temp->gid);
+			}
+			if (S_ISDIR(st.st_mode)) {
+				// Android 5.0 introduced codePath pointing to a directory instead of the apk itself
+				// TODO: check what this should do
+				if (fixDir(AT_FDCWD, temp->codePath.c_str(), temp->codePath, new_uid, new_gid, kMode_0755, new_uid, new_gid, perms) != 0)
+					return -1;
+			} else {
+				if (fixEntry(AT_FDCWD, temp->codePath.c_str(), temp->codePath, new_uid, new_gid, perms) != 0)
+					return -1;
+			}
+		}
+	} else if (remove_data) {
+		//Remove data directory since app isn't installed
+		string datapath = "/data/data/" + temp->dDir;
+		if (TWFunc::Path_Exists(datapath) && temp->appDir.size() >= 9 && temp->appDir.substr(0, 9) != "/mnt/asec") {
+			if (debug)
+				LOGINFO("Looking at '%s', removing data dir: '%s', appDir: '%s'", temp->codePath.c_str(), datapath.c_str(), temp->appDir.c_str());
+			if (TWFunc::removeDir(datapath, false) != 0) {
+				LOGINFO("Unable to removeDir '%s'\n", datapath.c_str());
+				return -1;
 			}
 		}
-		temp = temp->next;
 	}
 	return 0;
 }
 
-// TODO: merge to listAllDirEntries(path, type)
-vector <string> fixPermissions::listAllDirectories(string path) {
-	DIR *dir = opendir(path.c_str());
-	vector <string> dirs;
+int fixPermissions::fixDataData(size_t index, int worker __unused) {
+	package* temp = &packages[index];
+	string dir = dataDir + temp->dDir;
 
-	if (dir == NULL) {
-		LOGERR("Error opening '%s'\n", path.c_str());
-		return dirs;
-	}
-	struct dirent *entry = readdir(dir);
-	while (entry != NULL) {
-		if (entry->d_type == DT_DIR)
-			dirs.push_back(entry->d_name);
-		entry = readdir(dir);
-	}
-	closedir(dir);
-	return dirs;
-}
-
-vector <string> fixPermissions::listAllFiles(string path) {
-	DIR *dir = opendir(path.c_str());
-	vector <string> files;
-
-	if (dir == NULL) {
-		LOGERR("Error opening '%s'\n", path.c_str());
-		return files;
-	}
-	struct dirent *entry = readdir(dir);
-	while (entry != NULL) {
-		if (entry->d_type == DT_REG)
-			files.push_back(entry->d_name);
-		entry = readdir(dir);
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	DIR *d = fdopendir(fd);
+	if (d == NULL) {
+		close(fd);
+		return 0;
 	}
-	closedir(dir);
-	return files;
-}
+	if (debug)
+		LOGINFO("Looking at data directory: '%s'\n", dir.c_str());
 
-void fixPermissions::deletePackages() {
-	while (head) {
-		package* temp = head;
-		head = temp->next;
-		delete temp;
+	struct dirent *de;
+	int ret = 0;
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		if (de->d_type != DT_DIR)
+			continue;
+		string name = de->d_name;
+		string directory = dir + "/" + name;
+		if (name == ".")
+			ret = fixDir(fd, ".", directory, temp->uid, temp->gid, kMode_0755, temp->uid, temp->gid, kMode_0755);
+		else if (name == "..")
+			continue;
+		// TODO: when any of these fails, do we really want to stop everything?
+		else if (name == "lib")
+			ret = fixDir(fd, de->d_name, directory, 1000, 1000, kMode_0755, 1000, 1000, kMode_0755);
+		else if (name == "shared_prefs")
+			ret = fixDir(fd, de->d_name, directory, temp->uid, temp->gid, kMode_0771, temp->uid, temp->gid, kMode_0660);
+		else if (name == "databases")
+			ret = fixDir(fd, de->d_name, directory, temp->uid, temp->gid, kMode_0771, temp->uid, temp->gid, kMode_0660);
+		else if (name == "cache")
+			ret = fixDir(fd, de->d_name, directory, temp->uid, temp->gid, kMode_0771, temp->uid, temp->gid, kMode_0600);
+		else
+			ret = fixDir(fd, de->d_name, directory, temp->uid, temp->gid, kMode_0771, temp->uid, temp->gid, kMode_0755);
 	}
+	closedir(d);
+	return ret;
 }
 
 int fixPermissions::getPackages(const string& packageFile) {
-	deletePackages();
-	head = NULL;
+	packages.clear();
 
 	// TODO: simply skip all packages in /system/framework? or why are these excluded?
 	vector <string> skip;
@@ -521,25 +625,26 @@ int fixPermissions::getPackages(const string& packageFile) {
 		if (debug)
 			LOGINFO("Loading pkg: %s\n", name.c_str());
 
-		package* temp = new package;
-		temp->pkgName = name;
-		temp->codePath = codePath;
-		temp->appDir = codePath;
-		temp->dDir = name;
+		package temp;
+		temp.pkgName = name;
+		temp.codePath = codePath;
+		temp.appDir = codePath;
+		temp.dDir = name;
+		temp.uid = 0;
+		temp.gid = 0;
 		xml_attribute<>* attUserId = node->first_attribute("userId");
 		if (!attUserId)
 			attUserId = node->first_attribute("sharedUserId");
 		if (!attUserId) {
 			LOGINFO("Problem with userID on %s\n", name.c_str());
 		} else {
-			temp->uid = atoi(attUserId->value());
-			temp->gid = atoi(attUserId->value());
+			temp.uid = atoi(attUserId->value());
+			temp.gid = atoi(attUserId->value());
 		}
-		temp->next = head;
-		head = temp;
+		packages.push_back(temp);
 	}
 
-	if (head == NULL) {
+	if (packages.empty()) {
 		LOGERR("No package found to fix.\n");
 		return -1;
 	}
@@ -5,6 +5,7 @@
 #include <vector>
 #include <string.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -14,6 +15,10 @@
 
 using namespace std;
 
+#define FIXPERMS_MAX_THREADS 8
+
+struct selabel_handle;
+
 class fixPermissions {
 	public:
 		fixPermissions();
@@ -23,20 +28,6 @@ class fixPermissions {
 		int fixDataInternalContexts(void);
 
 	private:
-		int pchown(string fn, int puid, int pgid);
-		int pchmod(string fn, mode_t mode);
-		vector <string> listAllDirectories(string path);
-		vector <string> listAllFiles(string path);
-		void deletePackages();
-		int getPackages(const string& packageFile);
-		int fixApps();
-		int fixAllFiles(string directory, int uid, int gid, mode_t file_perms);
-		int fixDir(const string& dir, int diruid, int dirgid, mode_t dirmode, int fileuid, int filegid, mode_t filemode);
-		int fixDataData(string dataDir);
-		int restorecon(string entry, struct stat *sb);
-		int fixDataDataContexts(void);
-		int fixContextsRecursively(string path, int level);
-
 		struct package {
 			string pkgName;
 			string codePath;
@@ -44,9 +35,40 @@ class fixPermissions {
 			string dDir;
 			int gid;
 			int uid;
-			package *next;
 		};
+
+		// A phase's work units are handed out to the workers by index
+		typedef int (fixPermissions::*unitFunc)(size_t index, int worker);
+
+		int fixEntry(int dirfd, const char* name, const string& path, int uid, int gid, mode_t mode);
+		int fixDir(int dirfd, const char* name, const string& path, int diruid, int dirgid, mode_t dirmode, int fileuid, int filegid, mode_t filemode);
+		int getPackages(const string& packageFile);
+		int fixApp(size_t index, int worker);
+		int fixDataData(size_t index, int worker);
+		int runPhase(const string& phase, size_t count, unitFunc func);
+		static void* workerThread(void* cookie);
+		int restorecon(struct selabel_handle* handle, const string& entry, struct stat *sb);
+		int fixDataDataContexts(void);
+		int fixContextsRecursively(struct selabel_handle* handle, const string& path);
+		int fixContextUnit(size_t index, int worker);
+		int openContextHandles(void);
+		void closeContextHandles(void);
+
 		bool debug;
 		bool remove_data;
-		package* head;
+		vector<package> packages;
+		string dataDir;                                   // Data folder being fixed by fixDataData
+		vector<string> contextUnits;                      // Trees relabeled by fixContextUnit
+		struct selabel_handle* handles[FIXPERMS_MAX_THREADS]; // One label handle per worker, lookups are not thread safe
+
+		// State of the phase being run
+		pthread_mutex_t lock;
+		unitFunc phaseFunc;
+		size_t unitCount;
+		size_t nextUnit;
+		int nextWorker;
+		int threadCount;
+		bool failed;
+		unsigned long long changed;
+		unsigned long long untouched;
 };
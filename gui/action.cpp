@@ -40,6 +40,7 @@
 #include "../twrp-functions.hpp"
 #include "../openrecoveryscript.hpp"
 #include "../twrpDU.hpp"
+#include "../twrpFSProbe.hpp"
 
 #include <ctype.h>
 
@@ -265,6 +266,7 @@ GUIAction::GUIAction(xml_node<>* node)
 		ADD_ACTION(multirom_wipe);
 		ADD_ACTION(multirom_disable_flash_kernel);
 		ADD_ACTION(multirom_rm_bootimg);
+		ADD_ACTION(multirom_grow_img);
 		ADD_ACTION(multirom_backup_rom);
 		ADD_ACTION(multirom_sideload);
 		ADD_ACTION(multirom_execute_swap);
@@ -413,6 +415,8 @@ int GUIAction::flash_zip(std::string filename, int* wipe_cache)
 		LOGERR("No file specified.\n");
 		return -1;
 	}
+	du.Clear_Cache();
+	twrpFSProbe::Invalidate_All();
 
 	if (!PartitionManager.Mount_By_Path(filename, true))
 		return -1;
@@ -1355,6 +1359,7 @@ int GUIAction::cmd(std::string arg)
 	int op_status = 0;
 
 	operation_start("Command");
+	du.Clear_Cache();
 	LOGINFO("Running command: '%s'\n", arg.c_str());
 	if (simulate) {
 		simulate_progress_bar();
@@ -1362,6 +1367,9 @@ int GUIAction::cmd(std::string arg)
 		op_status = TWFunc::Exec_Cmd(arg);
 		if (op_status != 0)
 			op_status = 1;
+		// The command may have written to any block device
+		du.Clear_Cache();
+		twrpFSProbe::Invalidate_All();
 	}
 
 	operation_end(op_status);
@@ -1375,6 +1383,7 @@ int GUIAction::terminalcommand(std::string arg)
 
 	DataManager::GetValue("tw_terminal_location", cmdpath);
 	operation_start("CommandOutput");
+	du.Clear_Cache();
 	gui_print("%s # %s\n", cmdpath.c_str(), arg.c_str());
 	if (simulate) {
 		simulate_progress_bar();
@@ -1425,6 +1434,9 @@ int GUIAction::terminalcommand(std::string arg)
 			}
 			fclose(fp);
 		}
+		// The command may have written to any block device (dd, mkfs, ...)
+		du.Clear_Cache();
+		twrpFSProbe::Invalidate_All();
 		DataManager::SetValue("tw_operation_status", 0);
 		DataManager::SetValue("tw_operation_state", 1);
 		DataManager::SetValue("tw_terminal_state", 0);
@@ -2384,6 +2396,15 @@ int GUIAction::multirom_rm_bootimg(std::string arg)
 	return 0;
 }
 
+int GUIAction::multirom_grow_img(std::string arg)
+{
+	operation_start("Resizing");
+	std::string img = MultiROM::getRomsPath() + "/" + DataManager::GetStrValue("tw_multirom_rom_name") + "/" + arg + ".img";
+	int op_status = !MultiROM::growImage(img, DataManager::GetIntValue("tw_multirom_image_size"));
+	operation_end(op_status);
+	return 0;
+}
+
 int GUIAction::multirom_backup_rom(std::string arg)
 {
 	operation_start("Changing mountpoints for backup");
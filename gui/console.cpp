@@ -32,6 +32,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <string>
 
@@ -54,6 +55,28 @@ std::vector<std::string> gConsole;
 std::vector<std::string> gConsoleColor;
 static FILE* ors_file;
 
+// Backups print from several threads and fork tar children while doing
+// so.  The lock is held across fork() so a child never inherits the
+// console half updated, and it is only ever taken around the vector
+// updates, never while translating or calling out.
+static pthread_mutex_t console_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t console_once = PTHREAD_ONCE_INIT;
+
+static void console_lock_for_fork(void)
+{
+	pthread_mutex_lock(&console_lock);
+}
+
+static void console_unlock_after_fork(void)
+{
+	pthread_mutex_unlock(&console_lock);
+}
+
+static void console_init(void)
+{
+	pthread_atfork(console_lock_for_fork, console_unlock_after_fork, console_unlock_after_fork);
+}
+
 extern "C" void __gui_print(const char *color, char *buf)
 {
 	char *start, *next;
@@ -63,6 +86,8 @@ extern "C" void __gui_print(const char *color, char *buf)
 		return;
 	}
 
+	pthread_once(&console_once, console_init);
+	pthread_mutex_lock(&console_lock);
 	for (start = next = buf; *next != '\0';)
 	{
 		if (*next == '\n')
@@ -82,6 +107,7 @@ extern "C" void __gui_print(const char *color, char *buf)
 		gConsole.push_back(start);
 		gConsoleColor.push_back(color);
 	}
+	pthread_mutex_unlock(&console_lock);
 }
 
 extern "C" void gui_print(const char *fmt, ...)
@@ -168,27 +194,37 @@ void gui_msg(Message msg)
 		fprintf(ors_file, "%s", output.c_str());
 		fflush(ors_file);
 	}
+	pthread_once(&console_once, console_init);
+	pthread_mutex_lock(&console_lock);
 	gMessages.push_back(msg);
+	pthread_mutex_unlock(&console_lock);
 }
 
 void GUIConsole::Translate_Now() {
+	pthread_mutex_lock(&console_lock);
 	size_t message_count = gMessages.size();
-	if (message_count <= last_message_count)
+	if (message_count <= last_message_count) {
+		pthread_mutex_unlock(&console_lock);
 		return;
+	}
+	std::vector<Message> messages(gMessages.begin() + last_message_count, gMessages.end());
+	last_message_count = message_count;
+	pthread_mutex_unlock(&console_lock);
 
-	for (size_t m = last_message_count; m < message_count; m++) {
-		std::string message = gMessages[m];
+	for (size_t m = 0; m < messages.size(); m++) {
+		std::string message = messages[m];
 		std::string color = "normal";
-		if (gMessages[m].GetKind() == msg::kError)
+		if (messages[m].GetKind() == msg::kError)
 			color = "error";
-		else if (gMessages[m].GetKind() == msg::kHighlight)
+		else if (messages[m].GetKind() == msg::kHighlight)
 			color = "highlight";
-		else if (gMessages[m].GetKind() == msg::kWarning)
+		else if (messages[m].GetKind() == msg::kWarning)
 			color = "warning";
+		pthread_mutex_lock(&console_lock);
 		gConsole.push_back(message);
 		gConsoleColor.push_back(color);
+		pthread_mutex_unlock(&console_lock);
 	}
-	last_message_count = message_count;
 }
 
 GUIConsole::GUIConsole(xml_node<>* node) : GUIScrollList(node)
@@ -396,6 +396,7 @@ protected:
 	int multirom_wipe(std::string arg);
 	int multirom_disable_flash_kernel(std::string arg);
 	int multirom_rm_bootimg(std::string arg);
+	int multirom_grow_img(std::string arg);
 	int multirom_backup_rom(std::string arg);
 	int multirom_sideload(std::string arg);
 	int multirom_swap_calc_space(std::string arg);
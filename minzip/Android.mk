@@ -53,3 +53,24 @@ LOCAL_CFLAGS += -Wall
 LOCAL_STATIC_LIBRARIES += libz
 
 include $(BUILD_STATIC_LIBRARY)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := ExtractBench.c
+
+LOCAL_C_INCLUDES += \
+	external/zlib \
+	external/safe-iop/include
+
+LOCAL_MODULE := minzip_extract_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS += -Wall
+LOCAL_STATIC_LIBRARIES += libminzip libz
+ifeq ($(TWHAVE_SELINUX),true)
+LOCAL_C_INCLUDES += external/libselinux/include
+LOCAL_STATIC_LIBRARIES += libselinux
+endif
+
+include $(BUILD_EXECUTABLE)
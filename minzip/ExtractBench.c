@@ -0,0 +1,224 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Benchmark for mzExtractRecursive().
+ *
+ * Writes a synthetic archive of deflated entries spread over nested
+ * directories, then extracts it once on the calling thread and once
+ * with the worker pool, and reports the time each run took.
+ *
+ * usage: minzip_extract_bench <work-dir> [entries] [entry-size] [threads]
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+#define LOG_TAG "minzip_bench"
+#include "Zip.h"
+#include "DirUtil.h"
+#include "Log.h"
+
+static void put16(FILE *f, unsigned int v)
+{
+    fputc(v & 0xff, f);
+    fputc((v >> 8) & 0xff, f);
+}
+
+static void put32(FILE *f, unsigned long v)
+{
+    put16(f, v & 0xffff);
+    put16(f, (v >> 16) & 0xffff);
+}
+
+/* Fill buf with text that compresses roughly like typical system files.
+ */
+static void fillEntry(unsigned char *buf, size_t len, unsigned int seed)
+{
+    static const char words[] = "system framework lib app bin etc media "
+            "xbin vendor priv-app overlay fonts usr ";
+    size_t i;
+    for (i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = (seed >> 16) % 4 ? words[(seed >> 8) % (sizeof(words) - 1)]
+                                  : (unsigned char)(seed >> 20);
+    }
+}
+
+static bool writeSyntheticZip(const char *path, int numEntries, size_t entrySize)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        LOGE("Can't create \"%s\": %s\n", path, strerror(errno));
+        return false;
+    }
+
+    unsigned char *data = malloc(entrySize);
+    uLong bound = compressBound(entrySize);
+    unsigned char *comp = malloc(bound);
+    unsigned long *offsets = malloc(numEntries * sizeof(unsigned long));
+    unsigned long *crcs = malloc(numEntries * sizeof(unsigned long));
+    unsigned long *compLens = malloc(numEntries * sizeof(unsigned long));
+    char name[64];
+    int i;
+
+    for (i = 0; i < numEntries; i++) {
+        snprintf(name, sizeof(name), "system/d%02d/s%02d/f%05d",
+                i / 100, (i / 10) % 10, i);
+        fillEntry(data, entrySize, i);
+
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                8, Z_DEFAULT_STRATEGY);
+        zs.next_in = data;
+        zs.avail_in = entrySize;
+        zs.next_out = comp;
+        zs.avail_out = bound;
+        deflate(&zs, Z_FINISH);
+        compLens[i] = zs.total_out;
+        deflateEnd(&zs);
+
+        crcs[i] = crc32(0, data, entrySize);
+        offsets[i] = ftell(f);
+
+        put32(f, 0x04034b50);       // local file header
+        put16(f, 20);
+        put16(f, 0);
+        put16(f, 8);                // deflated
+        put16(f, 0);
+        put16(f, 0);
+        put32(f, crcs[i]);
+        put32(f, compLens[i]);
+        put32(f, entrySize);
+        put16(f, strlen(name));
+        put16(f, 0);
+        fwrite(name, 1, strlen(name), f);
+        fwrite(comp, 1, compLens[i], f);
+    }
+
+    unsigned long cdStart = ftell(f);
+    for (i = 0; i < numEntries; i++) {
+        snprintf(name, sizeof(name), "system/d%02d/s%02d/f%05d",
+                i / 100, (i / 10) % 10, i);
+        put32(f, 0x02014b50);       // central directory entry
+        put16(f, 0x0314);           // made by unix
+        put16(f, 20);
+        put16(f, 0);
+        put16(f, 8);
+        put16(f, 0);
+        put16(f, 0);
+        put32(f, crcs[i]);
+        put32(f, compLens[i]);
+        put32(f, entrySize);
+        put16(f, strlen(name));
+        put16(f, 0);
+        put16(f, 0);
+        put16(f, 0);
+        put16(f, 0);
+        put32(f, 0100644UL << 16);
+        put32(f, offsets[i]);
+        fwrite(name, 1, strlen(name), f);
+    }
+    unsigned long cdEnd = ftell(f);
+
+    put32(f, 0x06054b50);           // end of central directory
+    put16(f, 0);
+    put16(f, 0);
+    put16(f, numEntries);
+    put16(f, numEntries);
+    put32(f, cdEnd - cdStart);
+    put32(f, cdStart);
+    put16(f, 0);
+
+    free(data);
+    free(comp);
+    free(offsets);
+    free(crcs);
+    free(compLens);
+    return fclose(f) == 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool runExtract(const ZipArchive *za, const char *workDir,
+        int threads, int numEntries, size_t entrySize)
+{
+    char target[PATH_MAX];
+    snprintf(target, sizeof(target), "%s/out-%d", workDir, threads);
+    dirUnlinkHierarchy(target);
+    if (mkdir(target, 0755) != 0) {
+        LOGE("Can't create \"%s\": %s\n", target, strerror(errno));
+        return false;
+    }
+
+    struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
+    mzSetExtractThreads(threads);
+    sync();
+
+    double start = now();
+    bool ok = mzExtractRecursive(za, "system", target, &timestamp,
+            NULL, NULL, NULL);
+    sync();
+    double elapsed = now() - start;
+
+    printf("threads=%-2d %s: %d entries in %.3f s (%.0f entries/s, %.2f MB/s)\n",
+            threads, ok ? "ok" : "FAILED", numEntries, elapsed,
+            numEntries / elapsed,
+            (double)numEntries * entrySize / elapsed / (1024.0 * 1024.0));
+    dirUnlinkHierarchy(target);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("usage: %s <work-dir> [entries] [entry-size] [threads]\n",
+                argv[0]);
+        return 2;
+    }
+    const char *workDir = argv[1];
+    int numEntries = (argc > 2) ? atoi(argv[2]) : 1000;
+    size_t entrySize = (argc > 3) ? (size_t)atol(argv[3]) : 64 * 1024;
+    int threads = (argc > 4) ? atoi(argv[4]) : 0;
+    if (numEntries < 1 || numEntries > 65535) {
+        printf("entries must be between 1 and 65535\n");
+        return 2;
+    }
+
+    char zipPath[PATH_MAX];
+    snprintf(zipPath, sizeof(zipPath), "%s/bench.zip", workDir);
+    if (!writeSyntheticZip(zipPath, numEntries, entrySize)) {
+        return 1;
+    }
+
+    MemMapping map;
+    if (sysMapFile(zipPath, &map) != 0) {
+        LOGE("Can't map \"%s\"\n", zipPath);
+        return 1;
+    }
+    ZipArchive za;
+    if (mzOpenZipArchive(map.addr, map.length, &za) != 0) {
+        LOGE("Can't open \"%s\"\n", zipPath);
+        sysReleaseMap(&map);
+        return 1;
+    }
+
+    bool ok = runExtract(&za, workDir, 1, numEntries, entrySize) &&
+              runExtract(&za, workDir, threads, numEntries, entrySize);
+
+    mzCloseZipArchive(&za);
+    sysReleaseMap(&map);
+    unlink(zipPath);
+    return ok ? 0 : 1;
+}
@@ -9,9 +9,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <time.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
@@ -177,6 +180,29 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Find the EOCD.  We'll find it immediately unless they have a file
+ * comment.
+ *
+ * Returns NULL if there is none.
+ */
+static const unsigned char* findEocd(const unsigned char* addr,
+        size_t length)
+{
+    const unsigned char* ptr;
+
+    if (length < ENDHDR)
+        return NULL;
+
+    ptr = addr + length - ENDHDR;
+    while (ptr >= addr) {
+        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
+            return ptr;
+        ptr--;
+    }
+    return NULL;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
@@ -205,18 +231,8 @@ static bool parseZipArchive(ZipArchive* pArchive)
         goto bail;
     }
 
-    /*
-     * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
-     */
-    ptr = pArchive->addr + pArchive->length - ENDHDR;
-
-    while (ptr >= (const unsigned char*) pArchive->addr) {
-        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
-            break;
-        ptr--;
-    }
-    if (ptr < (const unsigned char*) pArchive->addr) {
+    ptr = findEocd(pArchive->addr, pArchive->length);
+    if (ptr == NULL) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
@@ -806,6 +822,141 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* Upper bound on the default number of extraction threads.  Beyond
+ * this the target storage, not inflate, is the bottleneck.
+ */
+#define UNZIP_MAX_THREADS 4
+
+static int gExtractThreads = 0;
+
+void mzSetExtractThreads(int threads)
+{
+    gExtractThreads = threads;
+}
+
+static int extractThreadCount(int numFiles)
+{
+    int threads = gExtractThreads;
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > UNZIP_MAX_THREADS) ? UNZIP_MAX_THREADS : (int)cpus;
+    }
+    if (threads > numFiles) {
+        threads = numFiles;
+    }
+    return (threads < 1) ? 1 : threads;
+}
+
+/* One entry selected for extraction by mzExtractRecursive().
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    bool isDir;
+    int status;         // 0 pending, 1 extracted, -1 failed
+} MzExtractItem;
+
+/* State shared between mzExtractRecursive() and its worker threads.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    struct selabel_handle *sehnd;
+    MzExtractItem *items;
+    int numItems;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t selabelLock;    // selabel_lookup() is not thread-safe
+    int nextItem;                   // next item a worker may claim
+    bool abort;
+} MzExtractJob;
+
+/* Create, fill in and timestamp the target file of one item.  The
+ * containing directory must already exist.  Safe to call from several
+ * threads at once; fscreate contexts are per-thread.
+ */
+static bool extractItem(MzExtractJob *job, MzExtractItem *item)
+{
+    const ZipEntry *pEntry = item->pEntry;
+    const char *targetFile = item->targetFile;
+
+    /*
+     * The entry is a regular file or a symlink. Open the target for writing.
+     *
+     * TODO: This behavior for symlinks seems rather bizarre. For a
+     * symlink foo/bar/baz -> foo/tar/taz, we will create a file called
+     * "foo/bar/baz" whose contents are the literal "foo/tar/taz". We
+     * warn about this for now and preserve older behavior.
+     */
+    if (mzIsZipEntrySymlink(pEntry)) {
+        LOGE("Symlink entry \"%.*s\" will be output as a regular file.",
+             pEntry->fileNameLen, pEntry->fileName);
+    }
+
+    char *secontext = NULL;
+
+    if (job->sehnd) {
+        pthread_mutex_lock(&job->selabelLock);
+        selabel_lookup(job->sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+        pthread_mutex_unlock(&job->selabelLock);
+        setfscreatecon(secontext);
+    }
+
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(job->pArchive, pEntry, fd);
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (job->timestamp != NULL && utime(targetFile, job->timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGV("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+static void *extractWorker(void *cookie)
+{
+    MzExtractJob *job = (MzExtractJob *)cookie;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->abort && job->nextItem < job->numItems) {
+        MzExtractItem *item = &job->items[job->nextItem++];
+        if (item->isDir) {
+            continue;
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        bool ok = extractItem(job, item);
+
+        pthread_mutex_lock(&job->lock);
+        item->status = ok ? 1 : -1;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -824,6 +975,11 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
  *     /tmp/two
  *     /tmp/d/three
  *
+ * All containing directories are created first, in archive order, on
+ * the calling thread.  The files themselves are then extracted by a
+ * pool of worker threads, while the calling thread reports each entry
+ * to the callback in archive order as it completes.
+ *
  * Returns true on success, false on failure.
  */
 bool mzExtractRecursive(const ZipArchive *pArchive,
@@ -876,7 +1032,21 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
+    MzExtractJob job;
+    memset(&job, 0, sizeof(job));
+    job.pArchive = pArchive;
+    job.timestamp = timestamp;
+    job.sehnd = sehnd;
+    job.items = (MzExtractItem *)calloc(pArchive->numEntries + 1,
+            sizeof(MzExtractItem));
+    if (job.items == NULL) {
+        LOGE("Can't allocate extraction list for %u entries\n",
+                pArchive->numEntries);
+        free(zpath);
+        return false;
+    }
+
+    /* Walk through the entries and select anything whose path begins
      * with zpath.
     //TODO: since the entries are sorted, binary search for the first match
     //      and stop after the first non-match.
@@ -884,7 +1054,8 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     unsigned int i;
     bool seenMatch = false;
     int ok = true;
-    int extractCount = 0;
+    int numFiles = 0;
+    char *lastParent = NULL;
     for (i = 0; i < pArchive->numEntries; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
         if (pEntry->fileNameLen < zipDirLen) {
@@ -932,88 +1103,128 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             break;
         }
 
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
+        MzExtractItem *item = &job.items[job.numItems];
+        item->pEntry = pEntry;
+        item->targetFile = strdup(targetFile);
+        if (item->targetFile == NULL) {
+            LOGE("Can't allocate target path for \"%s\"\n", targetFile);
+            ok = false;
+            break;
+        }
+        job.numItems++;
+
         /*
-         * Create the file or directory. We ignore directory entries
-         * because we recursively create paths to each file entry we encounter
-         * in the zip archive anyway.
+         * Create the containing directory of files now, so that no
+         * worker ever races another to create a shared parent. We ignore
+         * directory entries because we recursively create paths to each
+         * file entry we encounter in the zip archive anyway.
          *
          * NOTE: A "directory entry" in a zip archive is just a zero length
          * entry that ends in a "/". They're not mandatory and many tools get
          * rid of them. We need to process them only if we want to preserve
          * empty directories from the archive.
          */
-        if (pEntry->fileName[pEntry->fileNameLen-1] != '/') {
-            /* This is not a directory.  First, make sure that
-             * the containing directory exists.
-             */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
-            if (ret != 0) {
-                LOGE("Can't create containing directory for \"%s\": %s\n",
-                        targetFile, strerror(errno));
-                ok = false;
-                break;
-            }
+        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+            item->isDir = true;
+            item->status = 1;
+            continue;
+        }
 
-            /*
-             * The entry is a regular file or a symlink. Open the target for writing.
-             *
-             * TODO: This behavior for symlinks seems rather bizarre. For a
-             * symlink foo/bar/baz -> foo/tar/taz, we will create a file called
-             * "foo/bar/baz" whose contents are the literal "foo/tar/taz". We
-             * warn about this for now and preserve older behavior.
-             */
-            if (mzIsZipEntrySymlink(pEntry)) {
-                LOGE("Symlink entry \"%.*s\" will be output as a regular file.",
-                     pEntry->fileNameLen, pEntry->fileName);
-            }
+        /* Entries are sorted, so consecutive files usually share a
+         * parent that has already been created.
+         */
+        const char *slash = strrchr(targetFile, '/');
+        size_t parentLen = slash - targetFile;
+        if (lastParent != NULL && strlen(lastParent) == parentLen &&
+                strncmp(lastParent, targetFile, parentLen) == 0) {
+            numFiles++;
+            continue;
+        }
 
-            char *secontext = NULL;
+        int ret = dirCreateHierarchy(
+                targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
+        if (ret != 0) {
+            LOGE("Can't create containing directory for \"%s\": %s\n",
+                    targetFile, strerror(errno));
+            ok = false;
+            break;
+        }
+        free(lastParent);
+        lastParent = strndup(targetFile, parentLen);
+        numFiles++;
+    }
+    free(lastParent);
 
-            if (sehnd) {
-                selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                setfscreatecon(secontext);
+    int extractCount = 0;
+    if (ok) {
+        pthread_mutex_init(&job.lock, NULL);
+        pthread_cond_init(&job.cond, NULL);
+        pthread_mutex_init(&job.selabelLock, NULL);
+
+        int numThreads = extractThreadCount(numFiles);
+        pthread_t *threads = NULL;
+        int started = 0;
+        if (numThreads > 1) {
+            threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+            while (threads != NULL && started < numThreads) {
+                int err = pthread_create(&threads[started], NULL,
+                        extractWorker, &job);
+                if (err != 0) {
+                    LOGW("Can't start extraction thread %d: %s\n",
+                            started, strerror(err));
+                    break;
+                }
+                started++;
             }
+        }
 
-            int fd = creat(targetFile, UNZIP_FILEMODE);
-
-            if (secontext) {
-                freecon(secontext);
-                setfscreatecon(NULL);
+        /* Report entries in archive order as they finish.  Without any
+         * workers, extract each one here instead.
+         */
+        int n;
+        for (n = 0; n < job.numItems; n++) {
+            MzExtractItem *item = &job.items[n];
+            if (started > 0) {
+                pthread_mutex_lock(&job.lock);
+                while (item->status == 0) {
+                    pthread_cond_wait(&job.cond, &job.lock);
+                }
+                pthread_mutex_unlock(&job.lock);
+            } else if (!item->isDir) {
+                item->status = extractItem(&job, item) ? 1 : -1;
             }
 
-            if (fd < 0) {
-                LOGE("Can't create target file \"%s\": %s\n",
-                        targetFile, strerror(errno));
+            if (item->status < 0) {
                 ok = false;
                 break;
             }
-
-            bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-            close(fd);
-            if (!ok) {
-                LOGE("Error extracting \"%s\"\n", targetFile);
-                ok = false;
-                break;
+            if (!item->isDir) {
+                ++extractCount;
             }
+            if (callback != NULL) callback(item->targetFile, cookie);
+        }
 
-            if (timestamp != NULL && utime(targetFile, timestamp)) {
-                LOGE("Error touching \"%s\"\n", targetFile);
-                ok = false;
-                break;
+        if (started > 0) {
+            pthread_mutex_lock(&job.lock);
+            job.abort = true;
+            pthread_mutex_unlock(&job.lock);
+            while (started > 0) {
+                pthread_join(threads[--started], NULL);
             }
-
-            LOGV("Extracted file \"%s\"\n", targetFile);
-            ++extractCount;
         }
+        free(threads);
 
-        if (callback != NULL) callback(targetFile, cookie);
+        pthread_mutex_destroy(&job.selabelLock);
+        pthread_cond_destroy(&job.cond);
+        pthread_mutex_destroy(&job.lock);
     }
 
     LOGD("Extracted %d file(s)\n", extractCount);
 
+    for (i = 0; i < (unsigned int)job.numItems; i++) {
+        free(job.items[i].targetFile);
+    }
+    free(job.items);
     free(helper.buf);
     free(zpath);
 
@@ -1045,3 +1256,322 @@ int read_data(ZipArchive *zip, const ZipEntry *entry,char** ppData, int* pLength
     }
     return 0;
 }
+
+/*
+ * Convert "when" to an MS-DOS date and time, as stored in the headers.
+ */
+static unsigned int dosTime(time_t when)
+{
+    struct tm tm;
+
+    localtime_r(&when, &tm);
+    if (tm.tm_year < 80)
+        return (1 << 21) | (1 << 16);   // 1980-01-01 00:00:00
+    return ((tm.tm_year - 80) << 25) | ((tm.tm_mon + 1) << 21) |
+        (tm.tm_mday << 16) | (tm.tm_hour << 11) | (tm.tm_min << 5) |
+        (tm.tm_sec >> 1);
+}
+
+/*
+ * Raw-deflate "len" bytes of "data" into a malloc'd buffer.
+ *
+ * Returns NULL if that fails or doesn't make the data any smaller, in
+ * which case the caller stores it as is.
+ */
+static unsigned char* deflateData(const unsigned char* data, size_t len,
+        size_t* pCompLen)
+{
+    z_stream zstream;
+    unsigned char* buf;
+    uLong bound;
+    int zerr;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zerr = deflateInit2(&zstream, Z_BEST_COMPRESSION, Z_DEFLATED,
+            -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (zerr != Z_OK) {
+        LOGW("Installation of zlib deflate failed (zerr=%d)\n", zerr);
+        return NULL;
+    }
+
+    bound = deflateBound(&zstream, len);
+    buf = malloc(bound);
+    if (buf != NULL) {
+        zstream.next_in = (Bytef*) data;
+        zstream.avail_in = len;
+        zstream.next_out = buf;
+        zstream.avail_out = bound;
+        zerr = deflate(&zstream, Z_FINISH);
+        if (zerr == Z_STREAM_END && zstream.total_out < len) {
+            *pCompLen = zstream.total_out;
+        } else {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    deflateEnd(&zstream);
+    return buf;
+}
+
+static int pwriteFully(int fd, const unsigned char* buf, size_t len,
+        off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY(pwrite(fd, buf, len, offset));
+        if (n < 0)
+            return errno;
+        if (n == 0)
+            return EIO;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * State of one overlay entry while mzAppendZipEntries() packs it.
+ */
+typedef struct {
+    size_t nameLen;
+    const unsigned char* data;  // what is stored in the archive
+    unsigned char* buf;         // deflated copy of the contents, or NULL
+    size_t len;
+    int compression;
+    unsigned long crc;
+    const unsigned char* oldCen; // central dir record it replaces, or NULL
+} PackedEntry;
+
+/*
+ * Append the entries to the Zip archive at "path", followed by a new
+ * central directory and end-of-central-directory record.
+ *
+ * The new central directory lists the archive's entries in their
+ * original order, minus those with the name of an overlay entry, plus
+ * the overlay entries.  Readers locate the central directory from the
+ * end of the file, so they see the replaced entries while the existing
+ * local headers and data stay where they are and are never rewritten.
+ * Truncating the file back to "*pOrigLength" restores the original
+ * archive byte for byte.
+ *
+ * Returns 0 on success, or an errno value on failure, in which case the
+ * file is left as it was.
+ */
+int mzAppendZipEntries(const char* path, const ZipOverlayEntry* entries,
+        int count, off_t* pOrigLength)
+{
+    PackedEntry* packed = NULL;
+    unsigned char* addr = MAP_FAILED;
+    unsigned char* dataBuf = NULL;
+    unsigned char* cdBuf = NULL;
+    const unsigned char* eocd;
+    const unsigned char* ptr;
+    unsigned int numEntries, cdOffset, cdSize, total, i;
+    unsigned int modTime = dosTime(time(NULL));
+    size_t length, dataLen = 0, dataPos = 0, cdLen = 0, newCdLen = 0;
+    struct stat st;
+    int fd, j, err;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        err = errno;
+        LOGE("Can't open %s: %s\n", path, strerror(err));
+        return err;
+    }
+    if (fstat(fd, &st) < 0) {
+        err = errno;
+        LOGE("Can't stat %s: %s\n", path, strerror(err));
+        goto bail;
+    }
+    length = st.st_size;
+    if ((off_t) length != st.st_size || length < ENDHDR) {
+        err = EINVAL;
+        LOGE("Bad size of %s (%lld)\n", path, (long long) st.st_size);
+        goto bail;
+    }
+    addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        err = errno;
+        LOGE("Can't map %s: %s\n", path, strerror(err));
+        goto bail;
+    }
+
+    err = EINVAL;
+    eocd = findEocd(addr, length);
+    if (eocd == NULL) {
+        LOGE("Could not find end-of-central-directory in %s\n", path);
+        goto bail;
+    }
+    numEntries = get2LE(eocd + ENDSUB);
+    cdOffset = get4LE(eocd + ENDOFF);
+    cdSize = get4LE(eocd + ENDSIZ);
+    if (cdOffset > (size_t) (eocd - addr) ||
+            cdSize > (size_t) (eocd - addr) - cdOffset) {
+        LOGE("Invalid central directory offset=%u size=%u in %s\n",
+                cdOffset, cdSize, path);
+        goto bail;
+    }
+
+    /*
+     * Compress the overlay entries first, so the buffers for the new
+     * records can be sized up front.
+     */
+    err = ENOMEM;
+    packed = (PackedEntry*) calloc(count, sizeof(PackedEntry));
+    if (packed == NULL)
+        goto bail;
+    for (j = 0; j < count; j++) {
+        PackedEntry* p = &packed[j];
+        size_t len = entries[j].dataLen;
+
+        p->nameLen = strlen(entries[j].fileName);
+        if (p->nameLen == 0 || p->nameLen > 0xffff || len > 0xffffffffUL) {
+            err = EINVAL;
+            LOGE("Can't store '%s' (%zu bytes) in a Zip archive\n",
+                    entries[j].fileName, len);
+            goto bail;
+        }
+        p->crc = crc32(crc32(0L, Z_NULL, 0), entries[j].data, len);
+        p->buf = deflateData(entries[j].data, len, &p->len);
+        if (p->buf != NULL) {
+            p->data = p->buf;
+            p->compression = DEFLATED;
+        } else {
+            p->data = entries[j].data;
+            p->len = len;
+            p->compression = STORED;
+        }
+        dataLen += LOCHDR + p->nameLen + p->len;
+        newCdLen += CENHDR + p->nameLen;
+    }
+
+    dataBuf = malloc(dataLen);
+    cdBuf = malloc(cdSize + newCdLen + ENDHDR);
+    if (dataBuf == NULL || cdBuf == NULL)
+        goto bail;
+
+    /*
+     * Keep the records of the entries that aren't replaced, as they are.
+     */
+    err = EINVAL;
+    total = 0;
+    ptr = addr + cdOffset;
+    for (i = 0; i < numEntries; i++) {
+        size_t nameLen, recLen;
+
+        if ((size_t) (addr + cdOffset + cdSize - ptr) < CENHDR ||
+                get4LE(ptr) != CENSIG) {
+            LOGE("Missed a central dir sig (at %u) in %s\n", i, path);
+            goto bail;
+        }
+        nameLen = get2LE(ptr + CENNAM);
+        recLen = CENHDR + nameLen + get2LE(ptr + CENEXT) +
+            get2LE(ptr + CENCOM);
+        if ((size_t) (addr + cdOffset + cdSize - ptr) < recLen) {
+            LOGE("Central dir record ran off the end (at %u) in %s\n",
+                    i, path);
+            goto bail;
+        }
+
+        for (j = 0; j < count; j++) {
+            if (packed[j].nameLen == nameLen &&
+                    memcmp(entries[j].fileName, ptr + CENHDR, nameLen) == 0)
+                break;
+        }
+        if (j < count) {
+            packed[j].oldCen = ptr;
+        } else {
+            memcpy(cdBuf + cdLen, ptr, recLen);
+            cdLen += recLen;
+            total++;
+        }
+        ptr += recLen;
+    }
+
+    err = EFBIG;
+    if (total + count > 0xffff || length + dataLen + cdLen + newCdLen >
+            0xffffffffUL) {
+        LOGE("%s would outgrow the Zip format\n", path);
+        goto bail;
+    }
+
+    for (j = 0; j < count; j++) {
+        const PackedEntry* p = &packed[j];
+        unsigned char* loc = dataBuf + dataPos;
+        unsigned char* cen = cdBuf + cdLen;
+
+        set4LE(loc, LOCSIG);
+        set2LE(loc + LOCVER, 20);
+        set2LE(loc + LOCFLG, 0);
+        set2LE(loc + LOCHOW, p->compression);
+        set4LE(loc + LOCTIM, modTime);
+        set4LE(loc + LOCCRC, p->crc);
+        set4LE(loc + LOCSIZ, p->len);
+        set4LE(loc + LOCLEN, entries[j].dataLen);
+        set2LE(loc + LOCNAM, p->nameLen);
+        set2LE(loc + LOCEXT, 0);
+        memcpy(loc + LOCHDR, entries[j].fileName, p->nameLen);
+        memcpy(loc + LOCHDR + p->nameLen, p->data, p->len);
+
+        /* A replaced entry keeps its mode. */
+        memset(cen, 0, CENHDR);
+        set4LE(cen, CENSIG);
+        if (p->oldCen != NULL) {
+            set2LE(cen + CENVEM, get2LE(p->oldCen + CENVEM));
+            set4LE(cen + CENATX, get4LE(p->oldCen + CENATX));
+        } else {
+            mode_t mode = entries[j].mode ? entries[j].mode : 0644;
+            set2LE(cen + CENVEM, CENVEM_UNIX | 20);
+            set4LE(cen + CENATX, (S_IFREG | (mode & 07777)) << 16);
+        }
+        set2LE(cen + CENVER, 20);
+        set2LE(cen + CENHOW, p->compression);
+        set4LE(cen + CENTIM, modTime);
+        set4LE(cen + CENCRC, p->crc);
+        set4LE(cen + CENSIZ, p->len);
+        set4LE(cen + CENLEN, entries[j].dataLen);
+        set2LE(cen + CENNAM, p->nameLen);
+        set4LE(cen + CENOFF, length + dataPos);
+        memcpy(cen + CENHDR, entries[j].fileName, p->nameLen);
+
+        dataPos += LOCHDR + p->nameLen + p->len;
+        cdLen += CENHDR + p->nameLen;
+        total++;
+    }
+
+    memset(cdBuf + cdLen, 0, ENDHDR);
+    set4LE(cdBuf + cdLen, ENDSIG);
+    set2LE(cdBuf + cdLen + ENDSUB, total);
+    set2LE(cdBuf + cdLen + ENDTOT, total);
+    set4LE(cdBuf + cdLen + ENDSIZ, cdLen);
+    set4LE(cdBuf + cdLen + ENDOFF, length + dataLen);
+
+    err = pwriteFully(fd, dataBuf, dataLen, length);
+    if (err == 0)
+        err = pwriteFully(fd, cdBuf, cdLen + ENDHDR, length + dataLen);
+    if (err == 0 && fsync(fd) < 0)
+        err = errno;
+    if (err != 0) {
+        LOGE("Can't append to %s: %s\n", path, strerror(err));
+        if (ftruncate(fd, length) < 0)
+            LOGE("Can't truncate %s back: %s\n", path, strerror(errno));
+        goto bail;
+    }
+
+    LOGI("Appended %d entries to %s (%zu bytes)\n", count, path,
+            dataLen + cdLen + ENDHDR);
+    *pOrigLength = length;
+
+bail:
+    if (packed != NULL) {
+        for (j = 0; j < count; j++)
+            free(packed[j].buf);
+        free(packed);
+    }
+    free(dataBuf);
+    free(cdBuf);
+    if (addr != MAP_FAILED)
+        munmap(addr, length);
+    close(fd);
+    return err;
+}
@@ -91,6 +91,12 @@ INLINE long mzGetZipEntryOffset(const ZipEntry* pEntry) {
 INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
+INLINE long mzGetZipEntryCompLen(const ZipEntry* pEntry) {
+    return pEntry->compLen;
+}
+INLINE bool mzIsZipEntryDeflated(const ZipEntry* pEntry) {
+    return pEntry->compression == 8;    // DEFLATED
+}
 
 /*
  * Type definition for the callback function used by
@@ -155,7 +161,11 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
- * If callback is non-NULL, it will be invoked with each unpacked file.
+ * If callback is non-NULL, it will be invoked with each unpacked file,
+ * in archive order, on the calling thread.
+ *
+ * Files are extracted on a pool of worker threads; see
+ * mzSetExtractThreads().
  *
  * Returns true on success, false on failure.
  */
@@ -165,8 +175,37 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         void (*callback)(const char *fn, void*), void *cookie,
         struct selabel_handle *sehnd);
 
+/*
+ * Set the number of threads mzExtractRecursive() extracts files with.
+ * 0 (the default) picks one per online CPU, up to a small limit; 1
+ * extracts everything on the calling thread.
+ */
+void mzSetExtractThreads(int threads);
+
 int read_data(ZipArchive *zip, const ZipEntry *entry, char** ppData, int* pLength);
 
+/*
+ * One entry to add to, or replace in, an existing archive.
+ */
+typedef struct {
+    const char* fileName;
+    const unsigned char* data;
+    size_t dataLen;
+    mode_t mode;                // for new entries, 0 means 0644
+} ZipOverlayEntry;
+
+/*
+ * Add "count" entries to the Zip archive at "path", replacing those with
+ * the same names, without rewriting any of the existing data: the entries
+ * and a new central directory are appended to the file.
+ *
+ * On success, returns 0 and stores the original length of the file in
+ * "pOrigLength"; truncating the file to it restores the original archive.
+ * Returns an errno value on failure and leaves the file as it was.
+ */
+int mzAppendZipEntries(const char* path, const ZipOverlayEntry* entries,
+        int count, off_t* pOrigLength);
+
 #ifdef __cplusplus
 }
 #endif
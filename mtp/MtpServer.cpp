@@ -96,6 +96,12 @@ static const MtpEventCode kSupportedEventCodes[] = {
 	MTP_EVENT_OBJECT_PROP_CHANGED,
 };
 
+void (*MtpServer::sStorageChanged)(void) = NULL;
+
+void MtpServer::setStorageChangedCallback(void (*callback)(void)) {
+	sStorageChanged = callback;
+}
+
 MtpServer::MtpServer(MtpDatabase* database, bool ptp,
 					int fileGroup, int filePerm, int directoryPerm)
 	:	mDatabase(database),
@@ -485,6 +491,19 @@ bool MtpServer::handleRequest() {
 
 		if (response == MTP_RESPONSE_TRANSACTION_CANCELLED)
 			return false;
+		if (sStorageChanged && response == MTP_RESPONSE_OK) {
+			switch (operation) {
+				case MTP_OPERATION_SEND_OBJECT:
+				case MTP_OPERATION_DELETE_OBJECT:
+				case MTP_OPERATION_SEND_PARTIAL_OBJECT:
+				case MTP_OPERATION_TRUNCATE_OBJECT:
+				case MTP_OPERATION_END_EDIT_OBJECT:
+					sStorageChanged();
+					break;
+				default:
+					break;
+			}
+		}
 		mResponse.setResponseCode(response);
 		return true;
 }
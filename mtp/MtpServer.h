@@ -108,7 +108,12 @@ public:
     void                sendObjectRemoved(MtpObjectHandle handle);
     void                sendObjectUpdated(MtpObjectHandle handle);
 
+    // called after an operation that wrote to or deleted from storage
+    static void         setStorageChangedCallback(void (*callback)(void));
+
 private:
+    static void         (*sStorageChanged)(void);
+
     void                sendStoreAdded(MtpStorageID id);
     void                sendStoreRemoved(MtpStorageID id);
     void                sendEvent(MtpEventCode code, uint32_t param1);
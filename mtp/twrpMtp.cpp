@@ -112,6 +112,10 @@ pid_t twrpMtp::forkserver(int mtppipe[2]) {
 	return 0;
 }
 
+void twrpMtp::setStorageChangedCallback(void (*callback)(void)) {
+	MtpServer::setStorageChangedCallback(callback);
+}
+
 void twrpMtp::addStorage(std::string display, std::string path, int mtpid, uint64_t maxFileSize) {
 	s = new storage;
 	s->display = display;
@@ -37,6 +37,7 @@ class twrpMtp {
 		pthread_t threadserver(void);
 		pid_t forkserver(int mtppipe[2]);
 		void addStorage(std::string display, std::string path, int mtpid, uint64_t maxFileSize);
+		void setStorageChangedCallback(void (*callback)(void));
 	private:
 		int start(void);
 		typedef int (twrpMtp::*ThreadPtr)(void);
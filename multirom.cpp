@@ -7,6 +7,12 @@
 #include <linux/xattr.h>
 #include <sys/xattr.h>
 #include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <linux/loop.h>
 
 // clone libbootimg to /system/extras/ from
 // https://github.com/Tasssadar/libbootimg.git
@@ -27,13 +33,22 @@
 #include "openrecoveryscript.hpp"
 #include "fuse_sideload.h"
 #include "multiromedify.h"
+#include "multiromramdisk.h"
 
 extern "C" {
 #include "twcommon.h"
 #include "digest/md5.h"
 #include "multirom_hooks.h"
+#ifdef USE_EXT4
+#include "make_ext4fs.h"
+#endif
 }
 
+#ifdef HAVE_SELINUX
+#include <selinux/label.h>
+extern struct selabel_handle *selinux_handle;
+#endif
+
 #include "libblkid/include/blkid.h"
 #include "cp_xattrs/libcp_xattrs.h"
 
@@ -853,38 +868,42 @@ bool MultiROM::createFakeSystemImg()
 		size = sys->GetSizeTotal();
 	size = size/1024/1024 + 32;
 
-	if(!createImage(sysimg, "system", size))
+	// Thrown away after the install, so it is left sparse
+	if(!createImage(sysimg, "system", size, false))
 	{
 		LOGERR("Failed to create system.img!");
 		return false;
 	}
 
+	std::string img = sysimg + "/system.img";
 	std::string loop_device;
-	if(TWFunc::Exec_Cmd("losetup -f", loop_device) < 0)
+	if(!attachLoop(img, loop_device))
 	{
-		system_args("rm \"%s/system.img\"", sysimg.c_str());
-		LOGERR("Failed to find free loop device\n");
+		unlink(img.c_str());
+		LOGERR("Failed to setup loop device!\n");
 		return false;
 	}
 
-	TWFunc::trim(loop_device);
-
-	if(system_args("losetup \"%s\" \"%s/system.img\"", loop_device.c_str(), sysimg.c_str()) != 0)
+	std::string orig = sys->Actual_Block_Device + "-orig";
+	if(rename(sys->Actual_Block_Device.c_str(), orig.c_str()) < 0)
 	{
-		system_args("rm \"%s/system.img\"", sysimg.c_str());
-		LOGERR("Failed to setup loop device!\n");
+		LOGERR("Failed to fake system device: %s\n", strerror(errno));
+		detachLoop(loop_device);
+		unlink(img.c_str());
 		return false;
 	}
 
-	if(system_args("mv \"%s\" \"%s-orig\" && ln -s \"%s\" \"%s\"",
-		sys->Actual_Block_Device.c_str(), sys->Actual_Block_Device.c_str(), loop_device.c_str(), sys->Actual_Block_Device.c_str()) != 0)
+	if(symlink(loop_device.c_str(), sys->Actual_Block_Device.c_str()) < 0)
 	{
-		system_args("losetup -d \"%s\"; rm -f \"%s/system.img\"", loop_device.c_str(), sysimg.c_str());
-		LOGERR("Failed to fake system device!\n");
+		LOGERR("Failed to fake system device: %s\n", strerror(errno));
+		rename(orig.c_str(), sys->Actual_Block_Device.c_str());
+		detachLoop(loop_device);
+		unlink(img.c_str());
 		return false;
 	}
 
-	system_args("rm \"%s/system.img\"", sysimg.c_str());
+	// the loop device keeps the image alive until it is detached
+	unlink(img.c_str());
 	system_args("echo \"%s\" > /tmp/mrom_fakesyspart", sys->Actual_Block_Device.c_str());
 	return true;
 }
@@ -898,9 +917,9 @@ bool MultiROM::flashZip(std::string rom, std::string file)
 	int verify_status = 0;
 	int wipe_cache = 0;
 	int sideloaded = 0;
-	bool restore_script = false;
+	off_t restore_size = -1;
 	EdifyHacker hacker;
-	std::string boot, sysimg, loop_device;
+	std::string boot, sysimg, loop_device, orig_file;
 	TWPartition *data, *sys;
 
 	gui_print("Flashing ZIP file %s\n", file.c_str());
@@ -910,9 +929,11 @@ bool MultiROM::flashZip(std::string rom, std::string file)
 		return false;
 
 	gui_print("Preparing ZIP file...\n");
-	if(!prepareZIP(file, &hacker, restore_script))  // may change file var
+	if(!prepareZIP(file, &hacker, restore_size))  // may change file var
 		return false;
 
+	orig_file = file; // before translateToRealdata
+
 	if(!changeMounts(rom))
 	{
 		gui_print("Failed to change mountpoints!\n");
@@ -940,13 +961,6 @@ bool MultiROM::flashZip(std::string rom, std::string file)
 	status = TWinstall_zip(file.c_str(), &wipe_cache);
 	DataManager::SetValue(TW_SIGNED_ZIP_VERIFY_VAR, verify_status);
 
-	if(restore_script && hacker.restoreState() && hacker.writeToFile("/tmp/"MR_UPDATE_SCRIPT_NAME))
-	{
-		gui_print("Restoring original updater-script\n");
-		if(system_args("cd /tmp && zip \"%s\" %s", file.c_str(), MR_UPDATE_SCRIPT_NAME) != 0)
-			LOGERR("Failed to restore original updater-script, THIS ZIP IS NOW UNUSEABLE FOR NON-MULTIROM FLASHING\n");
-	}
-
 	system("rm -r "MR_UPDATE_SCRIPT_PATH);
 	if(file == "/tmp/mr_update.zip")
 		system("rm /tmp/mr_update.zip");
@@ -956,8 +970,8 @@ bool MultiROM::flashZip(std::string rom, std::string file)
 	else
 		gui_print("ZIP successfully installed\n");
 
-	if((hacker.getProcessFlags() & EDIFY_BLOCK_UPDATES) && system_args("busybox umount -d /tmpsystem") != 0)
-		system_args("dev=\"$(losetup | grep 'system\\.img' | grep -o '/.*:')\"; losetup -d \"${dev%%:}\"");
+	if(hacker.getProcessFlags() & EDIFY_BLOCK_UPDATES)
+		releaseFakeSystemImg();
 
 exit:
 	if(hacker.getProcessFlags() & EDIFY_BLOCK_UPDATES)
@@ -966,6 +980,8 @@ exit:
 	restoreBootPartition();
 	restoreMounts();
 
+	restoreZIP(orig_file, restore_size);
+
 	sideloaded = DataManager::GetIntValue("tw_mrom_sideloaded");
 	DataManager::SetValue("tw_mrom_sideloaded", 0);
 	if(sideloaded && file.compare(FUSE_SIDELOAD_HOST_PATHNAME) != 0)
@@ -977,7 +993,7 @@ bool MultiROM::flashORSZip(std::string file, int *wipe_cache)
 {
 	int status, verify_status = 0;
 	EdifyHacker hacker;
-	bool restore_script = false;
+	off_t restore_size = -1;
 
 	gui_print("Flashing ZIP file %s\n", file.c_str());
 
@@ -985,26 +1001,25 @@ bool MultiROM::flashORSZip(std::string file, int *wipe_cache)
 		return false;
 
 	gui_print("Preparing ZIP file...\n");
-	if(!prepareZIP(file, &hacker, restore_script)) // may change file var
+	if(!prepareZIP(file, &hacker, restore_size)) // may change file var
 		return false;
 
 	if(hacker.getProcessFlags() & EDIFY_BLOCK_UPDATES)
 	{
 		gui_print("ZIP uses block updates\n");
 		if(!createFakeSystemImg())
+		{
+			restoreZIP(file, restore_size);
+			system("rm -r "MR_UPDATE_SCRIPT_PATH);
 			return false;
+		}
 	}
 
 	DataManager::SetValue(TW_SIGNED_ZIP_VERIFY_VAR, 0);
 	status = TWinstall_zip(file.c_str(), wipe_cache);
 	DataManager::SetValue(TW_SIGNED_ZIP_VERIFY_VAR, verify_status);
 
-	if(restore_script && hacker.restoreState() && hacker.writeToFile("/tmp/"MR_UPDATE_SCRIPT_NAME))
-	{
-		gui_print("Restoring original updater-script\n");
-		if(system_args("cd /tmp && zip \"%s\" %s", file.c_str(), MR_UPDATE_SCRIPT_NAME) != 0)
-			LOGERR("Failed to restore original updater-script, THIS ZIP IS NOW UNUSEABLE FOR NON-MULTIROM FLASHING\n");
-	}
+	restoreZIP(file, restore_size);
 
 	system("rm -r "MR_UPDATE_SCRIPT_PATH);
 	if(file == "/tmp/mr_update.zip")
@@ -1017,8 +1032,7 @@ bool MultiROM::flashORSZip(std::string file, int *wipe_cache)
 
 	if(hacker.getProcessFlags() & EDIFY_BLOCK_UPDATES)
 	{
-		if(system_args("busybox umount -d /tmpsystem") != 0)
-			system_args("dev=\"$(losetup | grep 'system\\.img' | grep -o '/.*:')\"; losetup -d \"${dev%%:}\"");
+		releaseFakeSystemImg();
 		failsafeCheckPartition("/tmp/mrom_fakesyspart");
 	}
 
@@ -1046,7 +1060,7 @@ bool MultiROM::verifyZIP(const std::string& file, int &verify_status)
 	return true;
 }
 
-bool MultiROM::prepareZIP(std::string& file, EdifyHacker *hacker, bool& restore_script)
+bool MultiROM::prepareZIP(std::string& file, EdifyHacker *hacker, off_t& restore_size)
 {
 	bool res = false;
 
@@ -1105,7 +1119,6 @@ bool MultiROM::prepareZIP(std::string& file, EdifyHacker *hacker, bool& restore_
 	free(script_data);
 	script_data = NULL;
 
-	hacker->saveState();
 	hacker->replaceOffendings();
 
 	if(!hacker->writeToFile("/tmp/"MR_UPDATE_SCRIPT_NAME))
@@ -1125,38 +1138,63 @@ bool MultiROM::prepareZIP(std::string& file, EdifyHacker *hacker, bool& restore_
 
 	if(hacker->getProcessFlags() & EDIFY_CHANGED)
 	{
-		int64_t max_tmp_size = TWFunc::getFreeSpace("/tmp");
-		if(max_tmp_size < 0)
-			max_tmp_size = 450*1024*1024;
-		else
-			max_tmp_size *= 0.45;
+		// The new updater-script is appended in place and truncated back
+		// afterwards. The sideload ZIP and ZIPs on read-only storage are
+		// copied first instead.
+		bool in_place = (file.compare(FUSE_SIDELOAD_HOST_PATHNAME) != 0 && access(file.c_str(), W_OK) == 0);
+		if(!in_place)
+		{
+			int64_t max_tmp_size = TWFunc::getFreeSpace("/tmp");
+			if(max_tmp_size < 0)
+				max_tmp_size = 450*1024*1024;
+			else
+				max_tmp_size *= 0.45;
 
-		LOGINFO("ZIP size limit for /tmp: %.2f MB\n", double(max_tmp_size)/1024/1024);
+			LOGINFO("ZIP size limit for /tmp: %.2f MB\n", double(max_tmp_size)/1024/1024);
 
-		if(info.st_size < max_tmp_size)
-		{
-			gui_print("Copying ZIP to /tmp...\n");
-			system_args("cp \"%s\" /tmp/mr_update.zip", file.c_str());
-			file = "/tmp/mr_update.zip";
-		}
-		else if(file.compare(FUSE_SIDELOAD_HOST_PATHNAME) == 0)
-		{
-			std::string new_file = DataManager::GetStrValue("tw_storage_path") + "/sideload.zip";
-			gui_print("Copying ZIP to %s\n", new_file.c_str());
-			system_args("cp \"%s\" \"%s\"", file.c_str(), new_file.c_str());
-			file = new_file;
+			if(info.st_size < max_tmp_size)
+			{
+				gui_print("Copying ZIP to /tmp...\n");
+				TWFunc::copy_file(file, "/tmp/mr_update.zip", -1);
+				file = "/tmp/mr_update.zip";
+			}
+			else
+			{
+				std::string new_file = DataManager::GetStrValue("tw_storage_path") + "/sideload.zip";
+				gui_print("Copying ZIP to %s\n", new_file.c_str());
+				TWFunc::copy_file(file, new_file, -1);
+				file = new_file;
+			}
 		}
 		else
-		{
 			LOGINFO("Modifying ZIP %s in place, gonna restore it later\n", file.c_str());
-			restore_script = true;
+
+		MemMapping script;
+		if(sysMapFile("/tmp/"MR_UPDATE_SCRIPT_NAME, &script) != 0)
+		{
+			LOGERR("Failed to sysMapFile '%s'\n", "/tmp/"MR_UPDATE_SCRIPT_NAME);
+			system("rm /tmp/mr_update.zip");
+			return false;
 		}
 
-		if(system_args("cd /tmp && zip \"%s\" %s", file.c_str(), MR_UPDATE_SCRIPT_NAME) != 0)
+		ZipOverlayEntry entry;
+		entry.fileName = MR_UPDATE_SCRIPT_NAME;
+		entry.data = script.addr;
+		entry.dataLen = script.length;
+		entry.mode = 0;
+
+		off_t orig_size;
+		int err = mzAppendZipEntries(file.c_str(), &entry, 1, &orig_size);
+		sysReleaseMap(&script);
+		if(err != 0)
 		{
+			LOGERR("Failed to replace updater-script in %s: %s\n", file.c_str(), strerror(err));
 			system("rm /tmp/mr_update.zip");
 			return false;
 		}
+
+		if(in_place)
+			restore_size = orig_size;
 	}
 	else
 		gui_print("No need to change ZIP.\n");
@@ -1170,6 +1208,16 @@ exit:
 	return false;
 }
 
+void MultiROM::restoreZIP(const std::string& file, off_t restore_size)
+{
+	if(restore_size < 0)
+		return;
+
+	gui_print("Restoring original updater-script\n");
+	if(truncate(file.c_str(), restore_size) != 0)
+		LOGERR("Failed to restore original updater-script (%s), THIS ZIP IS NOW UNUSEABLE FOR NON-MULTIROM FLASHING\n", strerror(errno));
+}
+
 bool MultiROM::injectBoot(std::string img_path, bool only_if_older)
 {
 	int tr_my_ver = getTrampolineVersion();
@@ -1190,6 +1238,7 @@ bool MultiROM::injectBootDeprecated(std::string img_path, bool only_if_older)
 {
 	int rd_cmpr;
 	struct bootimg img;
+	MROMRamdisk rd;
 	std::string path_trampoline = m_path + "/trampoline";
 
 	if (access(path_trampoline.c_str(), F_OK) < 0)
@@ -1211,18 +1260,19 @@ bool MultiROM::injectBootDeprecated(std::string img_path, bool only_if_older)
 
 	// DECOMPRESS RAMDISK
 	gui_print("Decompressing ramdisk...\n");
-	system("mkdir /tmp/boot/rd");
-
-	rd_cmpr = decompressRamdisk("/tmp/boot/initrd.img", "/tmp/boot/rd/");
-	if(rd_cmpr == -1 || access("/tmp/boot/rd/init", F_OK) < 0)
+	rd_cmpr = rd.load("/tmp/boot/initrd.img");
+	if(rd_cmpr == -1 || !rd.exists("init"))
 	{
 		gui_print("Failed to decompress ramdisk!\n");
 		goto fail;
 	}
+	printRamdiskCompression(rd_cmpr);
 
 	if(only_if_older)
 	{
-		int tr_rd_ver = getTrampolineVersion("/tmp/boot/rd/init", true);
+		int tr_rd_ver = -1;
+		if(rd.extractFile("init", "/tmp/boot/init"))
+			tr_rd_ver = getTrampolineVersion("/tmp/boot/init", true);
 		int tr_my_ver = getTrampolineVersion();
 		if(tr_rd_ver >= tr_my_ver && tr_my_ver > 0)
 		{
@@ -1235,22 +1285,25 @@ bool MultiROM::injectBootDeprecated(std::string img_path, bool only_if_older)
 
 	// COPY TRAMPOLINE
 	gui_print("Copying trampoline...\n");
-	if(access("/tmp/boot/rd/main_init", F_OK) < 0)
-		system("mv /tmp/boot/rd/init /tmp/boot/rd/main_init");
+	if(!rd.exists("main_init"))
+		rd.rename("init", "main_init");
 
-	system_args("cp \"%s\" /tmp/boot/rd/init", path_trampoline.c_str());
-	system("chmod 750 /tmp/boot/rd/init");
-	system("ln -sf ../main_init /tmp/boot/rd/sbin/ueventd");
-	system("ln -sf ../main_init /tmp/boot/rd/sbin/watchdogd");
+	if(!rd.addFile("init", path_trampoline, 0750))
+		goto fail;
+	rd.addSymlink("sbin/ueventd", "../main_init");
+	rd.addSymlink("sbin/watchdogd", "../main_init");
 
 #ifdef MR_USE_MROM_FSTAB
-	system_args("cp \"%s/mrom.fstab\" /tmp/boot/rd/mrom.fstab", m_path.c_str());
+	rd.addFile("mrom.fstab", m_path + "/mrom.fstab");
 #endif
 
 	// COMPRESS RAMDISK
 	gui_print("Compressing ramdisk...\n");
-	if(!compressRamdisk("/tmp/boot/rd", "/tmp/boot/initrd.img", rd_cmpr))
+	if(!rd.save("/tmp/boot/initrd.img", rd_cmpr))
+	{
+		gui_print("Failed to compress ramdisk!\n");
 		goto fail;
+	}
 
 	// PACK BOOT IMG
 	gui_print("Packing boot image\n");
@@ -1277,7 +1330,7 @@ bool MultiROM::injectBootDeprecated(std::string img_path, bool only_if_older)
 	if(img_path == m_boot_dev)
 		system_args("dd bs=4096 if=/tmp/newboot.img of=\"%s\"", m_boot_dev.c_str());
 	else
-		system_args("cp /tmp/newboot.img \"%s\"", img_path.c_str());
+		TWFunc::copy_file("/tmp/newboot.img", img_path, -1);
 	return true;
 
 fail:
@@ -1285,87 +1338,26 @@ fail:
 	return false;
 }
 
-int MultiROM::decompressRamdisk(const char *src, const char* dest)
+void MultiROM::printRamdiskCompression(int cmpr)
 {
-	FILE *f = fopen(src, "r");
-	if(!f)
-	{
-		gui_print("Failed to open initrd\n");
-		return -1;
-	}
-
-	char m[4];
-	if(fread(m, 1, sizeof(m), f) != sizeof(m))
-	{
-		gui_print("Failed to read initrd magic\n");
-		fclose(f);
-		return -1;
-	}
-	fclose(f);
-
-	char cmd[256];
-	// gzip
-	if(*((uint16_t*)m) == 0x8B1F)
-	{
-		gui_print("Ramdisk uses GZIP compression\n");
-		sprintf(cmd, "cd \"%s\" && gzip -d -c \"%s\" | cpio -i", dest, src);
-		system(cmd);
-		return CMPR_GZIP;
-	}
-	// lz4
-	else if(*((uint32_t*)m) == 0x184C2102)
-	{
-		gui_print("Ramdisk uses LZ4 compression\n");
-		sprintf(cmd, "cd \"%s\" && lz4 -d \"%s\" stdout | cpio -i", dest, src);
-		system(cmd);
-		return CMPR_LZ4;
-	}
-	// lzma
-	else if(*((uint32_t*)m) == 0x0000005D || *((uint32_t*)m) == 0x8000005D)
-	{
-		gui_print("Ramdisk uses LZMA compression\n");
-		sprintf(cmd, "cd \"%s\" && lzma -d -c \"%s\" | cpio -i", dest, src);
-		system(cmd);
-		return CMPR_LZMA;
-	}
-	else
-		gui_print("Unknown ramdisk compression (%X %X %X %X)\n", m[0], m[1], m[2], m[3]);
-
-	return -1;
-}
-
-bool MultiROM::compressRamdisk(const char* src, const char* dst, int cmpr)
-{
-	char cmd[256];
 	switch(cmpr)
 	{
 		case CMPR_GZIP:
-			sprintf(cmd, "cd \"%s\" && find . | cpio -o -H newc | gzip > \"%s\"", src, dst);
-			system(cmd);
-			return true;
+			gui_print("Ramdisk uses GZIP compression\n");
+			break;
 		case CMPR_LZ4:
-			sprintf(cmd, "cd \"%s\" && find . | cpio -o -H newc | lz4 stdin \"%s\"", src, dst);
-			system(cmd);
-			return true;
-		// FIXME: busybox can't compress with lzma
+			gui_print("Ramdisk uses LZ4 compression\n");
+			break;
 		case CMPR_LZMA:
-			gui_print("Recovery can't compress ramdisk using LZMA!\n");
-			return false;
-//			sprintf(cmd, "cd \"%s\" && find . | cpio -o -H newc | lzma > \"%s\"", src, dst);
-//			system(cmd);
-//			return true;
-		default:
-			gui_print("Invalid compression type: %d", cmpr);
-			return false;
+			gui_print("Ramdisk uses LZMA compression\n");
+			break;
 	}
 }
 
 int MultiROM::copyBoot(std::string& orig, std::string rom)
 {
 	std::string img_path = getRomsPath() + "/" + rom + "/boot.img";
-	char cmd[256];
-	sprintf(cmd, "cp \"%s\" \"%s\"", orig.c_str(), img_path.c_str());
-	if(system(cmd) != 0)
+	if(TWFunc::copy_file(orig, img_path, -1) != 0)
 		return 1;
 
 	orig.swap(img_path);
@@ -1441,7 +1433,7 @@ std::string MultiROM::getNewRomName(std::string zip, std::string def)
 	return res;
 }
 
-bool MultiROM::createImage(const std::string& base, const char *img, int size)
+bool MultiROM::createImage(const std::string& base, const char *img, int size, bool preallocate)
 {
 	gui_print("Creating %s.img...\n", img);
 
@@ -1451,6 +1443,32 @@ bool MultiROM::createImage(const std::string& base, const char *img, int size)
 		return false;
 	}
 
+	const std::string path = base + "/" + img + ".img";
+	const off64_t len = (off64_t)size*1024*1024;
+
+#ifdef USE_EXT4
+	const std::string mountpoint = std::string("/") + img;
+	struct selabel_handle *sehnd = NULL;
+
+#ifdef HAVE_SELINUX
+	// make_ext4fs errors out if it has unknown path
+	if(TWFunc::Path_Exists("/file_contexts") &&
+		(!strcmp(img, "data") ||
+		 !strcmp(img, "system") ||
+		 !strcmp(img, "cache"))) {
+		sehnd = selinux_handle;
+	}
+#endif
+
+	// make_ext4fs only writes the metadata, the rest of the image stays a hole
+	LOGINFO("Creating %s, %d MB\n", path.c_str(), size);
+	if(make_ext4fs(path.c_str(), len, mountpoint.c_str(), sehnd) != 0)
+	{
+		gui_print("Failed to create %s image!\n", img);
+		unlink(path.c_str());
+		return false;
+	}
+#else
 	char cmd[256];
 
 	// make_ext4fs errors out if it has unknown path
@@ -1458,13 +1476,250 @@ bool MultiROM::createImage(const std::string& base, const char *img, int size)
 		(!strcmp(img, "data") ||
 		 !strcmp(img, "system") ||
 		 !strcmp(img, "cache"))) {
-		snprintf(cmd, sizeof(cmd), "make_ext4fs -l %dM -a \"/%s\" -S /file_contexts \"%s/%s.img\"", size, img, base.c_str(), img);
+		snprintf(cmd, sizeof(cmd), "make_ext4fs -l %dM -a \"/%s\" -S /file_contexts \"%s\"", size, img, path.c_str());
 	} else {
-		snprintf(cmd, sizeof(cmd), "make_ext4fs -l %dM \"%s/%s.img\"", size, base.c_str(), img);
+		snprintf(cmd, sizeof(cmd), "make_ext4fs -l %dM \"%s\"", size, path.c_str());
 	}
 
 	LOGINFO("Creating image with cmd: %s\n", cmd);
-	return system(cmd) == 0;
+	if(system(cmd) != 0)
+		return false;
+#endif
+
+	if(preallocate && !preallocateImage(path, 0, len))
+	{
+		gui_print("Not enough space for %s image!\n", img);
+		unlink(path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool MultiROM::preallocateImage(const std::string& path, off64_t from, off64_t to)
+{
+	int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+	if(fd < 0)
+	{
+		LOGERR("Failed to open %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	// Reserve the blocks so the ROM can't run out of space inside the image
+	// later on. This allocates unwritten extents, nothing is zeroed. Files
+	// systems without fallocate (FUSE, older vfat) keep a sparse image.
+	int res = fallocate64(fd, 0, from, to - from);
+	if(res < 0 && (errno == EOPNOTSUPP || errno == ENOSYS))
+	{
+		LOGINFO("%s can't be preallocated, leaving it sparse\n", path.c_str());
+		res = ftruncate64(fd, to);
+	}
+
+	if(res < 0)
+		LOGERR("Failed to allocate %s: %s\n", path.c_str(), strerror(errno));
+	close(fd);
+	return res >= 0;
+}
+
+bool MultiROM::growImage(const std::string& path, int size)
+{
+	struct stat64 info;
+	const off64_t len = (off64_t)size*1024*1024;
+
+	if(stat64(path.c_str(), &info) < 0)
+	{
+		gui_print("Failed to find %s!\n", path.c_str());
+		return false;
+	}
+
+	if(len <= info.st_size)
+	{
+		gui_print("Images can only grow, %s already has %lld MB\n", path.c_str(), (long long)info.st_size/1024/1024);
+		return false;
+	}
+
+	gui_print("Growing %s to %d MB...\n", path.c_str(), size);
+	if(!preallocateImage(path, info.st_size, len))
+	{
+		truncate64(path.c_str(), info.st_size);
+		return false;
+	}
+
+	// A mounted image is resized online by the kernel, once its loop
+	// device has picked up the new size. Otherwise it must be checked first.
+	std::string dev = findLoopByFile(path);
+	if(!dev.empty())
+	{
+		int fd = open(dev.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0 || ioctl(fd, LOOP_SET_CAPACITY, 0) < 0)
+		{
+			LOGERR("Failed to update size of %s: %s\n", dev.c_str(), strerror(errno));
+			if(fd >= 0)
+				close(fd);
+			return false;
+		}
+		close(fd);
+	}
+	else
+	{
+		dev = path;
+		int res = system_args("e2fsck -fp \"%s\"", dev.c_str());
+		if(res < 0 || !WIFEXITED(res) || WEXITSTATUS(res) > 1)
+		{
+			gui_print("Failed to check %s before resizing!\n", path.c_str());
+			return false;
+		}
+	}
+
+	if(system_args("resize2fs \"%s\"", dev.c_str()) != 0)
+	{
+		gui_print("Failed to resize filesystem in %s!\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool MultiROM::attachLoop(const std::string& file, std::string& loop_device)
+{
+	int file_fd = open(file.c_str(), O_RDWR | O_CLOEXEC);
+	if(file_fd < 0)
+	{
+		LOGERR("Failed to open %s: %s\n", file.c_str(), strerror(errno));
+		return false;
+	}
+
+	int set_fd_error = 0;
+
+	// another process may take the device between finding it and LOOP_SET_FD
+	for(int attempt = 0; attempt < 5; ++attempt)
+	{
+		int nr = -1;
+		int ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+		if(ctl >= 0)
+		{
+			nr = ioctl(ctl, LOOP_CTL_GET_FREE);
+			close(ctl);
+		}
+
+		char dev[64];
+		struct loop_info64 info;
+		int loop_fd = -1;
+
+		// kernels without loop-control, or it failed: probe the devices
+		for(int i = (nr < 0 ? 0 : nr); i < (nr < 0 ? 256 : nr + 1); ++i)
+		{
+			snprintf(dev, sizeof(dev), "/dev/block/loop%d", i);
+			if(access(dev, F_OK) < 0 && mknod(dev, S_IFBLK | 0600, makedev(7, i)) < 0)
+				continue;
+
+			loop_fd = open(dev, O_RDWR | O_CLOEXEC);
+			if(loop_fd < 0)
+				continue;
+			if(ioctl(loop_fd, LOOP_GET_STATUS64, &info) < 0 && errno == ENXIO)
+				break;
+			close(loop_fd);
+			loop_fd = -1;
+		}
+
+		if(loop_fd < 0)
+		{
+			if(nr < 0)
+				break;
+			continue;
+		}
+
+		if(ioctl(loop_fd, LOOP_SET_FD, file_fd) < 0)
+		{
+			set_fd_error = errno;
+			close(loop_fd);
+			if(set_fd_error == EBUSY)
+				continue;
+			break;
+		}
+
+		memset(&info, 0, sizeof(info));
+		strncpy((char*)info.lo_file_name, file.c_str(), LO_NAME_SIZE - 1);
+		if(ioctl(loop_fd, LOOP_SET_STATUS64, &info) < 0)
+			LOGINFO("Failed to set name of %s: %s\n", dev, strerror(errno));
+
+		close(loop_fd);
+		close(file_fd);
+		loop_device = dev;
+		LOGINFO("Attached %s to %s\n", file.c_str(), dev);
+		return true;
+	}
+
+	if(set_fd_error)
+		LOGERR("Failed to attach %s to a loop device: %s\n", file.c_str(), strerror(set_fd_error));
+	else
+		LOGERR("Failed to find free loop device\n");
+	close(file_fd);
+	return false;
+}
+
+bool MultiROM::detachLoop(const std::string& loop_device)
+{
+	int fd = open(loop_device.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0 || ioctl(fd, LOOP_CLR_FD, 0) < 0)
+	{
+		LOGERR("Failed to detach %s: %s\n", loop_device.c_str(), strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return false;
+	}
+	close(fd);
+	return true;
+}
+
+std::string MultiROM::findLoopByFile(const std::string& file)
+{
+	struct stat64 info;
+	if(stat64(file.c_str(), &info) < 0)
+		return "";
+
+	DIR *d = opendir("/dev/block");
+	if(!d)
+		return "";
+
+	std::string res;
+	struct dirent *dt;
+	while(res.empty() && (dt = readdir(d)))
+	{
+		if(strncmp(dt->d_name, "loop", 4) != 0)
+			continue;
+
+		std::string dev = std::string("/dev/block/") + dt->d_name;
+		int fd = open(dev.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0)
+			continue;
+
+		struct loop_info64 loop;
+		if(ioctl(fd, LOOP_GET_STATUS64, &loop) == 0 &&
+			loop.lo_inode == info.st_ino && loop.lo_device == (uint64_t)info.st_dev)
+		{
+			res = dev;
+		}
+		close(fd);
+	}
+	closedir(d);
+	return res;
+}
+
+void MultiROM::releaseFakeSystemImg()
+{
+	std::string dev;
+	if(TWFunc::read_file("/tmp/mrom_fakesyspart", dev) != 0)
+		return;
+	TWFunc::trim(dev);
+
+	// the updater may have left it mounted
+	umount("/tmpsystem");
+
+	char loop_device[PATH_MAX];
+	ssize_t len = readlink(dev.c_str(), loop_device, sizeof(loop_device) - 1);
+	if(len <= 0)
+		return;
+	loop_device[len] = 0;
+	detachLoop(loop_device);
 }
 
 bool MultiROM::createImagesFromBase(const std::string& base)
@@ -1607,15 +1862,14 @@ bool MultiROM::extractBootForROM(std::string base)
 
 	libbootimg_destroy(&img);
 
-	system("rm -r /tmp/boot");
-	system("mkdir /tmp/boot");
-
-	int rd_cmpr = decompressRamdisk((base + "/boot/initrd.img").c_str(), "/tmp/boot");
-	if(rd_cmpr == -1 || access("/tmp/boot/init", F_OK) < 0)
+	MROMRamdisk rd;
+	int rd_cmpr = rd.load(base + "/boot/initrd.img");
+	if(rd_cmpr == -1 || !rd.exists("init"))
 	{
 		gui_print("Failed to extract ramdisk!\n");
 		return false;
 	}
+	printRamdiskCompression(rd_cmpr);
 
 	// copy needed files
 	static const char *cp_f[] = {
@@ -1625,15 +1879,13 @@ bool MultiROM::extractBootForROM(std::string base)
 		NULL
 	};
 
-	for(int i = 0; cp_f[i]; ++i)
-		system_args("cp -a /tmp/boot/%s \"%s/boot/\"", cp_f[i], base.c_str());
+	rd.extract(base + "/boot", cp_f);
 
 	// check if main_init exists
 	sprintf(path, "%s/boot/main_init", base.c_str());
 	if(access(path, F_OK) < 0)
 		system_args("mv \"%s/boot/init\" \"%s/boot/main_init\"", base.c_str(), base.c_str());
 
-	system("rm -r /tmp/boot");
 	system_args("cd \"%s/boot\" && rm cmdline ramdisk.gz zImage", base.c_str());
 
 	if (DataManager::GetIntValue("tw_multirom_share_kernel") == 0)
@@ -2097,7 +2349,7 @@ bool MultiROM::installFromBackup(std::string name, std::string path, int type)
 		return false;
 	}
 
-	system_args("cp \"%s/boot.emmc.win\" \"%s/boot.img\"", path.c_str(), base.c_str());
+	TWFunc::copy_file(path + "/boot.emmc.win", base + "/boot.img", -1);
 
 	if(!extractBootForROM(base))
 		return false;
@@ -2236,10 +2488,11 @@ bool MultiROM::ubuntuTouchProcessBoot(const std::string& root, const char *init_
 {
 	int rd_cmpr;
 	struct bootimg img;
+	MROMRamdisk rd;
 
 	gui_print("Processing boot.img for Ubuntu Touch\n");
 	system("rm /tmp/boot.img");
-	system_args("cp %s/boot.img /tmp/boot.img", root.c_str());
+	TWFunc::copy_file(root + "/boot.img", "/tmp/boot.img", -1);
 
 	if(access("/tmp/boot.img", F_OK) < 0)
 	{
@@ -2265,30 +2518,35 @@ bool MultiROM::ubuntuTouchProcessBoot(const std::string& root, const char *init_
 	else
 	{
 		gui_print("Found dtb\n");
-		system_args("cp /tmp/boot/dtb.img %s/dtb.img", root.c_str());
+		TWFunc::copy_file("/tmp/boot/dtb.img", root + "/dtb.img", -1);
 	}
 
 	// DECOMPRESS RAMDISK
 	gui_print("Decompressing ramdisk...\n");
-	system("mkdir /tmp/boot/rd");
-	rd_cmpr = decompressRamdisk("/tmp/boot/initrd.img", "/tmp/boot/rd/");
-	if(rd_cmpr == -1 || access("/tmp/boot/rd/init", F_OK) < 0)
+	rd_cmpr = rd.load("/tmp/boot/initrd.img");
+	if(rd_cmpr == -1 || !rd.exists("init"))
 	{
 		gui_print("Failed to decompress ramdisk!\n");
 		goto fail_inject;
 	}
+	printRamdiskCompression(rd_cmpr);
 
 	// COPY INIT FILES
-	system_args("cp -ra %s/%s/* /tmp/boot/rd/; chmod 755 /tmp/boot/rd/init", m_path.c_str(), init_folder);
+	if(!rd.addTree(m_path + "/" + init_folder))
+		goto fail_inject;
+	rd.chmod("init", 0755);
 
 	// COMPRESS RAMDISK
 	gui_print("Compressing ramdisk...\n");
-	if(!compressRamdisk("/tmp/boot/rd", "/tmp/boot/initrd.img", rd_cmpr))
-		return false;
+	if(!rd.save("/tmp/boot/initrd.img", rd_cmpr))
+	{
+		gui_print("Failed to compress ramdisk!\n");
+		goto fail_inject;
+	}
 
 	// DEPLOY
-	system_args("cp /tmp/boot/initrd.img %s/initrd.img", root.c_str());
-	system_args("cp /tmp/boot/zImage %s/zImage", root.c_str());
+	TWFunc::copy_file("/tmp/boot/initrd.img", root + "/initrd.img", -1);
+	TWFunc::copy_file("/tmp/boot/zImage", root + "/zImage", -1);
 
 	if (libbootimg_load_ramdisk(&img, "/tmp/boot/initrd.img") < 0 ||
 		libbootimg_write_img_and_destroy(&img, (root + "/boot.img").c_str()) < 0)
@@ -2400,7 +2658,7 @@ bool MultiROM::sailfishProcessBoot(const std::string& root)
 
 	gui_print("Processing boot.img for SailfishOS\n");
 	system("rm /tmp/boot.img");
-	system_args("cp %s/boot.img /tmp/boot.img", root.c_str());
+	TWFunc::copy_file(root + "/boot.img", "/tmp/boot.img", -1);
 
 	if(access("/tmp/boot.img", F_OK) < 0)
 	{
@@ -2424,11 +2682,11 @@ bool MultiROM::sailfishProcessBoot(const std::string& root)
 	if(ret < 0 && ret != LIBBOOTIMG_ERROR_NO_BLOB_DATA)
 		gui_print("Failed to extract dtb.img from boot.img!\n");
 	else if(ret >= 0)
-		system_args("cp /tmp/boot/dtb.img \"%s/dtb.img\"", root.c_str());
+		TWFunc::copy_file("/tmp/boot/dtb.img", root + "/dtb.img", -1);
 
 	// DEPLOY
-	system_args("cp /tmp/boot/initrd.img \"%s/initrd.img\"", root.c_str());
-	system_args("cp /tmp/boot/zImage \"%s/zImage\"", root.c_str());
+	TWFunc::copy_file("/tmp/boot/initrd.img", root + "/initrd.img", -1);
+	TWFunc::copy_file("/tmp/boot/zImage", root + "/zImage", -1);
 
 	res = true;
 fail_inject:
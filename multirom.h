@@ -146,6 +146,7 @@ public:
 	static baseFolders& getBaseFolders();
 	static base_folder *getBaseFolder(const std::string& name);
 	static void updateImageVariables();
+	static bool growImage(const std::string& path, int size);
 
 	static bool move(std::string from, std::string to);
 	static bool erase(std::string name);
@@ -193,12 +194,12 @@ private:
 	static void findPath();
 	static bool changeMounts(std::string base);
 	static void restoreMounts();
-	static bool prepareZIP(std::string& file, EdifyHacker *hacker, bool& restore_script);
+	static bool prepareZIP(std::string& file, EdifyHacker *hacker, off_t& restore_size);
+	static void restoreZIP(const std::string& file, off_t restore_size);
 	static bool verifyZIP(const std::string& file, int &verify_status);
 	static std::string getNewRomName(std::string zip, std::string def);
 	static bool createDirs(std::string name, int type);
-	static bool compressRamdisk(const char *src, const char *dest, int cmpr);
-	static int decompressRamdisk(const char *src, const char *dest);
+	static void printRamdiskCompression(int cmpr);
 	static bool installFromBackup(std::string name, std::string path, int type);
 	static int getType(int os, std::string loc);
 	static int getTrampolineVersion();
@@ -211,7 +212,12 @@ private:
 	static void ubuntuDisableFlashKernel(bool initChroot, std::string rootDir);
 	static bool mountUbuntuImage(std::string name, std::string& dest);
 
-	static bool createImage(const std::string& base, const char *img, int size);
+	static bool createImage(const std::string& base, const char *img, int size, bool preallocate = true);
+	static bool preallocateImage(const std::string& path, off64_t from, off64_t to);
+	static bool attachLoop(const std::string& file, std::string& loop_device);
+	static bool detachLoop(const std::string& loop_device);
+	static std::string findLoopByFile(const std::string& file);
+	static void releaseFakeSystemImg();
 	static bool createImagesFromBase(const std::string& base);
 	static bool createDirsFromBase(const std::string& base);
 	static bool mountBaseImages(std::string base, std::string& dest);
@@ -0,0 +1,1031 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <zlib.h>
+#include <algorithm>
+
+#ifdef MR_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+
+#ifdef MR_HAVE_LZMA
+extern "C" {
+#include "LzmaDec.h"
+#include "LzmaEnc.h"
+}
+#endif
+
+extern "C" {
+#include "twcommon.h"
+}
+
+#include "multiromramdisk.h"
+#include "multirom.h"
+
+#define CPIO_MAGIC          "070701"
+#define CPIO_MAGIC_CRC      "070702"
+#define CPIO_HDR_SIZE       110
+#define CPIO_TRAILER        "TRAILER!!!"
+
+#define GZIP_BLOCK_SIZE     (128*1024)  // same as pigz
+#define GZIP_DICT_SIZE      (32*1024)
+#define LZ4_LEGACY_MAGIC    0x184C2102
+#define LZ4_LEGACY_BLOCK    (8*1024*1024)
+#define LZMA_HEADER_SIZE    13
+
+#define RAMDISK_MAX_THREADS 4
+
+static uint32_t getLE32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void putLE32(std::string& out, uint32_t val)
+{
+	for(int i = 0; i < 4; ++i)
+		out.push_back((char)((val >> (i*8)) & 0xFF));
+}
+
+static bool readFile(const std::string& path, std::string& data)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		LOGERR("Failed to open %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat info;
+	if(fstat(fd, &info) < 0)
+	{
+		LOGERR("Failed to stat %s: %s\n", path.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	data.resize(info.st_size);
+	size_t done = 0;
+	while(done < data.size())
+	{
+		ssize_t res = read(fd, &data[done], data.size() - done);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res <= 0)
+		{
+			LOGERR("Failed to read %s: %s\n", path.c_str(), res < 0 ? strerror(errno) : "unexpected EOF");
+			close(fd);
+			return false;
+		}
+		done += res;
+	}
+	close(fd);
+	return true;
+}
+
+static bool writeFile(const std::string& path, const std::string& data, mode_t mode)
+{
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+	if(fd < 0)
+	{
+		LOGERR("Failed to create %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	size_t done = 0;
+	while(done < data.size())
+	{
+		ssize_t res = write(fd, data.data() + done, data.size() - done);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res <= 0)
+		{
+			LOGERR("Failed to write %s: %s\n", path.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+		done += res;
+	}
+
+	if(close(fd) < 0)
+	{
+		LOGERR("Failed to write %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Codecs the tree has no library for go through the command line tools
+// recovery ships, only the cpio part is done in-process then.
+static bool readFromCommand(const std::string& cmd, std::string& out)
+{
+	FILE *p = popen(cmd.c_str(), "re");
+	if(!p)
+	{
+		LOGERR("Failed to run %s\n", cmd.c_str());
+		return false;
+	}
+
+	char buf[64*1024];
+	size_t len;
+	out.clear();
+	while((len = fread(buf, 1, sizeof(buf), p)) > 0)
+		out.append(buf, len);
+
+	if(pclose(p) != 0)
+	{
+		LOGERR("%s failed\n", cmd.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool writeToCommand(const std::string& cmd, const std::string& in)
+{
+	FILE *p = popen(cmd.c_str(), "we");
+	if(!p)
+	{
+		LOGERR("Failed to run %s\n", cmd.c_str());
+		return false;
+	}
+
+	bool res = fwrite(in.data(), 1, in.size(), p) == in.size();
+	if(pclose(p) != 0 || !res)
+	{
+		LOGERR("%s failed\n", cmd.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Runs func(cookie, i) for every i < count on up to RAMDISK_MAX_THREADS threads
+struct ParallelJob
+{
+	void (*func)(void *cookie, size_t idx);
+	void *cookie;
+	size_t count;
+	size_t next;
+};
+
+static void *parallelWorker(void *cookie)
+{
+	ParallelJob *job = (ParallelJob*)cookie;
+	size_t idx;
+	while((idx = __sync_fetch_and_add(&job->next, 1)) < job->count)
+		job->func(job->cookie, idx);
+	return NULL;
+}
+
+static void runParallel(size_t count, void (*func)(void *cookie, size_t idx), void *cookie)
+{
+	ParallelJob job = { func, cookie, count, 0 };
+	pthread_t threads[RAMDISK_MAX_THREADS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t thread_cnt = cpus > 0 ? cpus : 1;
+	size_t started = 0;
+
+	if(thread_cnt > RAMDISK_MAX_THREADS)
+		thread_cnt = RAMDISK_MAX_THREADS;
+	if(thread_cnt > count)
+		thread_cnt = count;
+
+	// the calling thread is one of the workers
+	for(size_t i = 1; i < thread_cnt; ++i)
+	{
+		if(pthread_create(&threads[started], NULL, parallelWorker, &job) != 0)
+			break;
+		++started;
+	}
+
+	parallelWorker(&job);
+
+	for(size_t i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+// GZIP
+
+static bool gzipDecompress(const std::string& in, std::string& out)
+{
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if(inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+		return false;
+
+	char buf[64*1024];
+	int res;
+	strm.next_in = (Bytef*)in.data();
+	strm.avail_in = in.size();
+	out.clear();
+	for(;;)
+	{
+		strm.next_out = (Bytef*)buf;
+		strm.avail_out = sizeof(buf);
+		res = inflate(&strm, Z_NO_FLUSH);
+		out.append(buf, sizeof(buf) - strm.avail_out);
+
+		if(res == Z_STREAM_END)
+		{
+			// concatenated members, anything else (e.g. padding) is ignored
+			if(strm.avail_in >= 2 && strm.next_in[0] == 0x1F && strm.next_in[1] == 0x8B)
+			{
+				inflateReset(&strm);
+				continue;
+			}
+			break;
+		}
+		if(res != Z_OK)
+			break;
+	}
+	inflateEnd(&strm);
+
+	if(res != Z_STREAM_END)
+	{
+		LOGERR("Failed to decompress gzip ramdisk (%d)\n", res);
+		return false;
+	}
+	return true;
+}
+
+// Blocks are deflated independently, each one primed with the last 32 KiB
+// of the block before it, and concatenated into a single gzip member.
+struct GzipBlocks
+{
+	const std::string *in;
+	std::vector<std::string> out;
+	std::vector<uLong> crc;
+	std::vector<char> ok;           // not vector<bool>, workers set these concurrently
+};
+
+static void gzipBlock(void *cookie, size_t idx)
+{
+	GzipBlocks *b = (GzipBlocks*)cookie;
+	const size_t start = idx*GZIP_BLOCK_SIZE;
+	const size_t len = std::min((size_t)GZIP_BLOCK_SIZE, b->in->size() - start);
+	const bool last = start + len == b->in->size();
+	const Bytef *data = (const Bytef*)b->in->data() + start;
+	std::string& out = b->out[idx];
+	z_stream strm;
+
+	b->crc[idx] = crc32(0L, data, len);
+
+	memset(&strm, 0, sizeof(strm));
+	if(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+
+	if(start != 0)
+	{
+		size_t dict = std::min(start, (size_t)GZIP_DICT_SIZE);
+		deflateSetDictionary(&strm, data - dict, dict);
+	}
+
+	out.resize(deflateBound(&strm, len) + 16);
+	strm.next_in = (Bytef*)data;
+	strm.avail_in = len;
+	strm.next_out = (Bytef*)&out[0];
+	strm.avail_out = out.size();
+
+	// Z_SYNC_FLUSH ends the block on a byte boundary without marking it last
+	int res = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+	if(res == (last ? Z_STREAM_END : Z_OK) && strm.avail_in == 0 && strm.avail_out != 0)
+	{
+		out.resize(out.size() - strm.avail_out);
+		b->ok[idx] = true;
+	}
+	deflateEnd(&strm);
+}
+
+static bool gzipCompress(const std::string& in, std::string& out)
+{
+	static const unsigned char header[] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3 };
+	const size_t cnt = std::max((size_t)1, (in.size() + GZIP_BLOCK_SIZE - 1)/GZIP_BLOCK_SIZE);
+	GzipBlocks b;
+
+	b.in = &in;
+	b.out.resize(cnt);
+	b.crc.resize(cnt);
+	b.ok.resize(cnt, false);
+	runParallel(cnt, gzipBlock, &b);
+
+	uLong crc = crc32(0L, Z_NULL, 0);
+	out.assign((const char*)header, sizeof(header));
+	for(size_t i = 0; i < cnt; ++i)
+	{
+		if(!b.ok[i])
+		{
+			LOGERR("Failed to compress ramdisk block %zu\n", i);
+			return false;
+		}
+		out += b.out[i];
+		crc = crc32_combine(crc, b.crc[i], std::min((size_t)GZIP_BLOCK_SIZE, in.size() - i*GZIP_BLOCK_SIZE));
+	}
+	putLE32(out, crc);
+	putLE32(out, in.size());
+	return true;
+}
+
+// LZ4 legacy format, the one the kernel unpacks: magic followed by blocks
+// of up to 8 MiB, each prefixed by its compressed size.
+
+#ifdef MR_HAVE_LZ4
+static bool lz4Decompress(const std::string& in, std::string& out)
+{
+	const unsigned char *p = (const unsigned char*)in.data();
+	size_t pos = 4;
+
+	out.clear();
+	while(pos + 4 <= in.size())
+	{
+		uint32_t len = getLE32(p + pos);
+		pos += 4;
+		if(len == LZ4_LEGACY_MAGIC)
+			continue;
+		if(len == 0)
+			break;
+		if(len > in.size() - pos || len > (uint32_t)LZ4_compressBound(LZ4_LEGACY_BLOCK))
+		{
+			LOGERR("Invalid LZ4 block size %u\n", len);
+			return false;
+		}
+
+		size_t old = out.size();
+		out.resize(old + LZ4_LEGACY_BLOCK);
+		int res = LZ4_decompress_safe(in.data() + pos, &out[old], len, LZ4_LEGACY_BLOCK);
+		if(res < 0)
+		{
+			LOGERR("Failed to decompress LZ4 block (%d)\n", res);
+			return false;
+		}
+		out.resize(old + res);
+		pos += len;
+	}
+	return true;
+}
+
+struct Lz4Blocks
+{
+	const std::string *in;
+	std::vector<std::string> out;
+};
+
+static void lz4Block(void *cookie, size_t idx)
+{
+	Lz4Blocks *b = (Lz4Blocks*)cookie;
+	const size_t start = idx*LZ4_LEGACY_BLOCK;
+	const int len = std::min((size_t)LZ4_LEGACY_BLOCK, b->in->size() - start);
+	std::string& out = b->out[idx];
+
+	out.resize(LZ4_compressBound(len));
+#if LZ4_VERSION_NUMBER >= 10700
+	int res = LZ4_compress_HC(b->in->data() + start, &out[0], len, out.size(), 9);
+#else
+	int res = LZ4_compressHC(b->in->data() + start, &out[0], len);
+#endif
+	out.resize(res > 0 ? res : 0);
+}
+
+static bool lz4Compress(const std::string& in, std::string& out)
+{
+	const size_t cnt = (in.size() + LZ4_LEGACY_BLOCK - 1)/LZ4_LEGACY_BLOCK;
+	Lz4Blocks b;
+
+	b.in = &in;
+	b.out.resize(cnt);
+	runParallel(cnt, lz4Block, &b);
+
+	out.clear();
+	putLE32(out, LZ4_LEGACY_MAGIC);
+	for(size_t i = 0; i < cnt; ++i)
+	{
+		if(b.out[i].empty())
+		{
+			LOGERR("Failed to compress ramdisk block %zu\n", i);
+			return false;
+		}
+		putLE32(out, b.out[i].size());
+		out += b.out[i];
+	}
+	return true;
+}
+#endif
+
+// LZMA "alone" format: 5 bytes of properties, 64-bit size, raw LZMA stream
+
+#ifdef MR_HAVE_LZMA
+static void *lzmaAlloc(void *p, size_t size) { return malloc(size); }
+static void lzmaFree(void *p, void *address) { free(address); }
+static ISzAlloc lzma_alloc = { lzmaAlloc, lzmaFree };
+
+static bool lzmaDecompress(const std::string& in, std::string& out)
+{
+	const Byte *p = (const Byte*)in.data();
+	CLzmaDec dec;
+	ELzmaStatus status;
+	Byte buf[64*1024];
+	size_t pos = LZMA_HEADER_SIZE;
+	uint64_t size = 0;
+	bool ok = false;
+
+	if(in.size() < LZMA_HEADER_SIZE)
+		return false;
+
+	for(int i = 0; i < 8; ++i)
+		size |= (uint64_t)p[LZMA_PROPS_SIZE + i] << (i*8);
+
+	LzmaDec_Construct(&dec);
+	if(LzmaDec_Allocate(&dec, p, LZMA_PROPS_SIZE, &lzma_alloc) != SZ_OK)
+	{
+		LOGERR("Invalid LZMA properties\n");
+		return false;
+	}
+	LzmaDec_Init(&dec);
+
+	out.clear();
+	for(;;)
+	{
+		SizeT out_len = sizeof(buf);
+		SizeT in_len = in.size() - pos;
+		ELzmaFinishMode mode = LZMA_FINISH_ANY;
+
+		// size is all ones when the stream has an end marker instead
+		if(size != (uint64_t)-1 && size - out.size() <= out_len)
+		{
+			out_len = size - out.size();
+			mode = LZMA_FINISH_END;
+		}
+
+		SRes res = LzmaDec_DecodeToBuf(&dec, buf, &out_len, p + pos, &in_len, mode, &status);
+		pos += in_len;
+		out.append((const char*)buf, out_len);
+
+		if(res != SZ_OK)
+			break;
+		if(status == LZMA_STATUS_FINISHED_WITH_MARK || (size != (uint64_t)-1 && out.size() == size))
+		{
+			ok = true;
+			break;
+		}
+		if(in_len == 0 && out_len == 0)
+			break;
+	}
+	LzmaDec_Free(&dec, &lzma_alloc);
+
+	if(!ok)
+		LOGERR("Failed to decompress LZMA ramdisk\n");
+	return ok;
+}
+
+static bool lzmaCompress(const std::string& in, std::string& out)
+{
+	CLzmaEncProps props;
+	LzmaEncProps_Init(&props);
+	props.level = 9;
+	props.numThreads = 2;   // separate match finder thread, if the SDK was built with it
+
+	// a dictionary larger than the ramdisk only costs memory when unpacking
+	props.dictSize = 1 << 16;
+	while(props.dictSize < in.size() && props.dictSize < (1 << 23))
+		props.dictSize <<= 1;
+
+	SizeT len = in.size() + in.size()/3 + 128;
+	SizeT props_size = LZMA_PROPS_SIZE;
+	out.resize(LZMA_HEADER_SIZE + len);
+
+	SRes res = LzmaEncode((Byte*)&out[LZMA_HEADER_SIZE], &len, (const Byte*)in.data(), in.size(),
+			&props, (Byte*)&out[0], &props_size, 0, NULL, &lzma_alloc, &lzma_alloc);
+	if(res != SZ_OK || props_size != LZMA_PROPS_SIZE)
+	{
+		LOGERR("Failed to compress ramdisk with LZMA (%d)\n", res);
+		return false;
+	}
+
+	uint64_t size = in.size();
+	for(int i = 0; i < 8; ++i)
+		out[LZMA_PROPS_SIZE + i] = (char)(size >> (i*8));
+	out.resize(LZMA_HEADER_SIZE + len);
+	return true;
+}
+#endif
+
+MROMRamdisk::MROMRamdisk()
+{
+}
+
+MROMRamdisk::~MROMRamdisk()
+{
+}
+
+std::string MROMRamdisk::normalize(const std::string& name)
+{
+	size_t start = 0;
+	while(true)
+	{
+		if(name.compare(start, 2, "./") == 0)
+			start += 2;
+		else if(name.compare(start, 1, "/") == 0)
+			start += 1;
+		else
+			break;
+	}
+
+	std::string res = name.substr(start);
+	while(!res.empty() && res[res.size()-1] == '/')
+		res.erase(res.size()-1);
+	return res == "." ? "" : res;
+}
+
+MROMRamdisk::Entry *MROMRamdisk::find(const std::string& name)
+{
+	const std::string n = normalize(name);
+	for(size_t i = 0; i < m_entries.size(); ++i)
+		if(m_entries[i].name == n)
+			return &m_entries[i];
+	return NULL;
+}
+
+const MROMRamdisk::Entry *MROMRamdisk::find(const std::string& name) const
+{
+	return const_cast<MROMRamdisk*>(this)->find(name);
+}
+
+MROMRamdisk::Entry& MROMRamdisk::add(const std::string& name)
+{
+	Entry *e = find(name);
+	if(!e)
+	{
+		m_entries.push_back(Entry());
+		e = &m_entries.back();
+		e->name = normalize(name);
+	}
+
+	e->mode = 0;
+	e->uid = e->gid = 0;
+	e->mtime = time(NULL);
+	e->dev_major = e->dev_minor = 0;
+	e->rdev_major = e->rdev_minor = 0;
+	e->data.clear();
+	return *e;
+}
+
+static bool parseHex(const char *p, uint32_t& val)
+{
+	val = 0;
+	for(int i = 0; i < 8; ++i)
+	{
+		int c = p[i];
+		val <<= 4;
+		if(c >= '0' && c <= '9')
+			val |= c - '0';
+		else if(c >= 'a' && c <= 'f')
+			val |= c - 'a' + 10;
+		else if(c >= 'A' && c <= 'F')
+			val |= c - 'A' + 10;
+		else
+			return false;
+	}
+	return true;
+}
+
+bool MROMRamdisk::parse(const std::string& cpio)
+{
+	enum { F_INO, F_MODE, F_UID, F_GID, F_NLINK, F_MTIME, F_SIZE,
+		F_DEVMAJ, F_DEVMIN, F_RDEVMAJ, F_RDEVMIN, F_NAMESIZE, F_CHECK, F_CNT };
+
+	std::vector<uint32_t> inodes;
+	size_t pos = 0;
+
+	m_entries.clear();
+	while(true)
+	{
+		uint32_t f[F_CNT];
+
+		if(pos > cpio.size() || cpio.size() - pos < CPIO_HDR_SIZE ||
+			(cpio.compare(pos, 6, CPIO_MAGIC) != 0 && cpio.compare(pos, 6, CPIO_MAGIC_CRC) != 0))
+		{
+			LOGERR("Invalid cpio header at %zu\n", pos);
+			return false;
+		}
+
+		for(int i = 0; i < F_CNT; ++i)
+		{
+			if(!parseHex(cpio.data() + pos + 6 + i*8, f[i]))
+			{
+				LOGERR("Invalid cpio header at %zu\n", pos);
+				return false;
+			}
+		}
+
+		size_t name_pos = pos + CPIO_HDR_SIZE;
+		size_t data_pos = (name_pos + f[F_NAMESIZE] + 3) & ~3;
+		if(f[F_NAMESIZE] == 0 || data_pos > cpio.size() || f[F_SIZE] > cpio.size() - data_pos)
+		{
+			LOGERR("Truncated cpio entry at %zu\n", pos);
+			return false;
+		}
+
+		std::string name(cpio, name_pos, f[F_NAMESIZE] - 1);
+		if(name == CPIO_TRAILER)
+			break;
+
+		pos = (data_pos + f[F_SIZE] + 3) & ~3;
+
+		name = normalize(name);
+		if(name.empty())
+			continue;
+
+		m_entries.push_back(Entry());
+		Entry& e = m_entries.back();
+		e.name = name;
+		e.mode = f[F_MODE];
+		e.uid = f[F_UID];
+		e.gid = f[F_GID];
+		e.mtime = f[F_MTIME];
+		e.dev_major = f[F_DEVMAJ];
+		e.dev_minor = f[F_DEVMIN];
+		e.rdev_major = f[F_RDEVMAJ];
+		e.rdev_minor = f[F_RDEVMIN];
+		e.data.assign(cpio, data_pos, f[F_SIZE]);
+		inodes.push_back(f[F_NLINK] > 1 && S_ISREG(f[F_MODE]) ? f[F_INO] : 0);
+	}
+
+	// newc stores the data of hard links only with the last one, they are
+	// written back as separate files.
+	for(size_t i = 0; i < m_entries.size(); ++i)
+	{
+		if(inodes[i] == 0 || !m_entries[i].data.empty())
+			continue;
+		for(size_t j = i + 1; j < m_entries.size(); ++j)
+		{
+			if(inodes[j] == inodes[i] && !m_entries[j].data.empty())
+			{
+				m_entries[i].data = m_entries[j].data;
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+static void putHeader(std::string& out, uint32_t ino, const uint32_t *f, const std::string& name, size_t size)
+{
+	char hdr[CPIO_HDR_SIZE + 1];
+	snprintf(hdr, sizeof(hdr), "%s%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x%08x",
+		CPIO_MAGIC, ino, f[0], f[1], f[2], f[3], f[4], (uint32_t)size,
+		f[5], f[6], f[7], f[8], (uint32_t)name.size() + 1, 0);
+
+	out.append(hdr, CPIO_HDR_SIZE);
+	out.append(name.c_str(), name.size() + 1);
+	out.append((4 - out.size() % 4) % 4, '\0');
+}
+
+void MROMRamdisk::serialize(std::string& cpio) const
+{
+	size_t total = 0;
+	for(size_t i = 0; i < m_entries.size(); ++i)
+		total += CPIO_HDR_SIZE + m_entries[i].name.size() + m_entries[i].data.size() + 8;
+
+	cpio.clear();
+	cpio.reserve(total + 512);
+
+	for(size_t i = 0; i < m_entries.size(); ++i)
+	{
+		const Entry& e = m_entries[i];
+		const uint32_t f[] = {
+			e.mode, e.uid, e.gid, S_ISDIR(e.mode) ? 2u : 1u, e.mtime,
+			e.dev_major, e.dev_minor, e.rdev_major, e.rdev_minor
+		};
+
+		putHeader(cpio, i + 1, f, e.name, e.data.size());
+		cpio += e.data;
+		cpio.append((4 - cpio.size() % 4) % 4, '\0');
+	}
+
+	const uint32_t trailer[] = { 0, 0, 0, 1, 0, 0, 0, 0, 0 };
+	putHeader(cpio, 0, trailer, CPIO_TRAILER, 0);
+
+	// pad to 512 bytes like cpio -o does
+	cpio.append((512 - cpio.size() % 512) % 512, '\0');
+}
+
+int MROMRamdisk::load(const std::string& path)
+{
+	std::string in, cpio;
+	int cmpr = -1;
+	bool res = false;
+
+	if(!readFile(path, in))
+		return -1;
+
+	if(in.size() < 4)
+	{
+		LOGERR("Failed to read initrd magic\n");
+		return -1;
+	}
+
+	const unsigned char *m = (const unsigned char*)in.data();
+	// gzip
+	if(m[0] == 0x1F && m[1] == 0x8B)
+	{
+		cmpr = CMPR_GZIP;
+		res = gzipDecompress(in, cpio);
+	}
+	// lz4
+	else if(getLE32(m) == LZ4_LEGACY_MAGIC)
+	{
+		cmpr = CMPR_LZ4;
+#ifdef MR_HAVE_LZ4
+		res = lz4Decompress(in, cpio);
+#else
+		res = readFromCommand("lz4 -d \"" + path + "\" stdout", cpio);
+#endif
+	}
+	// lzma
+	else if(getLE32(m) == 0x0000005D || getLE32(m) == 0x8000005D)
+	{
+		cmpr = CMPR_LZMA;
+#ifdef MR_HAVE_LZMA
+		res = lzmaDecompress(in, cpio);
+#else
+		res = readFromCommand("lzma -d -c \"" + path + "\"", cpio);
+#endif
+	}
+	else
+	{
+		LOGERR("Unknown ramdisk compression (%X %X %X %X)\n", m[0], m[1], m[2], m[3]);
+		return -1;
+	}
+
+	in.clear();
+	if(!res || !parse(cpio))
+		return -1;
+
+	LOGINFO("Loaded ramdisk %s: %zu entries, %zu bytes\n", path.c_str(), m_entries.size(), cpio.size());
+	return cmpr;
+}
+
+bool MROMRamdisk::save(const std::string& path, int cmpr) const
+{
+	std::string cpio, out;
+
+	serialize(cpio);
+
+	switch(cmpr)
+	{
+		case CMPR_GZIP:
+			if(!gzipCompress(cpio, out))
+				return false;
+			break;
+		case CMPR_LZ4:
+#ifdef MR_HAVE_LZ4
+			if(!lz4Compress(cpio, out))
+				return false;
+			break;
+#else
+			return writeToCommand("lz4 stdin \"" + path + "\"", cpio);
+#endif
+		case CMPR_LZMA:
+#ifdef MR_HAVE_LZMA
+			if(!lzmaCompress(cpio, out))
+				return false;
+			break;
+#else
+			// busybox lzma can only decompress
+			if(!writeToCommand("lzma -c > \"" + path + "\"", cpio))
+			{
+				LOGERR("Recovery can't compress ramdisk using LZMA!\n");
+				return false;
+			}
+			return true;
+#endif
+		default:
+			LOGERR("Invalid compression type: %d\n", cmpr);
+			return false;
+	}
+
+	LOGINFO("Saving ramdisk %s: %zu bytes, %zu compressed\n", path.c_str(), cpio.size(), out.size());
+	return writeFile(path, out, 0644);
+}
+
+bool MROMRamdisk::extractEntry(const Entry& e, const std::string& dest) const
+{
+	const std::string path = dest + "/" + e.name;
+	const mode_t perms = e.mode & 07777;
+	int res = 0;
+
+	unlink(path.c_str());
+
+	switch(e.mode & S_IFMT)
+	{
+		case S_IFDIR:
+			if(mkdir(path.c_str(), perms) < 0 && errno != EEXIST)
+				res = -1;
+			break;
+		case S_IFREG:
+			if(!writeFile(path, e.data, perms))
+				return false;
+			break;
+		case S_IFLNK:
+			res = symlink(e.data.c_str(), path.c_str());
+			break;
+		case S_IFCHR:
+		case S_IFBLK:
+		case S_IFIFO:
+		case S_IFSOCK:
+			res = mknod(path.c_str(), e.mode, makedev(e.rdev_major, e.rdev_minor));
+			break;
+		default:
+			LOGERR("Unknown type of ramdisk entry %s (0%o)\n", e.name.c_str(), e.mode);
+			return false;
+	}
+
+	if(res < 0)
+	{
+		LOGERR("Failed to create %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	lchown(path.c_str(), e.uid, e.gid);
+	if(!S_ISLNK(e.mode))
+		::chmod(path.c_str(), perms);
+	return true;
+}
+
+bool MROMRamdisk::extract(const std::string& dest, const char **patterns) const
+{
+	bool res = true;
+	for(size_t i = 0; i < m_entries.size(); ++i)
+	{
+		const Entry& e = m_entries[i];
+		if(patterns)
+		{
+			if(e.name.find('/') != std::string::npos)
+				continue;
+
+			int p;
+			for(p = 0; patterns[p] && fnmatch(patterns[p], e.name.c_str(), 0) != 0; ++p);
+			if(!patterns[p])
+				continue;
+		}
+
+		if(!extractEntry(e, dest))
+			res = false;
+	}
+	return res;
+}
+
+bool MROMRamdisk::extractFile(const std::string& name, const std::string& dest) const
+{
+	const Entry *e = find(name);
+	if(!e || !S_ISREG(e->mode))
+		return false;
+	return writeFile(dest, e->data, e->mode & 07777);
+}
+
+bool MROMRamdisk::exists(const std::string& name) const
+{
+	return find(name) != NULL;
+}
+
+bool MROMRamdisk::rename(const std::string& from, const std::string& to)
+{
+	Entry *e = find(from);
+	if(!e)
+		return false;
+
+	const std::string name = normalize(to);
+	for(size_t i = 0; i < m_entries.size(); ++i)
+	{
+		if(m_entries[i].name == name && &m_entries[i] != e)
+		{
+			m_entries.erase(m_entries.begin() + i);
+			e = find(from);
+			break;
+		}
+	}
+	e->name = name;
+	return true;
+}
+
+bool MROMRamdisk::chmod(const std::string& name, mode_t perms)
+{
+	Entry *e = find(name);
+	if(!e)
+		return false;
+	e->mode = (e->mode & S_IFMT) | (perms & 07777);
+	return true;
+}
+
+bool MROMRamdisk::addFile(const std::string& name, const std::string& src, int perms)
+{
+	struct stat info;
+	std::string data;
+
+	if(stat(src.c_str(), &info) < 0)
+	{
+		LOGERR("Failed to stat %s: %s\n", src.c_str(), strerror(errno));
+		return false;
+	}
+
+	if(!readFile(src, data))
+		return false;
+
+	Entry& e = add(name);
+	e.mode = S_IFREG | ((perms < 0 ? info.st_mode : perms) & 07777);
+	e.mtime = info.st_mtime;
+	e.data.swap(data);
+	return true;
+}
+
+bool MROMRamdisk::addSymlink(const std::string& name, const std::string& target)
+{
+	Entry& e = add(name);
+	e.mode = S_IFLNK | 0777;
+	e.data = target;
+	return true;
+}
+
+bool MROMRamdisk::addTree(const std::string& src, const std::string& dest)
+{
+	DIR *d = opendir(src.c_str());
+	if(!d)
+	{
+		LOGERR("Failed to open %s: %s\n", src.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct dirent *dt;
+	struct stat info;
+	bool res = true;
+
+	while(res && (dt = readdir(d)))
+	{
+		if(strcmp(dt->d_name, ".") == 0 || strcmp(dt->d_name, "..") == 0)
+			continue;
+
+		const std::string path = src + "/" + dt->d_name;
+		const std::string name = dest.empty() ? dt->d_name : dest + "/" + dt->d_name;
+
+		if(lstat(path.c_str(), &info) < 0)
+		{
+			LOGERR("Failed to stat %s: %s\n", path.c_str(), strerror(errno));
+			res = false;
+			break;
+		}
+
+		if(S_ISDIR(info.st_mode))
+		{
+			// existing directories keep their position so they stay before their contents
+			Entry *e = find(name);
+			if(!e || !S_ISDIR(e->mode))
+				e = &add(name);
+			e->mode = info.st_mode;
+			e->uid = info.st_uid;
+			e->gid = info.st_gid;
+			e->mtime = info.st_mtime;
+			res = addTree(path, name);
+			continue;
+		}
+
+		if(S_ISREG(info.st_mode))
+			res = addFile(name, path);
+		else if(S_ISLNK(info.st_mode))
+		{
+			char target[PATH_MAX];
+			ssize_t len = readlink(path.c_str(), target, sizeof(target) - 1);
+			if(len < 0)
+			{
+				LOGERR("Failed to read link %s: %s\n", path.c_str(), strerror(errno));
+				res = false;
+				break;
+			}
+			res = addSymlink(name, std::string(target, len));
+		}
+		else
+		{
+			LOGINFO("Skipping special file %s\n", path.c_str());
+			continue;
+		}
+
+		Entry *e = find(name);
+		if(e)
+		{
+			e->uid = info.st_uid;
+			e->gid = info.st_gid;
+			e->mtime = info.st_mtime;
+		}
+	}
+
+	closedir(d);
+	return res;
+}
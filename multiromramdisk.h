@@ -0,0 +1,59 @@
+#ifndef MULTIROM_RAMDISK_H
+#define MULTIROM_RAMDISK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// In-memory newc cpio archive of a boot image ramdisk.
+// load() decompresses and parses the whole ramdisk, the entries can then be
+// changed in place and save() writes it back compressed in one pass.
+class MROMRamdisk
+{
+public:
+	MROMRamdisk();
+	~MROMRamdisk();
+
+	int load(const std::string& path);                                  // returns CMPR_* or -1
+	bool save(const std::string& path, int cmpr) const;
+	bool extract(const std::string& dest, const char **patterns = NULL) const; // top-level names matching patterns, or everything
+	bool extractFile(const std::string& name, const std::string& dest) const;
+
+	bool exists(const std::string& name) const;
+	bool rename(const std::string& from, const std::string& to);
+	bool chmod(const std::string& name, mode_t perms);
+	bool addFile(const std::string& name, const std::string& src, int perms = -1); // perms < 0 keeps those of src
+	bool addSymlink(const std::string& name, const std::string& target);
+	bool addTree(const std::string& src, const std::string& dest = "");  // like cp -a src/* dest/
+
+	size_t size() const { return m_entries.size(); }
+
+private:
+	struct Entry
+	{
+		std::string name;       // without leading "./"
+		uint32_t mode;
+		uint32_t uid;
+		uint32_t gid;
+		uint32_t mtime;
+		uint32_t dev_major;
+		uint32_t dev_minor;
+		uint32_t rdev_major;
+		uint32_t rdev_minor;
+		std::string data;       // file contents or symlink target
+	};
+
+	bool parse(const std::string& cpio);
+	void serialize(std::string& cpio) const;
+	bool extractEntry(const Entry& e, const std::string& dest) const;
+	Entry *find(const std::string& name);
+	const Entry *find(const std::string& name) const;
+	Entry& add(const std::string& name);
+
+	static std::string normalize(const std::string& name);
+
+	std::vector<Entry> m_entries;
+};
+
+#endif
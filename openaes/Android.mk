@@ -36,4 +36,15 @@ ifneq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
 	LOCAL_SRC_FILES = src/oaes_lib.c src/isaac/rand.c src/ftime.c
 	LOCAL_STATIC_LIBRARIES = libc
 	include $(BUILD_STATIC_LIBRARY)
+
+	# Build host static library for the encryption benchmark
+	include $(CLEAR_VARS)
+	LOCAL_MODULE := libopenaes_host
+	LOCAL_MODULE_TAGS := optional
+	LOCAL_C_INCLUDES := \
+		$(commands_recovery_local_path)/openaes/src/isaac \
+		$(commands_recovery_local_path)/openaes/inc
+	# The host C library still has ftime
+	LOCAL_SRC_FILES = src/oaes_lib.c src/isaac/rand.c
+	include $(BUILD_HOST_STATIC_LIBRARY)
 endif
@@ -30,11 +30,18 @@
 #include <fstream>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/sysinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <map>
 
 #include "twrp-functions.hpp"
 #include "partitions.hpp"
 #include "twcommon.h"
 #include "openrecoveryscript.hpp"
+#include "tw_atomic.hpp"
+#include "twrpDU.hpp"
+#include "twrpFSProbe.hpp"
 #include "variables.h"
 #include "adb_install.h"
 #include "data.hpp"
@@ -83,56 +90,283 @@ int OpenRecoveryScript::copy_script_file(string filename) {
 	return 0;
 }
 
-int OpenRecoveryScript::run_script_file(void) {
+int OpenRecoveryScript::Parse_Script_File(vector<ORS_Command>& Commands) {
 	FILE *fp = fopen(SCRIPT_FILE_TMP, "r");
-	int ret_val = 0, cindex, line_len, i, remove_nl, install_cmd = 0, sideload = 0;
+	int cindex, line_len, i, remove_nl;
 	char script_line[SCRIPT_COMMAND_SIZE], command[SCRIPT_COMMAND_SIZE],
-		 value[SCRIPT_COMMAND_SIZE], mount[SCRIPT_COMMAND_SIZE],
-		 value1[SCRIPT_COMMAND_SIZE], value2[SCRIPT_COMMAND_SIZE];
-	char *val_start, *tok;
+		 value[SCRIPT_COMMAND_SIZE];
+	char *val_start;
+
+	if (fp == NULL)
+		return 0;
+	while (fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL) {
+		cindex = 0;
+		line_len = strlen(script_line);
+		if (line_len < 2)
+			continue; // there's a blank line or line is too short to contain a command
+		//gui_print("script line: '%s'\n", script_line);
+		for (i=0; i<line_len; i++) {
+			if ((int)script_line[i] == 32) {
+				cindex = i;
+				i = line_len;
+			}
+		}
+		memset(command, 0, sizeof(command));
+		memset(value, 0, sizeof(value));
+		if ((int)script_line[line_len - 1] == 10)
+				remove_nl = 2;
+			else
+				remove_nl = 1;
+		if (cindex != 0) {
+			strncpy(command, script_line, cindex);
+			LOGINFO("command is: '%s'\n", command);
+			val_start = script_line;
+			val_start += cindex + 1;
+			if ((int) *val_start == 32)
+				val_start++; //get rid of space
+			if ((int) *val_start == 51)
+				val_start++; //get rid of = at the beginning
+			if ((int) *val_start == 32)
+				val_start++; //get rid of space
+			strncpy(value, val_start, line_len - cindex - remove_nl);
+			LOGINFO("value is: '%s'\n", value);
+		} else {
+			strncpy(command, script_line, line_len - remove_nl + 1);
+			gui_print("command is: '%s' and there is no value\n", command);
+		}
+		ORS_Command Cmd;
+		Cmd.command = command;
+		Cmd.value = value;
+		Cmd.has_value = (cindex != 0);
+		Cmd.skip = false;
+		Cmd.mount_storage = false;
+		Cmd.ran = false;
+		Commands.push_back(Cmd);
+	}
+	fclose(fp);
+	return 1;
+}
+
+static bool Keeps_Mounts(const string& Command) {
+	// Commands that can not mount or unmount anything on their own
+	return Command == "print" || Command == "set" || Command == "mkdir";
+}
+
+static void Cancel_Plan(vector<ORS_Command>& Commands, size_t From) {
+	// A mount or unmount failed, so the state the plan assumed is wrong
+	for (size_t i = From + 1; i < Commands.size(); i++)
+		Commands[i].skip = false;
+}
 
-	if (fp != NULL) {
+void OpenRecoveryScript::Plan_Script(vector<ORS_Command>& Commands) {
+	std::map<string, bool> Mounted; // mount state the script itself has set up
+	bool storage_mounted = false;
+	int skipped = 0;
+
+	for (vector<ORS_Command>::iterator Cmd = Commands.begin(); Cmd != Commands.end(); Cmd++) {
+		if (Cmd->command == "mount" || Cmd->command == "unmount" || Cmd->command == "umount") {
+			bool mount = (Cmd->command == "mount");
+			string Path = TWFunc::Get_Root_Path(Cmd->value[0] != '/' ? "/" + Cmd->value : Cmd->value);
+			std::map<string, bool>::iterator state = Mounted.find(Path);
+			if (state != Mounted.end() && state->second == mount) {
+				Cmd->skip = true;
+				skipped++;
+			}
+			Mounted[Path] = mount;
+			if (!mount)
+				storage_mounted = false;
+		} else if (Cmd->command == "install") {
+			// Updater scripts unmount what they like, internal storage on
+			// /data included, so nothing after an install can rely on it
+			Cmd->mount_storage = !storage_mounted;
+			storage_mounted = false;
+			Mounted.clear();
+		} else if (Cmd->command == "restore") {
+			Cmd->mount_storage = !storage_mounted;
+			storage_mounted = false;
+			Mounted.clear();
+		} else if (!Keeps_Mounts(Cmd->command)) {
+			storage_mounted = false;
+			Mounted.clear();
+		}
+	}
+	LOGINFO("Planned %lu script commands, %i redundant\n", (unsigned long)Commands.size(), skipped);
+}
+
+void OpenRecoveryScript::Print_Timing(const vector<ORS_Command>& Commands, timespec& end) {
+	int32_t total = 0;
+
+	gui_msg("ors_timing=Command timing:");
+	for (size_t i = 0; i < Commands.size(); i++) {
+		if (!Commands[i].ran)
+			continue;
+		timespec cmd_start = Commands[i].start, cmd_end = end;
+		for (size_t j = i + 1; j < Commands.size(); j++) {
+			if (Commands[j].ran) {
+				cmd_end = Commands[j].start;
+				break;
+			}
+		}
+		int32_t ms = TWFunc::timespec_diff_ms(cmd_start, cmd_end);
+		total += ms;
+		gui_print("%5i.%03is  %s %s\n", ms / 1000, ms % 1000, Commands[i].command.c_str(), Commands[i].value.c_str());
+	}
+	char total_str[32];
+	sprintf(total_str, "%i.%03i", total / 1000, total % 1000);
+	gui_msg(Msg("ors_timing_total=Total: {1}s")(total_str));
+}
+
+// Reads the zip of the next install into the page cache while the current
+// one is being flashed, so its signature check and extraction don't have
+// to wait for storage.
+struct ORS_Prefetch {
+	string Zip;
+	vector<string> Storage_Roots;
+	TWAtomicInt cancel;
+	pthread_t thread;
+	bool running;
+};
+
+static ORS_Prefetch prefetch;
+
+#define PREFETCH_CHUNK (1024 * 1024)
+
+static const char* Prefetch_Unmountable[] = { "/data", "/cache", NULL };
+
+static void* Prefetch_Thread(void* cookie) {
+	ORS_Prefetch* job = (ORS_Prefetch*)cookie;
+	string Path = job->Zip;
+	struct stat st;
+	struct sysinfo si;
+	unsigned long long total = 0;
+	timespec start, end;
+
+	if (!TWFunc::Path_Exists(Path)) {
+		Path.clear();
+		for (vector<string>::iterator root = job->Storage_Roots.begin(); root != job->Storage_Roots.end() && Path.empty(); root++) {
+			if (TWFunc::Path_Exists(*root + "/" + job->Zip))
+				Path = *root + "/" + job->Zip;
+			else
+				Path = OpenRecoveryScript::Locate_Zip_File(job->Zip, *root);
+		}
+		if (Path.empty())
+			return NULL;
+	}
+	// An open file keeps its filesystem busy, so a zip on a partition the
+	// running install may unmount (updater scripts unmount /data, the
+	// cache wipe after an install unmounts /cache) must not be held open.
+	// Storage on /data/media is usually a bind mount, so compare devices.
+	if (TWFunc::Get_Root_Path(Path) == "/tmp" || stat(Path.c_str(), &st) != 0)
+		return NULL;
+	for (const char** busy = Prefetch_Unmountable; *busy; busy++) {
+		struct stat busy_st;
+		if (TWFunc::Get_Root_Path(Path) == *busy || (stat(*busy, &busy_st) == 0 && busy_st.st_dev == st.st_dev)) {
+			LOGINFO("Not prefetching '%s', it is on %s\n", Path.c_str(), *busy);
+			return NULL;
+		}
+	}
+
+	int fd = open(Path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || sysinfo(&si) != 0 || (unsigned long long)st.st_size > (unsigned long long)si.totalram * si.mem_unit / 4) {
+		LOGINFO("Not prefetching '%s'\n", Path.c_str());
+		close(fd);
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	char* buf = (char*)malloc(PREFETCH_CHUNK);
+	ssize_t len = 0;
+	while (buf && job->cancel.get_value() == 0 && (len = read(fd, buf, PREFETCH_CHUNK)) > 0)
+		total += len;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (buf && job->cancel.get_value() == 0) {
+		// A zip always ends with its end of central directory record,
+		// at most 64k of comment after it
+		bool found = false;
+		off_t tail = st.st_size < 65557 ? st.st_size : 65557;
+		if (len == 0 && total == (unsigned long long)st.st_size && tail >= 22 && pread(fd, buf, tail, st.st_size - tail) == tail) {
+			for (off_t i = tail - 22; i >= 0 && !found; i--)
+				found = (buf[i] == 'P' && buf[i + 1] == 'K' && buf[i + 2] == 5 && buf[i + 3] == 6);
+		}
+		if (!found)
+			LOGINFO("'%s' is unreadable or not a complete zip file\n", Path.c_str());
+	}
+	int32_t ms = TWFunc::timespec_diff_ms(start, end);
+	LOGINFO("Prefetched %llu KB of '%s' in %i.%03is\n", total / 1024, Path.c_str(), ms / 1000, ms % 1000);
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void Stop_Prefetch(void) {
+	if (!prefetch.running)
+		return;
+	prefetch.cancel.set_value(1);
+	pthread_join(prefetch.thread, NULL);
+	prefetch.running = false;
+}
+
+static void Start_Prefetch(const string& Zip) {
+	std::vector<PartitionList> Storage_List;
+
+	Stop_Prefetch();
+	if (Zip.empty() || Zip[0] == '@')
+		return; // block mapped zips are read straight from the data partition
+	if (DataManager::GetIntValue(TW_ORS_IS_SECONDARY_ROM) == 1)
+		return; // flashORSZip swaps the real partitions for the ROM's
+	prefetch.Zip = Zip;
+	prefetch.Storage_Roots.clear();
+	PartitionManager.Get_Partition_List("storage", &Storage_List);
+	for (size_t i = 0; i < Storage_List.size(); i++) {
+		if (PartitionManager.Is_Mounted_By_Path(Storage_List.at(i).Mount_Point))
+			prefetch.Storage_Roots.push_back(Storage_List.at(i).Mount_Point);
+	}
+	prefetch.cancel.set_value(0);
+	prefetch.running = (pthread_create(&prefetch.thread, NULL, Prefetch_Thread, (void*)&prefetch) == 0);
+}
+
+int OpenRecoveryScript::run_script_file(void) {
+	int ret_val = 0, line_len, i, remove_nl, install_cmd = 0, sideload = 0;
+	char command[SCRIPT_COMMAND_SIZE], value[SCRIPT_COMMAND_SIZE], mount[SCRIPT_COMMAND_SIZE],
+		 value1[SCRIPT_COMMAND_SIZE], value2[SCRIPT_COMMAND_SIZE];
+	char *tok;
+	vector<ORS_Command> Commands;
+	timespec end;
+
+	if (Parse_Script_File(Commands)) {
+		Plan_Script(Commands);
+		// Only the partition details after the last command matter
+		PartitionManager.Defer_System_Details(true);
 		DataManager::SetValue(TW_SIMULATE_ACTIONS, 0);
 		DataManager::SetValue("ui_progress", 0); // Reset the progress bar
-		while (fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL && ret_val == 0) {
-			cindex = 0;
-			line_len = strlen(script_line);
-			if (line_len < 2)
-				continue; // there's a blank line or line is too short to contain a command
-			//gui_print("script line: '%s'\n", script_line);
-			for (i=0; i<line_len; i++) {
-				if ((int)script_line[i] == 32) {
-					cindex = i;
-					i = line_len;
-				}
-			}
-			memset(command, 0, sizeof(command));
-			memset(value, 0, sizeof(value));
-			if ((int)script_line[line_len - 1] == 10)
-					remove_nl = 2;
-				else
-					remove_nl = 1;
-			if (cindex != 0) {
-				strncpy(command, script_line, cindex);
-				LOGINFO("command is: '%s'\n", command);
-				val_start = script_line;
-				val_start += cindex + 1;
-				if ((int) *val_start == 32)
-					val_start++; //get rid of space
-				if ((int) *val_start == 51)
-					val_start++; //get rid of = at the beginning
-				if ((int) *val_start == 32)
-					val_start++; //get rid of space
-				strncpy(value, val_start, line_len - cindex - remove_nl);
-				LOGINFO("value is: '%s'\n", value);
-			} else {
-				strncpy(command, script_line, line_len - remove_nl + 1);
-				gui_print("command is: '%s' and there is no value\n", command);
+		for (size_t n = 0; n < Commands.size() && ret_val == 0; n++) {
+			ORS_Command& Cmd = Commands[n];
+			if (Cmd.skip) {
+				LOGINFO("Skipping redundant '%s %s'\n", Cmd.command.c_str(), Cmd.value.c_str());
+				continue;
 			}
+			Cmd.ran = true;
+			clock_gettime(CLOCK_MONOTONIC, &Cmd.start);
+			strcpy(command, Cmd.command.c_str());
+			strcpy(value, Cmd.value.c_str());
 			if (strcmp(command, "install") == 0) {
 				// Install Zip
 				DataManager::SetValue("tw_action_text2", "Installing Zip");
-				PartitionManager.Mount_All_Storage();
+				if (Cmd.mount_storage)
+					PartitionManager.Mount_All_Storage();
+				Stop_Prefetch();
+				for (size_t next = n + 1; next < Commands.size(); next++) {
+					if (Commands[next].skip)
+						continue;
+					if (Commands[next].command == "install")
+						Start_Prefetch(Commands[next].value);
+					if (!Keeps_Mounts(Commands[next].command))
+						break;
+				}
 				ret_val = Install_Command(value);
 				install_cmd = -1;
 			} else if (strcmp(command, "wipe") == 0) {
@@ -180,7 +414,8 @@ int OpenRecoveryScript::run_script_file(void) {
 			} else if (strcmp(command, "restore") == 0) {
 				// Restore
 				DataManager::SetValue("tw_action_text2", gui_parse_text("{@restore}"));
-				PartitionManager.Mount_All_Storage();
+				if (Cmd.mount_storage)
+					PartitionManager.Mount_All_Storage();
 				DataManager::SetValue(TW_SKIP_MD5_CHECK_VAR, 0);
 				char folder_path[512], partitions[512];
 
@@ -296,6 +531,8 @@ int OpenRecoveryScript::run_script_file(void) {
 					strcpy(mount, value);
 				if (PartitionManager.Mount_By_Path(mount, true))
 					gui_msg(Msg("mounted=Mounted '{1}'")(mount));
+				else
+					Cancel_Plan(Commands, n);
 			} else if (strcmp(command, "unmount") == 0 || strcmp(command, "umount") == 0) {
 				// Unmount
 				DataManager::SetValue("tw_action_text2", gui_parse_text("{@unmounting}"));
@@ -306,6 +543,8 @@ int OpenRecoveryScript::run_script_file(void) {
 					strcpy(mount, value);
 				if (PartitionManager.UnMount_By_Path(mount, true))
 					gui_msg(Msg("unmounted=Unounted '{1}'")(mount));
+				else
+					Cancel_Plan(Commands, n);
 			} else if (strcmp(command, "set") == 0) {
 				// Set value
 				size_t len = strlen(value);
@@ -340,8 +579,10 @@ int OpenRecoveryScript::run_script_file(void) {
 					TWFunc::tw_reboot(rb_system);
 			} else if (strcmp(command, "cmd") == 0) {
 				DataManager::SetValue("tw_action_text2", gui_parse_text("{@running_command}"));
-				if (cindex != 0) {
+				if (Cmd.has_value) {
 					TWFunc::Exec_Cmd(value);
+					du.Clear_Cache();
+					twrpFSProbe::Invalidate_All();
 				} else {
 					LOGERR("No value given for cmd\n");
 				}
@@ -399,8 +640,11 @@ int OpenRecoveryScript::run_script_file(void) {
 				ret_val = 1;
 			}
 		}
-		fclose(fp);
+		Stop_Prefetch();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		PartitionManager.Defer_System_Details(false);
 		gui_msg("done_ors=Done processing script file");
+		Print_Timing(Commands, end);
 	} else {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(SCRIPT_FILE_TMP)(strerror(errno)));
 		return 1;
@@ -20,9 +20,22 @@
 #define _OPENRECOVERYSCRIPT_HPP
 
 #include <string>
+#include <vector>
+#include <time.h>
 
 using namespace std;
 
+// One line of the script file, parsed and planned before anything runs
+struct ORS_Command {
+	string command;
+	string value;
+	bool has_value;
+	bool skip;                                                                     // Redundant, dropped by the planner
+	bool mount_storage;                                                            // Mount all storage before running it
+	bool ran;
+	timespec start;
+};
+
 // Partition class
 class OpenRecoveryScript
 {
@@ -35,6 +48,11 @@ public:
 	static string Locate_Zip_File(string Path, string File);                       // Attempts to locate the zip file in storage
 	static int Backup_Command(string Options);                                     // Runs a backup
 	static void Run_OpenRecoveryScript();                                          // Starts the GUI Page for running OpenRecoveryScript
+
+private:
+	static int Parse_Script_File(vector<ORS_Command>& Commands);                   // Reads every command from the ORS file
+	static void Plan_Script(vector<ORS_Command>& Commands);                        // Drops mounts and unmounts that would not change anything
+	static void Print_Timing(const vector<ORS_Command>& Commands, timespec& end);  // Logs how long each command took
 };
 
 #endif // _OPENRECOVERYSCRIPT_HPP
@@ -22,8 +22,10 @@
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <iostream>
 #include <sstream>
 
@@ -40,6 +42,11 @@
 #include "twrpDigest.hpp"
 #include "twrpTar.hpp"
 #include "twrpDU.hpp"
+#include "twrpFSProbe.hpp"
+#include "dosfstools/src/mkfs.fat.h"
+#ifndef TW_NO_EXFAT
+#include "exfat/mkfs/mkexfatfs.h"
+#endif
 #include "fixPermissions.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
@@ -67,6 +74,13 @@ extern "C" {
 #include <linux/xattr.h>
 #endif
 
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKSECDISCARD
+#define BLKSECDISCARD _IO(0x12,125)
+#endif
+
 using namespace std;
 
 extern struct selabel_handle *selinux_handle;
@@ -123,6 +137,7 @@ TWPartition::TWPartition(const string& fstab_line) {
 	Primary_Block_Device = "";
 	Alternate_Block_Device = "";
 	Removable = false;
+	Sizing = false;
 	Is_Present = false;
 	Length = 0;
 	Size = 0;
@@ -159,6 +174,7 @@ TWPartition::TWPartition(const string& fstab_line) {
 	MTP_Storage_ID = 0;
 	Can_Flash_Img = false;
 	Is_ImageMount = false;
+	Stats = NULL;
 	Size_Raw = 0;
 	Mount_Read_Only = false;
 
@@ -860,54 +876,19 @@ bool TWPartition::Get_Size_Via_statfs(bool Display_Error) {
 	return true;
 }
 
-bool TWPartition::Get_Size_Via_df(bool Display_Error) {
-	FILE* fp;
-	char command[255], line[512];
-	int include_block = 1;
-	unsigned int min_len;
-
-	if (!Mount(Display_Error))
-		return false;
+bool TWPartition::Get_Size_Via_Superblock(bool Display_Error) {
+	twrpFSProbe_Info Info;
 
-	min_len = Actual_Block_Device.size() + 2;
-	sprintf(command, "df %s > /tmp/dfoutput.txt", Mount_Point.c_str());
-	TWFunc::Exec_Cmd(command);
-	fp = fopen("/tmp/dfoutput.txt", "rt");
-	if (fp == NULL) {
-		LOGINFO("Unable to open /tmp/dfoutput.txt.\n");
+	Find_Actual_Block_Device();
+	if (!Is_Present || !twrpFSProbe::Probe(Actual_Block_Device, &Info)) {
+		if (Display_Error && !Removable)
+			LOGERR("Unable to read the size of '%s'\n", Mount_Point.c_str());
 		return false;
 	}
-
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		unsigned long blocks, used, available;
-		char device[64];
-		char tmpString[64];
-
-		if (strncmp(line, "Filesystem", 10) == 0)
-			continue;
-		if (strlen(line) < min_len) {
-			include_block = 0;
-			continue;
-		}
-		if (include_block) {
-			sscanf(line, "%s %lu %lu %lu", device, &blocks, &used, &available);
-		} else {
-			// The device block string is so long that the df information is on the next line
-			int space_count = 0;
-			sprintf(tmpString, "/dev/block/%s", Actual_Block_Device.c_str());
-			while (tmpString[space_count] == 32)
-				space_count++;
-			sscanf(line + space_count, "%lu %lu %lu", &blocks, &used, &available);
-		}
-
-		// Adjust block size to byte size
-		Size = blocks * 1024ULL;
-		Used = used * 1024ULL;
-		Free = available * 1024ULL;
-		Backup_Size = Used;
-	}
-	fclose(fp);
+	Size = Info.Size;
+	Used = Info.Used;
+	Free = Info.Free;
+	Backup_Size = Used;
 	return true;
 }
 
@@ -1179,7 +1160,9 @@ bool TWPartition::Mount(bool Display_Error) {
 #endif
 	}
 
-	if (Removable)
+	// Update_Size holds the mount lock while it mounts, and sizes the
+	// partition itself once it is mounted
+	if (Removable && !Sizing)
 		Update_Size(Display_Error);
 
 	if (!Symlink_Mount_Point.empty() && TWFunc::Path_Exists(Symlink_Path)) {
@@ -1215,6 +1198,8 @@ bool TWPartition::UnMount(bool Display_Error) {
 				LOGINFO("Unable to unmount '%s'\n", Mount_Point.c_str());
 			return false;
 		} else {
+			// The superblock now holds the final usage counts
+			twrpFSProbe::Invalidate(Actual_Block_Device);
 			return true;
 		}
 	} else {
@@ -1232,6 +1217,8 @@ bool TWPartition::Wipe(string New_File_System) {
 		return false;
 	}
 
+	du.Clear_Cache();
+	twrpFSProbe::Invalidate(Actual_Block_Device);
 	if (Mount_Point == "/cache")
 		Log_Offset = 0;
 
@@ -1337,8 +1324,7 @@ bool TWPartition::Can_Repair() {
 }
 
 bool TWPartition::Repair() {
-	string command;
-
+	twrpFSProbe::Invalidate(Actual_Block_Device);
 	if (Current_File_System == "vfat") {
 		if (!TWFunc::Path_Exists("/sbin/fsck.fat")) {
 			gui_msg(Msg(msg::kError, "repair_not_exist={1} does not exist! Cannot repair!")("fsck.fat"));
@@ -1348,9 +1334,11 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("reparing=Repairing {1} using {2}...")(Display_Name)("fsck.fat"));
 		Find_Actual_Block_Device();
-		command = "/sbin/fsck.fat -y " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		vector<string> args;
+		args.push_back("/sbin/fsck.fat");
+		args.push_back("-y");
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1367,9 +1355,11 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("reparing=Repairing {1} using {2}...")(Display_Name)("e2fsck"));
 		Find_Actual_Block_Device();
-		command = "/sbin/e2fsck -fp " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		vector<string> args;
+		args.push_back("/sbin/e2fsck");
+		args.push_back("-fp");
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1386,9 +1376,10 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("reparing=Repairing {1} using {2}...")(Display_Name)("fsck.exfat"));
 		Find_Actual_Block_Device();
-		command = "/sbin/fsck.exfat " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		vector<string> args;
+		args.push_back("/sbin/fsck.exfat");
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1405,9 +1396,10 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("reparing=Repairing {1} using {2}...")(Display_Name)("fsck.f2fs"));
 		Find_Actual_Block_Device();
-		command = "/sbin/fsck.f2fs " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		vector<string> args;
+		args.push_back("/sbin/fsck.f2fs");
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1424,9 +1416,10 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("reparing=Repairing {1} using {2}...")(Display_Name)("ntfsfix"));
 		Find_Actual_Block_Device();
-		command = "/sbin/ntfsfix " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		vector<string> args;
+		args.push_back("/sbin/ntfsfix");
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1446,8 +1439,7 @@ bool TWPartition::Can_Resize() {
 }
 
 bool TWPartition::Resize() {
-	string command;
-
+	twrpFSProbe::Invalidate(Actual_Block_Device);
 	if (Current_File_System == "ext2" || Current_File_System == "ext3" || Current_File_System == "ext4") {
 		if (!Can_Repair()) {
 			LOGINFO("Cannot resize %s because %s cannot be repaired before resizing.\n", Display_Name.c_str(), Display_Name.c_str());
@@ -1465,7 +1457,9 @@ bool TWPartition::Resize() {
 			return false;
 		gui_msg(Msg("resizing=Resizing {1} using {2}...")(Display_Name)("resize2fs"));
 		Find_Actual_Block_Device();
-		command = "/sbin/resize2fs " + Actual_Block_Device;
+		vector<string> args;
+		args.push_back("/sbin/resize2fs");
+		args.push_back(Actual_Block_Device);
 		if (Length != 0) {
 			unsigned long long Actual_Size = IOCTL_Get_Block_Size();
 			if (Actual_Size == 0)
@@ -1480,13 +1474,10 @@ bool TWPartition::Resize() {
 				Block_Count = ((unsigned long long)(Length) / 1024LLU);
 			}
 			char temp[256];
-			sprintf(temp, "%llu", Block_Count);
-			command += " ";
-			command += temp;
-			command += "K";
+			sprintf(temp, "%lluK", Block_Count);
+			args.push_back(temp);
 		}
-		LOGINFO("Resize command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (TWFunc::Exec_Args(args) == 0) {
 			Update_Size(true);
 			gui_msg("done=Done.");
 			return true;
@@ -1499,9 +1490,11 @@ bool TWPartition::Resize() {
 	return false;
 }
 
-bool TWPartition::Backup(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size, pid_t &tar_fork_pid) {
+bool TWPartition::Backup(string backup_folder, const unsigned long long *overall_size, unsigned long long *backed_up_size, pid_t &tar_fork_pid) {
+	du.Clear_Cache();
+	twrpFSProbe::Invalidate(Actual_Block_Device);
 	if (Backup_Method == FILES) {
-		return Backup_Tar(backup_folder, overall_size, other_backups_size, tar_fork_pid);
+		return Backup_Tar(backup_folder, overall_size, backed_up_size, tar_fork_pid);
 	}
 	else if (Backup_Method == DD)
 		return Backup_DD(backup_folder);
@@ -1562,6 +1555,8 @@ bool TWPartition::Check_MD5(string restore_folder) {
 bool TWPartition::Restore(string restore_folder, const unsigned long long *total_restore_size, unsigned long long *already_restored_size) {
 	string Restore_File_System;
 
+	du.Clear_Cache();
+	twrpFSProbe::Invalidate(Actual_Block_Device);
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Display_Name, gui_parse_text("{@restoring}"));
 	LOGINFO("Restore filename is: %s\n", Backup_FileName.c_str());
 
@@ -1748,13 +1743,17 @@ bool TWPartition::Wipe_EXT23(string File_System) {
 		return false;
 
 	if (TWFunc::Path_Exists("/sbin/mke2fs")) {
-		string command;
+		vector<string> args;
 
 		gui_msg(Msg("formating_using=Formatting {1} using {2}...")(Display_Name)("mke2fs"));
 		Find_Actual_Block_Device();
-		command = "mke2fs -t " + File_System + " -m 0 " + Actual_Block_Device;
-		LOGINFO("mke2fs command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		args.push_back("/sbin/mke2fs");
+		args.push_back("-t");
+		args.push_back(File_System);
+		args.push_back("-m");
+		args.push_back("0");
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			Current_File_System = File_System;
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
@@ -1779,6 +1778,7 @@ bool TWPartition::Wipe_EXT4() {
 	if (!UnMount(true))
 		return false;
 
+	Discard_Block_Device();
 #if defined(HAVE_SELINUX) && defined(USE_EXT4)
 	int ret;
 	char *secontext = NULL;
@@ -1803,24 +1803,26 @@ bool TWPartition::Wipe_EXT4() {
 	}
 #else
 	if (TWFunc::Path_Exists("/sbin/make_ext4fs")) {
-		string Command;
+		vector<string> args;
 
 		gui_msg(Msg("formating_using=Formatting {1} using {2}...")(Display_Name)("make_ext4fs"));
 		Find_Actual_Block_Device();
-		Command = "make_ext4fs";
+		args.push_back("/sbin/make_ext4fs");
 		if (!Is_Decrypted && Length != 0) {
 			// Only use length if we're not decrypted
 			char len[32];
 			sprintf(len, "%i", Length);
-			Command += " -l ";
-			Command += len;
+			args.push_back("-l");
+			args.push_back(len);
 		}
 		if (TWFunc::Path_Exists("/file_contexts")) {
-			Command += " -S /file_contexts";
+			args.push_back("-S");
+			args.push_back("/file_contexts");
 		}
-		Command += " -a " + Mount_Point + " " + Actual_Block_Device;
-		LOGINFO("make_ext4fs command: %s\n", Command.c_str());
-		if (TWFunc::Exec_Cmd(Command) == 0) {
+		args.push_back("-a");
+		args.push_back(Mount_Point);
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			Current_File_System = "ext4";
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
@@ -1835,53 +1837,87 @@ bool TWPartition::Wipe_EXT4() {
 	return false;
 }
 
+// Tracks a filesystem being created in-process so its progress can be
+// shown and the time it took logged.
+struct Format_Progress {
+	int last_percent;
+	timespec start;
+};
+
+static void Format_Progress_Start(Format_Progress* Progress) {
+	Progress->last_percent = -1;
+	clock_gettime(CLOCK_MONOTONIC, &Progress->start);
+	DataManager::SetProgress(0);
+}
+
+static void Format_Progress_Update(uint64_t done, uint64_t total, void* cookie) {
+	Format_Progress* Progress = (Format_Progress*) cookie;
+	int percent = total ? (int)(done * 100 / total) : 100;
+
+	if (percent != Progress->last_percent) {
+		Progress->last_percent = percent;
+		DataManager::SetProgress((float)percent / 100);
+	}
+}
+
+static void Format_Progress_End(Format_Progress* Progress, const string& Display_Name) {
+	timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	DataManager::SetProgress(1);
+	LOGINFO("Formatted %s in %ims\n", Display_Name.c_str(), TWFunc::timespec_diff_ms(Progress->start, end));
+}
+
 bool TWPartition::Wipe_FAT() {
-	string command;
+	Format_Progress Progress;
+	int ret;
 
-	if (TWFunc::Path_Exists("/sbin/mkfs.fat")) {
-		if (!UnMount(true))
-			return false;
+	if (!UnMount(true))
+		return false;
 
-		gui_msg(Msg("formating_using=Formatting {1} using {2}...")(Display_Name)("mkfs.fat"));
-		Find_Actual_Block_Device();
-		command = "mkfs.fat " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
-			Current_File_System = "vfat";
-			Recreate_AndSec_Folder();
-			gui_msg("done=Done.");
-			return true;
-		} else {
-			gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(Display_Name));
-			return false;
-		}
+	gui_msg(Msg("formating_using=Formatting {1} using {2}...")(Display_Name)("mkfs.fat"));
+	Find_Actual_Block_Device();
+	Discard_Block_Device();
+	char* argv[] = { (char*) "mkfs.fat", (char*) Actual_Block_Device.c_str(), NULL };
+	Format_Progress_Start(&Progress);
+	mkfs_fat_set_progress(Format_Progress_Update, &Progress);
+	ret = mkfs_fat_main(2, argv);
+	mkfs_fat_set_progress(NULL, NULL);
+	Format_Progress_End(&Progress, Display_Name);
+	if (ret == 0) {
+		Current_File_System = "vfat";
+		Recreate_AndSec_Folder();
+		gui_msg("done=Done.");
 		return true;
+	} else {
+		gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(Display_Name));
+		return false;
 	}
-	else
-		return Wipe_RMRF();
-
-	return false;
 }
 
 bool TWPartition::Wipe_EXFAT() {
-	string command;
+#ifndef TW_NO_EXFAT
+	Format_Progress Progress;
+	int ret;
 
-	if (TWFunc::Path_Exists("/sbin/mkexfatfs")) {
-		if (!UnMount(true))
-			return false;
+	if (!UnMount(true))
+		return false;
 
-		gui_msg(Msg("formating_using=Formatting {1} using {2}...")(Display_Name)("mkexfatfs"));
-		Find_Actual_Block_Device();
-		command = "mkexfatfs " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
-			Recreate_AndSec_Folder();
-			gui_msg("done=Done.");
-			return true;
-		} else {
-			gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(Display_Name));
-			return false;
-		}
+	gui_msg(Msg("formating_using=Formatting {1} using {2}...")(Display_Name)("mkexfatfs"));
+	Find_Actual_Block_Device();
+	Discard_Block_Device();
+	Format_Progress_Start(&Progress);
+	ret = mkexfatfs(Actual_Block_Device.c_str(), NULL, Format_Progress_Update, &Progress);
+	Format_Progress_End(&Progress, Display_Name);
+	if (ret == 0) {
+		Recreate_AndSec_Folder();
+		gui_msg("done=Done.");
 		return true;
+	} else {
+		gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(Display_Name));
+		return false;
 	}
+#endif
 	return false;
 }
 
@@ -1918,6 +1954,50 @@ bool TWPartition::Wipe_MTD() {
 	return true;
 }
 
+// Discards the blocks the filesystem is about to be created on, when
+// enabled with tw_wipe_discard (1 = discard, 2 = secure discard).
+// Letting the storage drop the old data up front saves it from having
+// to garbage collect blocks the new filesystem will never read.  The
+// crypto footer at the end of the partition is left alone.
+void TWPartition::Discard_Block_Device(void) {
+	int discard = 0, fd;
+	uint64_t range[2], size = 0;
+	timespec start, end;
+
+	DataManager::GetValue(TW_WIPE_DISCARD_VAR, discard);
+	if (discard == 0 || Is_Decrypted)
+		return;
+
+	fd = open(Actual_Block_Device.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s' to discard: %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		return;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+		LOGINFO("Unable to get size of '%s': %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		close(fd);
+		return;
+	}
+	if (Length < 0 && (uint64_t)(-Length) < size)
+		size -= (uint64_t)(-Length);
+	else if (Length > 0 && (uint64_t)Length < size)
+		size = (uint64_t)Length;
+
+	range[0] = 0;
+	range[1] = size;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (discard == 2 && ioctl(fd, BLKSECDISCARD, &range) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		LOGINFO("Secure discarded %llu bytes of '%s' in %ims\n", (unsigned long long)size, Actual_Block_Device.c_str(), TWFunc::timespec_diff_ms(start, end));
+	} else if (ioctl(fd, BLKDISCARD, &range) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		LOGINFO("Discarded %llu bytes of '%s' in %ims\n", (unsigned long long)size, Actual_Block_Device.c_str(), TWFunc::timespec_diff_ms(start, end));
+	} else {
+		LOGINFO("Discard not supported on '%s': %s\n", Actual_Block_Device.c_str(), strerror(errno));
+	}
+	close(fd);
+}
+
 bool TWPartition::Wipe_RMRF() {
 	if (!Mount(true))
 		return false;
@@ -1934,15 +2014,17 @@ bool TWPartition::Wipe_RMRF() {
 }
 
 bool TWPartition::Wipe_F2FS() {
-	string command;
-
 	if (TWFunc::Path_Exists("/sbin/mkfs.f2fs")) {
 		if (!UnMount(true))
 			return false;
 
 		gui_msg(Msg("formating_using=Formatting {1} using {2}...")(Display_Name)("mkfs.f2fs"));
 		Find_Actual_Block_Device();
-		command = "mkfs.f2fs -t 1";
+		Discard_Block_Device();
+		vector<string> args;
+		args.push_back("/sbin/mkfs.f2fs");
+		args.push_back("-t");
+		args.push_back("1");
 		if (!Is_Decrypted && Length != 0) {
 			// Only use length if we're not decrypted
 			char len[32];
@@ -1950,11 +2032,11 @@ bool TWPartition::Wipe_F2FS() {
 			if (Length < 0)
 				mod_length *= -1;
 			sprintf(len, "%i", mod_length);
-			command += " -r ";
-			command += len;
+			args.push_back("-r");
+			args.push_back(len);
 		}
-		command += " " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
 			return true;
@@ -1983,16 +2065,16 @@ bool TWPartition::Wipe_F2FS() {
 }
 
 bool TWPartition::Wipe_NTFS() {
-	string command;
-
 	if (TWFunc::Path_Exists("/sbin/mkntfs")) {
 		if (!UnMount(true))
 			return false;
 
 		gui_msg(Msg("formating_using=Formatting {1} using {2}...")(Display_Name)("mkntfs"));
 		Find_Actual_Block_Device();
-		command = "mkntfs " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		vector<string> args;
+		args.push_back("/sbin/mkntfs");
+		args.push_back(Actual_Block_Device);
+		if (TWFunc::Exec_Args(args) == 0) {
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
 			return true;
@@ -2011,6 +2093,7 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 	return Wipe_Encryption();
 #else
 	string dir;
+	vector<string> dirs;
 
 	// This handles wiping data on devices with "sdcard" in /data/media
 	if (!Mount(true))
@@ -2033,13 +2116,16 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 			dir = "/data/";
 			dir.append(de->d_name);
 			if (de->d_type == DT_DIR) {
-				TWFunc::removeDir(dir, false);
+				dirs.push_back(dir);
 			} else if (de->d_type == DT_REG || de->d_type == DT_LNK || de->d_type == DT_FIFO || de->d_type == DT_SOCK) {
-				if (!unlink(dir.c_str()))
+				if (unlink(dir.c_str()))
 					LOGINFO("Unable to unlink '%s'\n", dir.c_str());
 			}
 		}
 		closedir(d);
+		// Remove all of the folders together so the threads are shared
+		// across them rather than working through one at a time.
+		TWFunc::removeDirs(dirs, false);
 
 		gui_msg("done=Done.");
 		return true;
@@ -2049,16 +2135,33 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 #endif // ifdef TW_OEM_BUILD
 }
 
-bool TWPartition::Backup_Tar(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size, pid_t &tar_fork_pid) {
+// Partitions may be sized (see TWPartitionManager::Update_System_Details)
+// or backed up (see TWPartitionManager::Run_Backup) from several threads
+// at once, so mounting, unmounting and the filesystem size queries are
+// done one partition at a time while the scans and archives run in
+// parallel.  The lock is recursive: a removable partition's Mount()
+// sizes it through Update_Size, which takes the lock again when Mount()
+// is called with it held, as Backup_Tar does.
+#ifndef PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+static pthread_mutex_t Mount_Lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
+#else
+static pthread_mutex_t Mount_Lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#endif
+
+bool TWPartition::Backup_Tar(string backup_folder, const unsigned long long *overall_size, unsigned long long *backed_up_size, pid_t &tar_fork_pid) {
 	char back_name[255], split_index[5];
 	string Full_FileName, Split_FileName, Tar_Args, Command;
-	int use_compression, use_encryption = 0, index, backup_count;
+	int use_compression, adaptive_compression = 0, use_encryption = 0, legacy_encryption = 0, index, backup_count;
 	struct stat st;
 	unsigned long long total_bsize = 0, file_size;
 	twrpTar tar;
 	vector <string> files;
+	bool mounted;
 
-	if (!Mount(true))
+	pthread_mutex_lock(&Mount_Lock);
+	mounted = Mount(true);
+	pthread_mutex_unlock(&Mount_Lock);
+	if (!mounted)
 		return false;
 
 	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Backup_Display_Name, "Backing Up");
@@ -2066,6 +2169,8 @@ bool TWPartition::Backup_Tar(string backup_folder, const unsigned long long *ove
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
 	tar.use_compression = use_compression;
+	DataManager::GetValue(TW_ADAPTIVE_COMPRESSION_VAR, adaptive_compression);
+	tar.adaptive_compression = adaptive_compression;
 
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	DataManager::GetValue("tw_encrypt_backup", use_encryption);
@@ -2076,6 +2181,8 @@ bool TWPartition::Backup_Tar(string backup_folder, const unsigned long long *ove
 		string Password;
 		DataManager::GetValue("tw_backup_password", Password);
 		tar.setpassword(Password);
+		DataManager::GetValue(TW_LEGACY_ENCRYPTION_VAR, legacy_encryption);
+		tar.legacy_encryption = legacy_encryption;
 	} else {
 		use_encryption = false;
 	}
@@ -2091,7 +2198,8 @@ bool TWPartition::Backup_Tar(string backup_folder, const unsigned long long *ove
 	tar.setsize(Backup_Size);
 	tar.partition_name = Backup_Name;
 	tar.backup_folder = backup_folder;
-	if (tar.createTarFork(overall_size, other_backups_size, tar_fork_pid) != 0)
+	tar.stats = Stats;
+	if (tar.createTarFork(overall_size, backed_up_size, tar_fork_pid) != 0)
 		return false;
 	return true;
 }
@@ -2123,7 +2231,10 @@ bool TWPartition::Backup_DD(string backup_folder) {
 
 	Command = "dd if=" + Actual_Block_Device + " of='" + Full_FileName + "'" + " bs=" + DD_BS + " count=" + DD_COUNT;
 	LOGINFO("Backup command: '%s'\n", Command.c_str());
+	uint64_t start = twrpStats::Now();
 	TWFunc::Exec_Cmd(Command);
+	if (Stats)
+		Stats->Add(TWSTAT_IMAGE, twrpStats::Now() - start, TWFunc::Get_File_Size(Full_FileName));
 	tw_set_default_metadata(Full_FileName.c_str());
 	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
 		gui_msg(Msg(msg::kError, "backup_size=Backup file size for '{1}' is 0 bytes.")(Full_FileName));
@@ -2147,7 +2258,10 @@ bool TWPartition::Backup_Dump_Image(string backup_folder) {
 
 	Command = "dump_image " + MTD_Name + " '" + Full_FileName + "'";
 	LOGINFO("Backup command: '%s'\n", Command.c_str());
+	uint64_t start = twrpStats::Now();
 	TWFunc::Exec_Cmd(Command);
+	if (Stats)
+		Stats->Add(TWSTAT_IMAGE, twrpStats::Now() - start, TWFunc::Get_File_Size(Full_FileName));
 	tw_set_default_metadata(Full_FileName.c_str());
 	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
 		// Actual size may not match backup size due to bad blocks on MTD devices so just check for 0 bytes
@@ -2227,6 +2341,7 @@ bool TWPartition::Restore_Tar(string restore_folder, string Restore_File_System,
 	if (!Password.empty())
 		tar.setpassword(Password);
 #endif
+	tar.stats = Stats;
 	if (tar.extractTarFork(total_restore_size, already_restored_size) != 0)
 		ret = false;
 	else
@@ -2262,6 +2377,7 @@ bool TWPartition::Restore_Image(string restore_folder, const unsigned long long
 	gui_msg(Msg("restoring=Restoring {1}...")(Backup_Display_Name));
 	Full_FileName = restore_folder + "/" + Backup_FileName;
 
+	uint64_t start = twrpStats::Now();
 	if (Restore_File_System == "emmc") {
 		if (!Flash_Image_DD(Full_FileName))
 			return false;
@@ -2269,6 +2385,8 @@ bool TWPartition::Restore_Image(string restore_folder, const unsigned long long
 		if (!Flash_Image_FI(Full_FileName))
 			return false;
 	}
+	if (Stats)
+		Stats->Add(TWSTAT_IMAGE, twrpStats::Now() - start, Restore_Size);
 	display_percent = (double)(Restore_Size + *already_restored_size) / (double)(*total_restore_size) * 100;
 	sprintf(size_progress, "%lluMB of %lluMB, %i%%", (Restore_Size + *already_restored_size) / 1048576, *total_restore_size / 1048576, (int)(display_percent));
 	DataManager::SetValue("tw_size_progress", size_progress);
@@ -2284,21 +2402,53 @@ bool TWPartition::Update_Size(bool Display_Error) {
 	if (!Can_Be_Mounted && !Is_Encrypted)
 		return false;
 
+	pthread_mutex_lock(&Mount_Lock);
 	Was_Already_Mounted = Is_Mounted();
+	if (!Was_Already_Mounted && Bind_Of.empty() && !Has_Data_Media && !Has_Android_Secure && (!Is_Encrypted || Is_Decrypted)) {
+		// Nothing here needs the files themselves, so read the usage
+		// from the superblock rather than mounting the partition.
+		if (Get_Size_Via_Superblock(false)) {
+			pthread_mutex_unlock(&Mount_Lock);
+			return true;
+		}
+	}
+	Sizing = true;
 	if (Removable || Is_Encrypted) {
-		if (!Mount(false))
+		if (!Mount(false)) {
+			Sizing = false;
+			pthread_mutex_unlock(&Mount_Lock);
 			return true;
-	} else if (!Mount(Display_Error))
+		}
+	} else if (!Mount(Display_Error)) {
+		Sizing = false;
+		pthread_mutex_unlock(&Mount_Lock);
 		return false;
+	}
+	Sizing = false;
 
 	ret = Get_Size_Via_statfs(Display_Error);
-	if (!ret || Size == 0) {
-		if (!Get_Size_Via_df(Display_Error)) {
-			if (!Was_Already_Mounted)
-				UnMount(false);
+	if (Was_Already_Mounted) {
+		// The superblock of a mounted filesystem lags behind what is in
+		// use, so statfs is the only answer worth giving here.
+		if (!ret) {
+			// Get_Size_Via_statfs already reported it unless Removable
+			if (Removable) {
+				if (Display_Error)
+					LOGERR("Unable to statfs '%s'\n", Mount_Point.c_str());
+				else
+					LOGINFO("Unable to statfs '%s'\n", Mount_Point.c_str());
+			}
+			pthread_mutex_unlock(&Mount_Lock);
+			return false;
+		}
+	} else if (!ret || Size == 0) {
+		if (!Get_Size_Via_Superblock(Display_Error)) {
+			UnMount(false);
+			pthread_mutex_unlock(&Mount_Lock);
 			return false;
 		}
 	}
+	pthread_mutex_unlock(&Mount_Lock);
 
 	if(!Bind_Of.empty()) {
 		Used = du.Get_Folder_Size(Actual_Block_Device);
@@ -2306,29 +2456,20 @@ bool TWPartition::Update_Size(bool Display_Error) {
 	}
 
 	if (Has_Data_Media) {
-		if (Mount(Display_Error)) {
-			unsigned long long data_media_used, actual_data;
-			Used = du.Get_Folder_Size("/data");
-			Backup_Size = Used;
-			int bak = (int)(Used / 1048576LLU);
-			int fre = (int)(Free / 1048576LLU);
-			LOGINFO("Data backup size is %iMB, free: %iMB.\n", bak, fre);
-		} else {
-			if (!Was_Already_Mounted)
-				UnMount(false);
-			return false;
-		}
+		unsigned long long data_media_used, actual_data;
+		Used = du.Get_Folder_Size("/data");
+		Backup_Size = Used;
+		int bak = (int)(Used / 1048576LLU);
+		int fre = (int)(Free / 1048576LLU);
+		LOGINFO("Data backup size is %iMB, free: %iMB.\n", bak, fre);
 	} else if (Has_Android_Secure) {
-		if (Mount(Display_Error))
-			Backup_Size = du.Get_Folder_Size(Backup_Path);
-		else {
-			if (!Was_Already_Mounted)
-				UnMount(false);
-			return false;
-		}
+		Backup_Size = du.Get_Folder_Size(Backup_Path);
 	}
-	if (!Was_Already_Mounted)
+	if (!Was_Already_Mounted) {
+		pthread_mutex_lock(&Mount_Lock);
 		UnMount(false);
+		pthread_mutex_unlock(&Mount_Lock);
+	}
 	return true;
 }
 
@@ -2459,6 +2600,7 @@ bool TWPartition::Flash_Image_DD(string Filename) {
 	Command = "dd bs=8388608 if='" + Filename + "' of=" + Actual_Block_Device;
 	LOGINFO("Flash command: '%s'\n", Command.c_str());
 	TWFunc::Exec_Cmd(Command);
+	twrpFSProbe::Invalidate(Actual_Block_Device);
 	return true;
 }
 
@@ -2473,6 +2615,7 @@ bool TWPartition::Flash_Image_FI(string Filename) {
 	Command = "flash_image " + MTD_Name + " '" + Filename + "'";
 	LOGINFO("Flash command: '%s'\n", Command.c_str());
 	TWFunc::Exec_Cmd(Command);
+	twrpFSProbe::Invalidate(Actual_Block_Device);
 	return true;
 }
 
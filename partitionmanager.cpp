@@ -23,13 +23,16 @@
 #include <sys/vfs.h>
 #include <unistd.h>
 #include <vector>
+#include <algorithm>
 #include <dirent.h>
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
 #include <iomanip>
+#include <limits.h>
 #include <sys/wait.h>
+#include <pthread.h>
 #include "variables.h"
 #include "twcommon.h"
 #include "partitions.hpp"
@@ -38,6 +41,7 @@
 #include "fixPermissions.hpp"
 #include "twrpDigest.hpp"
 #include "twrpDU.hpp"
+#include "twrpFSProbe.hpp"
 #include "set_metadata.h"
 #include "tw_atomic.hpp"
 #include "gui/gui.hpp"
@@ -62,8 +66,10 @@ extern bool datamedia;
 TWPartitionManager::TWPartitionManager(void) {
 	mtp_was_enabled = false;
 	mtp_write_fd = -1;
+	details_deferred = false;
+	details_stale = false;
 	stop_backup.set_value(0);
-	tar_fork_pid = 0;
+	memset(tar_fork_pids, 0, sizeof(tar_fork_pids));
 }
 
 int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error) {
@@ -524,86 +530,179 @@ bool TWPartitionManager::Make_MD5(bool generate_md5, string Backup_Folder, strin
 	return true;
 }
 
-bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folder, bool generate_md5, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long *img_time, unsigned long *file_time, unsigned long long *img_bytes, unsigned long long *file_bytes) {
+bool TWPartitionManager::Backup_Partition(TWPartition* Part, string Backup_Folder, bool generate_md5, const unsigned long long* total_size, unsigned long long* backed_up_size, pid_t &fork_pid, unsigned long *backup_time) {
 	time_t start, stop;
-	int use_compression;
-	float pos;
-	unsigned long long total_size, current_size;
-
-	string backup_log = Backup_Folder + "recovery.log";
+	twrpStats stats;
+	uint64_t stage_start, wall_start = twrpStats::Now();
 
 	if (Part == NULL)
 		return true;
 
-	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
-
-	total_size = *file_bytes + *img_bytes;
-	current_size = *file_bytes + *img_bytes - *file_bytes_remaining - *img_bytes_remaining;
 	// Set the position
-	pos = ((float)(current_size) / (float)(total_size));
-	DataManager::SetProgress(pos);
+	DataManager::SetProgress((float)(*backed_up_size) / (float)(*total_size));
 
-	TWFunc::SetPerformanceMode(true);
 	time(&start);
 
-	if (Part->Backup(Backup_Folder, &total_size, &current_size, tar_fork_pid)) {
+	Part->Stats = &stats;
+	if (Part->Backup(Backup_Folder, total_size, backed_up_size, fork_pid)) {
 		bool md5Success = false;
-		current_size += Part->Backup_Size;
-		pos = (float)((float)(current_size) / (float)(total_size));
-		DataManager::SetProgress(pos);
+		// Tar reports its progress as it goes, images only once done
+		if (Part->Backup_Method != 1)
+			__sync_add_and_fetch(backed_up_size, Part->Backup_Size);
+		DataManager::SetProgress((float)(*backed_up_size) / (float)(*total_size));
 		if (Part->Has_SubPartition) {
 			std::vector<TWPartition*>::iterator subpart;
 
 			for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 				if ((*subpart)->Can_Be_Backed_Up && (*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == Part->Mount_Point) {
-					if (!(*subpart)->Backup(Backup_Folder, &total_size, &current_size, tar_fork_pid)) {
-						TWFunc::SetPerformanceMode(false);
-						Clean_Backup_Folder(Backup_Folder);
-						TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
-						tw_set_default_metadata(backup_log.c_str());
+					(*subpart)->Stats = &stats;
+					bool subpart_ok = (*subpart)->Backup(Backup_Folder, total_size, backed_up_size, fork_pid);
+					(*subpart)->Stats = NULL;
+					if (!subpart_ok) {
+						Part->Stats = NULL;
 						return false;
 					}
 					sync();
 					sync();
+					stage_start = twrpStats::Now();
 					if (!Make_MD5(generate_md5, Backup_Folder, (*subpart)->Backup_FileName)) {
-						TWFunc::SetPerformanceMode(false);
+						Part->Stats = NULL;
 						return false;
 					}
-					if (Part->Backup_Method == 1) {
-						*file_bytes_remaining -= (*subpart)->Backup_Size;
-					} else {
-						*img_bytes_remaining -= (*subpart)->Backup_Size;
-					}
-					current_size += Part->Backup_Size;
-					pos = (float)(current_size / total_size);
-					DataManager::SetProgress(pos);
+					if (generate_md5)
+						stats.Add(TWSTAT_DIGEST, twrpStats::Now() - stage_start, TWFunc::Get_File_Size(Backup_Folder + (*subpart)->Backup_FileName));
+					if ((*subpart)->Backup_Method != 1)
+						__sync_add_and_fetch(backed_up_size, (*subpart)->Backup_Size);
+					DataManager::SetProgress((float)(*backed_up_size) / (float)(*total_size));
 				}
 			}
 		}
 		time(&stop);
-		int backup_time = (int) difftime(stop, start);
-		LOGINFO("Partition Backup time: %d\n", backup_time);
-		if (Part->Backup_Method == 1) {
-			*file_bytes_remaining -= Part->Backup_Size;
-			*file_time += backup_time;
-		} else {
-			*img_bytes_remaining -= Part->Backup_Size;
-			*img_time += backup_time;
-		}
+		*backup_time = (unsigned long) difftime(stop, start);
+		LOGINFO("Partition Backup time: %lu\n", *backup_time);
 
+		stage_start = twrpStats::Now();
 		md5Success = Make_MD5(generate_md5, Backup_Folder, Part->Backup_FileName);
-		TWFunc::SetPerformanceMode(false);
+		if (generate_md5)
+			stats.Add(TWSTAT_DIGEST, twrpStats::Now() - stage_start, TWFunc::Get_File_Size(Backup_Folder + Part->Backup_FileName));
+		Part->Stats = NULL;
+		if (md5Success) {
+			stats.Log_Summary(Part->Backup_Display_Name, "Backup", twrpStats::Now() - wall_start);
+			string report = Backup_Folder + Part->Backup_Name + ".backup-stats.json";
+			if (stats.Write_Report(report, Part->Backup_Name, "backup", twrpStats::Now() - wall_start))
+				tw_set_default_metadata(report.c_str());
+		}
 		return md5Success;
 	} else {
-		Clean_Backup_Folder(Backup_Folder);
-		TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
-		tw_set_default_metadata(backup_log.c_str());
-		TWFunc::SetPerformanceMode(false);
+		Part->Stats = NULL;
 		return false;
 	}
 	return 0;
 }
 
+// Returns the whole disk a block device belongs to, e.g. mmcblk0 for
+// /dev/block/mmcblk0p12, so partitions that share a disk can be kept
+// from being read at the same time.
+static string Get_Backup_Disk(const string& Block_Device) {
+	char path[PATH_MAX];
+	string name, sys_path;
+
+	if (Block_Device.empty())
+		return "mtd"; // MTD and BML images all come off the one flash chip
+	if (!realpath(Block_Device.c_str(), path))
+		return Block_Device;
+	name = TWFunc::Get_Filename(path);
+	sys_path = "/sys/class/block/" + name;
+	if (!realpath(sys_path.c_str(), path))
+		return name;
+	sys_path = path;
+	if (!TWFunc::Path_Exists(sys_path + "/partition"))
+		return name;
+	// A partition's sysfs node sits inside its disk's node
+	sys_path = TWFunc::Get_Path(sys_path);
+	return TWFunc::Get_Filename(TWFunc::Remove_Trailing_Slashes(sys_path));
+}
+
+struct Backup_Schedule;
+
+// One partition, together with its subpartitions, queued by Run_Backup
+struct Backup_Job {
+	Backup_Schedule* Schedule;
+	TWPartition* Part;
+	string Disk;                    // Whole disk the partition is read from
+	bool Is_Image;                  // Image backups are disk-bound, tar ones mostly CPU-bound
+	bool Started;
+	bool Running;
+	int Slot;                       // Index into tar_fork_pids while running
+	time_t Start;
+	unsigned long Backup_Time;
+	bool Result;
+	pthread_t Thread;
+	bool Has_Thread;
+};
+
+// State shared between Run_Backup and its backup threads
+struct Backup_Schedule {
+	TWPartitionManager* Manager;
+	string Backup_Folder;
+	bool Generate_MD5;
+	unsigned long long Total_Size;
+	unsigned long long Backed_Up_Size;  // Advanced by every running backup
+	std::vector<Backup_Job> Jobs;
+	int Running;
+	bool Slot_Used[TW_BACKUP_MAX_JOBS];
+	bool Failed;
+	pthread_mutex_t Lock;
+	pthread_cond_t Done;
+};
+
+static bool Backup_Job_Starts_Before(const Backup_Job* a, const Backup_Job* b) {
+	return a->Start < b->Start;
+}
+
+// Seconds during which at least one image (or tar) job was running
+static unsigned long Backup_Wall_Time(const std::vector<Backup_Job>& Jobs, bool Is_Image) {
+	std::vector<const Backup_Job*> jobs;
+	unsigned long total = 0;
+	time_t span_start = 0, span_stop = 0;
+
+	for (size_t i = 0; i < Jobs.size(); i++) {
+		if (Jobs[i].Started && Jobs[i].Is_Image == Is_Image)
+			jobs.push_back(&Jobs[i]);
+	}
+	std::sort(jobs.begin(), jobs.end(), Backup_Job_Starts_Before);
+	for (size_t i = 0; i < jobs.size(); i++) {
+		time_t stop = jobs[i]->Start + jobs[i]->Backup_Time;
+		if (i == 0 || jobs[i]->Start > span_stop) {
+			total += span_stop - span_start;
+			span_start = jobs[i]->Start;
+			span_stop = stop;
+		} else if (stop > span_stop) {
+			span_stop = stop;
+		}
+	}
+	return total + (span_stop - span_start);
+}
+
+void* TWPartitionManager::Backup_Thread(void* cookie) {
+	Backup_Job* job = (Backup_Job*) cookie;
+	Backup_Schedule* sched = job->Schedule;
+
+	time(&job->Start);
+	job->Result = sched->Manager->Backup_Partition(job->Part, sched->Backup_Folder, sched->Generate_MD5, &sched->Total_Size, &sched->Backed_Up_Size, sched->Manager->tar_fork_pids[job->Slot], &job->Backup_Time);
+
+	pthread_mutex_lock(&sched->Lock);
+	sched->Manager->tar_fork_pids[job->Slot] = 0;
+	sched->Slot_Used[job->Slot] = false;
+	job->Running = false;
+	sched->Running--;
+	if (!job->Result)
+		sched->Failed = true;
+	pthread_cond_broadcast(&sched->Done);
+	pthread_mutex_unlock(&sched->Lock);
+	return NULL;
+}
+
 void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 	DIR *d = opendir(Backup_Folder.c_str());
 	struct dirent *p;
@@ -638,29 +737,37 @@ int TWPartitionManager::Cancel_Backup() {
 
 	stop_backup.set_value(1);
 
-	if (tar_fork_pid != 0) {
+	bool killed = false;
+	for (int i = 0; i < TW_BACKUP_MAX_JOBS; i++) {
+		pid_t pid = tar_fork_pids[i];
+		if (pid == 0)
+			continue;
+		LOGINFO("Killing pid: %d\n", pid);
+		kill(pid, SIGUSR2);
+		while (kill(pid, 0) == 0) {
+			usleep(1000);
+		}
+		tar_fork_pids[i] = 0;
+		killed = true;
+	}
+	if (killed) {
 		DataManager::GetValue(TW_BACKUP_NAME, Backup_Name);
 		DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, Backup_Folder);
 		Full_Backup_Path = Backup_Folder + "/" + Backup_Name + "/";
-		LOGINFO("Killing pid: %d\n", tar_fork_pid);
-		kill(tar_fork_pid, SIGUSR2);
-		while (kill(tar_fork_pid, 0) == 0) {
-			usleep(1000);
-		}
 		LOGINFO("Backup_Run stopped and returning false, backup cancelled.\n");
 		LOGINFO("Removing directory %s\n", Full_Backup_Path.c_str());
 		TWFunc::removeDir(Full_Backup_Path, false);
-		tar_fork_pid = 0;
 	}
 
 	return 0;
 }
 
 int TWPartitionManager::Run_Backup(void) {
-	int check, do_md5, partition_count = 0, disable_free_space_check = 0;
+	int check, do_md5, partition_count = 0, disable_free_space_check = 0, max_jobs = 1;
 	string Backup_Folder, Backup_Name, Full_Backup_Path, Backup_List, backup_path;
-	unsigned long long total_bytes = 0, file_bytes = 0, img_bytes = 0, free_space = 0, img_bytes_remaining, file_bytes_remaining, subpart_size;
+	unsigned long long total_bytes = 0, file_bytes = 0, img_bytes = 0, free_space = 0, subpart_size;
 	unsigned long img_time = 0, file_time = 0;
+	Backup_Schedule sched;
 	TWPartition* backup_part = NULL;
 	TWPartition* storage = NULL;
 	std::vector<TWPartition*>::iterator subpart;
@@ -673,7 +780,8 @@ int TWPartitionManager::Run_Backup(void) {
 
 	time(&total_start);
 
-	Update_System_Details();
+	// The backup sizes below have to be current even in a batch
+	Update_System_Details(true);
 
 	if (!Mount_Current_Storage(true))
 		return false;
@@ -754,9 +862,6 @@ int TWPartitionManager::Run_Backup(void) {
 			return false;
 		}
 	}
-	img_bytes_remaining = img_bytes;
-	file_bytes_remaining = file_bytes;
-
 	gui_msg("backup_started=[BACKUP STARTED]");
 	gui_msg(Msg("backup_folder= * Backup Folder: {1}")(Full_Backup_Path));
 	if (!TWFunc::Recursive_Mkdir(Full_Backup_Path)) {
@@ -766,16 +871,34 @@ int TWPartitionManager::Run_Backup(void) {
 
 	DataManager::SetProgress(0.0);
 
+	sched.Manager = this;
+	sched.Backup_Folder = Full_Backup_Path;
+	sched.Generate_MD5 = do_md5;
+	sched.Total_Size = total_bytes;
+	sched.Backed_Up_Size = 0;
+	sched.Running = 0;
+	sched.Failed = false;
+	memset(sched.Slot_Used, 0, sizeof(sched.Slot_Used));
+
 	start_pos = 0;
 	end_pos = Backup_List.find(";", start_pos);
 	while (end_pos != string::npos && start_pos < Backup_List.size()) {
-		if (stop_backup.get_value() != 0)
-			return -1;
 		backup_path = Backup_List.substr(start_pos, end_pos - start_pos);
 		backup_part = Find_Partition_By_Path(backup_path);
 		if (backup_part != NULL) {
-			if (!Backup_Partition(backup_part, Full_Backup_Path, do_md5, &img_bytes_remaining, &file_bytes_remaining, &img_time, &file_time, &img_bytes, &file_bytes))
-				return false;
+			Backup_Job job;
+			job.Schedule = &sched;
+			job.Part = backup_part;
+			job.Disk = Get_Backup_Disk(backup_part->Actual_Block_Device);
+			job.Is_Image = backup_part->Backup_Method != 1;
+			job.Started = false;
+			job.Running = false;
+			job.Slot = 0;
+			job.Start = 0;
+			job.Backup_Time = 0;
+			job.Result = false;
+			job.Has_Thread = false;
+			sched.Jobs.push_back(job);
 		} else {
 			gui_msg(Msg(msg::kError, "unable_to_locate_partition=Unable to locate '{1}' partition for backup calculations.")(backup_path));
 		}
@@ -783,6 +906,93 @@ int TWPartitionManager::Run_Backup(void) {
 		end_pos = Backup_List.find(";", start_pos);
 	}
 
+	// Back up partitions side by side as long as they don't compete for
+	// the same thing: two images, or two tars, of the same disk are run
+	// one after the other, while e.g. a boot image and a data tar, or
+	// partitions on different disks, overlap.  tw_backup_jobs caps how
+	// many run at once and defaults to 1, one partition at a time as
+	// before.
+	DataManager::GetValue(TW_BACKUP_JOBS_VAR, max_jobs);
+	if (max_jobs < 1)
+		max_jobs = 1;
+	if (max_jobs > TW_BACKUP_MAX_JOBS)
+		max_jobs = TW_BACKUP_MAX_JOBS;
+
+	TWFunc::SetPerformanceMode(true);
+	pthread_mutex_init(&sched.Lock, NULL);
+	pthread_cond_init(&sched.Done, NULL);
+	pthread_mutex_lock(&sched.Lock);
+	for (;;) {
+		Backup_Job* next = NULL;
+		bool pending = false;
+
+		if (!sched.Failed && stop_backup.get_value() == 0) {
+			for (size_t i = 0; i < sched.Jobs.size(); i++) {
+				if (sched.Jobs[i].Started)
+					continue;
+				pending = true;
+				if (sched.Running >= max_jobs)
+					break;
+				bool conflict = false;
+				for (size_t j = 0; j < sched.Jobs.size() && !conflict; j++) {
+					if (sched.Jobs[j].Running && sched.Jobs[j].Disk == sched.Jobs[i].Disk && sched.Jobs[j].Is_Image == sched.Jobs[i].Is_Image)
+						conflict = true;
+				}
+				if (!conflict) {
+					next = &sched.Jobs[i];
+					break;
+				}
+			}
+		}
+		if (next == NULL) {
+			if (sched.Running == 0 && (!pending || sched.Failed || stop_backup.get_value() != 0))
+				break;
+			pthread_cond_wait(&sched.Done, &sched.Lock);
+			continue;
+		}
+
+		next->Started = true;
+		next->Running = true;
+		for (next->Slot = 0; sched.Slot_Used[next->Slot]; next->Slot++)
+			;
+		sched.Slot_Used[next->Slot] = true;
+		sched.Running++;
+		LOGINFO("Backing up %s (%s %s) alongside %i other partition(s)\n", next->Part->Mount_Point.c_str(), next->Disk.c_str(), next->Is_Image ? "image" : "tar", sched.Running - 1);
+		if (max_jobs > 1 && pthread_create(&next->Thread, NULL, Backup_Thread, (void*)next) == 0) {
+			next->Has_Thread = true;
+		} else {
+			// One at a time, or no thread to be had: back it up here
+			pthread_mutex_unlock(&sched.Lock);
+			Backup_Thread((void*)next);
+			pthread_mutex_lock(&sched.Lock);
+		}
+	}
+	pthread_mutex_unlock(&sched.Lock);
+
+	for (size_t i = 0; i < sched.Jobs.size(); i++) {
+		if (sched.Jobs[i].Has_Thread)
+			pthread_join(sched.Jobs[i].Thread, NULL);
+	}
+	pthread_cond_destroy(&sched.Done);
+	pthread_mutex_destroy(&sched.Lock);
+	TWFunc::SetPerformanceMode(false);
+
+	if (stop_backup.get_value() != 0)
+		return -1;
+	if (sched.Failed) {
+		// Only now that no job is writing to the folder any more
+		Clean_Backup_Folder(Full_Backup_Path);
+		string backup_log = Full_Backup_Path + "recovery.log";
+		TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
+		tw_set_default_metadata(backup_log.c_str());
+		return false;
+	}
+
+	// Rates are over the wall-clock time spent on each kind of backup;
+	// adding up the times of jobs that overlapped would undercount them
+	img_time = Backup_Wall_Time(sched.Jobs, true);
+	file_time = Backup_Wall_Time(sched.Jobs, false);
+
 	// Average BPS
 	if (img_time == 0)
 		img_time = 1;
@@ -831,10 +1041,15 @@ int TWPartitionManager::Run_Backup(void) {
 
 bool TWPartitionManager::Restore_Partition(TWPartition* Part, string Restore_Name, int partition_count, const unsigned long long *total_restore_size, unsigned long long *already_restored_size) {
 	time_t Start, Stop;
+	twrpStats stats;
+	uint64_t wall_start = twrpStats::Now();
 	TWFunc::SetPerformanceMode(true);
 	time(&Start);
 	//DataManager::ShowProgress(1.0 / (float)partition_count, 150);
-	if (!Part->Restore(Restore_Name, total_restore_size, already_restored_size)) {
+	Part->Stats = &stats;
+	bool ret = Part->Restore(Restore_Name, total_restore_size, already_restored_size);
+	Part->Stats = NULL;
+	if (!ret) {
 		TWFunc::SetPerformanceMode(false);
 		return false;
 	}
@@ -843,7 +1058,10 @@ bool TWPartitionManager::Restore_Partition(TWPartition* Part, string Restore_Nam
 
 		for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 			if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == Part->Mount_Point) {
-				if (!(*subpart)->Restore(Restore_Name, total_restore_size, already_restored_size)) {
+				(*subpart)->Stats = &stats;
+				ret = (*subpart)->Restore(Restore_Name, total_restore_size, already_restored_size);
+				(*subpart)->Stats = NULL;
+				if (!ret) {
 					TWFunc::SetPerformanceMode(false);
 					return false;
 				}
@@ -852,6 +1070,11 @@ bool TWPartitionManager::Restore_Partition(TWPartition* Part, string Restore_Nam
 	}
 	time(&Stop);
 	TWFunc::SetPerformanceMode(false);
+	stats.Log_Summary(Part->Backup_Display_Name, "Restore", twrpStats::Now() - wall_start);
+	// Restoring must not add files to the backup being restored, so the
+	// report goes next to the recovery log instead.
+	string report = "/tmp/" + Part->Backup_Name + ".restore-stats.json";
+	stats.Write_Report(report, Part->Backup_Name, "restore", twrpStats::Now() - wall_start);
 	gui_msg(Msg("restort_part_done=[{1} done ({2} seconds)]")(Part->Backup_Display_Name)((int)difftime(Stop, Start)));
 	return true;
 }
@@ -1294,14 +1517,63 @@ int TWPartitionManager::Resize_By_Path(string Path, bool Display_Error) {
 	return false;
 }
 
-void TWPartitionManager::Update_System_Details(void) {
+static void* Update_Size_Thread(void* cookie) {
+	TWPartition* Part = (TWPartition*) cookie;
+
+	Part->Update_Size(true);
+	return NULL;
+}
+
+void TWPartitionManager::Update_System_Details(bool Force) {
+	// Only the size scan is deferred; fstab and storage always have to
+	// follow block device changes such as a decrypt right away
+	if (details_deferred && !Force) {
+		LOGINFO("Deferring partition size update\n");
+		details_stale = true;
+	} else {
+		details_stale = false;
+		Update_Partition_Sizes();
+	}
+
+	Update_Storage_Sizes();
+
+	if (!Write_Fstab())
+		LOGERR("Error creating fstab\n");
+	return;
+}
+
+void TWPartitionManager::Update_Partition_Sizes(void) {
 	std::vector<TWPartition*>::iterator iter;
+	std::vector<pthread_t> threads;
+	std::vector<TWPartition*> bound;
 	int data_size = 0;
 
 	gui_msg("update_part_details=Updating partition details...");
+	// Size the partitions concurrently; mounting is serialized inside
+	// Update_Size so only the folder scans overlap.  Bound partitions
+	// wait until their source partition is done.
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Can_Be_Mounted) {
+		if (!(*iter)->Can_Be_Mounted)
+			continue;
+		if (!(*iter)->Bind_Of.empty()) {
+			bound.push_back(*iter);
+			continue;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Update_Size_Thread, (void*)(*iter)) == 0) {
+			threads.push_back(thread);
+		} else {
+			LOGINFO("Unable to create size thread for '%s', sizing inline\n", (*iter)->Mount_Point.c_str());
 			(*iter)->Update_Size(true);
+		}
+	}
+	for (std::vector<pthread_t>::iterator thread = threads.begin(); thread != threads.end(); thread++)
+		pthread_join(*thread, NULL);
+	for (iter = bound.begin(); iter != bound.end(); iter++)
+		(*iter)->Update_Size(true);
+
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		if ((*iter)->Can_Be_Mounted) {
 			if ((*iter)->Mount_Point == "/system") {
 				int backup_display_size = (int)((*iter)->Backup_Size / 1048576LLU);
 				DataManager::SetValue(TW_BACKUP_SYSTEM_SIZE, backup_display_size);
@@ -1396,12 +1668,6 @@ void TWPartitionManager::Update_System_Details(void) {
 	}
 	gui_msg("update_part_details_done=...done");
 	DataManager::SetValue(TW_BACKUP_DATA_SIZE, data_size);
-
-	Update_Storage_Sizes();
-
-	if (!Write_Fstab())
-		LOGERR("Error creating fstab\n");
-	return;
 }
 
 void TWPartitionManager::Update_Storage_Sizes()
@@ -1510,6 +1776,8 @@ int TWPartitionManager::Fix_Permissions(void) {
 	if (result == 0 && DataManager::GetIntValue("tw_fixperms_restorecon") == 1)
 		result = perms.fixContexts();
 #endif
+	du.Clear_Cache();
+	twrpFSProbe::Invalidate_All();
 	UnMount_Main_Partitions();
 	gui_msg("done=Done.");
 	return result;
@@ -1645,6 +1913,14 @@ int TWPartitionManager::usb_storage_disable(void) {
 	return true;
 }
 
+void TWPartitionManager::Defer_System_Details(bool Defer) {
+	// Batched operations (OpenRecoveryScript) each end with a full size
+	// scan of every partition; only the last one is ever looked at.
+	details_deferred = Defer;
+	if (!Defer && details_stale)
+		Update_System_Details();
+}
+
 void TWPartitionManager::Mount_All_Storage(void) {
 	std::vector<TWPartition*>::iterator iter;
 
@@ -1981,6 +2257,13 @@ TWPartition *TWPartitionManager::Get_Default_Storage_Partition()
 	return res;
 }
 
+#ifdef TW_HAS_MTP
+static void MTP_Storage_Changed(void) {
+	// Runs in the forked MTP server after it wrote to storage
+	du.Mark_Changed();
+}
+#endif
+
 bool TWPartitionManager::Enable_MTP(void) {
 #ifdef TW_HAS_MTP
 	if (mtppid) {
@@ -2015,6 +2298,7 @@ bool TWPartitionManager::Enable_MTP(void) {
 	 * twrp set tw_mtp_debug 1
 	 */
 	twrpMtp *mtp = new twrpMtp(DataManager::GetIntValue("tw_mtp_debug"));
+	mtp->setStorageChangedCallback(MTP_Storage_Changed);
 	mtppid = mtp->forkserver(mtppipe);
 	if (mtppid) {
 		close(mtppipe[0]); // Host closes read side
@@ -24,8 +24,10 @@
 #include <list>
 #include "twrpDU.hpp"
 #include "tw_atomic.hpp"
+#include "twrpStats.hpp"
 
 #define MAX_FSTAB_LINE_LENGTH 2048
+#define TW_BACKUP_MAX_JOBS 4                    // Most partitions Run_Backup backs up at once
 
 using namespace std;
 
@@ -65,7 +67,7 @@ public:
 	bool Repair();                                                            // Repairs the current file system
 	bool Can_Resize();                                                        // Checks to see if we have everything needed to be able to resize the current file system
 	bool Resize();                                                            // Resizes the current file system
-	bool Backup(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size, pid_t &tar_fork_pid); // Backs up the partition to the folder specified
+	bool Backup(string backup_folder, const unsigned long long *overall_size, unsigned long long *backed_up_size, pid_t &tar_fork_pid); // Backs up the partition to the folder specified
 	bool Check_MD5(string restore_folder);                                    // Checks MD5 of a backup
 	bool Restore(string restore_folder, const unsigned long long *total_restore_size, unsigned long long *already_restored_size); // Restores the partition using the backup folder provided
 	unsigned long long Get_Restore_Size(string restore_folder);               // Returns the overall restore size of the backup
@@ -119,17 +121,18 @@ private:
 	bool Wipe_EXFAT();                                                        // Formats as EXFAT
 	bool Wipe_MTD();                                                          // Formats as yaffs2 for MTD memory types
 	bool Wipe_RMRF();                                                         // Uses rm -rf to wipe
+	void Discard_Block_Device(void);                                          // Discards the block device before formatting when tw_wipe_discard is set
 	bool Wipe_F2FS();                                                         // Uses mkfs.f2fs to wipe
 	bool Wipe_NTFS();                                                         // Uses mkntfs to wipe
 	bool Wipe_Data_Without_Wiping_Media();                                    // Uses rm -rf to wipe but does not wipe /data/media
-	bool Backup_Tar(string backup_folder, const unsigned long long *overall_size, const unsigned long long *other_backups_size, pid_t &tar_fork_pid); // Backs up using tar for file systems
+	bool Backup_Tar(string backup_folder, const unsigned long long *overall_size, unsigned long long *backed_up_size, pid_t &tar_fork_pid); // Backs up using tar for file systems
 	bool Backup_DD(string backup_folder);                                     // Backs up using dd for emmc memory types
 	bool Backup_Dump_Image(string backup_folder);                             // Backs up using dump_image for MTD memory types
 	string Get_Restore_File_System(string restore_folder);                    // Returns the file system that was in place at the time of the backup
 	bool Restore_Tar(string restore_folder, string Restore_File_System, const unsigned long long *total_restore_size, unsigned long long *already_restored_size); // Restore using tar for file systems
 	bool Restore_Image(string restore_folder, const unsigned long long *total_restore_size, unsigned long long *already_restored_size, string Restore_File_System); // Restore using dd for images
 	bool Get_Size_Via_statfs(bool Display_Error);                             // Get Partition size, used, and free space using statfs
-	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space using df command
+	bool Get_Size_Via_Superblock(bool Display_Error);                         // Get Partition size, used, and free space from the filesystem superblock
 	bool Make_Dir(string Path, bool Display_Error);                           // Creates a directory if it doesn't already exist
 	bool Find_MTD_Block_Device(string MTD_Name);                              // Finds the mtd block device based on the name from the fstab
 	void Recreate_AndSec_Folder(void);                                        // Recreates the .android_secure folder
@@ -155,6 +158,7 @@ private:
 	string Alternate_Block_Device;                                            // Alternate block device (e.g. /dev/block/mmcblk1)
 	string Decrypted_Block_Device;                                            // Decrypted block device available after decryption
 	bool Removable;                                                           // Indicates if this partition is removable -- affects how often we check overall size, if present, etc.
+	bool Sizing;                                                              // Update_Size is mounting this partition, so Mount leaves the sizes to it
 	int Length;                                                               // Used by make_ext4fs to leave free space at the end of the partition block for things like a crypto footer
 	unsigned long long Size;                                                  // Overall size of the filesystem on the partition
 	unsigned long long Used;                                                  // Overall used space
@@ -188,6 +192,7 @@ private:
 	string Bind_Of;                                                           // Path to partition which is this partition bound to
 	bool Mount_Read_Only;                                                     // Only mount this partition as read-only
 	bool Is_ImageMount;                                                       // This is true if the partition is on .img file
+	twrpStats* Stats;                                                         // Stage timings for the backup or restore in progress, not owned, may be NULL
 
 friend class TWPartitionManager;
 friend class DataManager;
@@ -230,7 +235,8 @@ public:
 	int Wipe_Media_From_Data();                                               // Removes and recreates the media folder on /data/media devices
 	int Repair_By_Path(string Path, bool Display_Error);                      // Repairs a partition based on path
 	int Resize_By_Path(string Path, bool Display_Error);                      // Resizes a partition based on path
-	void Update_System_Details();                                             // Updates fstab, file systems, sizes, etc.
+	void Update_System_Details(bool Force = false);                           // Updates fstab, file systems, sizes, etc.
+	void Defer_System_Details(bool Defer);                                    // While deferred, Update_System_Details skips the size scan unless forced
 	int Decrypt_Device(string Password);                                      // Attempt to decrypt any encrypted partitions
 	int usb_storage_enable(void);                                             // Enable USB storage mode
 	int usb_storage_disable(void);                                            // Disable USB storage mode
@@ -268,9 +274,11 @@ public:
 
 private:
 	void Setup_Settings_Storage_Partition(TWPartition* Part);                 // Sets up settings storage
+	void Update_Partition_Sizes();                                            // Sizes every partition and publishes the backup sizes
 	void Setup_Android_Secure_Location(TWPartition* Part);                    // Sets up .android_secure if needed
 	bool Make_MD5(bool generate_md5, string Backup_Folder, string Backup_Filename); // Generates an MD5 after a backup is made
-	bool Backup_Partition(TWPartition* Part, string Backup_Folder, bool generate_md5, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long *img_time, unsigned long *file_time, unsigned long long *img_bytes, unsigned long long *file_bytes);
+	bool Backup_Partition(TWPartition* Part, string Backup_Folder, bool generate_md5, const unsigned long long* total_size, unsigned long long* backed_up_size, pid_t &fork_pid, unsigned long *backup_time);
+	static void* Backup_Thread(void* cookie);                                 // Backs up one partition scheduled by Run_Backup
 	void Output_Partition(TWPartition* Part);
 	TWPartition* Find_Partition_By_MTP_Storage_ID(unsigned int Storage_ID);   // Returns a pointer to a partition based on MTP Storage ID
 	bool Add_Remove_MTP_Storage(TWPartition* Part, int message_type);   // Adds or removes an MTP Storage partition
@@ -279,7 +287,9 @@ private:
 	pid_t mtppid;
 	bool mtp_was_enabled;
 	int mtp_write_fd;
-	pid_t tar_fork_pid;
+	pid_t tar_fork_pids[TW_BACKUP_MAX_JOBS];                                  // Tar processes of the partitions being backed up
+	bool details_deferred;                                                    // Update_System_Details is being batched, see Defer_System_Details
+	bool details_stale;                                                       // A deferred size scan is still pending
 
 private:
 	std::vector<TWPartition*> Partitions;                                     // Vector list of all partitions
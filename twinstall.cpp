@@ -39,6 +39,8 @@
 #include "data.hpp"
 #include "partitions.hpp"
 #include "twrpDigest.hpp"
+#include "twrpDU.hpp"
+#include "twrpFSProbe.hpp"
 #include "twrp-functions.hpp"
 #include "gui/gui.hpp"
 extern "C" {
@@ -178,6 +180,12 @@ static int Run_Update_Binary(const char *path, ZipArchive *Zip, int* wipe_cache)
 	args[3] = (char*)path;
 	args[4] = NULL;
 
+	// Ask our updater for a per-function profile in the log
+	if (DataManager::GetIntValue(TW_UPDATER_PROFILE_VAR) == 1)
+		setenv("UPDATER_PROFILE", "1", 1);
+	else
+		unsetenv("UPDATER_PROFILE");
+
 	pid_t pid = fork();
 	if (pid == 0) {
 		close(pipe_fd[0]);
@@ -301,5 +309,9 @@ extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
 	}
 	ret_val = Run_Update_Binary(path, &Zip, wipe_cache);
 	sysReleaseMap(&map);
+	// Every install path (GUI, OpenRecoveryScript, sideload) ends here.
+	// Block based OTAs write straight to the unmounted partitions.
+	du.Clear_Cache();
+	twrpFSProbe::Invalidate_All();
 	return ret_val;
 }
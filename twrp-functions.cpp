@@ -26,17 +26,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/mount.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/reboot.h>
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <ctype.h>
 #include <algorithm>
+#include <deque>
+#include <pthread.h>
 
 #include "twrp-functions.hpp"
 #include "twcommon.h"
@@ -48,10 +54,12 @@
 #include "cutils/properties.h"
 #include "cutils/android_reboot.h"
 #include "gui/gui.hpp"
+#include "cp_xattrs/libcp_xattrs.h"
 #include <sys/reboot.h>
 #endif // ndef BUILD_TWRPTAR_MAIN
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	#include "openaes/inc/oaes_lib.h"
+	#include "twrpAES.hpp"
 #endif
 
 extern "C" {
@@ -69,63 +77,208 @@ extern "C" {
 #include <selinux/label.h>
 #endif
 
-/* Execute a command */
-int TWFunc::Exec_Cmd(const string& cmd, string &result) {
-	FILE* exec;
-	char buffer[130];
-	int ret = 0;
-	exec = __popen(cmd.c_str(), "r");
-	if (!exec) return -1;
-	while(!feof(exec)) {
-		if (fgets(buffer, 128, exec) != NULL) {
-			result += buffer;
-		}
+// Output from commands is read through this much buffer at a time
+#define EXEC_READ_SIZE (64 * 1024)
+
+// Interprets a wait() status the way Wait_For_Child reports it
+static int Check_Child_Status(int status, const string& Child_Name) {
+	if (WIFSIGNALED(status)) {
+		gui_msg(Msg(msg::kError, "pid_signal={1} process ended with signal: {2}")(Child_Name)(WTERMSIG(status))); // Seg fault or some other non-graceful termination
+		return -1;
+	} else if (WEXITSTATUS(status) == 0) {
+		LOGINFO("%s process ended with RC=%d\n", Child_Name.c_str(), WEXITSTATUS(status)); // Success
+	} else {
+		gui_msg(Msg(msg::kError, "pid_error={1} process ended with ERROR: {2}")(Child_Name)(WEXITSTATUS(status))); // Graceful exit, but there was an error
+		return -1;
 	}
-	ret = __pclose(exec);
-	return ret;
+	return 0;
 }
 
-int TWFunc::Exec_Cmd(const string& cmd) {
+// Returns the command line Args stands for, for logging
+static string Command_Name(const vector<string>& Args) {
+	string name;
+
+	if (Args.size() == 3 && Args[1] == "-c")
+		return Args[2]; // sh -c "command"
+	for (size_t i = 0; i < Args.size(); i++) {
+		if (i)
+			name += " ";
+		name += Args[i];
+	}
+	return name;
+}
+
+// Starts argv with vfork, without going through a shell unless argv
+// asks for one, and waits for it to finish.  stdout (and stderr when
+// Capture_Stderr is set) is read into Result and/or shown in the GUI
+// line by line when either is requested; otherwise the child shares
+// the recovery's output.  The child is killed if it runs for longer
+// than Timeout seconds (0 waits forever).  Returns the raw wait status,
+// or -1 if the command could not be run or timed out.
+int TWFunc::Run_Command(const vector<string>& Args, string* Result, bool Show_Output, bool Capture_Stderr, int Timeout) {
+	vector<char*> argv;
+	int pipefd[2] = {-1, -1};
+	bool capture = Result || Show_Output;
+	bool timed_out = false;
+	int status = -1;
+	timespec start, now;
 	pid_t pid;
-	int status;
-	switch(pid = fork())
-	{
-		case -1:
-			LOGERR("Exec_Cmd(): vfork failed: %d!\n", errno);
-			return -1;
-		case 0: // child
-			execl("/sbin/sh", "sh", "-c", cmd.c_str(), NULL);
-			_exit(127);
+
+	if (Args.empty())
+		return -1;
+	for (size_t i = 0; i < Args.size(); i++)
+		argv.push_back(const_cast<char*>(Args[i].c_str()));
+	argv.push_back(NULL);
+
+	if (capture && pipe2(pipefd, O_CLOEXEC) != 0) {
+		LOGERR("Run_Command(): pipe failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = vfork();
+	if (pid < 0) {
+		LOGERR("Run_Command(): vfork failed: %d!\n", errno);
+		if (capture) {
+			close(pipefd[0]);
+			close(pipefd[1]);
+		}
+		return -1;
+	}
+	if (pid == 0) {
+		// Only async-signal-safe calls from here on, we share the
+		// parent's memory until exec
+		if (capture) {
+			dup2(pipefd[1], STDOUT_FILENO);
+			if (Capture_Stderr)
+				dup2(pipefd[1], STDERR_FILENO);
+		}
+		if (strchr(argv[0], '/'))
+			execv(argv[0], &argv[0]);
+		else
+			execvp(argv[0], &argv[0]);
+		_exit(127);
+	}
+
+	if (capture) {
+		char* buffer = (char*) malloc(EXEC_READ_SIZE);
+		string line;
+
+		close(pipefd[1]);
+		while (buffer) {
+			struct pollfd pfd;
+			int wait_ms = -1;
+
+			if (Timeout > 0) {
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				wait_ms = Timeout * 1000 - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+				if (wait_ms <= 0) {
+					timed_out = true;
+					break;
+				}
+			}
+			pfd.fd = pipefd[0];
+			pfd.events = POLLIN;
+			int ret = poll(&pfd, 1, wait_ms);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret == 0)
+				continue; // the deadline is checked at the top of the loop
+			ssize_t len = read(pipefd[0], buffer, EXEC_READ_SIZE);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0)
+				break;
+			if (Result)
+				Result->append(buffer, len);
+			if (Show_Output) {
+				line.append(buffer, len);
+				size_t pos;
+				while ((pos = line.find('\n')) != string::npos) {
+					gui_print("%s\n", line.substr(0, pos).c_str());
+					line.erase(0, pos + 1);
+				}
+			}
+		}
+		if (Show_Output && !line.empty())
+			gui_print("%s\n", line.c_str());
+		close(pipefd[0]);
+		free(buffer);
+	}
+
+	// A child that timed out while we were reading its output is still
+	// running; kill it first so the blocking wait below can reap it
+	if (timed_out)
+		kill(pid, SIGKILL);
+	for (;;) {
+		pid_t rc_pid = waitpid(pid, &status, timed_out ? 0 : (Timeout > 0 ? WNOHANG : 0));
+		if (rc_pid == pid)
 			break;
-		default:
-		{
-			if (TWFunc::Wait_For_Child(pid, &status, cmd) != 0)
-				return -1;
-			else
-				return 0;
+		if (rc_pid < 0 && errno == ECHILD) {
+			LOGERR("%s no child process exist\n", Args[0].c_str());
+			status = 0;
+			break;
+		} else if (rc_pid < 0 && errno != EINTR) {
+			LOGERR("%s Unexpected error %d\n", Args[0].c_str(), errno);
+			status = -1;
+			break;
+		}
+		if (rc_pid == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= Timeout * 1000) {
+				timed_out = true;
+				kill(pid, SIGKILL);
+			} else
+				usleep(10000);
 		}
 	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+	if (timed_out) {
+		LOGERR("'%s' timed out after %i seconds and was killed\n", Command_Name(Args).c_str(), Timeout);
+		return -1;
+	}
+	LOGINFO("'%s' finished in %li ms\n", Command_Name(Args).c_str(), ms);
+	return status;
 }
 
-int TWFunc::Exec_Cmd_Show_Output(const string& cmd) {
-	FILE* exec;
-	char buffer[130];
-	int ret = 0;
-	exec = __popen(cmd.c_str(), "r");
+/* Execute a command */
 
-	if (!exec)
+int TWFunc::Exec_Cmd(const string& cmd, string &result, int timeout) {
+	vector<string> args;
+	args.push_back("/sbin/sh");
+	args.push_back("-c");
+	args.push_back(cmd);
+	return Run_Command(args, &result, false, false, timeout);
+}
+
+int TWFunc::Exec_Cmd(const string& cmd, int timeout) {
+	vector<string> args;
+	args.push_back("/sbin/sh");
+	args.push_back("-c");
+	args.push_back(cmd);
+	int status = Run_Command(args, NULL, false, false, timeout);
+	if (status == -1)
 		return -1;
+	return Check_Child_Status(status, cmd);
+}
 
-	while(!feof(exec)) {
-		memset(buffer, 0, sizeof(buffer));
-		if (fgets(buffer, 128, exec) != NULL) {
-			buffer[128] = '\n';
-			buffer[129] = NULL;
-			gui_print(buffer);
-		}
-	}
-	ret = __pclose(exec);
-	return ret;
+int TWFunc::Exec_Cmd_Show_Output(const string& cmd) {
+	vector<string> args;
+	args.push_back("/sbin/sh");
+	args.push_back("-c");
+	args.push_back(cmd);
+	return Run_Command(args, NULL, true, false, 0);
+}
+
+int TWFunc::Exec_Args(const vector<string>& args, string* result, int timeout) {
+	string name = Command_Name(args);
+	LOGINFO("Running: %s\n", name.c_str());
+	int status = Run_Command(args, result, false, true, timeout);
+	if (status == -1)
+		return -1;
+	return Check_Child_Status(status, name);
 }
 
 // Returns "file.name" from a full /path/to/file.name
@@ -150,20 +303,16 @@ string TWFunc::Get_Path(string Path) {
 		return Path;
 }
 
-int TWFunc::Wait_For_Child(pid_t pid, int *status, string Child_Name) {
+int TWFunc::Wait_For_Child(pid_t pid, int *status, string Child_Name, struct rusage *usage) {
 	pid_t rc_pid;
 
-	rc_pid = waitpid(pid, status, 0);
+	if (usage) {
+		memset(usage, 0, sizeof(*usage));
+		rc_pid = wait4(pid, status, 0, usage);
+	} else
+		rc_pid = waitpid(pid, status, 0);
 	if (rc_pid > 0) {
-		if (WIFSIGNALED(*status)) {
-			gui_msg(Msg(msg::kError, "pid_signal={1} process ended with signal: {2}")(Child_Name)(WTERMSIG(*status))); // Seg fault or some other non-graceful termination
-			return -1;
-		} else if (WEXITSTATUS(*status) == 0) {
-			LOGINFO("%s process ended with RC=%d\n", Child_Name.c_str(), WEXITSTATUS(*status)); // Success
-		} else {
-			gui_msg(Msg(msg::kError, "pid_error={1} process ended with ERROR: {2}")(Child_Name)(WEXITSTATUS(*status))); // Graceful exit, but there was an error
-			return -1;
-		}
+		return Check_Child_Status(*status, Child_Name);
 	} else { // no PID returned
 		if (errno == ECHILD)
 			LOGERR("%s no child process exist\n", Child_Name.c_str());
@@ -206,16 +355,47 @@ int TWFunc::Get_File_Type(string fn) {
 	return 0;
 }
 
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+// Identifies the start of a decrypted file, see Try_Decrypting_File
+static int Decrypted_File_Type(const string& fn, const uint8_t* buffer, size_t len) {
+	if (len < 2) {
+		LOGINFO("Successfully decrypted '%s' but read length too small.\n", fn.c_str());
+		return 1; // Decrypted successfully
+	}
+	if (buffer[0] == 0x1f && buffer[1] == 0x8b) {
+		LOGINFO("Successfully decrypted '%s' and file is compressed.\n", fn.c_str());
+		return 3; // Compressed
+	}
+	if (len >= 262 && strncmp((const char*) buffer + 257, "ustar", 5) == 0) {
+		LOGINFO("Successfully decrypted '%s' and file is tar format.\n", fn.c_str());
+		return 2; // Tar
+	}
+	LOGINFO("No errors decrypting '%s' but no known file format.\n", fn.c_str());
+	return 1; // Decrypted successfully
+}
+#endif
+
 int TWFunc::Try_Decrypting_File(string fn, string password) {
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	if (twrpAES::Is_Container(fn)) {
+		uint8_t sample[4096];
+		size_t sample_len = sizeof(sample);
+		int ret = twrpAES::Try_Decrypt(fn, password, sample, &sample_len);
+		if (ret < 0)
+			LOGERR("Failed to read '%s' to try decrypt\n", fn.c_str());
+		else if (ret == 0)
+			LOGERR("Failed to decrypt file '%s'\n", fn.c_str());
+		else
+			ret = Decrypted_File_Type(fn, sample, sample_len);
+		return ret;
+	}
+
 	OAES_CTX * ctx = NULL;
 	uint8_t _key_data[32] = "";
 	FILE *f;
 	uint8_t buffer[4096];
 	uint8_t *buffer_out = NULL;
-	uint8_t *ptr = NULL;
 	size_t read_len = 0, out_len = 0;
-	int firstbyte = 0, secondbyte = 0, key_len;
 	size_t _j = 0;
 	size_t _key_data_len = 0;
 
@@ -274,31 +454,9 @@ int TWFunc::Try_Decrypting_File(string fn, string password) {
 	}
 	fclose(f);
 	oaes_free(&ctx);
-	if (out_len < 2) {
-		LOGINFO("Successfully decrypted '%s' but read length too small.\n", fn.c_str());
-		free(buffer_out);
-		return 1; // Decrypted successfully
-	}
-	ptr = buffer_out;
-	firstbyte = *ptr & 0xff;
-	ptr++;
-	secondbyte = *ptr & 0xff;
-	if (firstbyte == 0x1f && secondbyte == 0x8b) {
-		LOGINFO("Successfully decrypted '%s' and file is compressed.\n", fn.c_str());
-		free(buffer_out);
-		return 3; // Compressed
-	}
-	if (out_len >= 262) {
-		ptr = buffer_out + 257;
-		if (strncmp((char*)ptr, "ustar", 5) == 0) {
-			LOGINFO("Successfully decrypted '%s' and file is tar format.\n", fn.c_str());
-			free(buffer_out);
-			return 2; // Tar
-		}
-	}
+	int ret = Decrypted_File_Type(fn, buffer_out, out_len);
 	free(buffer_out);
-	LOGINFO("No errors decrypting '%s' but no known file format.\n", fn.c_str());
-	return 1; // Decrypted successfully
+	return ret;
 #else
 	LOGERR("Encrypted backup support not included.\n");
 	return -1;
@@ -362,6 +520,141 @@ vector<string> TWFunc::split_string(const string &in, char del, bool skip_empty)
 	return res;
 }
 
+// Largest single request handed to the kernel by copy_file
+#define COPY_CHUNK (8 * 1024 * 1024)
+
+// Copies len bytes at offset from one file to the same offset in the
+// other, in the kernel when it can: copy_file_range first (which also
+// lets filesystems share the blocks), then sendfile, then read/write.
+static bool Copy_File_Range(int in_fd, int out_fd, off64_t offset, off64_t len) {
+	static bool have_copy_file_range = true;
+	static bool have_sendfile = true;
+	char* buf = NULL;
+
+	while (len > 0) {
+		size_t chunk = len > COPY_CHUNK ? COPY_CHUNK : (size_t)len;
+		ssize_t ret = -1;
+#ifdef __NR_copy_file_range
+		if (have_copy_file_range) {
+			loff_t in_off = offset, out_off = offset;
+			ret = syscall(__NR_copy_file_range, in_fd, &in_off, out_fd, &out_off, chunk, 0);
+			if (ret < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+				if (errno == ENOSYS)
+					have_copy_file_range = false;
+				ret = -2;
+			}
+		} else
+#endif
+			ret = -2;
+		if (ret == -2 && have_sendfile) {
+			off_t in_off = offset;
+			if (lseek64(out_fd, offset, SEEK_SET) == offset) {
+				ret = sendfile(out_fd, in_fd, &in_off, chunk);
+				if (ret < 0 && (errno == ENOSYS || errno == EINVAL)) {
+					have_sendfile = false;
+					ret = -2;
+				}
+			}
+		}
+		if (ret == -2) {
+			if (!buf && !(buf = (char*) malloc(1024 * 1024)))
+				return false;
+			if (chunk > 1024 * 1024)
+				chunk = 1024 * 1024;
+			ret = pread64(in_fd, buf, chunk, offset);
+			if (ret > 0 && pwrite64(out_fd, buf, ret, offset) != ret)
+				ret = -1;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			free(buf);
+			return false;
+		}
+		offset += ret;
+		len -= ret;
+	}
+	free(buf);
+	return true;
+}
+
+int TWFunc::copy_file(string src, string dst, int mode, bool preserve_xattrs) {
+	struct stat st;
+	int in_fd, out_fd;
+	off64_t offset = 0, data, hole;
+	bool ok = true;
+
+	LOGINFO("Copying file %s to %s\n", src.c_str(), dst.c_str());
+	in_fd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		LOGINFO("Unable to open '%s': %s\n", src.c_str(), strerror(errno));
+		return -1;
+	}
+	if (fstat(in_fd, &st) != 0) {
+		close(in_fd);
+		return -1;
+	}
+	out_fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (out_fd < 0) {
+		LOGINFO("Unable to create '%s': %s\n", dst.c_str(), strerror(errno));
+		close(in_fd);
+		return -1;
+	}
+
+	// Only the data regions are copied, so holes in the source stay
+	// holes in the copy.  Without SEEK_DATA support the whole file is
+	// treated as data.  Files that don't report a size (proc, sysfs,
+	// devices) are simply read until EOF.
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		char buf[4096];
+		ssize_t len;
+		while ((len = read(in_fd, buf, sizeof(buf))) != 0) {
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0 || write(out_fd, buf, len) != len) {
+				ok = false;
+				break;
+			}
+		}
+		st.st_size = 0;
+	}
+	while (ok && offset < st.st_size) {
+		data = lseek64(in_fd, offset, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break; // only a hole remains
+			data = offset;
+			hole = st.st_size;
+		} else {
+			hole = lseek64(in_fd, data, SEEK_HOLE);
+			if (hole < 0 || hole > st.st_size)
+				hole = st.st_size;
+		}
+		if (hole > data)
+			ok = Copy_File_Range(in_fd, out_fd, data, hole - data);
+		offset = hole;
+	}
+	if (ok && st.st_size > 0 && ftruncate64(out_fd, st.st_size) != 0)
+		ok = false;
+	if (!ok)
+		LOGINFO("Unable to copy '%s' to '%s': %s\n", src.c_str(), dst.c_str(), strerror(errno));
+	close(in_fd);
+	if (close(out_fd) != 0)
+		ok = false;
+	if (!ok)
+		return -1;
+
+	if (chmod(dst.c_str(), mode < 0 ? (st.st_mode & 07777) : mode) != 0)
+		return -1;
+#ifndef BUILD_TWRPTAR_MAIN
+	if (preserve_xattrs && !cp_xattrs_single_file(src, dst))
+		return -1;
+#else
+	(void) preserve_xattrs;
+#endif
+	return 0;
+}
+
 #ifndef BUILD_TWRPTAR_MAIN
 
 // Returns "/path" from a full /path/to/file.name
@@ -611,60 +904,187 @@ void TWFunc::check_and_run_script(const char* script_file, const char* display_n
 	}
 }
 
-int TWFunc::removeDir(const string path, bool skipParent) {
-	DIR *d = opendir(path.c_str());
-	int r = 0;
-	string new_path;
+// Tree removal is spread over a pool of threads.  Every directory is a
+// node that any thread may empty; a node is rmdir'ed by whichever
+// thread finishes its last child, so parents always go after their
+// contents without any thread waiting on another.
+#define REMOVE_MAX_THREADS 8
+
+struct Remove_Node {
+	string path;
+	Remove_Node* parent;
+	int pending;           // this node's own scan plus unfinished child directories
+	bool remove_self;
+};
+
+struct Remove_Job {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	deque<Remove_Node*> queue;
+	int busy;
+	unsigned long long removed;
+	int error;
+};
+
+// Called with job->lock held once a node has no work left.
+static void Remove_Finish_Node(Remove_Job* job, Remove_Node* node) {
+	while (node && --node->pending == 0) {
+		Remove_Node* parent = node->parent;
+		if (node->remove_self) {
+			if (rmdir(node->path.c_str()) == 0) {
+				job->removed++;
+			} else {
+				LOGINFO("Unable to removeDir '%s': %s\n", node->path.c_str(), strerror(errno));
+				if (!job->error)
+					job->error = -1;
+			}
+		}
+		delete node;
+		node = parent;
+	}
+}
+
+static void Remove_Scan_Node(Remove_Job* job, Remove_Node* node) {
+	unsigned long long removed = 0;
+	vector<Remove_Node*> children;
+	// A root given as a symlink is followed, as opendir() did; below the
+	// root a directory swapped for a symlink mid-removal is not.
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	if (node->parent != NULL)
+		flags |= O_NOFOLLOW;
+	int fd = open(node->path.c_str(), flags);
+	DIR* d = (fd < 0) ? NULL : fdopendir(fd);
 
 	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
-		return -1;
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(node->path)(strerror(errno)));
+		if (fd >= 0)
+			close(fd);
+		pthread_mutex_lock(&job->lock);
+		if (!job->error)
+			job->error = -1;
+		node->remove_self = false;
+		Remove_Finish_Node(job, node);
+		pthread_mutex_unlock(&job->lock);
+		return;
 	}
 
-	if (d) {
-		struct dirent *p;
-		while (!r && (p = readdir(d))) {
-			if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-				continue;
-			new_path = path + "/";
-			new_path.append(p->d_name);
-			if (p->d_type == DT_DIR) {
-				r = removeDir(new_path, true);
-				if (!r) {
-					if (p->d_type == DT_DIR)
-						r = rmdir(new_path.c_str());
-					else
-						LOGINFO("Unable to removeDir '%s': %s\n", new_path.c_str(), strerror(errno));
-				}
-			} else if (p->d_type == DT_REG || p->d_type == DT_LNK || p->d_type == DT_FIFO || p->d_type == DT_SOCK) {
-				r = unlink(new_path.c_str());
-				if (r != 0) {
-					LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(), strerror(errno));
-				}
-			}
+	struct dirent* p;
+	while ((p = readdir(d)) != NULL) {
+		if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
+			continue;
+		unsigned char type = p->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(fd, p->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+				type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
 		}
-		closedir(d);
-
-		if (!r) {
-			if (skipParent)
-				return 0;
-			else
-				r = rmdir(path.c_str());
+		if (type == DT_DIR) {
+			Remove_Node* child = new Remove_Node;
+			child->path = node->path + "/" + p->d_name;
+			child->parent = node;
+			child->pending = 1;
+			child->remove_self = true;
+			children.push_back(child);
+		} else if (unlinkat(fd, p->d_name, 0) == 0) {
+			removed++;
+		} else {
+			LOGINFO("Unable to unlink '%s/%s': %s\n", node->path.c_str(), p->d_name, strerror(errno));
+			pthread_mutex_lock(&job->lock);
+			if (!job->error)
+				job->error = -1;
+			pthread_mutex_unlock(&job->lock);
 		}
 	}
-	return r;
+	closedir(d);
+
+	pthread_mutex_lock(&job->lock);
+	job->removed += removed;
+	node->pending += children.size();
+	for (vector<Remove_Node*>::iterator it = children.begin(); it != children.end(); it++)
+		job->queue.push_back(*it);
+	if (!children.empty())
+		pthread_cond_broadcast(&job->cond);
+	Remove_Finish_Node(job, node);
+	pthread_mutex_unlock(&job->lock);
 }
 
-int TWFunc::copy_file(string src, string dst, int mode) {
-	LOGINFO("Copying file %s to %s\n", src.c_str(), dst.c_str());
-	ifstream srcfile(src.c_str(), ios::binary);
-	ofstream dstfile(dst.c_str(), ios::binary);
-	dstfile << srcfile.rdbuf();
-	srcfile.close();
-	dstfile.close();
-	if (chmod(dst.c_str(), mode) != 0)
-		return -1;
-	return 0;
+static void* Remove_Thread(void* cookie) {
+	Remove_Job* job = (Remove_Job*) cookie;
+
+	pthread_mutex_lock(&job->lock);
+	while (true) {
+		while (job->queue.empty() && job->busy > 0)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->queue.empty())
+			break;
+		// Depth first keeps the number of open nodes small.
+		Remove_Node* node = job->queue.back();
+		job->queue.pop_back();
+		job->busy++;
+		pthread_mutex_unlock(&job->lock);
+
+		Remove_Scan_Node(job, node);
+
+		pthread_mutex_lock(&job->lock);
+		job->busy--;
+		if (job->busy == 0 && job->queue.empty())
+			pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+int TWFunc::removeDirs(const vector<string>& paths, bool skipParent) {
+	Remove_Job job;
+	timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	job.busy = 0;
+	job.removed = 0;
+	job.error = 0;
+	for (vector<string>::const_iterator it = paths.begin(); it != paths.end(); it++) {
+		Remove_Node* root = new Remove_Node;
+		root->path = *it;
+		root->parent = NULL;
+		root->pending = 1;
+		root->remove_self = !skipParent;
+		job.queue.push_back(root);
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int thread_count = (cpus < 1) ? 2 : (int)cpus * 2;
+	if (thread_count > REMOVE_MAX_THREADS)
+		thread_count = REMOVE_MAX_THREADS;
+	pthread_t threads[REMOVE_MAX_THREADS];
+	int started = 0;
+	for (int i = 1; i < thread_count; i++) {
+		if (pthread_create(&threads[started], NULL, Remove_Thread, (void*)&job) != 0)
+			break;
+		started++;
+	}
+	Remove_Thread((void*)&job);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	int32_t ms = timespec_diff_ms(start, end);
+	unsigned long long rate = job.removed * 1000ULL / (ms > 0 ? ms : 1);
+	if (paths.size() == 1)
+		LOGINFO("Removed %llu entries from '%s' in %i.%03is (%llu entries/sec, %i threads)\n", job.removed, paths[0].c_str(), ms / 1000, ms % 1000, rate, started + 1);
+	else
+		LOGINFO("Removed %llu entries from %i folders in %i.%03is (%llu entries/sec, %i threads)\n", job.removed, (int)paths.size(), ms / 1000, ms % 1000, rate, started + 1);
+	return job.error;
+}
+
+int TWFunc::removeDir(const string path, bool skipParent) {
+	vector<string> paths;
+
+	paths.push_back(path);
+	return removeDirs(paths, skipParent);
 }
 
 unsigned int TWFunc::Get_D_Type_From_Stat(string Path) {
@@ -46,13 +46,14 @@ public:
 	static string Get_Path(string Path);                                        // Trims everything after the last / in the string
 	static string Get_Filename(string Path);                                    // Trims the path off of a filename
 
-	static int Wait_For_Child(pid_t pid, int *status, string Child_Name);       // Waits for pid to exit and checks exit status
+	static int Wait_For_Child(pid_t pid, int *status, string Child_Name, struct rusage *usage = NULL); // Waits for pid to exit and checks exit status, optionally returning its resource usage
 	static bool Path_Exists(string Path);                                       // Returns true if the path exists
 	static int Get_File_Type(string fn); // Determines file type, 0 for unknown, 1 for gzip, 2 for OAES encrypted
 	static int Try_Decrypting_File(string fn, string password); // -1 for some error, 0 for failed to decrypt, 1 for decrypted, 3 for decrypted and found gzip format
 	static unsigned long Get_File_Size(string Path);                            // Returns the size of a file
 	static std::string Remove_Trailing_Slashes(const std::string& path, bool leaveLast = false); // Normalizes the path, e.g /data//media/ -> /data/media
 	static vector<string> split_string(const string &in, char del, bool skip_empty);
+	static int copy_file(string src, string dst, int mode, bool preserve_xattrs = false); //copy file from src to dst with mode permissions (-1 keeps the source's), keeping holes
 
 #ifndef BUILD_TWRPTAR_MAIN
 	static void install_htc_dumlock(void);                                      // Installs HTC Dumlock
@@ -65,11 +66,12 @@ public:
 	static void Update_Intent_File(string Intent);                              // Updates intent file
 	static int tw_reboot(RebootCommand command);                                // Prepares the device for rebooting
 	static void check_and_run_script(const char* script_file, const char* display_name); // checks for the existence of a script, chmods it to 755, then runs it
-	static int Exec_Cmd(const string& cmd, string &result); //execute a command and return the result as a string by reference
-	static int Exec_Cmd(const string& cmd); //execute a command
+	static int Exec_Cmd(const string& cmd, string &result, int timeout = 0); //execute a command and return the result as a string by reference
+	static int Exec_Cmd(const string& cmd, int timeout = 0); //execute a command
 	static int Exec_Cmd_Show_Output(const string& cmd);
+	static int Exec_Args(const vector<string>& args, string* result = NULL, int timeout = 0); //run a program directly without a shell, optionally capturing stdout and stderr
 	static int removeDir(const string path, bool removeParent); //recursively remove a directory
-	static int copy_file(string src, string dst, int mode); //copy file from src to dst with mode permissions
+	static int removeDirs(const vector<string>& paths, bool skipParent); //remove several directory trees at once on a pool of threads
 	static unsigned int Get_D_Type_From_Stat(string Path);                      // Returns a dirent dt_type value using stat instead of dirent
 	static timespec timespec_diff(timespec& start, timespec& end);	            // Return a diff for 2 times
 	static int32_t timespec_diff_ms(timespec& start, timespec& end);            // Returns diff in ms
@@ -106,6 +108,7 @@ public:
 
 private:
 	static void Copy_Log(string Source, string Destination);
+	static int Run_Command(const vector<string>& Args, string* Result, bool Show_Output, bool Capture_Stderr, int Timeout); // vforks and execs Args, returns the wait status
 
 };
 
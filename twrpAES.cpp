@@ -0,0 +1,826 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "twrpAES.hpp"
+#include "twrpStats.hpp"
+#include "twcommon.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <wmmintrin.h>
+#define TWAES_HW_X86
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || (defined(__clang__) && __clang_major__ >= 16) || (!defined(__clang__) && __GNUC__ >= 6))
+// Only Encrypt_ARMv8 is built for the crypto extensions, see
+// TWAES_ARM_TARGET.  These compilers declare the AES intrinsics
+// without the extensions being enabled for the whole file.
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+#define TWAES_HW_ARM
+#ifdef __clang__
+#define TWAES_ARM_TARGET __attribute__((target("crypto")))
+#else
+#define TWAES_ARM_TARGET __attribute__((target("+crypto")))
+#endif
+#endif
+
+#define KEY_CHECK_CHUNK   0xffffffff
+#define BATCH_BLOCKS      64            // Key stream generated per call, 1KB
+#define MAX_CHUNK_SIZE    (16 * 1024 * 1024)
+
+/* Table driven AES encryption, after the reference implementation in
+ * FIPS-197.  The tables are built once from the S-box rather than
+ * stored, CTR mode never needs the inverse cipher.
+ */
+static uint8_t Sbox[256];
+static uint32_t Te0[256], Te1[256], Te2[256], Te3[256];
+static pthread_once_t Tables_Once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t Rotate_Right(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint8_t Xtime(uint8_t x) {
+	return (uint8_t) ((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+static void Build_Tables(void) {
+	uint8_t p = 1, q = 1;
+
+	// Walk the multiplicative group with generator 3, q tracking 1/p
+	do {
+		p = p ^ Xtime(p);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80)
+			q ^= 0x09;
+		uint8_t x = q ^ (uint8_t) ((q << 1) | (q >> 7)) ^ (uint8_t) ((q << 2) | (q >> 6))
+			^ (uint8_t) ((q << 3) | (q >> 5)) ^ (uint8_t) ((q << 4) | (q >> 4));
+		Sbox[p] = x ^ 0x63;
+	} while (p != 1);
+	Sbox[0] = 0x63;
+
+	for (int i = 0; i < 256; i++) {
+		uint8_t s = Sbox[i], s2 = Xtime(s), s3 = s2 ^ s;
+		uint32_t t = ((uint32_t) s2 << 24) | ((uint32_t) s << 16) | ((uint32_t) s << 8) | s3;
+		Te0[i] = t;
+		Te1[i] = Rotate_Right(t, 8);
+		Te2[i] = Rotate_Right(t, 16);
+		Te3[i] = Rotate_Right(t, 24);
+	}
+}
+
+static inline uint32_t Get_BE32(const uint8_t* p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static inline void Put_BE32(uint8_t* p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline uint32_t Get_LE32(const uint8_t* p) {
+	return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+}
+
+static inline void Put_LE32(uint8_t* p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void Encrypt_Table(const uint32_t* rk, int Rounds, const uint8_t* in, uint8_t* out, size_t Blocks) {
+	for (; Blocks > 0; Blocks--, in += 16, out += 16) {
+		uint32_t s0 = Get_BE32(in) ^ rk[0];
+		uint32_t s1 = Get_BE32(in + 4) ^ rk[1];
+		uint32_t s2 = Get_BE32(in + 8) ^ rk[2];
+		uint32_t s3 = Get_BE32(in + 12) ^ rk[3];
+		const uint32_t* k = rk + 4;
+
+		for (int r = 1; r < Rounds; r++, k += 4) {
+			uint32_t t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xff] ^ Te2[(s2 >> 8) & 0xff] ^ Te3[s3 & 0xff] ^ k[0];
+			uint32_t t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xff] ^ Te2[(s3 >> 8) & 0xff] ^ Te3[s0 & 0xff] ^ k[1];
+			uint32_t t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xff] ^ Te2[(s0 >> 8) & 0xff] ^ Te3[s1 & 0xff] ^ k[2];
+			uint32_t t3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xff] ^ Te2[(s1 >> 8) & 0xff] ^ Te3[s2 & 0xff] ^ k[3];
+			s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+		}
+		Put_BE32(out, (((uint32_t) Sbox[s0 >> 24] << 24) | ((uint32_t) Sbox[(s1 >> 16) & 0xff] << 16)
+			| ((uint32_t) Sbox[(s2 >> 8) & 0xff] << 8) | Sbox[s3 & 0xff]) ^ k[0]);
+		Put_BE32(out + 4, (((uint32_t) Sbox[s1 >> 24] << 24) | ((uint32_t) Sbox[(s2 >> 16) & 0xff] << 16)
+			| ((uint32_t) Sbox[(s3 >> 8) & 0xff] << 8) | Sbox[s0 & 0xff]) ^ k[1]);
+		Put_BE32(out + 8, (((uint32_t) Sbox[s2 >> 24] << 24) | ((uint32_t) Sbox[(s3 >> 16) & 0xff] << 16)
+			| ((uint32_t) Sbox[(s0 >> 8) & 0xff] << 8) | Sbox[s1 & 0xff]) ^ k[2]);
+		Put_BE32(out + 12, (((uint32_t) Sbox[s3 >> 24] << 24) | ((uint32_t) Sbox[(s0 >> 16) & 0xff] << 16)
+			| ((uint32_t) Sbox[(s1 >> 8) & 0xff] << 8) | Sbox[s2 & 0xff]) ^ k[3]);
+	}
+}
+
+#ifdef TWAES_HW_X86
+// Four blocks at a time keep the AES unit's pipeline full
+__attribute__((target("aes,sse2")))
+static void Encrypt_AESNI(const uint8_t* Keys, int Rounds, const uint8_t* in, uint8_t* out, size_t Blocks) {
+	__m128i k[15];
+
+	for (int i = 0; i <= Rounds; i++)
+		k[i] = _mm_loadu_si128((const __m128i*) (Keys + i * 16));
+	for (; Blocks >= 4; Blocks -= 4, in += 64, out += 64) {
+		__m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) in), k[0]);
+		__m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (in + 16)), k[0]);
+		__m128i b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (in + 32)), k[0]);
+		__m128i b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (in + 48)), k[0]);
+		for (int r = 1; r < Rounds; r++) {
+			b0 = _mm_aesenc_si128(b0, k[r]);
+			b1 = _mm_aesenc_si128(b1, k[r]);
+			b2 = _mm_aesenc_si128(b2, k[r]);
+			b3 = _mm_aesenc_si128(b3, k[r]);
+		}
+		_mm_storeu_si128((__m128i*) out, _mm_aesenclast_si128(b0, k[Rounds]));
+		_mm_storeu_si128((__m128i*) (out + 16), _mm_aesenclast_si128(b1, k[Rounds]));
+		_mm_storeu_si128((__m128i*) (out + 32), _mm_aesenclast_si128(b2, k[Rounds]));
+		_mm_storeu_si128((__m128i*) (out + 48), _mm_aesenclast_si128(b3, k[Rounds]));
+	}
+	for (; Blocks > 0; Blocks--, in += 16, out += 16) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*) in), k[0]);
+		for (int r = 1; r < Rounds; r++)
+			b = _mm_aesenc_si128(b, k[r]);
+		_mm_storeu_si128((__m128i*) out, _mm_aesenclast_si128(b, k[Rounds]));
+	}
+}
+#endif
+
+#ifdef TWAES_HW_ARM
+// AESE does AddRoundKey before SubBytes and ShiftRows, so the last round
+// key is applied with a plain XOR
+TWAES_ARM_TARGET
+static void Encrypt_ARMv8(const uint8_t* Keys, int Rounds, const uint8_t* in, uint8_t* out, size_t Blocks) {
+	uint8x16_t k[15];
+
+	for (int i = 0; i <= Rounds; i++)
+		k[i] = vld1q_u8(Keys + i * 16);
+	for (; Blocks >= 4; Blocks -= 4, in += 64, out += 64) {
+		uint8x16_t b0 = vld1q_u8(in), b1 = vld1q_u8(in + 16), b2 = vld1q_u8(in + 32), b3 = vld1q_u8(in + 48);
+		for (int r = 0; r < Rounds - 1; r++) {
+			b0 = vaesmcq_u8(vaeseq_u8(b0, k[r]));
+			b1 = vaesmcq_u8(vaeseq_u8(b1, k[r]));
+			b2 = vaesmcq_u8(vaeseq_u8(b2, k[r]));
+			b3 = vaesmcq_u8(vaeseq_u8(b3, k[r]));
+		}
+		vst1q_u8(out, veorq_u8(vaeseq_u8(b0, k[Rounds - 1]), k[Rounds]));
+		vst1q_u8(out + 16, veorq_u8(vaeseq_u8(b1, k[Rounds - 1]), k[Rounds]));
+		vst1q_u8(out + 32, veorq_u8(vaeseq_u8(b2, k[Rounds - 1]), k[Rounds]));
+		vst1q_u8(out + 48, veorq_u8(vaeseq_u8(b3, k[Rounds - 1]), k[Rounds]));
+	}
+	for (; Blocks > 0; Blocks--, in += 16, out += 16) {
+		uint8x16_t b = vld1q_u8(in);
+		for (int r = 0; r < Rounds - 1; r++)
+			b = vaesmcq_u8(vaeseq_u8(b, k[r]));
+		vst1q_u8(out, veorq_u8(vaeseq_u8(b, k[Rounds - 1]), k[Rounds]));
+	}
+}
+#endif
+
+enum AES_Implementation {
+	AES_UNKNOWN,
+	AES_TABLE,
+	AES_NI,
+	AES_ARMV8,
+};
+
+static AES_Implementation Hardware = AES_UNKNOWN;
+
+static void Detect_Hardware(void) {
+	Build_Tables();
+	Hardware = AES_TABLE;
+#if defined(TWAES_HW_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("aes"))
+		Hardware = AES_NI;
+#elif defined(TWAES_HW_ARM)
+	if (getauxval(AT_HWCAP) & HWCAP_AES)
+		Hardware = AES_ARMV8;
+#endif
+	// Lets the benchmark and tests compare against the table code
+	if (getenv("TWAES_NO_HW"))
+		Hardware = AES_TABLE;
+}
+
+twrpAESCipher::twrpAESCipher() {
+	pthread_once(&Tables_Once, Detect_Hardware);
+	Key_Bytes = 0;
+	Rounds = 0;
+	memset(Round_Keys, 0, sizeof(Round_Keys));
+	memset(Round_Key_Bytes, 0, sizeof(Round_Key_Bytes));
+	memset(Nonce, 0, sizeof(Nonce));
+}
+
+const char* twrpAESCipher::Implementation(void) {
+	pthread_once(&Tables_Once, Detect_Hardware);
+	if (Hardware == AES_NI)
+		return "aes-ni";
+	if (Hardware == AES_ARMV8)
+		return "armv8-ce";
+	return "table";
+}
+
+void twrpAESCipher::Set_Key(const string& Password) {
+	uint8_t key[32];
+	size_t len = Password.size();
+
+	// Same padding as openaes so a password means the same key in both formats
+	for (int i = 0; i < 32; i++)
+		key[i] = i + 1;
+	if (len > 32)
+		len = 32;
+	memcpy(key, Password.c_str(), len);
+	if (len <= 16)
+		Expand_Key(key, 16);
+	else if (len <= 24)
+		Expand_Key(key, 24);
+	else
+		Expand_Key(key, 32);
+	memset(key, 0, sizeof(key));
+}
+
+void twrpAESCipher::Expand_Key(const uint8_t* Key, int Bytes) {
+	int nk = Bytes / 4;
+	int words;
+	uint8_t rcon = 1;
+
+	Key_Bytes = Bytes;
+	Rounds = nk + 6;
+	words = 4 * (Rounds + 1);
+	for (int i = 0; i < nk; i++)
+		Round_Keys[i] = Get_BE32(Key + i * 4);
+	for (int i = nk; i < words; i++) {
+		uint32_t t = Round_Keys[i - 1];
+		if (i % nk == 0) {
+			t = ((uint32_t) Sbox[(t >> 16) & 0xff] << 24) | ((uint32_t) Sbox[(t >> 8) & 0xff] << 16)
+				| ((uint32_t) Sbox[t & 0xff] << 8) | Sbox[t >> 24];
+			t ^= (uint32_t) rcon << 24;
+			rcon = Xtime(rcon);
+		} else if (nk > 6 && i % nk == 4) {
+			t = ((uint32_t) Sbox[t >> 24] << 24) | ((uint32_t) Sbox[(t >> 16) & 0xff] << 16)
+				| ((uint32_t) Sbox[(t >> 8) & 0xff] << 8) | Sbox[t & 0xff];
+		}
+		Round_Keys[i] = Round_Keys[i - nk] ^ t;
+	}
+	for (int i = 0; i < words; i++)
+		Put_BE32(Round_Key_Bytes + i * 4, Round_Keys[i]);
+}
+
+void twrpAESCipher::Set_Nonce(const uint8_t* nonce) {
+	memcpy(Nonce, nonce, sizeof(Nonce));
+}
+
+void twrpAESCipher::Encrypt_Blocks(const uint8_t* Counters, uint8_t* Out, size_t Blocks) const {
+#if defined(TWAES_HW_X86)
+	if (Hardware == AES_NI) {
+		Encrypt_AESNI(Round_Key_Bytes, Rounds, Counters, Out, Blocks);
+		return;
+	}
+#elif defined(TWAES_HW_ARM)
+	if (Hardware == AES_ARMV8) {
+		Encrypt_ARMv8(Round_Key_Bytes, Rounds, Counters, Out, Blocks);
+		return;
+	}
+#endif
+	Encrypt_Table(Round_Keys, Rounds, Counters, Out, Blocks);
+}
+
+void twrpAESCipher::Crypt(uint32_t Chunk, uint8_t* Data, size_t Len) const {
+	uint8_t counters[BATCH_BLOCKS * 16];
+	uint8_t stream[BATCH_BLOCKS * 16];
+	uint32_t block = 0;
+
+	for (int i = 0; i < BATCH_BLOCKS; i++) {
+		memcpy(counters + i * 16, Nonce, 8);
+		Put_BE32(counters + i * 16 + 8, Chunk);
+	}
+	while (Len > 0) {
+		size_t blocks = (Len + 15) / 16;
+		if (blocks > BATCH_BLOCKS)
+			blocks = BATCH_BLOCKS;
+		for (size_t i = 0; i < blocks; i++)
+			Put_BE32(counters + i * 16 + 12, block++);
+		Encrypt_Blocks(counters, stream, blocks);
+		size_t len = blocks * 16;
+		if (len > Len)
+			len = Len;
+		size_t i = 0;
+		for (; i + sizeof(unsigned long) <= len; i += sizeof(unsigned long)) {
+			unsigned long d, s;
+			memcpy(&d, Data + i, sizeof(d));
+			memcpy(&s, stream + i, sizeof(s));
+			d ^= s;
+			memcpy(Data + i, &d, sizeof(d));
+		}
+		for (; i < len; i++)
+			Data[i] ^= stream[i];
+		Data += len;
+		Len -= len;
+	}
+}
+
+void twrpAESCipher::Key_Check(uint8_t* Check) const {
+	uint8_t counter[16], out[16];
+
+	memcpy(counter, Nonce, 8);
+	Put_BE32(counter + 8, KEY_CHECK_CHUNK);
+	Put_BE32(counter + 12, KEY_CHECK_CHUNK);
+	Encrypt_Blocks(counter, out, 1);
+	memcpy(Check, out, 8);
+}
+
+static bool Read_Full(int fd, void* Buffer, size_t Size, size_t* Got) {
+	uint8_t* ptr = (uint8_t*) Buffer;
+
+	*Got = 0;
+	while (*Got < Size) {
+		ssize_t len = read(fd, ptr + *Got, Size - *Got);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return false;
+		if (len == 0)
+			break;
+		*Got += len;
+	}
+	return true;
+}
+
+static bool Write_Full(int fd, const void* Buffer, size_t Size) {
+	const uint8_t* ptr = (const uint8_t*) Buffer;
+
+	while (Size > 0) {
+		ssize_t len = write(fd, ptr, Size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return false;
+		ptr += len;
+		Size -= len;
+	}
+	return true;
+}
+
+twrpAES::twrpAES(const string& password, twrpStats* stats) {
+	Password = password;
+	Stats = stats;
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	Thread_Count = 1;
+	Set_Threads(cores > 0 ? (int) cores : 1);
+	In_Fd = -1;
+	Out_Fd = -1;
+	Encrypting = false;
+	Result = false;
+	Started = false;
+	Worker_Count = 0;
+	memset(Buffers, 0, sizeof(Buffers));
+	Job_Count = 0;
+	Next_Job = 0;
+	Pending = 0;
+	Quit = false;
+	pthread_mutex_init(&Lock, NULL);
+	pthread_cond_init(&Work_Ready, NULL);
+	pthread_cond_init(&Work_Done, NULL);
+}
+
+twrpAES::~twrpAES() {
+	if (Started)
+		Wait();
+	pthread_mutex_destroy(&Lock);
+	pthread_cond_destroy(&Work_Ready);
+	pthread_cond_destroy(&Work_Done);
+}
+
+void twrpAES::Set_Threads(int Count) {
+	if (Count < 1)
+		Count = 1;
+	if (Count > TWAES_MAX_THREADS)
+		Count = TWAES_MAX_THREADS;
+	Thread_Count = Count;
+}
+
+bool twrpAES::Start_Encrypt(int in_fd, int out_fd) {
+	return Start(true, in_fd, out_fd);
+}
+
+bool twrpAES::Start_Decrypt(int in_fd, int out_fd) {
+	return Start(false, in_fd, out_fd);
+}
+
+bool twrpAES::Start(bool Encrypt, int in_fd, int out_fd) {
+	In_Fd = in_fd;
+	Out_Fd = out_fd;
+	Encrypting = Encrypt;
+	Result = false;
+	Quit = false;
+	Job_Count = 0;
+	Next_Job = 0;
+	Cipher.Set_Key(Password);
+
+	// The stream thread does its share of the work, so one less worker
+	for (Worker_Count = 0; Worker_Count < Thread_Count - 1; Worker_Count++) {
+		if (pthread_create(&Workers[Worker_Count], NULL, Worker_Thread, this) != 0) {
+			LOGINFO("twrpAES: unable to start worker thread, continuing with %i\n", Worker_Count + 1);
+			break;
+		}
+	}
+	if (pthread_create(&Stream, NULL, Stream_Thread, this) != 0) {
+		LOGINFO("twrpAES: unable to start stream thread\n");
+		Stop_Workers();
+		close(In_Fd);
+		close(Out_Fd);
+		return false;
+	}
+	Started = true;
+	return true;
+}
+
+void twrpAES::Stop_Workers(void) {
+	pthread_mutex_lock(&Lock);
+	Quit = true;
+	pthread_cond_broadcast(&Work_Ready);
+	pthread_mutex_unlock(&Lock);
+	for (int i = 0; i < Worker_Count; i++)
+		pthread_join(Workers[i], NULL);
+	Worker_Count = 0;
+}
+
+bool twrpAES::Wait(void) {
+	if (!Started)
+		return Result;
+	pthread_join(Stream, NULL);
+	Stop_Workers();
+	Started = false;
+	return Result;
+}
+
+void* twrpAES::Stream_Thread(void* cookie) {
+	twrpAES* aes = (twrpAES*) cookie;
+	sigset_t set;
+
+	// A reader that stops early must show up as EPIPE, not kill recovery
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (int i = 0; i < aes->Thread_Count; i++) {
+		aes->Buffers[i] = (uint8_t*) malloc(TWAES_CHUNK_SIZE);
+		if (!aes->Buffers[i]) {
+			LOGINFO("twrpAES: out of memory\n");
+			break;
+		}
+	}
+	if (aes->Buffers[aes->Thread_Count - 1])
+		aes->Result = aes->Encrypting ? aes->Encrypt_Stream() : aes->Decrypt_Stream();
+	for (int i = 0; i < aes->Thread_Count; i++) {
+		free(aes->Buffers[i]);
+		aes->Buffers[i] = NULL;
+	}
+	close(aes->In_Fd);
+	close(aes->Out_Fd);
+	aes->In_Fd = -1;
+	aes->Out_Fd = -1;
+	return NULL;
+}
+
+void* twrpAES::Worker_Thread(void* cookie) {
+	twrpAES* aes = (twrpAES*) cookie;
+
+	pthread_mutex_lock(&aes->Lock);
+	for (;;) {
+		while (!aes->Quit && aes->Next_Job >= aes->Job_Count)
+			pthread_cond_wait(&aes->Work_Ready, &aes->Lock);
+		if (aes->Quit)
+			break;
+		pthread_mutex_unlock(&aes->Lock);
+		aes->Do_Next_Job();
+		pthread_mutex_lock(&aes->Lock);
+	}
+	pthread_mutex_unlock(&aes->Lock);
+	return NULL;
+}
+
+bool twrpAES::Do_Next_Job(void) {
+	pthread_mutex_lock(&Lock);
+	if (Next_Job >= Job_Count) {
+		pthread_mutex_unlock(&Lock);
+		return false;
+	}
+	Job* job = &Jobs[Next_Job++];
+	pthread_mutex_unlock(&Lock);
+
+	uint64_t start = twrpStats::Now();
+	Cipher.Crypt(job->Chunk, job->Data, job->Len);
+	if (Stats)
+		Stats->Add(TWSTAT_ENCRYPT, twrpStats::Now() - start, job->Len);
+
+	pthread_mutex_lock(&Lock);
+	if (--Pending == 0)
+		pthread_cond_signal(&Work_Done);
+	pthread_mutex_unlock(&Lock);
+	return true;
+}
+
+bool twrpAES::Run_Jobs(int Count) {
+	pthread_mutex_lock(&Lock);
+	Job_Count = Count;
+	Next_Job = 0;
+	Pending = Count;
+	if (Count > 1)
+		pthread_cond_broadcast(&Work_Ready);
+	pthread_mutex_unlock(&Lock);
+
+	while (Do_Next_Job())
+		;
+
+	pthread_mutex_lock(&Lock);
+	while (Pending > 0)
+		pthread_cond_wait(&Work_Done, &Lock);
+	Job_Count = 0;
+	Next_Job = 0;
+	pthread_mutex_unlock(&Lock);
+	return true;
+}
+
+bool twrpAES::Encrypt_Stream(void) {
+	uint8_t header[TWAES_HEADER_SIZE], nonce[8];
+	uint32_t chunk = 0;
+	bool eof = false;
+
+	int rfd = open("/dev/urandom", O_RDONLY);
+	size_t got = 0;
+	if (rfd < 0 || !Read_Full(rfd, nonce, sizeof(nonce), &got) || got != sizeof(nonce)) {
+		LOGINFO("twrpAES: unable to read /dev/urandom: %s\n", strerror(errno));
+		if (rfd >= 0)
+			close(rfd);
+		return false;
+	}
+	close(rfd);
+	Cipher.Set_Nonce(nonce);
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, TWAES_MAGIC, TWAES_MAGIC_LEN);
+	header[6] = TWAES_VERSION;
+	header[7] = Cipher.Key_Size();
+	Put_LE32(header + 8, TWAES_CHUNK_SIZE);
+	memcpy(header + 12, nonce, 8);
+	Cipher.Key_Check(header + 20);
+	if (!Write_Full(Out_Fd, header, sizeof(header))) {
+		LOGINFO("twrpAES: error writing header: %s\n", strerror(errno));
+		return false;
+	}
+
+	while (!eof) {
+		int count = 0;
+		for (; count < Thread_Count; count++) {
+			if (!Read_Full(In_Fd, Buffers[count], TWAES_CHUNK_SIZE, &got)) {
+				LOGINFO("twrpAES: error reading input: %s\n", strerror(errno));
+				return false;
+			}
+			if (got < TWAES_CHUNK_SIZE)
+				eof = true;
+			if (got == 0)
+				break;
+			Jobs[count].Data = Buffers[count];
+			Jobs[count].Len = got;
+			Jobs[count].Chunk = chunk++;
+			if (eof) {
+				count++;
+				break;
+			}
+		}
+		if (count == 0)
+			break;
+		Run_Jobs(count);
+		for (int i = 0; i < count; i++) {
+			uint8_t len[4];
+			Put_LE32(len, Jobs[i].Len);
+			if (!Write_Full(Out_Fd, len, sizeof(len)) || !Write_Full(Out_Fd, Jobs[i].Data, Jobs[i].Len)) {
+				LOGINFO("twrpAES: error writing output: %s\n", strerror(errno));
+				return false;
+			}
+		}
+	}
+	uint8_t end[4] = { 0, 0, 0, 0 };
+	if (!Write_Full(Out_Fd, end, sizeof(end))) {
+		LOGINFO("twrpAES: error writing output: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool twrpAES::Read_Header(int fd, const string& password, twrpAESCipher* cipher, uint32_t* Chunk_Size) {
+	uint8_t header[TWAES_HEADER_SIZE], check[8];
+	size_t got;
+
+	if (!Read_Full(fd, header, sizeof(header), &got) || got != sizeof(header) || memcmp(header, TWAES_MAGIC, TWAES_MAGIC_LEN) != 0) {
+		LOGINFO("twrpAES: not an encrypted backup\n");
+		return false;
+	}
+	if (header[6] != TWAES_VERSION) {
+		LOGINFO("twrpAES: unsupported version %i\n", header[6]);
+		return false;
+	}
+	*Chunk_Size = Get_LE32(header + 8);
+	if (*Chunk_Size == 0 || *Chunk_Size > MAX_CHUNK_SIZE) {
+		LOGINFO("twrpAES: bad chunk size %u\n", *Chunk_Size);
+		return false;
+	}
+	cipher->Set_Key(password);
+	cipher->Set_Nonce(header + 12);
+	cipher->Key_Check(check);
+	if (cipher->Key_Size() != header[7] || memcmp(check, header + 20, sizeof(check)) != 0) {
+		LOGINFO("twrpAES: wrong password\n");
+		return false;
+	}
+	return true;
+}
+
+bool twrpAES::Decrypt_Stream(void) {
+	uint32_t chunk_size, chunk = 0;
+	bool eof = false;
+	size_t got;
+
+	if (!Read_Header(In_Fd, Password, &Cipher, &chunk_size))
+		return false;
+	if (chunk_size > TWAES_CHUNK_SIZE) {
+		for (int i = 0; i < Thread_Count; i++) {
+			uint8_t* buf = (uint8_t*) realloc(Buffers[i], chunk_size);
+			if (!buf) {
+				LOGINFO("twrpAES: out of memory\n");
+				return false;
+			}
+			Buffers[i] = buf;
+		}
+	}
+
+	while (!eof) {
+		int count = 0;
+		for (; count < Thread_Count; count++) {
+			uint8_t len[4];
+			if (!Read_Full(In_Fd, len, sizeof(len), &got) || got != sizeof(len)) {
+				LOGINFO("twrpAES: archive is truncated\n");
+				return false;
+			}
+			uint32_t chunk_len = Get_LE32(len);
+			if (chunk_len == 0) {
+				eof = true;
+				break;
+			}
+			if (chunk_len > chunk_size) {
+				LOGINFO("twrpAES: archive is corrupt\n");
+				return false;
+			}
+			if (!Read_Full(In_Fd, Buffers[count], chunk_len, &got) || got != chunk_len) {
+				LOGINFO("twrpAES: archive is truncated\n");
+				return false;
+			}
+			Jobs[count].Data = Buffers[count];
+			Jobs[count].Len = chunk_len;
+			Jobs[count].Chunk = chunk++;
+		}
+		if (count == 0)
+			break;
+		Run_Jobs(count);
+		for (int i = 0; i < count; i++) {
+			if (!Write_Full(Out_Fd, Jobs[i].Data, Jobs[i].Len)) {
+				// tar stops reading after its end of archive blocks
+				if (errno == EPIPE)
+					return true;
+				LOGINFO("twrpAES: error writing output: %s\n", strerror(errno));
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool twrpAES::Is_Container(const string& Filename) {
+	char magic[TWAES_MAGIC_LEN];
+	size_t got = 0;
+
+	int fd = open(Filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool ret = Read_Full(fd, magic, sizeof(magic), &got) && got == sizeof(magic) && memcmp(magic, TWAES_MAGIC, TWAES_MAGIC_LEN) == 0;
+	close(fd);
+	return ret;
+}
+
+int twrpAES::Try_Decrypt(const string& Filename, const string& Password, uint8_t* Sample, size_t* Sample_Len) {
+	twrpAESCipher cipher;
+	uint32_t chunk_size;
+	uint8_t len[4];
+	size_t got;
+
+	int fd = open(Filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOGINFO("twrpAES: unable to open '%s': %s\n", Filename.c_str(), strerror(errno));
+		return -1;
+	}
+	if (!Read_Header(fd, Password, &cipher, &chunk_size)) {
+		close(fd);
+		return 0;
+	}
+	if (!Read_Full(fd, len, sizeof(len), &got) || got != sizeof(len)) {
+		close(fd);
+		return -1;
+	}
+	size_t want = Get_LE32(len);
+	if (want > *Sample_Len)
+		want = *Sample_Len;
+	if (!Read_Full(fd, Sample, want, &got)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	cipher.Crypt(0, Sample, got);
+	*Sample_Len = got;
+	return 1;
+}
+
+bool twrpAES::Read_Tail(const string& Filename, const string& Password, uint8_t* Tail, size_t Len) {
+	twrpAESCipher cipher;
+	uint32_t chunk_size, chunk = 0, last_len = 0, prev_len = 0;
+	off64_t pos = TWAES_HEADER_SIZE, last_pos = -1, prev_pos = -1;
+	uint8_t len[4];
+	size_t got;
+	bool ret = false;
+
+	int fd = open(Filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return false;
+	if (!Read_Header(fd, Password, &cipher, &chunk_size)) {
+		close(fd);
+		return false;
+	}
+	// Skip from length to length to find the last chunk, only it and,
+	// when it is shorter than Len, the one before it are decrypted
+	for (;;) {
+		if (lseek64(fd, pos, SEEK_SET) != pos || !Read_Full(fd, len, sizeof(len), &got) || got != sizeof(len))
+			break;
+		uint32_t chunk_len = Get_LE32(len);
+		if (chunk_len == 0) {
+			ret = last_pos >= 0 && (size_t) last_len + prev_len >= Len;
+			break;
+		}
+		prev_pos = last_pos;
+		prev_len = last_len;
+		last_pos = pos + sizeof(len);
+		last_len = chunk_len;
+		pos = last_pos + chunk_len;
+		chunk++;
+	}
+	if (ret) {
+		// Len bytes, the end of the chunk before the last and the last
+		size_t from_prev = last_len < Len ? Len - last_len : 0;
+		uint8_t* buf = (uint8_t*) malloc(prev_len + last_len);
+		ret = buf != NULL;
+		if (ret && from_prev > 0) {
+			ret = lseek64(fd, prev_pos, SEEK_SET) == prev_pos && Read_Full(fd, buf, prev_len, &got) && got == prev_len;
+			if (ret) {
+				cipher.Crypt(chunk - 2, buf, prev_len);
+				memcpy(Tail, buf + prev_len - from_prev, from_prev);
+			}
+		}
+		if (ret) {
+			ret = lseek64(fd, last_pos, SEEK_SET) == last_pos && Read_Full(fd, buf, last_len, &got) && got == last_len;
+			if (ret) {
+				cipher.Crypt(chunk - 1, buf, last_len);
+				memcpy(Tail + from_prev, buf + last_len - (Len - from_prev), Len - from_prev);
+			}
+		}
+		free(buf);
+	}
+	close(fd);
+	return ret;
+}
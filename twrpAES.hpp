@@ -0,0 +1,136 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPAES_HPP
+#define TWRPAES_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+
+using namespace std;
+
+class twrpStats;
+
+// Encrypted backup container, version 1:
+//
+//   header   "OATWRP" (6), version (1), key size in bytes (1),
+//            chunk size (4), nonce (8), key check (8), reserved (4)
+//   chunks   plain text length (4) followed by that many bytes of
+//            AES-CTR cipher text; only the last chunk may be short
+//   end      a chunk length of 0
+//
+// Numbers are little endian.  The counter block for block b of chunk c
+// is nonce || c || b with c and b big endian, so chunks are encrypted
+// and decrypted independently, in any order and on any core.  The key
+// check is the start of the key stream for chunk 0xffffffff, which lets
+// a password be verified without decrypting any data.  The header
+// starts with "OA" like openaes output, so Get_File_Type reports both
+// formats as encrypted.
+#define TWAES_MAGIC            "OATWRP"
+#define TWAES_MAGIC_LEN        6
+#define TWAES_VERSION          1
+#define TWAES_HEADER_SIZE      32
+#define TWAES_CHUNK_SIZE       (1024 * 1024)
+#define TWAES_MAX_THREADS      8
+
+// AES in CTR mode, using the ARMv8 crypto extensions or AES-NI when
+// the CPU has them and a table driven implementation otherwise
+class twrpAESCipher {
+public:
+	twrpAESCipher();
+	void Set_Key(const string& Password);                                     // Pads the password into a 128, 192 or 256 bit key as openaes does
+	void Set_Nonce(const uint8_t* Nonce);                                     // 8 bytes
+	void Crypt(uint32_t Chunk, uint8_t* Data, size_t Len) const;              // Encrypts or decrypts a chunk in place, thread safe
+	void Key_Check(uint8_t* Check) const;                                     // 8 bytes identifying the key and nonce
+	int Key_Size(void) const { return Key_Bytes; }
+	static const char* Implementation(void);                                  // "armv8-ce", "aes-ni" or "table"
+
+private:
+	void Expand_Key(const uint8_t* Key, int Bytes);
+	void Encrypt_Blocks(const uint8_t* Counters, uint8_t* Out, size_t Blocks) const;
+
+	int Key_Bytes;
+	int Rounds;
+	uint32_t Round_Keys[60];                                                  // Big endian words, as in FIPS-197
+	uint8_t Round_Key_Bytes[240];                                             // The same keys in byte order for the instructions
+	uint8_t Nonce[8];
+};
+
+// Encrypts or decrypts a stream between two fds on a pool of threads.
+// It takes the place of an openaes process in the backup and restore
+// pipelines: one thread reads the input a batch of chunks at a time,
+// the chunks are processed in parallel and written out in order.
+class twrpAES {
+public:
+	twrpAES(const string& Password, twrpStats* Stats);
+	~twrpAES();
+	bool Start_Encrypt(int In_Fd, int Out_Fd);                                // Both fds are closed when the stream ends
+	bool Start_Decrypt(int In_Fd, int Out_Fd);
+	bool Wait(void);                                                          // Waits for the stream to end, false on any error
+	void Set_Threads(int Count);                                              // Defaults to the number of cores
+
+	static bool Is_Container(const string& Filename);
+	static int Try_Decrypt(const string& Filename, const string& Password, uint8_t* Sample, size_t* Sample_Len); // -1 on error, 0 for a wrong password, 1 with the start of the plain text in Sample
+	static bool Read_Tail(const string& Filename, const string& Password, uint8_t* Tail, size_t Len); // Decrypts the last Len bytes of the plain text
+
+private:
+	twrpAES(const twrpAES&);
+	twrpAES& operator=(const twrpAES&);
+
+	struct Job {
+		uint8_t* Data;
+		size_t Len;
+		uint32_t Chunk;
+	};
+
+	bool Start(bool Encrypt, int In_Fd, int Out_Fd);
+	bool Encrypt_Stream(void);
+	bool Decrypt_Stream(void);
+	bool Run_Jobs(int Count);                                                 // Processes Jobs[0..Count) on the pool and this thread
+	bool Do_Next_Job(void);
+	void Stop_Workers(void);
+	static void* Stream_Thread(void* cookie);
+	static void* Worker_Thread(void* cookie);
+	static bool Read_Header(int fd, const string& Password, twrpAESCipher* Cipher, uint32_t* Chunk_Size);
+
+	string Password;
+	twrpStats* Stats;
+	twrpAESCipher Cipher;
+	int Thread_Count;
+	int In_Fd, Out_Fd;
+	bool Encrypting;
+	bool Result;
+	bool Started;
+	pthread_t Stream;
+	pthread_t Workers[TWAES_MAX_THREADS];
+	int Worker_Count;
+
+	pthread_mutex_t Lock;
+	pthread_cond_t Work_Ready;
+	pthread_cond_t Work_Done;
+	Job Jobs[TWAES_MAX_THREADS];
+	uint8_t* Buffers[TWAES_MAX_THREADS];
+	int Job_Count;
+	int Next_Job;
+	int Pending;
+	bool Quit;
+};
+
+#endif // TWRPAES_HPP
@@ -24,6 +24,9 @@ extern "C" {
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <fstream>
 #include <string>
 #include <vector>
@@ -36,7 +39,17 @@ using namespace std;
 
 extern bool datamedia;
 
+// Directory scans are dominated by stat latency rather than CPU, so
+// use a few more threads than cores.
+#define TW_DU_MAX_THREADS 8
+
 twrpDU::twrpDU() {
+	pthread_mutex_init(&cache_lock, NULL);
+	// du is a global, so this runs before anything forks
+	void* shared = mmap(NULL, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	local_generation = 0;
+	generation = (shared == MAP_FAILED) ? &local_generation : (volatile uint32_t*)shared;
+	cache_generation = *generation;
 	add_relative_dir(".");
 	add_relative_dir("..");
 	add_relative_dir("lost+found");
@@ -65,35 +78,172 @@ vector<string> twrpDU::get_absolute_dirs(void) {
 	return absolutedir;
 }
 
-uint64_t twrpDU::Get_Folder_Size(const string& Path) {
-	DIR* d;
-	struct dirent* de;
+void twrpDU::Clear_Cache(void) {
+	pthread_mutex_lock(&cache_lock);
+	cache.clear();
+	cache_generation = __sync_add_and_fetch(generation, 1);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void twrpDU::Mark_Changed(void) {
+	// No locks: the mutex may have been held by another thread at fork
+	__sync_add_and_fetch(generation, 1);
+}
+
+static bool Same_Time(const struct timespec& a, const struct timespec& b) {
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Reads one directory: the total size of the files directly inside it
+// and the names of its subdirectories.  Unchanged directories are
+// answered from the cache without reading them again.
+bool twrpDU::Scan_Dir(const string& Path, uint64_t* files_size, vector<string>* subdirs, bool* from_cache) {
 	struct stat st;
-	uint64_t dusize = 0;
-	string FullPath;
+	int fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
 
-	d = opendir(Path.c_str());
+	pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+	pthread_mutex_lock(&cache_lock);
+	map<pair<dev_t, ino_t>, twrpDU_Dir>::iterator it = cache.find(key);
+	if (it != cache.end() && Same_Time(it->second.mtime, st.st_mtim) && Same_Time(it->second.ctime, st.st_ctim)) {
+		*files_size = it->second.files_size;
+		*subdirs = it->second.subdirs;
+		pthread_mutex_unlock(&cache_lock);
+		close(fd);
+		*from_cache = true;
+		return true;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	DIR* d = fdopendir(fd);
 	if (d == NULL) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
-		return 0;
+		close(fd);
+		return false;
 	}
 
+	twrpDU_Dir entry;
+	entry.mtime = st.st_mtim;
+	entry.ctime = st.st_ctim;
+	entry.files_size = 0;
+
+	struct dirent* de;
+	struct stat est;
 	while ((de = readdir(d)) != NULL) {
-		FullPath = Path + "/";
-		FullPath += de->d_name;
-		if (lstat(FullPath.c_str(), &st)) {
+		if (fstatat(fd, de->d_name, &est, AT_SYMLINK_NOFOLLOW)) {
+			string FullPath = Path + "/" + de->d_name;
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
 			LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
 			continue;
 		}
-		if (S_ISDIR(st.st_mode) && !check_skip_dirs(FullPath) && de->d_type != DT_SOCK) {
-			dusize += Get_Folder_Size(FullPath);
-		} else if (st.st_mode & S_IFREG) {
-			dusize += (uint64_t)(st.st_size);
+		if (S_ISDIR(est.st_mode) && de->d_type != DT_SOCK) {
+			entry.subdirs.push_back(de->d_name);
+		} else if (est.st_mode & S_IFREG) {
+			entry.files_size += (uint64_t)(est.st_size);
 		}
 	}
 	closedir(d);
-	return dusize;
+
+	*files_size = entry.files_size;
+	*subdirs = entry.subdirs;
+	*from_cache = false;
+
+	pthread_mutex_lock(&cache_lock);
+	cache[key] = entry;
+	pthread_mutex_unlock(&cache_lock);
+	return true;
+}
+
+// Pulls directories off the shared queue until the whole tree has
+// been scanned, pushing each directory's subdirectories back on.
+void* twrpDU::Scan_Thread(void *cookie) {
+	Scan_Job* job = (Scan_Job*) cookie;
+
+	pthread_mutex_lock(&job->lock);
+	while (true) {
+		while (job->queue.empty() && job->busy > 0)
+			pthread_cond_wait(&job->cond, &job->lock);
+		if (job->queue.empty())
+			break;
+
+		string Path = job->queue.front();
+		job->queue.pop_front();
+		job->busy++;
+		pthread_mutex_unlock(&job->lock);
+
+		uint64_t files_size = 0;
+		vector<string> subdirs;
+		bool from_cache = false;
+		bool ok = job->du->Scan_Dir(Path, &files_size, &subdirs, &from_cache);
+
+		pthread_mutex_lock(&job->lock);
+		if (ok) {
+			job->total += files_size;
+			job->scanned++;
+			if (from_cache)
+				job->cached++;
+			for (vector<string>::iterator iter = subdirs.begin(); iter != subdirs.end(); iter++) {
+				string FullPath = Path + "/" + *iter;
+				if (!job->du->check_skip_dirs(FullPath))
+					job->queue.push_back(FullPath);
+			}
+		}
+		job->busy--;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+uint64_t twrpDU::Get_Folder_Size(const string& Path) {
+	Scan_Job job;
+
+	pthread_mutex_lock(&cache_lock);
+	if (*generation != cache_generation) {
+		// Cleared by another process since the cache was filled
+		cache.clear();
+		cache_generation = *generation;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	job.du = this;
+	job.busy = 0;
+	job.total = 0;
+	job.scanned = 0;
+	job.cached = 0;
+	job.queue.push_back(Path);
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int thread_count = (cpus < 1) ? 2 : (int)cpus * 2;
+	if (thread_count > TW_DU_MAX_THREADS)
+		thread_count = TW_DU_MAX_THREADS;
+
+	pthread_t threads[TW_DU_MAX_THREADS];
+	int started = 0;
+	for (int i = 1; i < thread_count; i++) {
+		if (pthread_create(&threads[started], NULL, Scan_Thread, (void*)&job) != 0) {
+			LOGINFO("Unable to create du thread %i, continuing with %i\n", i, started + 1);
+			break;
+		}
+		started++;
+	}
+	// The calling thread works the queue too.
+	Scan_Thread((void*)&job);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+	LOGINFO("Folder size of '%s' is %llu bytes (%i folders, %i unchanged since last scan)\n", Path.c_str(), (unsigned long long)job.total, job.scanned, job.cached);
+	return job.total;
 }
 
 bool twrpDU::check_relative_skip_dirs(const string& dir) {
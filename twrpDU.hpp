@@ -26,18 +26,36 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <fstream>
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
 #include "twcommon.h"
 
 using namespace std;
 
+// What a directory held the last time it was scanned: the total size
+// of the files directly inside it and the names of its subdirectories.
+// Valid as long as the directory's mtime and ctime are unchanged.  A
+// file rewritten in place does not touch its directory, so anything in
+// recovery that writes to storage calls Clear_Cache(), or Mark_Changed()
+// from a forked child such as the MTP server.
+struct twrpDU_Dir {
+	struct timespec mtime;
+	struct timespec ctime;
+	uint64_t files_size;
+	vector<string> subdirs;
+};
+
 class twrpDU {
 
 public:
 	twrpDU();
-	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat
+	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat, on several threads
+	void Clear_Cache(void);                       // Forget cached directory totals after writing to storage
+	void Mark_Changed(void);                      // Lock-free Clear_Cache for forked children, applied on the next scan
 	void add_absolute_dir(const string& Path);
 	void add_relative_dir(const string& Path);
 	bool check_relative_skip_dirs(const string& dir);
@@ -46,8 +64,26 @@ public:
 	vector<string> get_absolute_dirs(void);
 	void clear_relative_dir(string dir);
 private:
+	struct Scan_Job {
+		twrpDU* du;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		deque<string> queue;   // directories waiting to be scanned
+		int busy;              // directories being scanned right now
+		uint64_t total;
+		int scanned;
+		int cached;
+	};
+	static void* Scan_Thread(void *cookie);
+	bool Scan_Dir(const string& Path, uint64_t* files_size, vector<string>* subdirs, bool* from_cache);
+
 	vector<string> absolutedir;
 	vector<string> relativedir;
+	map<pair<dev_t, ino_t>, twrpDU_Dir> cache;
+	pthread_mutex_t cache_lock;
+	volatile uint32_t* generation;  // shared with forked children (MTP), bumped by Clear_Cache
+	uint32_t cache_generation;      // generation the cache was filled under
+	uint32_t local_generation;      // used if the shared page can't be mapped
 };
 
 extern twrpDU du;
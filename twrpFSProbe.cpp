@@ -0,0 +1,326 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "twrpFSProbe.hpp"
+#include "twcommon.h"
+
+static map<string, twrpFSProbe_Info> probe_cache;
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint16_t le16(const unsigned char* p) {
+	return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t le32(const unsigned char* p) {
+	return (uint32_t)le16(p) | ((uint32_t)le16(p + 2) << 16);
+}
+
+static inline uint64_t le64(const unsigned char* p) {
+	return (uint64_t)le32(p) | ((uint64_t)le32(p + 4) << 32);
+}
+
+static bool read_at(int fd, void* buf, size_t len, uint64_t offset) {
+	unsigned char* p = (unsigned char*) buf;
+
+	while (len > 0) {
+		ssize_t r = pread64(fd, p, len, (off64_t)offset);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		p += r;
+		len -= r;
+		offset += r;
+	}
+	return true;
+}
+
+bool twrpFSProbe::Probe(const string& Block_Device, twrpFSProbe_Info* Info) {
+	pthread_mutex_lock(&probe_lock);
+	map<string, twrpFSProbe_Info>::iterator it = probe_cache.find(Block_Device);
+	if (it != probe_cache.end()) {
+		*Info = it->second;
+		pthread_mutex_unlock(&probe_lock);
+		return true;
+	}
+	pthread_mutex_unlock(&probe_lock);
+
+	int fd = open(Block_Device.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGINFO("twrpFSProbe: unable to open '%s' (%s)\n", Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	bool ret = Probe_Ext(fd, Info) || Probe_F2FS(fd, Info) || Probe_ExFAT(fd, Info) || Probe_VFAT(fd, Info);
+	close(fd);
+	if (!ret) {
+		LOGINFO("twrpFSProbe: no supported filesystem found on '%s'\n", Block_Device.c_str());
+		return false;
+	}
+
+	LOGINFO("twrpFSProbe: '%s' is %s, size %llu, used %llu, free %llu\n", Block_Device.c_str(), Info->File_System.c_str(), Info->Size, Info->Used, Info->Free);
+	pthread_mutex_lock(&probe_lock);
+	probe_cache[Block_Device] = *Info;
+	pthread_mutex_unlock(&probe_lock);
+	return true;
+}
+
+void twrpFSProbe::Invalidate(const string& Block_Device) {
+	pthread_mutex_lock(&probe_lock);
+	probe_cache.erase(Block_Device);
+	pthread_mutex_unlock(&probe_lock);
+}
+
+void twrpFSProbe::Invalidate_All(void) {
+	pthread_mutex_lock(&probe_lock);
+	probe_cache.clear();
+	pthread_mutex_unlock(&probe_lock);
+}
+
+// The free block count in the ext superblock is only brought up to date
+// when the filesystem is unmounted, which is exactly when we use it.
+// Like statfs, the inode tables and journal are left out of both the
+// size and the used space so backup sizes are not inflated by them.
+bool twrpFSProbe::Probe_Ext(int fd, twrpFSProbe_Info* Info) {
+	unsigned char sb[1024];
+
+	if (!read_at(fd, sb, sizeof(sb), 1024) || le16(sb + 0x38) != 0xEF53)
+		return false;
+
+	uint32_t log_block_size = le32(sb + 0x18);
+	if (log_block_size > 6)
+		return false;
+	uint64_t block_size = 1024ULL << log_block_size;
+	uint32_t feature_compat = le32(sb + 0x5C);
+	uint32_t feature_incompat = le32(sb + 0x60);
+	uint64_t blocks = le32(sb + 0x04);
+	uint64_t free_blocks = le32(sb + 0x0C);
+	if (feature_incompat & 0x80) { // 64bit
+		blocks |= (uint64_t)le32(sb + 0x150) << 32;
+		free_blocks |= (uint64_t)le32(sb + 0x158) << 32;
+	}
+	if (free_blocks > blocks)
+		return false;
+
+	if (feature_incompat & (0x40 | 0x80 | 0x200)) // extents, 64bit, flex_bg
+		Info->File_System = "ext4";
+	else if (feature_compat & 0x4) // has_journal
+		Info->File_System = "ext3";
+	else
+		Info->File_System = "ext2";
+	uint64_t overhead = (uint64_t)le32(sb + 0x00) * le16(sb + 0x58); // inode count * inode size
+	if (feature_compat & 0x4) // journal size is kept with the backup of its block map
+		overhead += ((uint64_t)le32(sb + 0x10C + 15 * 4) << 32) | le32(sb + 0x10C + 16 * 4);
+	Info->Size = blocks * block_size;
+	Info->Free = free_blocks * block_size;
+	Info->Used = Info->Size - Info->Free;
+	if (overhead < Info->Used) {
+		Info->Size -= overhead;
+		Info->Used -= overhead;
+	}
+	return true;
+}
+
+// f2fs keeps its block usage in the checkpoint rather than the
+// superblock.  There are two checkpoint packs; the newer one wins.
+bool twrpFSProbe::Probe_F2FS(int fd, twrpFSProbe_Info* Info) {
+	unsigned char sb[128], cp[24];
+
+	if (!read_at(fd, sb, sizeof(sb), 1024) || le32(sb) != 0xF2F52010)
+		return false;
+
+	uint32_t log_blocksize = le32(sb + 16);
+	uint32_t log_blocks_per_seg = le32(sb + 20);
+	if (log_blocksize < 9 || log_blocksize > 16 || log_blocks_per_seg > 16)
+		return false;
+	uint64_t block_size = 1ULL << log_blocksize;
+	uint64_t cp_blkaddr = le32(sb + 76);
+
+	uint64_t best_version = 0, user_blocks = 0, valid_blocks = 0;
+	bool found = false;
+	for (int pack = 0; pack < 2; pack++) {
+		uint64_t addr = cp_blkaddr + ((uint64_t)pack << log_blocks_per_seg);
+		if (!read_at(fd, cp, sizeof(cp), addr * block_size))
+			continue;
+		uint64_t version = le64(cp);
+		uint64_t user = le64(cp + 8);
+		uint64_t valid = le64(cp + 16);
+		if (valid > user || (found && version <= best_version))
+			continue;
+		best_version = version;
+		user_blocks = user;
+		valid_blocks = valid;
+		found = true;
+	}
+	if (!found)
+		return false;
+
+	Info->File_System = "f2fs";
+	Info->Size = user_blocks * block_size;
+	Info->Used = valid_blocks * block_size;
+	Info->Free = Info->Size - Info->Used;
+	return true;
+}
+
+bool twrpFSProbe::Probe_ExFAT(int fd, twrpFSProbe_Info* Info) {
+	unsigned char bs[512];
+
+	if (!read_at(fd, bs, sizeof(bs), 0) || memcmp(bs + 3, "EXFAT   ", 8) != 0)
+		return false;
+
+	uint32_t fat_offset = le32(bs + 80);
+	uint32_t heap_offset = le32(bs + 88);
+	uint32_t cluster_count = le32(bs + 92);
+	uint32_t root_cluster = le32(bs + 96);
+	unsigned sector_bits = bs[108], cluster_bits = bs[109];
+	unsigned percent = bs[112];
+	if (sector_bits < 9 || sector_bits > 12 || sector_bits + cluster_bits > 25 || cluster_count == 0)
+		return false;
+	uint64_t sector_size = 1ULL << sector_bits;
+	uint64_t cluster_size = sector_size << cluster_bits;
+
+	Info->File_System = "exfat";
+	Info->Size = cluster_count * cluster_size;
+
+	// Count the allocated clusters in the allocation bitmap, found
+	// through its entry in the first cluster of the root directory.
+	uint64_t used_clusters = 0;
+	bool counted = false;
+	vector<unsigned char> cluster(cluster_size);
+	if (root_cluster >= 2 && root_cluster < cluster_count + 2 &&
+			read_at(fd, &cluster[0], cluster_size, heap_offset * sector_size + (root_cluster - 2) * cluster_size)) {
+		for (uint64_t i = 0; i + 32 <= cluster_size && cluster[i] != 0; i += 32) {
+			if (cluster[i] != 0x81)
+				continue;
+			uint32_t bitmap_cluster = le32(&cluster[i + 20]);
+			uint64_t bitmap_bytes = le64(&cluster[i + 24]);
+			uint64_t bits_left = cluster_count;
+			if (bitmap_bytes * 8 < bits_left)
+				break;
+			// The bitmap is followed through the FAT in case it is
+			// fragmented; its clusters are normally contiguous.
+			while (bits_left > 0 && bitmap_cluster >= 2 && bitmap_cluster < cluster_count + 2) {
+				if (!read_at(fd, &cluster[0], cluster_size, heap_offset * sector_size + (uint64_t)(bitmap_cluster - 2) * cluster_size))
+					break;
+				uint64_t bytes = cluster_size;
+				if (bytes * 8 > bits_left)
+					bytes = (bits_left + 7) / 8;
+				for (uint64_t b = 0; b < bytes; b++) {
+					unsigned char v = cluster[b];
+					if (b == bytes - 1 && bits_left < bytes * 8)
+						v &= (unsigned char)((1U << (bits_left - (bytes - 1) * 8)) - 1);
+					used_clusters += __builtin_popcount(v);
+				}
+				bits_left -= (bytes * 8 > bits_left) ? bits_left : bytes * 8;
+				unsigned char next[4];
+				if (bits_left == 0 || !read_at(fd, next, 4, fat_offset * sector_size + (uint64_t)bitmap_cluster * 4))
+					break;
+				bitmap_cluster = le32(next);
+			}
+			counted = (bits_left == 0);
+			break;
+		}
+	}
+	if (counted) {
+		Info->Used = used_clusters * cluster_size;
+	} else if (percent <= 100) {
+		Info->Used = Info->Size / 100 * percent;
+	} else {
+		return false;
+	}
+	Info->Free = Info->Size - Info->Used;
+	return true;
+}
+
+bool twrpFSProbe::Probe_VFAT(int fd, twrpFSProbe_Info* Info) {
+	unsigned char bs[512];
+
+	if (!read_at(fd, bs, sizeof(bs), 0) || bs[510] != 0x55 || bs[511] != 0xAA)
+		return false;
+
+	uint32_t bytes_per_sector = le16(bs + 11);
+	uint32_t sectors_per_cluster = bs[13];
+	uint32_t reserved = le16(bs + 14);
+	uint32_t num_fats = bs[16];
+	uint32_t root_entries = le16(bs + 17);
+	uint32_t total_sectors = le16(bs + 19) ? le16(bs + 19) : le32(bs + 32);
+	uint32_t fat_sectors = le16(bs + 22) ? le16(bs + 22) : le32(bs + 36);
+	if (bytes_per_sector < 512 || bytes_per_sector > 4096 || (bytes_per_sector & (bytes_per_sector - 1)) ||
+			sectors_per_cluster == 0 || (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+			reserved == 0 || num_fats == 0 || fat_sectors == 0)
+		return false;
+
+	uint32_t root_sectors = (root_entries * 32 + bytes_per_sector - 1) / bytes_per_sector;
+	uint64_t meta_sectors = reserved + (uint64_t)num_fats * fat_sectors + root_sectors;
+	if (meta_sectors >= total_sectors)
+		return false;
+	uint32_t clusters = (uint32_t)((total_sectors - meta_sectors) / sectors_per_cluster);
+	uint64_t cluster_size = (uint64_t)bytes_per_sector * sectors_per_cluster;
+	int fat_bits = clusters < 4085 ? 12 : (clusters < 65525 ? 16 : 32);
+	if ((uint64_t)fat_sectors * bytes_per_sector * 8 < (uint64_t)(clusters + 2) * fat_bits)
+		return false;
+
+	uint64_t free_clusters = 0;
+	bool counted = false;
+	if (fat_bits == 32) {
+		// FAT32 keeps a free cluster count in the FSInfo sector
+		unsigned char fsinfo[512];
+		uint32_t fsinfo_sector = le16(bs + 48);
+		if (fsinfo_sector != 0 && fsinfo_sector < reserved &&
+				read_at(fd, fsinfo, sizeof(fsinfo), (uint64_t)fsinfo_sector * bytes_per_sector) &&
+				le32(fsinfo) == 0x41615252 && le32(fsinfo + 484) == 0x61417272 &&
+				le32(fsinfo + 488) <= clusters) {
+			free_clusters = le32(fsinfo + 488);
+			counted = true;
+		}
+	}
+	if (!counted) {
+		vector<unsigned char> fat((uint64_t)fat_sectors * bytes_per_sector);
+		if (!read_at(fd, &fat[0], fat.size(), (uint64_t)reserved * bytes_per_sector))
+			return false;
+		for (uint32_t c = 2; c < clusters + 2; c++) {
+			uint32_t entry;
+			if (fat_bits == 32) {
+				entry = le32(&fat[c * 4]) & 0x0FFFFFFF;
+			} else if (fat_bits == 16) {
+				entry = le16(&fat[c * 2]);
+			} else {
+				entry = le16(&fat[c + c / 2]);
+				entry = (c & 1) ? (entry >> 4) : (entry & 0xFFF);
+			}
+			if (entry == 0)
+				free_clusters++;
+		}
+	}
+
+	Info->File_System = "vfat";
+	Info->Size = clusters * cluster_size;
+	Info->Free = free_clusters * cluster_size;
+	Info->Used = Info->Size - Info->Free;
+	return true;
+}
@@ -0,0 +1,54 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPFSPROBE_HPP
+#define TWRPFSPROBE_HPP
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// Size and usage of a filesystem as recorded in its own metadata
+struct twrpFSProbe_Info {
+	string File_System;
+	unsigned long long Size;
+	unsigned long long Used;
+	unsigned long long Free;
+};
+
+// Reads filesystem geometry and usage straight from the superblock of
+// an unmounted block device (ext2/3/4, f2fs, vfat and exfat) so that
+// partitions can be measured without mounting them or running df.
+// Results are cached per block device until Invalidate() is called;
+// anything that changes a filesystem while it is unmounted, or
+// unmounts it after writing, must invalidate it.
+class twrpFSProbe {
+public:
+	static bool Probe(const string& Block_Device, twrpFSProbe_Info* Info);   // Reads the superblock, or returns the cached result
+	static void Invalidate(const string& Block_Device);                      // Drops the cached result for a device
+	static void Invalidate_All(void);                                         // Drops every cached result
+
+private:
+	static bool Probe_Ext(int fd, twrpFSProbe_Info* Info);
+	static bool Probe_F2FS(int fd, twrpFSProbe_Info* Info);
+	static bool Probe_VFAT(int fd, twrpFSProbe_Info* Info);
+	static bool Probe_ExFAT(int fd, twrpFSProbe_Info* Info);
+};
+
+#endif // TWRPFSPROBE_HPP
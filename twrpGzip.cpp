@@ -0,0 +1,290 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "twrpGzip.hpp"
+#include "twrpStats.hpp"
+#include "twcommon.h"
+
+#define GZIP_IN_SIZE      (256 * 1024)
+#define GZIP_OUT_SIZE     (256 * 1024)
+#define SAMPLE_SIZE       4096
+#define MIN_SAMPLE_SIZE   512
+
+// Shannon entropy of the sample, in bits per byte, above which a file
+// is stored or compressed at the fast level.  Random data scores close
+// to 8, text and databases well under 6.
+#define STORE_ENTROPY     7.5
+#define FAST_ENTROPY      6.0
+
+// Writers by the fd they write to.  An entry is only set, read and
+// cleared by the thread writing that archive, so libtar's hooks find
+// their writer with a plain index instead of a locked search.
+#define MAX_WRITER_FD     1024
+static twrpGzip* Writers[MAX_WRITER_FD];
+
+twrpGzip::twrpGzip(const string& name, twrpStats* stats) {
+	Name = name;
+	Stats = stats;
+	Initialized = false;
+	Fd = -1;
+	Level = TWGZIP_NORMAL;
+	In_Buffer = NULL;
+	In_Used = 0;
+	Out_Buffer = NULL;
+	memset(Level_Bytes, 0, sizeof(Level_Bytes));
+	memset(Level_Nsec, 0, sizeof(Level_Nsec));
+	Stored_Files = 0;
+}
+
+twrpGzip::~twrpGzip() {
+	if (Initialized) {
+		deflateEnd(&Stream);
+		Unregister();
+	}
+	free(In_Buffer);
+	free(Out_Buffer);
+}
+
+bool twrpGzip::Open(int fd) {
+	In_Buffer = (unsigned char*) malloc(GZIP_IN_SIZE);
+	Out_Buffer = (unsigned char*) malloc(GZIP_OUT_SIZE);
+	if (!In_Buffer || !Out_Buffer) {
+		LOGINFO("twrpGzip: out of memory\n");
+		return false;
+	}
+	if (fd < 0 || fd >= MAX_WRITER_FD) {
+		LOGINFO("twrpGzip: fd %i out of range\n", fd);
+		return false;
+	}
+	memset(&Stream, 0, sizeof(Stream));
+	// 15 + 16 asks zlib for a gzip header and trailer rather than zlib's own
+	if (deflateInit2(&Stream, Level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		LOGINFO("twrpGzip: deflateInit2 failed\n");
+		return false;
+	}
+	Initialized = true;
+	Fd = fd;
+	Writers[Fd] = this;
+	return true;
+}
+
+bool twrpGzip::Deflate(int Flush) {
+	int ret;
+
+	Stream.next_in = In_Buffer;
+	Stream.avail_in = In_Used;
+	do {
+		Stream.next_out = Out_Buffer;
+		Stream.avail_out = GZIP_OUT_SIZE;
+		uint64_t start = twrpStats::Now();
+		ret = deflate(&Stream, Flush);
+		Level_Nsec[Level] += twrpStats::Now() - start;
+		if (ret == Z_STREAM_ERROR) {
+			LOGINFO("twrpGzip: deflate failed for '%s'\n", Name.c_str());
+			return false;
+		}
+		if (!Write_Out(GZIP_OUT_SIZE - Stream.avail_out))
+			return false;
+	} while (Stream.avail_out == 0 || (Flush == Z_FINISH && ret != Z_STREAM_END));
+	Level_Bytes[Level] += In_Used;
+	In_Used = 0;
+	return true;
+}
+
+bool twrpGzip::Write_Out(size_t Len) {
+	unsigned char* ptr = Out_Buffer;
+
+	while (Len > 0) {
+		ssize_t written = write(Fd, ptr, Len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGINFO("twrpGzip: error writing '%s': %s\n", Name.c_str(), strerror(errno));
+			return false;
+		}
+		ptr += written;
+		Len -= written;
+	}
+	return true;
+}
+
+bool twrpGzip::Set_Level(int level) {
+	if (level == TWGZIP_STORE)
+		Stored_Files++;
+	if (level == Level)
+		return true;
+	// Compress what is buffered at the old level before switching
+	if (In_Used > 0 && !Deflate(Z_NO_FLUSH))
+		return false;
+	int ret;
+	do {
+		Stream.next_out = Out_Buffer;
+		Stream.avail_out = GZIP_OUT_SIZE;
+		ret = deflateParams(&Stream, level, Z_DEFAULT_STRATEGY);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			LOGINFO("twrpGzip: deflateParams failed for '%s'\n", Name.c_str());
+			return false;
+		}
+		if (!Write_Out(GZIP_OUT_SIZE - Stream.avail_out))
+			return false;
+	} while (ret == Z_BUF_ERROR && Stream.avail_out == 0);
+	Level = level;
+	return true;
+}
+
+bool twrpGzip::Write(const void* Buffer, size_t Size) {
+	const unsigned char* ptr = (const unsigned char*) Buffer;
+
+	while (Size > 0) {
+		size_t len = GZIP_IN_SIZE - In_Used;
+		if (len > Size)
+			len = Size;
+		memcpy(In_Buffer + In_Used, ptr, len);
+		In_Used += len;
+		ptr += len;
+		Size -= len;
+		if (In_Used == GZIP_IN_SIZE && !Deflate(Z_NO_FLUSH))
+			return false;
+	}
+	return true;
+}
+
+bool twrpGzip::Finish(void) {
+	bool ret = Deflate(Z_FINISH);
+	uint64_t total_in = 0, total_nsec = 0;
+
+	for (int i = 0; i <= TWGZIP_NORMAL; i++) {
+		total_in += Level_Bytes[i];
+		total_nsec += Level_Nsec[i];
+	}
+	if (Stats)
+		Stats->Add(TWSTAT_COMPRESS, total_nsec, total_in);
+	if (ret) {
+		// Estimate what the stored and fast data would have cost at the
+		// normal level from the rate seen on this archive
+		uint64_t other_bytes = total_in - Level_Bytes[TWGZIP_NORMAL];
+		uint64_t other_nsec = total_nsec - Level_Nsec[TWGZIP_NORMAL];
+		long long saved_ms = 0;
+		if (Level_Bytes[TWGZIP_NORMAL] > 0)
+			saved_ms = ((long long) ((double) Level_Nsec[TWGZIP_NORMAL] / Level_Bytes[TWGZIP_NORMAL] * other_bytes) - (long long) other_nsec) / 1000000;
+		LOGINFO("%s: compressed %llu to %llu bytes (%.1f%%), stored %llu bytes from %u files, fast %llu bytes, %llu ms deflating, about %lli ms saved\n",
+			Name.c_str(), (unsigned long long) total_in, (unsigned long long) Stream.total_out,
+			total_in ? (double) Stream.total_out * 100 / total_in : 0.0,
+			(unsigned long long) Level_Bytes[TWGZIP_STORE], Stored_Files, (unsigned long long) Level_Bytes[TWGZIP_FAST],
+			(unsigned long long) (total_nsec / 1000000), saved_ms > 0 ? saved_ms : 0);
+	}
+	deflateEnd(&Stream);
+	Initialized = false;
+	Unregister();
+	return ret;
+}
+
+void twrpGzip::Unregister(void) {
+	if (Writers[Fd] == this)
+		Writers[Fd] = NULL;
+}
+
+// Formats that are compressed already and gain nothing from deflate
+static bool Is_Compressed_Format(const unsigned char* b, size_t len) {
+	if (len < 12)
+		return false;
+	return (memcmp(b, "PK\x03\x04", 4) == 0)                              // zip, apk, jar
+		|| (b[0] == 0x1f && b[1] == 0x8b)                              // gzip
+		|| (b[0] == 0xff && b[1] == 0xd8 && b[2] == 0xff)              // jpeg
+		|| (memcmp(b, "\x89PNG", 4) == 0)
+		|| (memcmp(b, "GIF8", 4) == 0)
+		|| (memcmp(b + 4, "ftyp", 4) == 0)                             // mp4, 3gp, heif
+		|| (memcmp(b, "\x1a\x45\xdf\xa3", 4) == 0)                     // mkv, webm
+		|| (memcmp(b, "RIFF", 4) == 0 && memcmp(b + 8, "WEBP", 4) == 0)
+		|| (memcmp(b, "OggS", 4) == 0)
+		|| (memcmp(b, "fLaC", 4) == 0)
+		|| (memcmp(b, "ID3", 3) == 0)                                   // mp3
+		|| (b[0] == 0xff && (b[1] == 0xfb || b[1] == 0xf3 || b[1] == 0xf2 || b[1] == 0xf1 || b[1] == 0xf9)) // mp3, aac
+		|| (memcmp(b, "\xfd" "7zXZ", 5) == 0)
+		|| (memcmp(b, "BZh", 3) == 0)
+		|| (memcmp(b, "7z\xbc\xaf\x27\x1c", 6) == 0)
+		|| (memcmp(b, "\x28\xb5\x2f\xfd", 4) == 0)                     // zstd
+		|| (memcmp(b, "\x04\x22\x4d\x18", 4) == 0);                    // lz4
+}
+
+int twrpGzip::Choose_Level(const char* Path, const struct stat* st) {
+	unsigned char sample[SAMPLE_SIZE];
+	unsigned counts[256];
+	ssize_t len;
+	int fd;
+
+	if (!S_ISREG(st->st_mode) || st->st_size < MIN_SAMPLE_SIZE)
+		return TWGZIP_NORMAL;
+	fd = open(Path, O_RDONLY);
+	if (fd < 0)
+		return TWGZIP_NORMAL;
+	len = read(fd, sample, sizeof(sample));
+	close(fd);
+	if (len < MIN_SAMPLE_SIZE)
+		return TWGZIP_NORMAL;
+	if (Is_Compressed_Format(sample, len))
+		return TWGZIP_STORE;
+
+	memset(counts, 0, sizeof(counts));
+	for (ssize_t i = 0; i < len; i++)
+		counts[sample[i]]++;
+	double entropy = 0;
+	for (int i = 0; i < 256; i++) {
+		if (counts[i]) {
+			double p = (double) counts[i] / len;
+			entropy -= p * log2(p);
+		}
+	}
+	if (entropy > STORE_ENTROPY)
+		return TWGZIP_STORE;
+	if (entropy > FAST_ENTROPY)
+		return TWGZIP_FAST;
+	return TWGZIP_NORMAL;
+}
+
+twrpGzip* twrpGzip::Find(int fd) {
+	if (fd < 0 || fd >= MAX_WRITER_FD)
+		return NULL;
+	return Writers[fd];
+}
+
+ssize_t twrpGzip::Tar_Write(int fd, const void* Buffer, size_t Size) {
+	twrpGzip* gz = Find(fd);
+
+	if (!gz)
+		return write(fd, Buffer, Size);
+	return gz->Write(Buffer, Size) ? (ssize_t) Size : -1;
+}
+
+int twrpGzip::Tar_Close(int fd) {
+	twrpGzip* gz = Find(fd);
+	bool ret = true;
+
+	if (gz)
+		ret = gz->Finish();
+	if (close(fd) != 0)
+		ret = false;
+	return ret ? 0 : -1;
+}
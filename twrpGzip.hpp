@@ -0,0 +1,81 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPGZIP_HPP
+#define TWRPGZIP_HPP
+
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+using namespace std;
+
+class twrpStats;
+
+// Compression levels picked per file by Choose_Level
+#define TWGZIP_STORE       0    // Already compressed, e.g. APKs, JPEG, MP4
+#define TWGZIP_FAST        1    // Dense but not random, e.g. native code
+#define TWGZIP_NORMAL      6    // Text, databases and everything else, same as pigz
+
+// Writes a gzip stream to an fd, compressing each tar member at the
+// level chosen for it.  Output is a single ordinary gzip stream, so
+// archives restore with pigz exactly as before.  Level changes start
+// a new deflate block; nothing else about the stream changes.
+//
+// The writer is registered against the fd it writes to so that libtar,
+// which only passes an fd to its write and close hooks, can be pointed
+// at Tar_Write and Tar_Close.  Each writer must be used from the one
+// thread that writes its archive.
+class twrpGzip {
+public:
+	twrpGzip(const string& Name, twrpStats* Stats);
+	~twrpGzip();
+	bool Open(int Fd);                                                        // Starts the stream and registers the writer for Fd
+	bool Set_Level(int Level);                                                // Level for everything written from now on, called before each file
+	bool Write(const void* Buffer, size_t Size);
+	bool Finish(void);                                                        // Ends the stream and logs the ratio and time saved
+	static int Choose_Level(const char* Path, const struct stat* st);         // Samples a file's magic and entropy
+
+	static ssize_t Tar_Write(int fd, const void* Buffer, size_t Size);        // libtar write hook
+	static int Tar_Close(int fd);                                             // libtar close hook, finishes the stream and closes fd
+
+private:
+	twrpGzip(const twrpGzip&);
+	twrpGzip& operator=(const twrpGzip&);
+	bool Deflate(int Flush);
+	bool Write_Out(size_t Len);                                               // Writes the first Len bytes of Out_Buffer to Fd
+	void Unregister(void);
+	static twrpGzip* Find(int fd);
+
+	string Name;
+	twrpStats* Stats;
+	z_stream Stream;
+	bool Initialized;
+	int Fd;
+	int Level;
+	unsigned char* In_Buffer;
+	size_t In_Used;
+	unsigned char* Out_Buffer;
+	uint64_t Level_Bytes[TWGZIP_NORMAL + 1];                                  // Input bytes compressed at each level
+	uint64_t Level_Nsec[TWGZIP_NORMAL + 1];                                   // Time spent deflating at each level
+	unsigned Stored_Files;
+};
+
+#endif // TWRPGZIP_HPP
@@ -0,0 +1,119 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "twrpStats.hpp"
+#include "twcommon.h"
+
+static const char* const Stage_Names[TWSTAT_STAGE_COUNT] = {
+	"scan",
+	"stat",
+	"archive",
+	"write",
+	"compress",
+	"encrypt",
+	"extract",
+	"image",
+	"digest",
+};
+
+twrpStats::twrpStats() {
+	void* mem = mmap(NULL, sizeof(Counter) * TWSTAT_STAGE_COUNT, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		LOGINFO("twrpStats: unable to map shared counters, child process stats will be lost\n");
+		Counters = Fallback;
+	} else {
+		Counters = (Counter*) mem;
+	}
+	Reset();
+}
+
+twrpStats::~twrpStats() {
+	if (Counters != Fallback)
+		munmap(Counters, sizeof(Counter) * TWSTAT_STAGE_COUNT);
+}
+
+void twrpStats::Add(twrpStats_Stage Stage, uint64_t Nsec, uint64_t Bytes) {
+	__sync_fetch_and_add(&Counters[Stage].Nsec, Nsec);
+	__sync_fetch_and_add(&Counters[Stage].Bytes, Bytes);
+	__sync_fetch_and_add(&Counters[Stage].Calls, 1);
+}
+
+void twrpStats::Reset(void) {
+	memset(Counters, 0, sizeof(Counter) * TWSTAT_STAGE_COUNT);
+}
+
+uint64_t twrpStats::Get_Nsec(twrpStats_Stage Stage) const {
+	return Counters[Stage].Nsec;
+}
+
+uint64_t twrpStats::Get_Bytes(twrpStats_Stage Stage) const {
+	return Counters[Stage].Bytes;
+}
+
+uint64_t twrpStats::Get_Calls(twrpStats_Stage Stage) const {
+	return Counters[Stage].Calls;
+}
+
+uint64_t twrpStats::Now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char* twrpStats::Stage_Name(twrpStats_Stage Stage) {
+	return Stage_Names[Stage];
+}
+
+bool twrpStats::Write_Report(const string& Path, const string& Name, const string& Operation, uint64_t Wall_Nsec) const {
+	FILE* fp = fopen(Path.c_str(), "w");
+	if (!fp) {
+		LOGINFO("Unable to write stats report '%s'\n", Path.c_str());
+		return false;
+	}
+	fprintf(fp, "{\n\t\"name\": \"%s\",\n\t\"operation\": \"%s\",\n\t\"wall_ms\": %llu,\n\t\"stages\": {", Name.c_str(), Operation.c_str(), (unsigned long long) (Wall_Nsec / 1000000));
+	bool first = true;
+	for (int i = 0; i < TWSTAT_STAGE_COUNT; i++) {
+		const Counter& c = Counters[i];
+		if (c.Calls == 0)
+			continue;
+		double mbps = c.Nsec ? (double) c.Bytes / 1048576.0 / ((double) c.Nsec / 1e9) : 0;
+		fprintf(fp, "%s\n\t\t\"%s\": { \"ms\": %llu, \"bytes\": %llu, \"calls\": %llu, \"mb_per_sec\": %.1f }", first ? "" : ",",
+			Stage_Names[i], (unsigned long long) (c.Nsec / 1000000), (unsigned long long) c.Bytes, (unsigned long long) c.Calls, mbps);
+		first = false;
+	}
+	fprintf(fp, "\n\t}\n}\n");
+	if (fclose(fp) != 0) {
+		LOGINFO("Unable to write stats report '%s'\n", Path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void twrpStats::Log_Summary(const string& Name, const string& Operation, uint64_t Wall_Nsec) const {
+	LOGINFO("%s of %s took %llu ms:\n", Operation.c_str(), Name.c_str(), (unsigned long long) (Wall_Nsec / 1000000));
+	for (int i = 0; i < TWSTAT_STAGE_COUNT; i++) {
+		const Counter& c = Counters[i];
+		if (c.Calls == 0)
+			continue;
+		LOGINFO("  %-8s %8llu ms %12llu bytes %8llu calls\n", Stage_Names[i], (unsigned long long) (c.Nsec / 1000000), (unsigned long long) c.Bytes, (unsigned long long) c.Calls);
+	}
+}
@@ -0,0 +1,73 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPSTATS_HPP
+#define TWRPSTATS_HPP
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// Stages of a backup or restore that are timed separately
+enum twrpStats_Stage {
+	TWSTAT_SCAN,        // Walking the tree to build the list of files
+	TWSTAT_STAT,        // lstat() of each entry as it is archived
+	TWSTAT_ARCHIVE,     // libtar adding entries, including time spent in write
+	TWSTAT_WRITE,       // Writing an uncompressed tar stream through the write buffer
+	TWSTAT_COMPRESS,    // CPU time used by pigz, compressing or decompressing
+	TWSTAT_ENCRYPT,     // CPU time used by openaes or the twrpAES threads
+	TWSTAT_EXTRACT,     // libtar extracting archives
+	TWSTAT_IMAGE,       // Reading or writing raw images
+	TWSTAT_DIGEST,      // Generating the MD5
+	TWSTAT_STAGE_COUNT
+};
+
+// Time, bytes and calls per stage for one partition's backup or
+// restore.  The counters live in shared memory, so a twrpStats can be
+// handed to a forked child (twrpTar does its work in one) and to its
+// threads, and whatever they add is seen by the parent.
+class twrpStats {
+public:
+	twrpStats();
+	~twrpStats();
+	void Add(twrpStats_Stage Stage, uint64_t Nsec, uint64_t Bytes);          // Thread and process safe
+	void Reset(void);
+	uint64_t Get_Nsec(twrpStats_Stage Stage) const;
+	uint64_t Get_Bytes(twrpStats_Stage Stage) const;
+	uint64_t Get_Calls(twrpStats_Stage Stage) const;
+	bool Write_Report(const string& Path, const string& Name, const string& Operation, uint64_t Wall_Nsec) const; // Writes the totals as JSON
+	void Log_Summary(const string& Name, const string& Operation, uint64_t Wall_Nsec) const;
+
+	static uint64_t Now(void);                                                // CLOCK_MONOTONIC in nanoseconds
+	static const char* Stage_Name(twrpStats_Stage Stage);
+
+private:
+	twrpStats(const twrpStats&);
+	twrpStats& operator=(const twrpStats&);
+
+	struct Counter {
+		uint64_t Nsec;
+		uint64_t Bytes;
+		uint64_t Calls;
+	};
+	Counter* Counters;
+	Counter Fallback[TWSTAT_STAGE_COUNT];                                     // Used if the shared mapping fails
+};
+
+#endif // TWRPSTATS_HPP
@@ -26,6 +26,7 @@ extern "C" {
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -34,11 +35,14 @@ extern "C" {
 #include <string>
 #include <sstream>
 #include <vector>
+#include <map>
 #include <csignal>
 #include <dirent.h>
 #include <libgen.h>
 #include <sys/mman.h>
 #include "twrpTar.hpp"
+#include "twrpGzip.hpp"
+#include "twrpAES.hpp"
 #include "twcommon.h"
 #include "variables.h"
 #include "twrp-functions.hpp"
@@ -53,6 +57,9 @@ extern "C" {
 
 using namespace std;
 
+// Stats of the archive being written by this (forked) process, for write_tar
+static twrpStats* write_stats = NULL;
+
 twrpTar::twrpTar(void) {
 	use_encryption = 0;
 	userdata_encryption = 0;
@@ -61,13 +68,19 @@ twrpTar::twrpTar(void) {
 	has_data_media = 0;
 	pigz_pid = 0;
 	oaes_pid = 0;
+	stats = NULL;
+	adaptive_compression = 0;
+	legacy_encryption = 0;
+	gzip = NULL;
+	aes = NULL;
 	Total_Backup_Size = 0;
 	Archive_Current_Size = 0;
 	include_root_dir = true;
 }
 
 twrpTar::~twrpTar(void) {
-	// Do nothing
+	delete gzip;
+	delete aes;
 }
 
 void twrpTar::setfn(string fn) {
@@ -90,13 +103,35 @@ void twrpTar::Signal_Kill(int signum) {
 	_exit(255);
 }
 
-int twrpTar::createTarFork(const unsigned long long *overall_size, const unsigned long long *other_backups_size, pid_t &fork_pid) {
+// backed_up_size counts the bytes backed up so far across every partition
+// in the backup, including ones being backed up at the same time on other
+// threads, and is advanced as this archive is written.
+int twrpTar::createTarFork(const unsigned long long *overall_size, unsigned long long *backed_up_size, pid_t &fork_pid) {
 	int status = 0;
 	pid_t rc_pid, tar_fork_pid;
 	int progress_pipe[2], ret;
+	map<string, unsigned long long> folder_sizes;
 
 	file_count = 0;
 
+	if (use_encryption || userdata_encryption) {
+		// Size the folders the encrypted archives are split by before
+		// forking: du's cache lock may be held by another backup thread
+		// at the time of the fork, and a child's cache is thrown away.
+		DIR* d = opendir(tardir.c_str());
+		struct dirent* de;
+
+		if (d != NULL) {
+			while ((de = readdir(d)) != NULL) {
+				string FileName = tardir + "/" + de->d_name;
+
+				if (de->d_type == DT_DIR && !du.check_skip_dirs(FileName))
+					folder_sizes[FileName] = du.Get_Folder_Size(FileName);
+			}
+			closedir(d);
+		}
+	}
+
 	if (pipe(progress_pipe) < 0) {
 		LOGINFO("Error creating progress tracking pipe\n");
 		gui_err("backup_error=Error creating backup.");
@@ -116,6 +151,8 @@ int twrpTar::createTarFork(const unsigned long long *overall_size, const unsigne
 		signal(SIGUSR2, twrpTar::Signal_Kill);
 		close(progress_pipe[0]);
 		progress_pipe_fd = progress_pipe[1];
+		write_stats = stats;
+		uint64_t scan_start = twrpStats::Now();
 
 		if (use_encryption || userdata_encryption) {
 			LOGINFO("Using encryption\n");
@@ -165,9 +202,9 @@ int twrpTar::createTarFork(const unsigned long long *overall_size, const unsigne
 							_exit(-1);
 						}
 						file_count = (unsigned long long)(ret);
-						regular_size += du.Get_Folder_Size(FileName);
+						regular_size += folder_sizes[FileName];
 					} else {
-						encrypt_size += du.Get_Folder_Size(FileName);
+						encrypt_size += folder_sizes[FileName];
 					}
 				} else if (de->d_type == DT_REG) {
 					stat(FileName.c_str(), &st);
@@ -238,6 +275,8 @@ int twrpTar::createTarFork(const unsigned long long *overall_size, const unsigne
 				}
 			}
 
+			if (stats)
+				stats->Add(TWSTAT_SCAN, twrpStats::Now() - scan_start, 0);
 			// Send file count to parent
 			write(progress_pipe_fd, &file_count, sizeof(file_count));
 			// Send backup size to parent
@@ -251,8 +290,11 @@ int twrpTar::createTarFork(const unsigned long long *overall_size, const unsigne
 				reg.thread_id = 0;
 				reg.use_encryption = 0;
 				reg.use_compression = use_compression;
+				reg.adaptive_compression = adaptive_compression;
+				reg.legacy_encryption = legacy_encryption;
 				reg.split_archives = 1;
 				reg.progress_pipe_fd = progress_pipe_fd;
+				reg.stats = stats;
 				LOGINFO("Creating unencrypted backup...\n");
 				if (createList((void*)&reg) != 0) {
 					LOGINFO("Error creating unencrypted backup.\n");
@@ -294,8 +336,11 @@ int twrpTar::createTarFork(const unsigned long long *overall_size, const unsigne
 				enc[i].use_encryption = use_encryption;
 				enc[i].setpassword(password);
 				enc[i].use_compression = use_compression;
+				enc[i].adaptive_compression = adaptive_compression;
+				enc[i].legacy_encryption = legacy_encryption;
 				enc[i].split_archives = 1;
 				enc[i].progress_pipe_fd = progress_pipe_fd;
+				enc[i].stats = stats;
 				LOGINFO("Start encryption thread %i\n", i);
 				ret = pthread_create(&enc_thread[i], &tattr, createList, (void*)&enc[i]);
 				if (ret) {
@@ -362,14 +407,19 @@ int twrpTar::createTarFork(const unsigned long long *overall_size, const unsigne
 				_exit(-1);
 			}
 			file_count = (unsigned long long)(ret);
+			if (stats)
+				stats->Add(TWSTAT_SCAN, twrpStats::Now() - scan_start, 0);
 			// Create a backup
 			reg.setfn(tarfn);
 			reg.ItemList = &FileList;
 			reg.thread_id = 0;
 			reg.use_encryption = 0;
 			reg.use_compression = use_compression;
+			reg.adaptive_compression = adaptive_compression;
+			reg.legacy_encryption = legacy_encryption;
 			reg.setsize(Total_Backup_Size);
 			reg.progress_pipe_fd = progress_pipe_fd;
+			reg.stats = stats;
 			if (Total_Backup_Size > MAX_ARCHIVE_SIZE) {
 				gui_msg("split_backup=Breaking backup file into multiple archives...");
 				reg.split_archives = 1;
@@ -418,12 +468,15 @@ int twrpTar::createTarFork(const unsigned long long *overall_size, const unsigne
 			} else {
 				files_backup++;
 				size_backup += fs;
+				unsigned long long all_backed_up = __sync_add_and_fetch(backed_up_size, fs);
 				display_percent = (double)(files_backup) / (double)(file_count) * 100;
 				sprintf(file_progress, file_prog.c_str(), files_backup, file_count, (int)(display_percent));
 #ifndef BUILD_TWRPTAR_MAIN
 				DataManager::SetValue("tw_file_progress", file_progress);
-				display_percent = (double)(size_backup + *other_backups_size) / (double)(*overall_size) * 100;
-				sprintf(size_progress, size_prog.c_str(), (size_backup + *other_backups_size) / 1048576, *overall_size / 1048576, (int)(display_percent));
+				display_percent = (double)(all_backed_up) / (double)(*overall_size) * 100;
+				if (display_percent > 100)
+					display_percent = 100;
+				sprintf(size_progress, size_prog.c_str(), all_backed_up / 1048576, *overall_size / 1048576, (int)(display_percent));
 				DataManager::SetValue("tw_size_progress", size_progress);
 				progress_percent = (display_percent / 100);
 				DataManager::SetProgress((float)(progress_percent));
@@ -503,6 +556,7 @@ int twrpTar::extractTarFork(const unsigned long long *overall_size, unsigned lon
 					tars[0].basefn = basefn;
 					tars[0].thread_id = 0;
 					tars[0].progress_pipe_fd = progress_pipe_fd;
+					tars[0].stats = stats;
 					if (extractMulti((void*)&tars[0]) != 0) {
 						LOGINFO("Error extracting split archive.\n");
 						gui_err("restore_error=Error during restore process.");
@@ -544,6 +598,7 @@ int twrpTar::extractTarFork(const unsigned long long *overall_size, unsigned lon
 						tars[i].setpassword(password);
 						tars[i].thread_id = i;
 						tars[i].progress_pipe_fd = progress_pipe_fd;
+						tars[i].stats = stats;
 						LOGINFO("Creating extract thread ID %i\n", i);
 						ret = pthread_create(&tar_thread[i], &tattr, extractMulti, (void*)&tars[i]);
 						if (ret) {
@@ -687,6 +742,7 @@ int twrpTar::extractTar() {
 	char* charRootDir = (char*) tardir.c_str();
 	if (openTar() == -1)
 		return -1;
+	uint64_t stage_start = stats ? twrpStats::Now() : 0;
 	if (tar_extract_all(t, charRootDir, &progress_pipe_fd) != 0) {
 		LOGINFO("Unable to extract tar archive '%s'\n", tarfn.c_str());
 		gui_err("restore_error=Error during restore process.");
@@ -697,6 +753,18 @@ int twrpTar::extractTar() {
 		gui_err("restore_error=Error during restore process.");
 		return -1;
 	}
+	if (aes) {
+		bool decrypted = aes->Wait();
+		delete aes;
+		aes = NULL;
+		if (!decrypted) {
+			LOGINFO("Unable to decrypt '%s'\n", tarfn.c_str());
+			gui_err("restore_error=Error during restore process.");
+			return -1;
+		}
+	}
+	if (stats)
+		stats->Add(TWSTAT_EXTRACT, twrpStats::Now() - stage_start, TWFunc::Get_File_Size(tarfn));
 	return 0;
 }
 
@@ -760,7 +828,10 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 	while (i < list_size) {
 		if (TarList->at(i).thread_id == thread_id) {
 			strcpy(buf, TarList->at(i).fn.c_str());
+			uint64_t stage_start = stats ? twrpStats::Now() : 0;
 			lstat(buf, &st);
+			if (stats)
+				stats->Add(TWSTAT_STAT, twrpStats::Now() - stage_start, 0);
 			if (S_ISREG(st.st_mode)) { // item is a regular file
 				fs = (unsigned long long)(st.st_size);
 				if (split_archives && Archive_Current_Size + fs > MAX_ARCHIVE_SIZE) {
@@ -789,11 +860,18 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 				write(progress_pipe_fd, &fs, sizeof(fs));
 			}
 			LOGINFO("addFile '%s' including root: %i\n", buf, include_root_dir);
+			if (gzip && !gzip->Set_Level(twrpGzip::Choose_Level(buf, &st))) {
+				gui_err("backup_error=Error creating backup.");
+				return -1;
+			}
+			stage_start = stats ? twrpStats::Now() : 0;
 			if (addFile(buf, include_root_dir) != 0) {
 				LOGINFO("Error adding file '%s' to '%s'\n", buf, tarfn.c_str());
 				gui_err("backup_error=Error creating backup.");
 				return -1;
 			}
+			if (stats)
+				stats->Add(TWSTAT_ARCHIVE, twrpStats::Now() - stage_start, S_ISREG(st.st_mode) ? st.st_size : 0);
 		}
 		i++;
 	}
@@ -863,8 +941,9 @@ int twrpTar::createTar() {
 	char* charTarFile = (char*) tarfn.c_str();
 	char* charRootDir = (char*) tardir.c_str();
 	static tartype_t type = { open, close, read, write_tar };
+	static tartype_t gzip_type = { open, twrpGzip::Tar_Close, read, twrpGzip::Tar_Write };
 
-	if (use_encryption && use_compression) {
+	if (use_encryption && use_compression && !adaptive_compression) {
 		// Compressed and encrypted
 		Archive_Current_Type = 3;
 		LOGINFO("Using encryption and compression...\n");
@@ -914,7 +993,8 @@ int twrpTar::createTar() {
 			}
 		} else {
 			// Parent
-			oaes_pid = fork();
+			if (legacy_encryption)
+				oaes_pid = fork();
 
 			if (oaes_pid < 0) {
 				LOGINFO("openaes fork() failed\n");
@@ -923,7 +1003,7 @@ int twrpTar::createTar() {
 				for (i = 0; i < 4; i++)
 					close(pipes[i]); // close all
 				return -1;
-			} else if (oaes_pid == 0) {
+			} else if (oaes_pid == 0 && legacy_encryption) {
 				// openaes Child
 				close(pipes[0]);
 				close(pipes[1]);
@@ -942,8 +1022,14 @@ int twrpTar::createTar() {
 			} else {
 				// Parent
 				close(pipes[0]);
-				close(pipes[2]);
 				close(pipes[3]);
+				if (legacy_encryption) {
+					close(pipes[2]);
+				} else if (!Start_AES(true, pipes[2], output_fd)) {
+					close(pipes[1]);
+					gui_err("backup_error=Error creating backup.");
+					return -1;
+				}
 				fd = pipes[1];
 				if(tar_fdopen(&t, fd, charRootDir, NULL, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
 					close(fd);
@@ -954,7 +1040,7 @@ int twrpTar::createTar() {
 				return 0;
 			}
 		}
-	} else if (use_compression) {
+	} else if (use_compression && !adaptive_compression) {
 		// Compressed
 		Archive_Current_Type = 1;
 		LOGINFO("Using compression...\n");
@@ -1005,9 +1091,9 @@ int twrpTar::createTar() {
 			}
 		}
 	} else if (use_encryption) {
-		// Encrypted
-		Archive_Current_Type = 2;
-		LOGINFO("Using encryption...\n");
+		// Encrypted, and compressed in this process if requested
+		Archive_Current_Type = use_compression ? 3 : 2;
+		LOGINFO("Using encryption%s...\n", use_compression ? " and adaptive compression" : "");
 		int oaesfd[2];
 		int output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 		if (output_fd < 0) {
@@ -1020,7 +1106,8 @@ int twrpTar::createTar() {
 			close(output_fd);
 			return -1;
 		}
-		oaes_pid = fork();
+		if (legacy_encryption)
+			oaes_pid = fork();
 
 		if (oaes_pid < 0) {
 			LOGINFO("fork() failed\n");
@@ -1029,7 +1116,7 @@ int twrpTar::createTar() {
 			close(oaesfd[0]);
 			close(oaesfd[1]);
 			return -1;
-		} else if (oaes_pid == 0) {
+		} else if (oaes_pid == 0 && legacy_encryption) {
 			// Child
 			close(oaesfd[1]);   // close unused
 			dup2(oaesfd[0], 0); // remap stdin
@@ -1043,9 +1130,20 @@ int twrpTar::createTar() {
 			}
 		} else {
 			// Parent
-			close(oaesfd[0]); // close parent input
+			if (legacy_encryption) {
+				close(oaesfd[0]); // close parent input
+			} else if (!Start_AES(true, oaesfd[0], output_fd)) {
+				close(oaesfd[1]);
+				gui_err("backup_error=Error creating backup.");
+				return -1;
+			}
 			fd = oaesfd[1];   // copy parent output
-			if(tar_fdopen(&t, fd, charRootDir, NULL, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
+			if (use_compression && !Open_Gzip(fd)) {
+				close(fd);
+				gui_err("backup_error=Error creating backup.");
+				return -1;
+			}
+			if(tar_fdopen(&t, fd, charRootDir, use_compression ? &gzip_type : NULL, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
 				close(fd);
 				LOGINFO("tar_fdopen failed\n");
 				gui_err("backup_error=Error creating backup.");
@@ -1053,6 +1151,26 @@ int twrpTar::createTar() {
 			}
 			return 0;
 		}
+	} else if (use_compression) {
+		// Compressed in this process, skipping data that is compressed already
+		Archive_Current_Type = 1;
+		LOGINFO("Using adaptive compression...\n");
+		fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd < 0) {
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
+			return -1;
+		}
+		if (!Open_Gzip(fd)) {
+			close(fd);
+			gui_err("backup_error=Error creating backup.");
+			return -1;
+		}
+		if (tar_fdopen(&t, fd, charRootDir, &gzip_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
+			close(fd);
+			LOGINFO("tar_fdopen failed\n");
+			gui_err("backup_error=Error creating backup.");
+			return -1;
+		}
 	} else {
 		// Not compressed or encrypted
 		init_libtar_buffer(0);
@@ -1065,6 +1183,31 @@ int twrpTar::createTar() {
 	return 0;
 }
 
+bool twrpTar::Open_Gzip(int out_fd) {
+	delete gzip;
+	gzip = new twrpGzip(tarfn, stats);
+	if (!gzip->Open(out_fd)) {
+		delete gzip;
+		gzip = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Encrypts or decrypts between the fds on this process' threads in place
+// of an openaes child, taking ownership of both fds
+bool twrpTar::Start_AES(bool Encrypt, int in_fd, int out_fd) {
+	delete aes;
+	aes = new twrpAES(password, stats);
+	if (!(Encrypt ? aes->Start_Encrypt(in_fd, out_fd) : aes->Start_Decrypt(in_fd, out_fd))) {
+		LOGINFO("Unable to start encryption for '%s'\n", tarfn.c_str());
+		delete aes;
+		aes = NULL;
+		return false;
+	}
+	return true;
+}
+
 int twrpTar::openTar() {
 	char* charRootDir = (char*) tardir.c_str();
 	char* charTarFile = (char*) tarfn.c_str();
@@ -1093,7 +1236,10 @@ int twrpTar::openTar() {
 			close(input_fd);
 			return -1;
 		}
-		oaes_pid = fork();
+		// The in process decrypter starts below, once pigz has been forked
+		bool container = twrpAES::Is_Container(tarfn);
+		if (!container)
+			oaes_pid = fork();
 
 		if (oaes_pid < 0) {
 			LOGINFO("pigz fork() failed\n");
@@ -1102,7 +1248,7 @@ int twrpTar::openTar() {
 			for (i = 0; i < 4; i++)
 				close(pipes[i]); // close all
 			return -1;
-		} else if (oaes_pid == 0) {
+		} else if (oaes_pid == 0 && !container) {
 			// openaes Child
 			close(pipes[0]); // Close pipes that are not used by this child
 			close(pipes[2]);
@@ -1133,6 +1279,7 @@ int twrpTar::openTar() {
 				// pigz Child
 				close(pipes[1]); // Close pipes not used by this child
 				close(pipes[2]);
+				close(input_fd);
 				close(0);
 				dup2(pipes[0], 0);
 				close(1);
@@ -1148,8 +1295,14 @@ int twrpTar::openTar() {
 			} else {
 				// Parent
 				close(pipes[0]); // Close pipes not used by parent
-				close(pipes[1]);
 				close(pipes[3]);
+				if (!container) {
+					close(pipes[1]);
+				} else if (!Start_AES(false, input_fd, pipes[1])) {
+					close(pipes[2]);
+					gui_err("restore_error=Error during restore process.");
+					return -1;
+				}
 				fd = pipes[2];
 				if(tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
 					close(fd);
@@ -1175,7 +1328,9 @@ int twrpTar::openTar() {
 			return -1;
 		}
 
-		oaes_pid = fork();
+		bool container = twrpAES::Is_Container(tarfn);
+		if (!container)
+			oaes_pid = fork();
 		if (oaes_pid < 0) {
 			LOGINFO("fork() failed\n");
 			gui_err("restore_error=Error during restore process.");
@@ -1183,7 +1338,7 @@ int twrpTar::openTar() {
 			close(oaesfd[0]);
 			close(oaesfd[1]);
 			return -1;
-		} else if (oaes_pid == 0) {
+		} else if (oaes_pid == 0 && !container) {
 			// Child
 			close(oaesfd[0]); // Close unused pipe
 			close(0);   // close stdin
@@ -1198,7 +1353,13 @@ int twrpTar::openTar() {
 			}
 		} else {
 			// Parent
-			close(oaesfd[1]); // close parent output
+			if (!container) {
+				close(oaesfd[1]); // close parent output
+			} else if (!Start_AES(false, input_fd, oaesfd[1])) {
+				close(oaesfd[0]);
+				gui_err("restore_error=Error during restore process.");
+				return -1;
+			}
 			fd = oaesfd[0];   // copy parent input
 			if(tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
 				close(fd);
@@ -1295,6 +1456,12 @@ int twrpTar::addFile(string fn, bool include_root) {
 	return 0;
 }
 
+// CPU time, user and system, used by a child process
+static uint64_t Rusage_Nsec(const struct rusage& usage) {
+	return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL
+		+ (uint64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
 int twrpTar::closeTar() {
 	flush_libtar_buffer(t->fd);
 	if (tar_append_eof(t) != 0) {
@@ -1306,13 +1473,33 @@ int twrpTar::closeTar() {
 		LOGINFO("Unable to close tar archive: '%s'\n", tarfn.c_str());
 		return -1;
 	}
+	delete gzip;
+	gzip = NULL;
 	if (Archive_Current_Type > 0) {
 		close(fd);
 		int status;
-		if (pigz_pid > 0 && TWFunc::Wait_For_Child(pigz_pid, &status, "pigz") != 0)
-			return -1;
-		if (oaes_pid > 0 && TWFunc::Wait_For_Child(oaes_pid, &status, "openaes") != 0)
-			return -1;
+		struct rusage usage;
+		if (pigz_pid > 0) {
+			if (TWFunc::Wait_For_Child(pigz_pid, &status, "pigz", &usage) != 0)
+				return -1;
+			if (stats)
+				stats->Add(TWSTAT_COMPRESS, Rusage_Nsec(usage), 0);
+		}
+		if (oaes_pid > 0) {
+			if (TWFunc::Wait_For_Child(oaes_pid, &status, "openaes", &usage) != 0)
+				return -1;
+			if (stats)
+				stats->Add(TWSTAT_ENCRYPT, Rusage_Nsec(usage), 0);
+		}
+		if (aes) {
+			bool encrypted = aes->Wait();
+			delete aes;
+			aes = NULL;
+			if (!encrypted) {
+				LOGINFO("Unable to encrypt '%s'\n", tarfn.c_str());
+				return -1;
+			}
+		}
 	}
 	free_libtar_buffer();
 	if (use_compression && !use_encryption) {
@@ -1447,6 +1634,25 @@ unsigned long long twrpTar::uncompressedSize(string filename, int *archive_type)
 		} else if (ret == 1) {
 			LOGERR("Decrypted file is not in tar format.\n");
 			total_size = TWFunc::Get_File_Size(filename);
+		} else if (ret == 3 && twrpAES::Is_Container(filename)) {
+			// The gzip trailer holds the original size, only the last chunk is decrypted to read it
+			uint8_t isize[4];
+			*archive_type = 3;
+			unsigned long long file_size = TWFunc::Get_File_Size(filename);
+			if (twrpAES::Read_Tail(filename, password, isize, sizeof(isize))) {
+				total_size = (unsigned long long) isize[0] | ((unsigned long long) isize[1] << 8) | ((unsigned long long) isize[2] << 16) | ((unsigned long long) isize[3] << 24);
+				// ISIZE is the size modulo 4GB.  Deflate never grows data by
+				// more than a few bytes per 64KB block and the container adds
+				// 4 bytes per chunk, so the original is at least the archive
+				// size less that overhead; take the smallest size it can be.
+				unsigned long long min_size = file_size - file_size / 8192 - 4096;
+				if (file_size < 8192)
+					min_size = 0;
+				while (total_size < min_size)
+					total_size += 1ULL << 32;
+			} else {
+				total_size = file_size;
+			}
 		} else if (ret == 3) {
 			*archive_type = 3;
 			Command = "openaes dec --key \"" + password + "\" --in '" + filename + "' | pigz -l";
@@ -1474,5 +1680,10 @@ unsigned long long twrpTar::uncompressedSize(string filename, int *archive_type)
 }
 
 extern "C" ssize_t write_tar(int fd, const void *buffer, size_t size) {
-	return (ssize_t) write_libtar_buffer(fd, buffer, size);
+	if (!write_stats)
+		return (ssize_t) write_libtar_buffer(fd, buffer, size);
+	uint64_t start = twrpStats::Now();
+	ssize_t ret = (ssize_t) write_libtar_buffer(fd, buffer, size);
+	write_stats->Add(TWSTAT_WRITE, twrpStats::Now() - start, ret > 0 ? ret : 0);
+	return ret;
 }
@@ -28,9 +28,13 @@ extern "C" {
 #include <string>
 #include <vector>
 #include "twrpDU.hpp"
+#include "twrpStats.hpp"
 
 using namespace std;
 
+class twrpGzip;
+class twrpAES;
+
 struct TarListStruct {
 	std::string fn;
 	unsigned thread_id;
@@ -45,7 +49,7 @@ class twrpTar {
 public:
 	twrpTar();
 	virtual ~twrpTar();
-	int createTarFork(const unsigned long long *overall_size, const unsigned long long *other_backups_size, pid_t &fork_pid);
+	int createTarFork(const unsigned long long *overall_size, unsigned long long *backed_up_size, pid_t &fork_pid);
 	int extractTarFork(const unsigned long long *overall_size, unsigned long long *other_backups_size);
 	void setfn(string fn);
 	void setdir(string dir);
@@ -63,6 +67,9 @@ public:
 	int progress_pipe_fd;
 	string partition_name;
 	string backup_folder;
+	twrpStats* stats;                                   // Per-stage timings are added here when set
+	int adaptive_compression;                           // Compress in process, storing files that are compressed already, instead of using pigz
+	int legacy_encryption;                              // Encrypt with an openaes process instead of the multithreaded twrpAES container
 
 private:
 	int extract();
@@ -75,6 +82,8 @@ private:
 	int extractTar();
 	string Strip_Root_Dir(string Path);
 	int openTar();
+	bool Open_Gzip(int out_fd);
+	bool Start_AES(bool Encrypt, int in_fd, int out_fd);
 	int Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id);
 	static void* createList(void *cookie);
 	static void* extractMulti(void *cookie);
@@ -90,6 +99,8 @@ private:
 	int fd;
 	pid_t pigz_pid;
 	pid_t oaes_pid;
+	twrpGzip* gzip;
+	twrpAES* aes;
 	unsigned long long file_count;
 
 	string tardir;
@@ -7,16 +7,19 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpStats.cpp \
+	../twrpGzip.cpp \
+	../twrpAES.cpp \
 	../tarWrite.c \
 	../twrpDU.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
 
-LOCAL_C_INCLUDES += bionic
+LOCAL_C_INCLUDES += bionic external/zlib
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
     LOCAL_C_INCLUDES += external/stlport/stlport
 endif
 
-LOCAL_STATIC_LIBRARIES := libc libtar_static libstdc++
+LOCAL_STATIC_LIBRARIES := libc libtar_static libz libstdc++
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
     LOCAL_STATIC_LIBRARIES += libstlport_static
 endif
@@ -50,12 +53,15 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpStats.cpp \
+	../twrpGzip.cpp \
+	../twrpAES.cpp \
 	../tarWrite.c \
 	../twrpDU.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
 
-LOCAL_C_INCLUDES += bionic external/stlport/stlport
-LOCAL_SHARED_LIBRARIES := libc libtar libstlport libstdc++
+LOCAL_C_INCLUDES += bionic external/stlport/stlport external/zlib
+LOCAL_SHARED_LIBRARIES := libc libtar libz libstlport libstdc++
 
 ifeq ($(TWHAVE_SELINUX), true)
     LOCAL_C_INCLUDES += external/libselinux/include
@@ -76,3 +82,84 @@ LOCAL_MODULE_TAGS:= optional
 LOCAL_MODULE_CLASS := UTILITY_EXECUTABLES
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/utilities
 include $(BUILD_EXECUTABLE)
+
+
+# Build copy_file benchmark
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	copyBench.cpp \
+	../twrp-functions.cpp \
+	../twrpTar.cpp \
+	../twrpStats.cpp \
+	../twrpGzip.cpp \
+	../twrpAES.cpp \
+	../tarWrite.c \
+	../twrpDU.cpp
+LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
+
+LOCAL_C_INCLUDES += bionic external/zlib
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
+    LOCAL_C_INCLUDES += external/stlport/stlport
+endif
+
+LOCAL_STATIC_LIBRARIES := libc libtar_static libz libstdc++
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
+    LOCAL_STATIC_LIBRARIES += libstlport_static
+endif
+
+ifeq ($(TWHAVE_SELINUX), true)
+    LOCAL_C_INCLUDES += external/libselinux/include
+    LOCAL_STATIC_LIBRARIES += libselinux
+    LOCAL_CFLAGS += -DHAVE_SELINUX
+endif
+ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
+    LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
+else
+	LOCAL_STATIC_LIBRARIES += libopenaes_static
+endif
+
+LOCAL_MODULE:= copy_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS:= optional
+LOCAL_MODULE_CLASS := UTILITY_EXECUTABLES
+LOCAL_MODULE_PATH := $(PRODUCT_OUT)/utilities
+include $(BUILD_EXECUTABLE)
+
+
+# Build backup/restore benchmark for the host
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	tarBench.cpp \
+	../twrpStats.cpp \
+	../twrpGzip.cpp \
+	../tarWrite.c \
+	../digest/md5.c
+LOCAL_CFLAGS:= -g -W -DBUILD_TWRPTAR_MAIN
+
+LOCAL_C_INCLUDES += external/zlib
+LOCAL_STATIC_LIBRARIES := libtar_host libz-host libcutils
+
+LOCAL_MODULE:= tar_bench
+LOCAL_MODULE_TAGS:= optional
+include $(BUILD_HOST_EXECUTABLE)
+
+
+# Build encryption benchmark for the host
+ifneq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	aesBench.cpp \
+	../twrpAES.cpp \
+	../twrpStats.cpp
+LOCAL_CFLAGS:= -g -W -DBUILD_TWRPTAR_MAIN
+
+LOCAL_STATIC_LIBRARIES := libopenaes_host
+LOCAL_LDLIBS := -lpthread
+
+LOCAL_MODULE:= aes_bench
+LOCAL_MODULE_TAGS:= optional
+include $(BUILD_HOST_EXECUTABLE)
+endif
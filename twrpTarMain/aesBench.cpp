@@ -0,0 +1,244 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Encryption throughput benchmark.
+//
+// Encrypts and decrypts the same data with openaes, one 4064 byte CBC
+// record at a time exactly as the openaes binary does, and with twrpAES
+// at every thread count up to the number of cores.  The data goes
+// through a pipe and a file in the work directory like a backup does,
+// and every decrypted stream is checked against the original.
+// Setting TWAES_NO_HW in the environment measures twrpAES without the
+// AES instructions.
+//
+// usage: aes_bench <work-dir> [size-MB]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+extern "C" {
+	#include "../openaes/inc/oaes_lib.h"
+}
+#include "../twrpAES.hpp"
+#include "../twrpStats.hpp"
+
+using namespace std;
+
+#define BENCH_PASSWORD    "twrp aes bench"
+#define OAES_ENC_RECORD   (4096 - 2 * OAES_BLOCK_SIZE)
+#define OAES_DEC_RECORD   4096
+
+struct pipe_job {
+	int fd;
+	const uint8_t* data;
+	size_t size;
+	bool ok;
+};
+
+static double mb_per_sec(size_t bytes, uint64_t nsec) {
+	return nsec ? (double) bytes / 1048576.0 / ((double) nsec / 1e9) : 0;
+}
+
+// Same key padding as openaes' command line tool
+static void oaes_key(OAES_CTX* ctx) {
+	uint8_t key[32];
+	size_t len = strlen(BENCH_PASSWORD);
+
+	for (int i = 0; i < 32; i++)
+		key[i] = i + 1;
+	memcpy(key, BENCH_PASSWORD, len);
+	oaes_key_import_data(ctx, key, len <= 16 ? 16 : (len <= 24 ? 24 : 32));
+}
+
+static bool run_openaes(const string& file, const uint8_t* data, size_t size) {
+	OAES_CTX* ctx = oaes_alloc();
+	uint8_t out[OAES_DEC_RECORD + 2 * OAES_BLOCK_SIZE];
+	size_t out_len;
+	uint64_t start;
+
+	if (!ctx)
+		return false;
+	oaes_key(ctx);
+
+	start = twrpStats::Now();
+	FILE* fp = fopen(file.c_str(), "wb");
+	if (!fp) {
+		oaes_free(&ctx);
+		return false;
+	}
+	for (size_t pos = 0; pos < size; pos += OAES_ENC_RECORD) {
+		size_t len = size - pos < OAES_ENC_RECORD ? size - pos : OAES_ENC_RECORD;
+		out_len = sizeof(out);
+		if (oaes_encrypt(ctx, data + pos, len, out, &out_len) != OAES_RET_SUCCESS) {
+			printf("openaes: encryption failed\n");
+			fclose(fp);
+			oaes_free(&ctx);
+			return false;
+		}
+		fwrite(out, 1, out_len, fp);
+	}
+	fclose(fp);
+	uint64_t enc_nsec = twrpStats::Now() - start;
+
+	start = twrpStats::Now();
+	fp = fopen(file.c_str(), "rb");
+	uint8_t in[OAES_DEC_RECORD];
+	size_t in_len, pos = 0;
+	bool ok = fp != NULL;
+	while (ok && (in_len = fread(in, 1, sizeof(in), fp)) > 0) {
+		out_len = sizeof(out);
+		if (oaes_decrypt(ctx, in, in_len, out, &out_len) != OAES_RET_SUCCESS || pos + out_len > size || memcmp(out, data + pos, out_len) != 0)
+			ok = false;
+		pos += out_len;
+	}
+	if (fp)
+		fclose(fp);
+	uint64_t dec_nsec = twrpStats::Now() - start;
+	oaes_free(&ctx);
+	ok = ok && pos == size;
+	printf("openaes   1 thread    encrypt %8.1f MB/s   decrypt %8.1f MB/s   %s\n",
+		mb_per_sec(size, enc_nsec), mb_per_sec(size, dec_nsec), ok ? "verified" : "FAILED");
+	unlink(file.c_str());
+	return ok;
+}
+
+static void* feed_pipe(void* cookie) {
+	pipe_job* job = (pipe_job*) cookie;
+	size_t pos = 0;
+
+	while (pos < job->size) {
+		ssize_t len = write(job->fd, job->data + pos, job->size - pos);
+		if (len <= 0)
+			break;
+		pos += len;
+	}
+	close(job->fd);
+	job->ok = pos == job->size;
+	return NULL;
+}
+
+static void* check_pipe(void* cookie) {
+	pipe_job* job = (pipe_job*) cookie;
+	uint8_t buf[64 * 1024];
+	size_t pos = 0;
+	ssize_t len;
+
+	job->ok = true;
+	while ((len = read(job->fd, buf, sizeof(buf))) > 0) {
+		if (pos + len > job->size || memcmp(buf, job->data + pos, len) != 0)
+			job->ok = false;
+		pos += len;
+	}
+	close(job->fd);
+	job->ok = job->ok && pos == job->size;
+	return NULL;
+}
+
+// Runs one direction: a thread on the other end of the pipe feeds or
+// checks the plain text while twrpAES works between the pipe and file
+static bool run_stream(bool encrypt, const string& file, const uint8_t* data, size_t size, int threads, twrpStats* stats, uint64_t* nsec) {
+	int pipes[2], file_fd;
+	pthread_t thread;
+	pipe_job job;
+
+	if (pipe(pipes) < 0)
+		return false;
+	file_fd = encrypt ? open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(file.c_str(), O_RDONLY);
+	if (file_fd < 0)
+		return false;
+	job.fd = encrypt ? pipes[1] : pipes[0];
+	job.data = data;
+	job.size = size;
+	job.ok = false;
+
+	uint64_t start = twrpStats::Now();
+	twrpAES aes(BENCH_PASSWORD, stats);
+	aes.Set_Threads(threads);
+	bool ok = encrypt ? aes.Start_Encrypt(pipes[0], file_fd) : aes.Start_Decrypt(file_fd, pipes[1]);
+	if (!ok) {
+		close(job.fd);
+		return false;
+	}
+	pthread_create(&thread, NULL, encrypt ? feed_pipe : check_pipe, &job);
+	ok = aes.Wait();
+	pthread_join(thread, NULL);
+	*nsec = twrpStats::Now() - start;
+	return ok && job.ok;
+}
+
+static bool run_twrpaes(const string& file, const uint8_t* data, size_t size, int threads) {
+	twrpStats stats;
+	uint64_t enc_nsec, dec_nsec;
+
+	bool ok = run_stream(true, file, data, size, threads, &stats, &enc_nsec)
+		&& run_stream(false, file, data, size, threads, &stats, &dec_nsec);
+	printf("twrpAES %3i thread%s   encrypt %8.1f MB/s   decrypt %8.1f MB/s   %s, %.1f MB/s per core\n",
+		threads, threads == 1 ? " " : "s", mb_per_sec(size, enc_nsec), mb_per_sec(size, dec_nsec), ok ? "verified" : "FAILED",
+		mb_per_sec(stats.Get_Bytes(TWSTAT_ENCRYPT), stats.Get_Nsec(TWSTAT_ENCRYPT)));
+	unlink(file.c_str());
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	size_t size_mb = 256;
+	bool ok = true;
+
+	if (argc < 2) {
+		printf("usage: %s <work-dir> [size-MB]\n", argv[0]);
+		return 1;
+	}
+	string file = string(argv[1]) + "/aes_bench.win";
+	if (argc > 2)
+		size_mb = atoi(argv[2]);
+	if (size_mb == 0) {
+		printf("Invalid size\n");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	// Not a multiple of any record or chunk size, so every tail is exercised
+	size_t size = size_mb * 1024 * 1024 + 12345;
+	uint8_t* data = (uint8_t*) malloc(size);
+	if (!data) {
+		printf("Unable to allocate %llu bytes\n", (unsigned long long) size);
+		return 1;
+	}
+	srand(1);
+	for (size_t i = 0; i < size; i++)
+		data[i] = (i & 0x10000) ? rand() : (uint8_t) ("The quick brown fox "[i % 20]);
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		cores = 1;
+	if (cores > TWAES_MAX_THREADS)
+		cores = TWAES_MAX_THREADS;
+	printf("%llu MB, %li cores, AES implementation: %s\n", (unsigned long long) size_mb, cores, twrpAESCipher::Implementation());
+	ok = run_openaes(file, data, size);
+	for (int threads = 1; threads <= cores; threads *= 2)
+		ok = run_twrpaes(file, data, size, threads) && ok;
+	if ((cores & (cores - 1)) != 0)
+		ok = run_twrpaes(file, data, size, cores) && ok;
+	free(data);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Throughput benchmark for TWFunc::copy_file().
+//
+// Writes a dense file and a sparse file (1MB of data every 16MB) into
+// the work directory, copies each with copy_file() and with a plain
+// 64KB read/write loop, checks that the copies match and reports the
+// time taken and the space allocated by each copy.
+//
+// usage: copy_bench <work-dir> [size-MB]
+
+#include "../twrp-functions.hpp"
+#include "../twrpDU.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+twrpDU du;
+
+#define MB (1024 * 1024)
+
+static double elapsed(const timespec& start) {
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static bool make_file(const string& path, long size_mb, bool sparse) {
+	char* buf = (char*) malloc(MB);
+	unsigned int seed = 1;
+	bool ok = true;
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0 || !buf) {
+		printf("Unable to create '%s': %s\n", path.c_str(), strerror(errno));
+		free(buf);
+		return false;
+	}
+	for (long i = 0; i < size_mb && ok; i++) {
+		if (sparse && i % 16 != 0)
+			continue;
+		for (int j = 0; j < MB; j++)
+			buf[j] = (char) (rand_r(&seed) & 0xff);
+		ok = pwrite(fd, buf, MB, (off_t) i * MB) == MB;
+	}
+	if (ok)
+		ok = ftruncate(fd, (off_t) size_mb * MB) == 0;
+	close(fd);
+	free(buf);
+	return ok;
+}
+
+static int plain_copy(const string& src, const string& dst) {
+	char buf[64 * 1024];
+	ssize_t len;
+	int in_fd = open(src.c_str(), O_RDONLY);
+	int out_fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (in_fd < 0 || out_fd < 0)
+		return -1;
+	while ((len = read(in_fd, buf, sizeof(buf))) > 0) {
+		if (write(out_fd, buf, len) != len) {
+			len = -1;
+			break;
+		}
+	}
+	close(in_fd);
+	if (close(out_fd) != 0)
+		len = -1;
+	return len < 0 ? -1 : 0;
+}
+
+static bool same_contents(const string& a, const string& b) {
+	char buf_a[64 * 1024], buf_b[64 * 1024];
+	ssize_t len_a, len_b;
+	bool same = true;
+	FILE* fa = fopen(a.c_str(), "rb");
+	FILE* fb = fopen(b.c_str(), "rb");
+
+	if (!fa || !fb)
+		same = false;
+	while (same) {
+		len_a = fread(buf_a, 1, sizeof(buf_a), fa);
+		len_b = fread(buf_b, 1, sizeof(buf_b), fb);
+		if (len_a != len_b || memcmp(buf_a, buf_b, len_a) != 0)
+			same = false;
+		if (len_a <= 0)
+			break;
+	}
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return same;
+}
+
+static bool run(const string& name, const string& src, const string& dir, long size_mb) {
+	string dst_plain = dir + "/" + name + ".plain";
+	string dst_copy = dir + "/" + name + ".copy";
+	struct stat st_plain, st_copy;
+	timespec start;
+	double t_plain, t_copy;
+
+	sync();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (plain_copy(src, dst_plain) != 0) {
+		printf("%s: read/write copy failed: %s\n", name.c_str(), strerror(errno));
+		return false;
+	}
+	t_plain = elapsed(start);
+
+	sync();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (TWFunc::copy_file(src, dst_copy, -1) != 0) {
+		printf("%s: copy_file failed: %s\n", name.c_str(), strerror(errno));
+		return false;
+	}
+	t_copy = elapsed(start);
+
+	if (!same_contents(src, dst_copy)) {
+		printf("%s: copy_file output differs from the source\n", name.c_str());
+		return false;
+	}
+	stat(dst_plain.c_str(), &st_plain);
+	stat(dst_copy.c_str(), &st_copy);
+	printf("%-6s read/write: %7.3fs %8.1f MB/s %8lld KB allocated\n", name.c_str(),
+		t_plain, size_mb / t_plain, (long long) st_plain.st_blocks / 2);
+	printf("%-6s copy_file:  %7.3fs %8.1f MB/s %8lld KB allocated\n", name.c_str(),
+		t_copy, size_mb / t_copy, (long long) st_copy.st_blocks / 2);
+	unlink(dst_plain.c_str());
+	unlink(dst_copy.c_str());
+	return true;
+}
+
+int main(int argc, char **argv) {
+	long size_mb = 256;
+	bool ok;
+
+	if (argc < 2) {
+		printf("usage: %s <work-dir> [size-MB]\n", argv[0]);
+		return 1;
+	}
+	string dir = argv[1];
+	if (argc > 2)
+		size_mb = strtol(argv[2], NULL, 10);
+	if (size_mb <= 0) {
+		printf("Invalid size '%s'\n", argv[2]);
+		return 1;
+	}
+
+	string dense = dir + "/copy_bench.dense";
+	string sparse = dir + "/copy_bench.sparse";
+	ok = make_file(dense, size_mb, false) && make_file(sparse, size_mb, true);
+	if (ok)
+		ok = run("dense", dense, dir, size_mb) && run("sparse", sparse, dir, size_mb);
+	unlink(dense.c_str());
+	unlink(sparse.c_str());
+	return ok ? 0 : 1;
+}
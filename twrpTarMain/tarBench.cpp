@@ -0,0 +1,382 @@
+
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Backup and restore benchmark for the tar pipeline.
+//
+// Generates a reproducible tree (a fixed seed, a mix of small and large
+// files, some random and some compressible, plus directories and
+// symlinks), backs it up the way twrpTar does -- libtar writing through
+// the tarWrite buffer, through a pigz pipe or through twrpGzip's
+// adaptive compression -- then restores it with tar_extract_all and
+// checks the result against the source.  Each run
+// is timed per stage with twrpStats and the totals are written as the
+// same JSON reports a backup leaves next to its images.
+//
+// usage: tar_bench <work-dir> [file-count] [max-file-KB]
+
+extern "C" {
+	#include "../libtar/libtar.h"
+	#include "../tarWrite.h"
+	#include "../digest/md5.h"
+}
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "../twrpGzip.hpp"
+#include "../twrpStats.hpp"
+
+using namespace std;
+
+enum bench_mode {
+	BENCH_TAR,
+	BENCH_PIGZ,
+	BENCH_ADAPTIVE
+};
+
+static twrpStats* write_stats = NULL;
+
+extern "C" ssize_t bench_write(int fd, const void *buffer, size_t size) {
+	uint64_t start = twrpStats::Now();
+	ssize_t ret = (ssize_t) write_libtar_buffer(fd, buffer, size);
+	write_stats->Add(TWSTAT_WRITE, twrpStats::Now() - start, ret > 0 ? ret : 0);
+	return ret;
+}
+
+static uint64_t rusage_nsec(const struct rusage& usage) {
+	return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL
+		+ (uint64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+static uint64_t file_size(const string& path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static bool make_tree(const string& dir, int count, int max_kb) {
+	unsigned int seed = 1;
+	char* buf = (char*) malloc(max_kb * 1024);
+	bool ok = buf != NULL && mkdir(dir.c_str(), 0755) == 0;
+
+	for (int i = 0; i < count && ok; i++) {
+		char sub[32], name[64];
+		snprintf(sub, sizeof(sub), "/d%02d", i % 16);
+		string subdir = dir + sub;
+		if (i < 16)
+			ok = mkdir(subdir.c_str(), 0755) == 0;
+		// Mostly small files with the odd large one, as on /data
+		int size = (i % 32 == 0) ? max_kb * 1024 : rand_r(&seed) % (max_kb * 1024 / 16 + 1);
+		if (i % 2 == 0) {
+			for (int j = 0; j < size; j++)
+				buf[j] = (char) (rand_r(&seed) & 0xff);
+		} else {
+			for (int j = 0; j < size; j++)
+				buf[j] = "twrp backup benchmark\n"[j % 22];
+		}
+		snprintf(name, sizeof(name), "/f%05d", i);
+		string path = subdir + name;
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		ok = ok && fd >= 0 && write(fd, buf, size) == size;
+		if (fd >= 0)
+			close(fd);
+		if (ok && i % 64 == 1)
+			ok = symlink(name + 1, (path + ".lnk").c_str()) == 0;
+	}
+	free(buf);
+	if (!ok)
+		printf("Unable to create the source tree in '%s': %s\n", dir.c_str(), strerror(errno));
+	return ok;
+}
+
+static void scan_tree(const string& dir, vector<string>* files) {
+	DIR* d = opendir(dir.c_str());
+	struct dirent* de;
+
+	if (!d)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		string path = dir + "/" + de->d_name;
+		files->push_back(path);
+		if (de->d_type == DT_DIR)
+			scan_tree(path, files);
+	}
+	closedir(d);
+}
+
+static int remove_tree(const string& dir) {
+	string cmd = "rm -rf '" + dir + "'";
+	return system(cmd.c_str());
+}
+
+// Starts pigz reading from or writing to archive, returns our end of the pipe
+static int start_pigz(const string& archive, bool decompress, pid_t* pid) {
+	int pipes[2], fd;
+
+	if (pipe(pipes) < 0)
+		return -1;
+	fd = decompress ? open(archive.c_str(), O_RDONLY) : open(archive.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	*pid = fork();
+	if (*pid < 0)
+		return -1;
+	if (*pid == 0) {
+		dup2(decompress ? fd : pipes[0], 0);
+		dup2(decompress ? pipes[1] : fd, 1);
+		close(pipes[0]);
+		close(pipes[1]);
+		close(fd);
+		if (decompress)
+			execlp("pigz", "pigz", "-d", "-c", NULL);
+		else
+			execlp("pigz", "pigz", "-", NULL);
+		_exit(127);
+	}
+	close(fd);
+	close(decompress ? pipes[1] : pipes[0]);
+	return decompress ? pipes[0] : pipes[1];
+}
+
+static bool wait_pigz(pid_t pid, twrpStats* stats, const string& archive) {
+	struct rusage usage;
+	int status;
+
+	if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("pigz failed\n");
+		return false;
+	}
+	stats->Add(TWSTAT_COMPRESS, rusage_nsec(usage), file_size(archive));
+	return true;
+}
+
+static bool digest(const string& archive, twrpStats* stats) {
+	unsigned char buf[64 * 1024], md5[MD5LENGTH];
+	struct MD5Context ctx;
+	uint64_t start = twrpStats::Now(), total = 0;
+	ssize_t len;
+	int fd = open(archive.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		return false;
+	MD5Init(&ctx);
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		MD5Update(&ctx, buf, len);
+		total += len;
+	}
+	MD5Final(md5, &ctx);
+	close(fd);
+	stats->Add(TWSTAT_DIGEST, twrpStats::Now() - start, total);
+	return len == 0;
+}
+
+static bool backup(const string& src, const string& archive, bench_mode mode, twrpStats* stats) {
+	static tartype_t type = { open, close, read, bench_write };
+	static tartype_t gzip_type = { open, twrpGzip::Tar_Close, read, twrpGzip::Tar_Write };
+	twrpGzip gzip(archive, stats);
+	vector<string> files;
+	TAR* t;
+	pid_t pid = 0;
+	uint64_t start;
+
+	start = twrpStats::Now();
+	scan_tree(src, &files);
+	stats->Add(TWSTAT_SCAN, twrpStats::Now() - start, 0);
+
+	if (mode == BENCH_PIGZ) {
+		int fd = start_pigz(archive, false, &pid);
+		if (fd < 0 || tar_fdopen(&t, fd, (char*) src.c_str(), NULL, O_WRONLY, 0644, TAR_GNU) != 0) {
+			printf("Unable to start pigz: %s\n", strerror(errno));
+			return false;
+		}
+	} else if (mode == BENCH_ADAPTIVE) {
+		int fd = open(archive.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || !gzip.Open(fd) || tar_fdopen(&t, fd, (char*) src.c_str(), &gzip_type, O_WRONLY, 0644, TAR_GNU) != 0) {
+			printf("Unable to create '%s': %s\n", archive.c_str(), strerror(errno));
+			return false;
+		}
+	} else {
+		write_stats = stats;
+		init_libtar_buffer(0);
+		if (tar_open(&t, (char*) archive.c_str(), &type, O_WRONLY | O_CREAT | O_TRUNC, 0644, TAR_GNU) != 0) {
+			printf("Unable to create '%s': %s\n", archive.c_str(), strerror(errno));
+			return false;
+		}
+	}
+	for (size_t i = 0; i < files.size(); i++) {
+		struct stat st;
+		char* name = (char*) files[i].c_str();
+
+		start = twrpStats::Now();
+		lstat(name, &st);
+		stats->Add(TWSTAT_STAT, twrpStats::Now() - start, 0);
+		if (mode == BENCH_ADAPTIVE && !gzip.Set_Level(twrpGzip::Choose_Level(name, &st)))
+			return false;
+		start = twrpStats::Now();
+		if (tar_append_file(t, name, name + src.size() + 1) != 0) {
+			printf("Unable to add '%s'\n", name);
+			return false;
+		}
+		stats->Add(TWSTAT_ARCHIVE, twrpStats::Now() - start, S_ISREG(st.st_mode) ? st.st_size : 0);
+	}
+	if (mode == BENCH_TAR)
+		flush_libtar_buffer(t->fd);
+	if (tar_append_eof(t) != 0)
+		return false;
+	if (tar_close(t) != 0)
+		return false;
+	if (mode == BENCH_TAR)
+		free_libtar_buffer();
+	if (mode == BENCH_PIGZ && !wait_pigz(pid, stats, archive))
+		return false;
+	return digest(archive, stats);
+}
+
+static bool restore(const string& archive, const string& dst, bench_mode mode, twrpStats* stats) {
+	bool compress = mode != BENCH_TAR;
+	int progress_fd = 0;
+	pid_t pid = 0;
+	TAR* t;
+
+	if (mkdir(dst.c_str(), 0755) != 0)
+		return false;
+	if (compress) {
+		int fd = start_pigz(archive, true, &pid);
+		if (fd < 0 || tar_fdopen(&t, fd, (char*) dst.c_str(), NULL, O_RDONLY, 0644, TAR_GNU) != 0)
+			return false;
+	} else if (tar_open(&t, (char*) archive.c_str(), NULL, O_RDONLY, 0644, TAR_GNU) != 0) {
+		return false;
+	}
+	uint64_t start = twrpStats::Now();
+	if (tar_extract_all(t, (char*) dst.c_str(), &progress_fd) != 0) {
+		printf("Unable to extract '%s'\n", archive.c_str());
+		tar_close(t);
+		return false;
+	}
+	if (tar_close(t) != 0)
+		return false;
+	stats->Add(TWSTAT_EXTRACT, twrpStats::Now() - start, file_size(archive));
+	return !compress || wait_pigz(pid, stats, archive);
+}
+
+static bool same_file(const string& a, const string& b) {
+	char buf_a[64 * 1024], buf_b[64 * 1024];
+	size_t len_a, len_b;
+	bool same = true;
+	FILE* fa = fopen(a.c_str(), "rb");
+	FILE* fb = fopen(b.c_str(), "rb");
+
+	if (!fa || !fb)
+		same = false;
+	while (same) {
+		len_a = fread(buf_a, 1, sizeof(buf_a), fa);
+		len_b = fread(buf_b, 1, sizeof(buf_b), fb);
+		if (len_a != len_b || memcmp(buf_a, buf_b, len_a) != 0)
+			same = false;
+		if (len_a == 0)
+			break;
+	}
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return same;
+}
+
+static bool verify(const string& src, const string& dst) {
+	vector<string> files;
+
+	scan_tree(src, &files);
+	for (size_t i = 0; i < files.size(); i++) {
+		string restored = dst + files[i].substr(src.size());
+		struct stat st_src, st_dst;
+
+		if (lstat(files[i].c_str(), &st_src) != 0 || lstat(restored.c_str(), &st_dst) != 0
+			|| (st_src.st_mode & S_IFMT) != (st_dst.st_mode & S_IFMT)
+			|| (S_ISREG(st_src.st_mode) && !same_file(files[i], restored))) {
+			printf("Restored '%s' does not match the source\n", restored.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool run(const string& dir, const string& src, const string& name, bench_mode mode) {
+	string archive = dir + "/tar_bench." + name + ".win";
+	string dst = dir + "/tar_bench." + name + ".restore";
+	uint64_t start;
+
+	twrpStats backup_stats;
+	start = twrpStats::Now();
+	if (!backup(src, archive, mode, &backup_stats))
+		return false;
+	backup_stats.Log_Summary(name, "Backup", twrpStats::Now() - start);
+	backup_stats.Write_Report(dir + "/tar_bench." + name + ".backup-stats.json", name, "backup", twrpStats::Now() - start);
+
+	twrpStats restore_stats;
+	start = twrpStats::Now();
+	if (!restore(archive, dst, mode, &restore_stats))
+		return false;
+	restore_stats.Log_Summary(name, "Restore", twrpStats::Now() - start);
+	restore_stats.Write_Report(dir + "/tar_bench." + name + ".restore-stats.json", name, "restore", twrpStats::Now() - start);
+
+	bool ok = verify(src, dst);
+	printf("%s: archive %llu bytes, restore %s\n", name.c_str(), (unsigned long long) file_size(archive), ok ? "verified" : "FAILED");
+	unlink(archive.c_str());
+	remove_tree(dst);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	int count = 2000, max_kb = 1024;
+	bool ok;
+
+	if (argc < 2) {
+		printf("usage: %s <work-dir> [file-count] [max-file-KB]\n", argv[0]);
+		return 1;
+	}
+	string dir = argv[1];
+	if (argc > 2)
+		count = atoi(argv[2]);
+	if (argc > 3)
+		max_kb = atoi(argv[3]);
+	if (count <= 0 || max_kb <= 0) {
+		printf("Invalid file count or size\n");
+		return 1;
+	}
+
+	string src = dir + "/tar_bench.src";
+	ok = make_tree(src, count, max_kb) && run(dir, src, "tar", BENCH_TAR);
+	if (ok && system("pigz --version > /dev/null 2>&1") == 0)
+		ok = run(dir, src, "pigz", BENCH_PIGZ) && run(dir, src, "adaptive", BENCH_ADAPTIVE);
+	else if (ok)
+		printf("pigz not found, skipping the compressed runs\n");
+	remove_tree(src);
+	return ok ? 0 : 1;
+}
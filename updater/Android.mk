@@ -62,6 +62,7 @@ ifneq ($(wildcard external/e2fsprogs/misc/tune2fs.h),)
 endif
 
 LOCAL_C_INCLUDES += external/e2fsprogs/misc
+LOCAL_C_INCLUDES += external/zlib
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
 # Each library in TARGET_RECOVERY_UPDATER_LIBS should have a function
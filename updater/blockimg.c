@@ -37,6 +37,7 @@
 #include "mincrypt/sha.h"
 #include "minzip/Hash.h"
 #include "updater.h"
+#include "zlib.h"
 
 #define BLOCKSIZE 4096
 
@@ -228,67 +229,181 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
 // can't write each section until it's that transfer's turn to go.
 //
 // To achieve this, we expand the new data from the archive in a
-// background thread, and block that threads 'receive uncompressed
-// data' function until the main thread has reached a point where we
-// want some new data to be written.  We signal the background thread
-// with the destination for the data and block the main thread,
-// waiting for the background thread to complete writing that section.
-// Then it signals the main thread to wake up and goes back to
-// blocking waiting for a transfer.
+// background thread into a ring buffer of NEW_DATA_BUFFER_MB
+// megabytes.  When the main thread reaches a 'new' command it drains
+// the ring into the target ranges, while the background thread keeps
+// inflating ahead of it.  Inflate and block writes (and the other
+// commands in between) therefore overlap instead of alternating.
 //
 // NewThreadInfo is the struct used to pass information back and forth
-// between the two threads.  When the main thread wants some data
-// written, it sets rss to the destination location and signals the
-// condition.  When the background thread is done writing, it clears
-// rss and signals the condition again.
+// between the two threads.  'head' and 'tail' count the total bytes
+// ever put into and taken out of the ring; the background thread
+// waits while the ring is full, the main thread while it is empty.
+// The time each side spends waiting tells us whether inflate or the
+// storage limited throughput.
+
+#define NEW_DATA_BUFFER_MB 8
 
 typedef struct {
     ZipArchive* za;
     const ZipEntry* entry;
+    uint8_t* zip_addr;
 
-    RangeSinkState* rss;
+    uint8_t* buffer;
+    size_t buffer_size;
+    uint64_t head;
+    uint64_t tail;
+    bool done;
+
+    // Time the background thread spent blocked on a full ring, and
+    // the main thread spent blocked on an empty one.
+    double producer_wait;
+    double consumer_wait;
+    double start_time;
+    double inflate_time;
 
     pthread_mutex_t mu;
     pthread_cond_t cv;
 } NewThreadInfo;
 
-static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
-    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    while (size > 0) {
-        // Wait for nti->rss to be non-NULL, indicating some of this
-        // data is wanted.
-        pthread_mutex_lock(&nti->mu);
-        while (nti->rss == NULL) {
+// Wait until there is free space in the ring and return a pointer to
+// the largest contiguous free region, storing its size in *avail.
+static uint8_t* reserve_new_data(NewThreadInfo* nti, size_t* avail) {
+    pthread_mutex_lock(&nti->mu);
+    if (nti->head - nti->tail == nti->buffer_size) {
+        double start = now_seconds();
+        while (nti->head - nti->tail == nti->buffer_size) {
             pthread_cond_wait(&nti->cv, &nti->mu);
         }
-        pthread_mutex_unlock(&nti->mu);
+        nti->producer_wait += now_seconds() - start;
+    }
+    size_t used = nti->head - nti->tail;
+    pthread_mutex_unlock(&nti->mu);
 
-        // At this point nti->rss is set, and we own it.  The main
-        // thread is waiting for it to disappear from nti.
-        ssize_t written = RangeSinkWrite(data, size, nti->rss);
-        data += written;
-        size -= written;
+    size_t offset = nti->head % nti->buffer_size;
+    size_t contiguous = nti->buffer_size - offset;
+    size_t free_space = nti->buffer_size - used;
+    *avail = free_space < contiguous ? free_space : contiguous;
+    return nti->buffer + offset;
+}
 
-        if (nti->rss->p_block == nti->rss->tgt->count) {
-            // we have written all the bytes desired by this rss.
+static void commit_new_data(NewThreadInfo* nti, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    pthread_mutex_lock(&nti->mu);
+    nti->head += size;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+}
 
-            pthread_mutex_lock(&nti->mu);
-            nti->rss = NULL;
-            pthread_cond_broadcast(&nti->cv);
-            pthread_mutex_unlock(&nti->mu);
-        }
+static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+
+    while (size > 0) {
+        size_t avail;
+        uint8_t* dest = reserve_new_data(nti, &avail);
+        size_t copy = (size_t) size < avail ? (size_t) size : avail;
+        memcpy(dest, data, copy);
+        commit_new_data(nti, copy);
+        data += copy;
+        size -= copy;
     }
 
     return true;
 }
 
+// Inflate a deflated entry straight into the ring buffer, skipping
+// minzip's bounce buffer and per-chunk callback.
+static bool inflate_new_data(NewThreadInfo* nti) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    strm.next_in = nti->zip_addr + mzGetZipEntryOffset(nti->entry);
+    strm.avail_in = mzGetZipEntryCompLen(nti->entry);
+
+    int ret = inflateInit2(&strm, -MAX_WBITS);
+    if (ret != Z_OK) {
+        fprintf(stderr, "failed to init new data inflation: %d\n", ret);
+        return false;
+    }
+
+    do {
+        size_t avail;
+        strm.next_out = reserve_new_data(nti, &avail);
+        strm.avail_out = avail;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        commit_new_data(nti, avail - strm.avail_out);
+    } while (ret == Z_OK);
+
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        fprintf(stderr, "new data inflation failed: %d\n", ret);
+        return false;
+    }
+    return true;
+}
+
 static void* unzip_new_data(void* cookie) {
     NewThreadInfo* nti = (NewThreadInfo*) cookie;
-    mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
+    if (nti->zip_addr != NULL && mzIsZipEntryDeflated(nti->entry)) {
+        inflate_new_data(nti);
+    } else {
+        mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
+    }
+
+    pthread_mutex_lock(&nti->mu);
+    nti->done = true;
+    nti->inflate_time = now_seconds() - nti->start_time;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
     return NULL;
 }
 
+// Write new data from the ring into the ranges described by rss until
+// all of them are filled.  Returns -1 if the new data runs out first
+// or a write fails.
+static int write_new_data(NewThreadInfo* nti, RangeSinkState* rss) {
+    while (rss->p_block < rss->tgt->count) {
+        pthread_mutex_lock(&nti->mu);
+        if (nti->head == nti->tail && !nti->done) {
+            double start = now_seconds();
+            while (nti->head == nti->tail && !nti->done) {
+                pthread_cond_wait(&nti->cv, &nti->mu);
+            }
+            nti->consumer_wait += now_seconds() - start;
+        }
+        size_t used = nti->head - nti->tail;
+        pthread_mutex_unlock(&nti->mu);
+
+        if (used == 0) {
+            fprintf(stderr, "new data ended before all blocks were written\n");
+            return -1;
+        }
+
+        size_t offset = nti->tail % nti->buffer_size;
+        size_t contiguous = nti->buffer_size - offset;
+        ssize_t size = used < contiguous ? used : contiguous;
+        ssize_t written = RangeSinkWrite(nti->buffer + offset, size, rss);
+        if (written <= 0) {
+            fprintf(stderr, "failed to write new data\n");
+            return -1;
+        }
+
+        pthread_mutex_lock(&nti->mu);
+        nti->tail += written;
+        pthread_cond_broadcast(&nti->cv);
+        pthread_mutex_unlock(&nti->mu);
+    }
+
+    return 0;
+}
+
 static int ReadBlocks(RangeSet* src, uint8_t* buffer, int fd) {
     int i;
     size_t p = 0;
@@ -1287,15 +1402,9 @@ static int PerformCommandNew(CommandParameters* params) {
             goto pcnout;
         }
 
-        pthread_mutex_lock(&params->nti.mu);
-        params->nti.rss = &rss;
-        pthread_cond_broadcast(&params->nti.cv);
-
-        while (params->nti.rss) {
-            pthread_cond_wait(&params->nti.cv, &params->nti.mu);
+        if (write_new_data(&params->nti, &rss) == -1) {
+            goto pcnout;
         }
-
-        pthread_mutex_unlock(&params->nti.mu);
     }
 
     params->written += tgt->size;
@@ -1610,7 +1719,17 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
     if (params.canwrite) {
         params.nti.za = za;
         params.nti.entry = new_entry;
+        params.nti.zip_addr = ui->package_zip_addr;
+        params.nti.buffer_size = NEW_DATA_BUFFER_MB * 1024 * 1024;
+        params.nti.buffer = malloc(params.nti.buffer_size);
+
+        if (params.nti.buffer == NULL) {
+            fprintf(stderr, "failed to allocate %zu bytes for new data\n",
+                params.nti.buffer_size);
+            goto pbiudone;
+        }
 
+        params.nti.start_time = now_seconds();
         pthread_mutex_init(&params.nti.mu, NULL);
         pthread_cond_init(&params.nti.cv, NULL);
         pthread_attr_init(&attr);
@@ -1735,6 +1854,18 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
         pthread_join(params.thread, NULL);
 
         fprintf(stderr, "wrote %d blocks; expected %d\n", params.written, total_blocks);
+        fprintf(stderr, "new data: %" PRIu64 " bytes inflated in %.2f s; "
+                "inflate waited %.2f s on a full buffer, writes waited %.2f s "
+                "on an empty one; throughput limited by %s\n",
+                params.nti.head, params.nti.inflate_time,
+                params.nti.producer_wait, params.nti.consumer_wait,
+                params.nti.producer_wait > params.nti.consumer_wait ?
+                        "storage" : "inflate");
+
+        // Only safe once the background thread is gone; on failure it
+        // may still be blocked on the ring, so the buffer is left alone.
+        free(params.nti.buffer);
+        params.nti.buffer = NULL;
         fprintf(stderr, "max alloc needed was %zu\n", params.bufsize);
 
         // Delete stash only after successfully completing the update, as it
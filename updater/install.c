@@ -28,7 +28,8 @@
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
@@ -771,102 +772,367 @@ static struct perm_parsed_args ParsePermArgs(State * state, int argc, char** arg
     return parsed;
 }
 
-static int ApplyParsedPerms(
-        State * state,
-        const char* filename,
+// Bookkeeping for one set_metadata/set_metadata_recursive call.  The
+// recursive walk hands top-level subdirectories to worker threads, so
+// everything here except the counters is shared and 'lock' serializes
+// reporting and the subtree queue.
+typedef struct {
+    State* state;
+    struct perm_parsed_args parsed;
+    pthread_mutex_t lock;
+
+    int root_fd;
+    const char* root_path;
+    char** subtrees;
+    int num_subtrees;
+    int next_subtree;
+
+    int bad;
+    long entries;
+    long issued;
+    long skipped;
+} MetadataWalk;
+
+typedef struct {
+    int bad;
+    long entries;
+    long issued;
+    long skipped;
+} MetadataCounts;
+
+#define MetadataError(walk, ...)                    \
+    do {                                            \
+        pthread_mutex_lock(&(walk)->lock);          \
+        uiPrintf((walk)->state, __VA_ARGS__);       \
+        pthread_mutex_unlock(&(walk)->lock);        \
+    } while (0)
+
+// Apply the parsed metadata to 'name' in the directory 'dirfd' (whose
+// full path is 'path', used for the xattr-based calls and messages).
+// Every change is skipped when the current value already matches.
+static void ApplyParsedPerms(
+        MetadataWalk* walk,
+        int dirfd,
+        const char* name,
+        const char* path,
         const struct stat *statptr,
-        struct perm_parsed_args parsed)
+        MetadataCounts* counts)
 {
-    int bad = 0;
+    const struct perm_parsed_args* parsed = &walk->parsed;
+
+    ++counts->entries;
 
-    if (parsed.has_selabel) {
-        if (lsetfilecon(filename, parsed.selabel) != 0) {
-            uiPrintf(state, "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
-                    filename, parsed.selabel, strerror(errno));
-            bad++;
+    if (parsed->has_selabel) {
+        char* current = NULL;
+        if (lgetfilecon(path, &current) >= 0 && current != NULL &&
+                strcmp(current, parsed->selabel) == 0) {
+            ++counts->skipped;
+        } else {
+            ++counts->issued;
+            if (lsetfilecon(path, parsed->selabel) != 0) {
+                MetadataError(walk, "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
+                        path, parsed->selabel, strerror(errno));
+                counts->bad++;
+            }
         }
+        freecon(current);
     }
 
     /* ignore symlinks */
     if (S_ISLNK(statptr->st_mode)) {
-        return bad;
+        return;
+    }
+
+    uid_t uid = parsed->has_uid ? parsed->uid : (uid_t) -1;
+    gid_t gid = parsed->has_gid ? parsed->gid : (gid_t) -1;
+    bool chowned = false;
+    if ((parsed->has_uid && statptr->st_uid != parsed->uid) ||
+            (parsed->has_gid && statptr->st_gid != parsed->gid)) {
+        ++counts->issued;
+        chowned = true;
+        if (fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+            MetadataError(walk, "ApplyParsedPerms: chown of %s to %d:%d failed: %s\n",
+                    path, uid, gid, strerror(errno));
+            counts->bad++;
+        }
+    } else if (parsed->has_uid || parsed->has_gid) {
+        ++counts->skipped;
+    }
+
+    // "mode" applies to everything; "dmode"/"fmode" override it for
+    // directories and regular files.
+    bool has_mode = parsed->has_mode;
+    mode_t mode = parsed->mode;
+    if (parsed->has_dmode && S_ISDIR(statptr->st_mode)) {
+        has_mode = true;
+        mode = parsed->dmode;
+    }
+    if (parsed->has_fmode && S_ISREG(statptr->st_mode)) {
+        has_mode = true;
+        mode = parsed->fmode;
+    }
+    if (has_mode) {
+        // chown clears the setuid/setgid bits, so always reapply after it.
+        if (!chowned && (statptr->st_mode & 07777) == (mode & 07777)) {
+            ++counts->skipped;
+        } else {
+            ++counts->issued;
+            if (fchmodat(dirfd, name, mode, 0) < 0) {
+                MetadataError(walk, "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
+                        path, mode, strerror(errno));
+                counts->bad++;
+            }
+        }
     }
 
-    if (parsed.has_uid) {
-        if (chown(filename, parsed.uid, -1) < 0) {
-            uiPrintf(state, "ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                    filename, parsed.uid, strerror(errno));
-            bad++;
+    if (parsed->has_capabilities && S_ISREG(statptr->st_mode)) {
+        if (parsed->capabilities == 0) {
+            ++counts->issued;
+            if ((lremovexattr(path, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
+                // Report failure unless it's ENODATA (attribute not set)
+                MetadataError(walk, "ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
+                       path, parsed->capabilities, strerror(errno));
+                counts->bad++;
+            }
+        } else {
+            struct vfs_cap_data cap_data;
+            memset(&cap_data, 0, sizeof(cap_data));
+            cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
+            cap_data.data[0].permitted = (uint32_t) (parsed->capabilities & 0xffffffff);
+            cap_data.data[0].inheritable = 0;
+            cap_data.data[1].permitted = (uint32_t) (parsed->capabilities >> 32);
+            cap_data.data[1].inheritable = 0;
+
+            struct vfs_cap_data current;
+            if (lgetxattr(path, XATTR_NAME_CAPS, &current, sizeof(current)) ==
+                        sizeof(current) &&
+                    memcmp(&current, &cap_data, sizeof(current)) == 0) {
+                ++counts->skipped;
+            } else {
+                ++counts->issued;
+                if (lsetxattr(path, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
+                    MetadataError(walk, "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
+                            path, parsed->capabilities, strerror(errno));
+                    counts->bad++;
+                }
+            }
         }
     }
+}
 
-    if (parsed.has_gid) {
-        if (chown(filename, -1, parsed.gid) < 0) {
-            uiPrintf(state, "ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                    filename, parsed.gid, strerror(errno));
-            bad++;
+// Apply metadata to everything below the directory open as 'dirfd',
+// children before their parent (like nftw's FTW_DEPTH).  'path' holds
+// the directory's path in a PATH_MAX buffer and is restored on return.
+// Takes ownership of dirfd.
+static void WalkMetadata(MetadataWalk* walk, int dirfd, char* path,
+        MetadataCounts* counts) {
+    DIR* dir = fdopendir(dirfd);
+    if (dir == NULL) {
+        MetadataError(walk, "set_metadata_recursive: can't open %s: %s\n",
+                path, strerror(errno));
+        close(dirfd);
+        counts->bad++;
+        return;
+    }
+
+    size_t len = strlen(path);
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (len + 1 + strlen(de->d_name) >= PATH_MAX) {
+            MetadataError(walk, "set_metadata_recursive: path too long under %s\n", path);
+            counts->bad++;
+            continue;
+        }
+        snprintf(path + len, PATH_MAX - len, "/%s", de->d_name);
+
+        struct stat st;
+        if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            MetadataError(walk, "set_metadata_recursive: can't stat %s: %s\n",
+                    path, strerror(errno));
+            counts->bad++;
+            path[len] = '\0';
+            continue;
         }
-    }
 
-    if (parsed.has_mode) {
-        if (chmod(filename, parsed.mode) < 0) {
-            uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                    filename, parsed.mode, strerror(errno));
-            bad++;
+        if (S_ISDIR(st.st_mode)) {
+            int fd = openat(dirfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                MetadataError(walk, "set_metadata_recursive: can't open %s: %s\n",
+                        path, strerror(errno));
+                counts->bad++;
+            } else {
+                WalkMetadata(walk, fd, path, counts);
+            }
         }
+        ApplyParsedPerms(walk, dirfd, de->d_name, path, &st, counts);
+        path[len] = '\0';
+    }
+    closedir(dir);
+}
+
+// Apply metadata to the top-level subdirectory 'name' of the root and
+// everything below it.
+static void MetadataSubtree(MetadataWalk* walk, const char* name,
+        const struct stat* st, MetadataCounts* counts) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", walk->root_path, name);
+    int fd = openat(walk->root_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        MetadataError(walk, "set_metadata_recursive: can't open %s: %s\n",
+                path, strerror(errno));
+        counts->bad++;
+    } else {
+        WalkMetadata(walk, fd, path, counts);
     }
+    ApplyParsedPerms(walk, walk->root_fd, name, path, st, counts);
+}
 
-    if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-        if (chmod(filename, parsed.dmode) < 0) {
-            uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                    filename, parsed.dmode, strerror(errno));
-            bad++;
+static void* MetadataWorker(void* cookie) {
+    MetadataWalk* walk = (MetadataWalk*) cookie;
+    MetadataCounts counts;
+    memset(&counts, 0, sizeof(counts));
+
+    while (true) {
+        pthread_mutex_lock(&walk->lock);
+        if (walk->next_subtree >= walk->num_subtrees) {
+            pthread_mutex_unlock(&walk->lock);
+            break;
         }
+        const char* name = walk->subtrees[walk->next_subtree++];
+        pthread_mutex_unlock(&walk->lock);
+
+        struct stat st;
+        if (fstatat(walk->root_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            MetadataError(walk, "set_metadata_recursive: can't stat %s/%s: %s\n",
+                    walk->root_path, name, strerror(errno));
+            counts.bad++;
+            continue;
+        }
+        MetadataSubtree(walk, name, &st, &counts);
     }
 
-    if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-        if (chmod(filename, parsed.fmode) < 0) {
-            uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
-                   filename, parsed.fmode, strerror(errno));
-            bad++;
+    pthread_mutex_lock(&walk->lock);
+    walk->bad += counts.bad;
+    walk->entries += counts.entries;
+    walk->issued += counts.issued;
+    walk->skipped += counts.skipped;
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+#define METADATA_MAX_THREADS 4
+
+// set_metadata_recursive: top-level entries that aren't directories
+// are handled on this thread, while each top-level subdirectory is an
+// independent unit of work for the worker pool.  The root itself is
+// done last.
+static void SetMetadataRecursive(MetadataWalk* walk, const char* root,
+        const struct stat* root_st) {
+    char path[PATH_MAX];
+    MetadataCounts counts;
+    memset(&counts, 0, sizeof(counts));
+
+    walk->root_path = root;
+    walk->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (walk->root_fd < 0) {
+        if (errno != ENOTDIR && errno != ELOOP) {
+            MetadataError(walk, "set_metadata_recursive: can't open %s: %s\n",
+                    root, strerror(errno));
+            counts.bad++;
         }
+        // Not a directory (or unreadable); there is nothing to recurse into.
+        ApplyParsedPerms(walk, AT_FDCWD, root, root, root_st, &counts);
+        goto done;
     }
 
-    if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
-        if (parsed.capabilities == 0) {
-            if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
-                // Report failure unless it's ENODATA (attribute not set)
-                uiPrintf(state, "ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
-                       filename, parsed.capabilities, strerror(errno));
-                bad++;
+    DIR* dir = fdopendir(dup(walk->root_fd));
+    if (dir == NULL) {
+        MetadataError(walk, "set_metadata_recursive: can't open %s: %s\n",
+                root, strerror(errno));
+        counts.bad++;
+        goto done;
+    }
+    int allocated = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(walk->root_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            MetadataError(walk, "set_metadata_recursive: can't stat %s/%s: %s\n",
+                    root, de->d_name, strerror(errno));
+            counts.bad++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            char* name = strdup(de->d_name);
+            if (name != NULL && walk->num_subtrees >= allocated) {
+                int grown = allocated * 2 + 16;
+                char** subtrees = realloc(walk->subtrees, grown * sizeof(char*));
+                if (subtrees == NULL) {
+                    free(name);
+                    name = NULL;
+                } else {
+                    walk->subtrees = subtrees;
+                    allocated = grown;
+                }
             }
-        } else {
-            struct vfs_cap_data cap_data;
-            memset(&cap_data, 0, sizeof(cap_data));
-            cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
-            cap_data.data[0].permitted = (uint32_t) (parsed.capabilities & 0xffffffff);
-            cap_data.data[0].inheritable = 0;
-            cap_data.data[1].permitted = (uint32_t) (parsed.capabilities >> 32);
-            cap_data.data[1].inheritable = 0;
-            if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
-                uiPrintf(state, "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
-                        filename, parsed.capabilities, strerror(errno));
-                bad++;
+            if (name == NULL) {
+                // Out of memory to queue it; do this subtree right here.
+                MetadataError(walk, "set_metadata_recursive: out of memory queueing %s/%s\n",
+                        root, de->d_name);
+                counts.bad++;
+                MetadataSubtree(walk, de->d_name, &st, &counts);
+                continue;
             }
+            walk->subtrees[walk->num_subtrees++] = name;
+            continue;
         }
+        snprintf(path, sizeof(path), "%s/%s", root, de->d_name);
+        ApplyParsedPerms(walk, walk->root_fd, de->d_name, path, &st, &counts);
     }
+    closedir(dir);
 
-    return bad;
-}
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = cpus > METADATA_MAX_THREADS ? METADATA_MAX_THREADS : (int) cpus;
+    if (num_threads > walk->num_subtrees) {
+        num_threads = walk->num_subtrees;
+    }
+    pthread_t threads[METADATA_MAX_THREADS];
+    int started = 0;
+    while (started < num_threads &&
+            pthread_create(&threads[started], NULL, MetadataWorker, walk) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        // No threads (or no subdirectories); do the subtrees inline.
+        MetadataWorker(walk);
+    }
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+
+    ApplyParsedPerms(walk, AT_FDCWD, root, root, root_st, &counts);
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-static State* recursive_state;
+done:
+    if (walk->root_fd >= 0) {
+        close(walk->root_fd);
+    }
+    int i;
+    for (i = 0; i < walk->num_subtrees; ++i) {
+        free(walk->subtrees[i]);
+    }
+    free(walk->subtrees);
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(recursive_state, filename, statptr, recursive_parsed_args);
+    walk->bad += counts.bad;
+    walk->entries += counts.entries;
+    walk->issued += counts.issued;
+    walk->skipped += counts.skipped;
 }
 
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -891,17 +1157,24 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
         goto done;
     }
 
-    struct perm_parsed_args parsed = ParsePermArgs(state, argc, args);
+    MetadataWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.state = state;
+    walk.parsed = ParsePermArgs(state, argc, args);
+    pthread_mutex_init(&walk.lock, NULL);
 
     if (recursive) {
-        recursive_parsed_args = parsed;
-        recursive_state = state;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-        recursive_state = NULL;
+        SetMetadataRecursive(&walk, args[0], &sb);
+        printf("%s: %ld entries under %s, %ld syscalls issued, %ld skipped\n",
+                name, walk.entries, args[0], walk.issued, walk.skipped);
     } else {
-        bad += ApplyParsedPerms(state, args[0], &sb, parsed);
+        MetadataCounts counts;
+        memset(&counts, 0, sizeof(counts));
+        ApplyParsedPerms(&walk, AT_FDCWD, args[0], args[0], &sb, &counts);
+        walk.bad = counts.bad;
     }
+    bad += walk.bad;
+    pthread_mutex_destroy(&walk.lock);
 
 done:
     for (i = 0; i < argc; ++i) {
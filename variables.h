@@ -20,6 +20,8 @@
 #define TW_VERSION_STR              "2.8.7"
 
 #define TW_USE_COMPRESSION_VAR      "tw_use_compression"
+#define TW_ADAPTIVE_COMPRESSION_VAR "tw_adaptive_compression"
+#define TW_LEGACY_ENCRYPTION_VAR    "tw_legacy_encryption"
 #define TW_FILENAME                 "tw_filename"
 #define TW_ZIP_INDEX                "tw_zip_index"
 #define TW_ZIP_QUEUE_COUNT       "tw_zip_queue_count"
@@ -84,9 +86,12 @@
 #define TW_SKIP_MD5_CHECK_VAR       "tw_skip_md5_check"
 #define TW_SKIP_MD5_GENERATE_VAR    "tw_skip_md5_generate"
 #define TW_SIGNED_ZIP_VERIFY_VAR    "tw_signed_zip_verify"
+#define TW_UPDATER_PROFILE_VAR      "tw_updater_profile"
 #define TW_REBOOT_AFTER_FLASH_VAR   "tw_reboot_after_flash_option"
 #define TW_TIME_ZONE_VAR            "tw_time_zone"
 #define TW_RM_RF_VAR                "tw_rm_rf"
+#define TW_WIPE_DISCARD_VAR         "tw_wipe_discard"
+#define TW_BACKUP_JOBS_VAR          "tw_backup_jobs"
 
 #define TW_BACKUPS_FOLDER_VAR       "tw_backups_folder"
 